@@ -0,0 +1,179 @@
+#include "rdma_atomic.h"
+#include "rdma_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char *atomic_op_str(enum atomic_op op) {
+    return op == ATOMIC_CMP_SWP ? "cmp_swp" : "fetch_add";
+}
+
+const char *atomic_cap_str(enum ibv_atomic_cap cap) {
+    switch(cap) {
+    case IBV_ATOMIC_NONE: return "ATOMIC_NONE";
+    case IBV_ATOMIC_HCA:  return "ATOMIC_HCA";
+    case IBV_ATOMIC_GLOB: return "ATOMIC_GLOB";
+    default:              return "invalid atomic capability";
+    }
+}
+
+// Per-run state shared with the completion handler
+struct atomic_run {
+    struct atomic_window *win;
+    enum atomic_op op;
+    struct atomic_stats *stats;
+    uint64_t first_ns;          // Compare-and-swap: first attempt for this value
+};
+
+static void post_one(struct atomic_window *win, enum atomic_op op, uint64_t add) {
+    uint32_t slot = win->posted % win->depth;
+    struct ibv_qp_ex *qpx = win->qpx;
+
+    qpx->wr_id = win->posted;
+    qpx->wr_flags = IBV_SEND_SIGNALED;
+    win->post_ns[slot] = rdma_now_ns();
+    if(op == ATOMIC_FETCH_ADD) {
+        ibv_wr_atomic_fetch_add(qpx, win->remote_rkey, win->remote_addr, add);
+    } else {
+        ibv_wr_atomic_cmp_swp(qpx, win->remote_rkey, win->remote_addr,
+                              win->expected, win->expected + 1);
+    }
+    ibv_wr_set_sge(qpx, win->lkey, (uintptr_t)&win->results[slot], sizeof(uint64_t));
+    win->posted++;
+}
+
+static void record_value(struct atomic_stats *stats, uint64_t value, uint64_t lat) {
+    if(stats->values && value <= stats->last) {
+        stats->disorder++;
+    }
+    stats->last = value;
+    stats->values++;
+    hist_record(&stats->lat, lat);
+}
+
+static int on_atomic_completion(void *arg, const struct ibv_wc *wc, uint64_t nic_ns) {
+    struct atomic_run *run = arg;
+    struct atomic_window *win = run->win;
+    uint32_t slot = wc->wr_id % win->depth;
+    uint64_t old = win->results[slot];
+    uint64_t now = rdma_now_ns();
+    (void)nic_ns;
+
+    run->stats->attempts++;
+    win->completed = wc->wr_id + 1;
+    if(run->op == ATOMIC_FETCH_ADD) {
+        record_value(run->stats, old, now - win->post_ns[slot]);
+    } else if(old == win->expected) {
+        record_value(run->stats, old, now - run->first_ns);
+        win->expected = old + 1;
+        run->first_ns = 0;
+    } else {
+        // Someone else moved the counter; try again from where it is
+        win->expected = old;
+    }
+    return 0;
+}
+
+static int window_init(struct atomic_window *win) {
+    win->post_ns = calloc(win->depth, sizeof(*win->post_ns));
+    if(!win->post_ns) {
+        perror("calloc");
+        return -1;
+    }
+    win->posted = 0;
+    win->completed = 0;
+    return 0;
+}
+
+int atomic_window_run(struct atomic_window *win, enum atomic_op op, uint64_t iters,
+                      struct atomic_stats *stats) {
+    struct atomic_run run = { .win = win, .op = op, .stats = stats };
+    uint32_t depth = win->depth;
+    int ret = 0;
+
+    memset(stats, 0, sizeof(*stats));
+    hist_init(&stats->lat);
+    if(op == ATOMIC_CMP_SWP || win->depth == 0) {
+        win->depth = 1;
+    }
+    if(window_init(win)) {
+        win->depth = depth;
+        return -1;
+    }
+
+    uint64_t start = rdma_now_ns();
+    while(stats->values < iters && !rdma_stop_requested) {
+        // Top the window back up with one doorbell. A compare-and-swap
+        // goes out only once the last one is back, and as often as it
+        // takes to get one value.
+        uint64_t want = op == ATOMIC_FETCH_ADD ? iters : win->completed + 1;
+        if(win->posted < want && win->posted - win->completed < win->depth) {
+            ibv_wr_start(win->qpx);
+            while(win->posted < want && win->posted - win->completed < win->depth) {
+                if(op == ATOMIC_CMP_SWP && run.first_ns == 0) {
+                    run.first_ns = rdma_now_ns();
+                }
+                post_one(win, op, 1);
+            }
+            if(ibv_wr_complete(win->qpx)) {
+                perror("ibv_wr_complete");
+                ret = -1;
+                break;
+            }
+        }
+
+        if(cq_poller_wait(win->poller, on_atomic_completion, &run) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+    stats->elapsed_ns = rdma_now_ns() - start;
+
+    // Leave nothing in flight pointing at results or post_ns
+    while(ret == 0 && win->completed < win->posted) {
+        if(cq_poller_wait(win->poller, on_atomic_completion, &run) < 0) {
+            ret = -1;
+        }
+    }
+    free(win->post_ns);
+    win->post_ns = NULL;
+    win->depth = depth;
+    return ret;
+}
+
+static int on_once_completion(void *arg, const struct ibv_wc *wc, uint64_t nic_ns) {
+    struct atomic_window *win = arg;
+    (void)nic_ns;
+
+    win->completed = wc->wr_id + 1;
+    return 0;
+}
+
+int atomic_fetch_add_once(struct atomic_window *win, uint64_t add, uint64_t *old) {
+    uint32_t depth = win->depth;
+    int ret = 0;
+
+    win->depth = 1;
+    if(window_init(win)) {
+        win->depth = depth;
+        return -1;
+    }
+    ibv_wr_start(win->qpx);
+    post_one(win, ATOMIC_FETCH_ADD, add);
+    if(ibv_wr_complete(win->qpx)) {
+        perror("ibv_wr_complete");
+        ret = -1;
+    }
+    while(ret == 0 && win->completed < win->posted) {
+        if(cq_poller_wait(win->poller, on_once_completion, win) < 0) {
+            ret = -1;
+        }
+    }
+    if(ret == 0) {
+        *old = win->results[0];
+    }
+    free(win->post_ns);
+    win->post_ns = NULL;
+    win->depth = depth;
+    return ret;
+}
@@ -0,0 +1,71 @@
+#ifndef RDMA_ATOMIC_H
+#define RDMA_ATOMIC_H
+
+#include <stdint.h>
+#include <infiniband/verbs.h>
+#include "rdma_cq.h"
+#include "rdma_hist.h"
+
+// Sequence numbers from remote 64-bit atomics on RC.
+// The owner registers an array of counters with REMOTE_ATOMIC access and
+// advertises it; clients take values from it with ibv_wr_atomic_fetch_add
+// or ibv_wr_atomic_cmp_swp, executed by the owner's NIC without its CPU.
+// Each counter has a cache line to itself, so clients on different
+// counters never contend for the same line in the NIC's atomic unit.
+//
+// Fetch-and-add always succeeds, so up to `depth` of them are pipelined.
+// Compare-and-swap only succeeds against the value it expects, and the
+// next one depends on what the last returned, so it runs one at a time
+// and retries with the returned value when another client got in first.
+//
+// Every value obtained is unique among all clients of the counter, and
+// the values one client obtains increase: atomics on one QP execute in
+// order. The counter array is initialized by its owner to zero, which
+// reads the same in either byte order; after that only atomics touch it,
+// since some NICs keep it big-endian.
+
+#define ATOMIC_COUNTER_STRIDE 64    // Bytes between counters
+
+enum atomic_op {
+    ATOMIC_FETCH_ADD,
+    ATOMIC_CMP_SWP,
+};
+
+const char *atomic_op_str(enum atomic_op op);
+const char *atomic_cap_str(enum ibv_atomic_cap cap);
+
+struct atomic_window {
+    struct ibv_qp_ex *qpx;      // Extended QP, connected (RC)
+    struct cq_poller *poller;   // Completion engine on the send CQ
+    uint64_t *results;          // `depth` 8-byte slots the old values land in
+    uint32_t lkey;              // Local key of results
+    uint32_t remote_rkey;       // The counter array's
+    uint64_t remote_addr;       // The counter this client takes values from
+    uint32_t depth;             // Fetch-and-adds in flight (compare-and-swap: 1)
+
+    uint64_t posted;
+    uint64_t completed;
+    uint64_t expected;          // Compare-and-swap: value the counter is thought to hold
+    uint64_t *post_ns;          // Post time per slot
+};
+
+// Results of a run
+struct atomic_stats {
+    uint64_t values;            // Values obtained
+    uint64_t attempts;          // Atomics executed, failed compare-and-swaps included
+    uint64_t elapsed_ns;
+    uint64_t last;              // Last value obtained
+    uint64_t disorder;          // Values not above the one before (must stay 0)
+    struct rdma_hist lat;       // Per value: first attempt to the one that got it (ns)
+};
+
+// Obtain `iters` values from the counter. Returns 0, or -1 on a post
+// failure or a completion error.
+int atomic_window_run(struct atomic_window *win, enum atomic_op op, uint64_t iters,
+                      struct atomic_stats *stats);
+
+// One fetch-and-add of `add`, waited for: the counter's value before it
+// in `*old`. With `add` 0 it reads the counter as the atomics see it.
+int atomic_fetch_add_once(struct atomic_window *win, uint64_t add, uint64_t *old);
+
+#endif // RDMA_ATOMIC_H
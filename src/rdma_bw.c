@@ -0,0 +1,648 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <infiniband/verbs.h>
+#include "rdma_common.h"
+#include "rdma_opts.h"
+#include "rdma_endpoint.h"
+#include "rdma_send.h"
+#include "rdma_recv.h"
+#include "rdma_cq.h"
+
+// Streaming write-with-immediate bandwidth benchmark.
+// For every (message size, queue depth) point of the grid the sender runs
+// the send window and the receiver drains its ring; with -b both sides do
+// both at once. With -j N each side opens N QP/CQ pairs, each driven by
+// its own pinned worker thread (a sender and a receiver thread with -b),
+// and reports per-QP as well as aggregate throughput. Results are printed
+// as a table and, with -J, written as JSON.
+//
+//   server: rdma_bw [options]
+//   client: rdma_bw [options] <server_ip>
+//
+// As with rdma_lat, the client picks the test and the server follows.
+
+#define BW_MIN_SIZE       2
+#define BW_MAX_SIZE       (1u << 20)
+#define BW_MAX_DEPTH      128
+#define BW_MAX_THREADS    64
+
+// Without -n each point moves about BW_TARGET_BYTES per QP, within these
+// bounds
+#define BW_TARGET_BYTES   (1ULL << 30)
+#define BW_MIN_ITERS      5000
+#define BW_MAX_ITERS      200000
+
+// Source data per QP. Its content does not matter, so deep windows of large
+// messages reuse slots instead of registering depth x size bytes per QP.
+#define BW_SRC_BYTES      (8u << 20)
+
+// How long a receiver keeps draining after the peer has finished sending.
+// Only UC, which drops what it cannot place, ever needs it.
+#define BW_DRAIN_NS       200000000ULL
+
+// Test parameters the client hands to the server before QPs are created
+struct bw_config {
+    uint32_t qp_type;
+    uint32_t bidirectional;
+    uint32_t threads;           // QP/CQ pairs and worker threads per side
+    uint32_t min_size;
+    uint32_t max_size;
+    uint32_t min_depth;
+    uint32_t max_depth;
+    uint64_t iters;             // Per QP; 0: sized per point
+    uint32_t use_inline;
+    uint32_t signal_every;
+    uint32_t post_batch;
+};
+
+// One QP's counts for one grid point
+struct bw_qp_result {
+    uint64_t tx_msgs;
+    uint64_t tx_ns;             // First post to last send completion
+    uint64_t rx_msgs;
+};
+
+// One side's view of one grid point, swapped after the point
+struct bw_side_result {
+    uint64_t cpu_ns;            // Process CPU time over the point
+    struct bw_qp_result qp[BW_MAX_THREADS];
+};
+
+// One QP with its CQs and receive ring, driven by a sender thread, a
+// receiver thread or both
+struct bw_worker {
+    struct rdma_endpoint *ep;
+    const struct bw_config *cfg;
+    struct recv_ring ring;
+    struct cq_poller tx_poller;
+    struct cq_poller rx_poller;
+    uint32_t src_slots;         // Source slots in the endpoint buffer
+    int tx_cpu;
+    int rx_cpu;
+    pthread_t tx_thread;
+    pthread_t rx_thread;
+
+    // The point being run
+    uint32_t size;
+    uint32_t depth;
+    uint64_t iters;
+    int rx_stop;                // Tells receiver_thread to return (atomic)
+    int rx_done;                // receiver_thread has returned (atomic)
+    int tx_ret;
+    int rx_ret;
+    struct send_stats tx_stats;
+    struct recv_stats rx_stats;
+};
+
+// What goes over the socket, field by field, in rdma_wire's encoding
+static void bw_config_fields(struct rdma_wire_codec *c, void *obj) {
+    struct bw_config *cfg = obj;
+    rdma_wire_u32(c, &cfg->qp_type);
+    rdma_wire_u32(c, &cfg->bidirectional);
+    rdma_wire_u32(c, &cfg->threads);
+    rdma_wire_u32(c, &cfg->min_size);
+    rdma_wire_u32(c, &cfg->max_size);
+    rdma_wire_u32(c, &cfg->min_depth);
+    rdma_wire_u32(c, &cfg->max_depth);
+    rdma_wire_u64(c, &cfg->iters);
+    rdma_wire_u32(c, &cfg->use_inline);
+    rdma_wire_u32(c, &cfg->signal_every);
+    rdma_wire_u32(c, &cfg->post_batch);
+}
+
+static void bw_side_result_fields(struct rdma_wire_codec *c, void *obj) {
+    struct bw_side_result *res = obj;
+    rdma_wire_u64(c, &res->cpu_ns);
+    for(uint32_t i = 0; i < BW_MAX_THREADS; i++) {
+        rdma_wire_u64(c, &res->qp[i].tx_msgs);
+        rdma_wire_u64(c, &res->qp[i].tx_ns);
+        rdma_wire_u64(c, &res->qp[i].rx_msgs);
+    }
+}
+
+static uint64_t point_iters(const struct bw_config *cfg, uint32_t size) {
+    if(cfg->iters) {
+        return cfg->iters;
+    }
+    uint64_t iters = BW_TARGET_BYTES / size;
+    if(iters < BW_MIN_ITERS) {
+        return BW_MIN_ITERS;
+    }
+    return iters > BW_MAX_ITERS ? BW_MAX_ITERS : iters;
+}
+
+static void *sender_thread(void *arg) {
+    struct bw_worker *w = arg;
+    struct rdma_endpoint *ep = w->ep;
+
+    if(rdma_pin_self(w->tx_cpu)) {
+        w->tx_ret = -1;
+        return NULL;
+    }
+
+    // Every write lands on the peer's landing area past its source slots
+    struct send_window win = {
+        .qpx = ep->qpx,
+        .poller = &w->tx_poller,
+        .buf = ep->buf,
+        .buf_slots = w->src_slots < w->depth ? w->src_slots : 0,
+        .lkey = ep->mr->lkey,
+        .msg_size = w->size,
+        .remote_rkey = ep->remote_rkey,
+        .remote_addr = ep->remote_addr + (uint64_t)w->src_slots * w->cfg->max_size,
+        .depth = w->depth,
+        .signal_every = w->cfg->signal_every,
+        .max_inline = ep->max_inline,
+        .batch = w->cfg->post_batch
+    };
+    w->tx_ret = send_window_run(&win, w->iters, &w->tx_stats);
+    return NULL;
+}
+
+static void *receiver_thread(void *arg) {
+    struct bw_worker *w = arg;
+
+    if(rdma_pin_self(w->rx_cpu)) {
+        w->rx_ret = -1;
+    } else {
+        w->rx_ret = recv_ring_run(&w->ring, &w->rx_poller, w->iters, &w->rx_stop,
+                                  &w->rx_stats);
+    }
+    __atomic_store_n(&w->rx_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Stop each receiver once it has everything, or BW_DRAIN_NS after the peer
+// finished sending if something was lost on the way
+static int join_receivers(struct bw_worker *workers, uint32_t n) {
+    uint64_t deadline = rdma_now_ns() + BW_DRAIN_NS;
+    int ret = 0;
+
+    for(uint32_t i = 0; i < n; i++) {
+        struct bw_worker *w = &workers[i];
+        while(!__atomic_load_n(&w->rx_done, __ATOMIC_ACQUIRE) &&
+              rdma_now_ns() < deadline && !rdma_stop_requested) {
+            usleep(1000);
+        }
+        __atomic_store_n(&w->rx_stop, 1, __ATOMIC_RELEASE);
+        pthread_join(w->rx_thread, NULL);
+        if(w->rx_ret) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+static int run_point(struct bw_worker *workers, const struct bw_config *cfg,
+                     int is_server, int sock, uint32_t size, uint32_t depth,
+                     uint64_t iters, struct bw_side_result *res) {
+    int sending = cfg->bidirectional || !is_server;
+    int receiving = cfg->bidirectional || is_server;
+    uint32_t n = cfg->threads;
+    uint32_t rx_started = 0;
+    uint32_t tx_started = 0;
+    int ret = 0;
+
+    memset(res, 0, sizeof(*res));
+    uint64_t cpu_start = rdma_cpu_time_ns();
+
+    for(uint32_t i = 0; i < n; i++) {
+        struct bw_worker *w = &workers[i];
+        w->size = size;
+        w->depth = depth;
+        w->iters = iters;
+        w->rx_stop = 0;
+        w->rx_done = 0;
+        w->tx_ret = 0;
+        w->rx_ret = 0;
+    }
+
+    // Start draining before the peer can start sending
+    for(; receiving && rx_started < n; rx_started++) {
+        if(pthread_create(&workers[rx_started].rx_thread, NULL, receiver_thread,
+                          &workers[rx_started])) {
+            perror("pthread_create");
+            ret = -1;
+            break;
+        }
+    }
+    if(ret == 0) {
+        ret = rdma_sock_barrier(sock);
+    }
+
+    for(; ret == 0 && sending && tx_started < n; tx_started++) {
+        if(pthread_create(&workers[tx_started].tx_thread, NULL, sender_thread,
+                          &workers[tx_started])) {
+            perror("pthread_create");
+            ret = -1;
+            break;
+        }
+    }
+    for(uint32_t i = 0; i < tx_started; i++) {
+        struct bw_worker *w = &workers[i];
+        pthread_join(w->tx_thread, NULL);
+        if(w->tx_ret) {
+            ret = -1;
+        }
+        res->qp[i].tx_msgs = w->tx_stats.msgs;
+        res->qp[i].tx_ns = w->tx_stats.elapsed_ns;
+    }
+
+    // Tell the peer we are done sending and learn when it is
+    char token = 'D';
+    if(rdma_sock_send(sock, &token, 1) || rdma_sock_recv(sock, &token, 1)) {
+        ret = -1;
+    }
+
+    if(join_receivers(workers, rx_started)) {
+        ret = -1;
+    }
+    for(uint32_t i = 0; i < rx_started; i++) {
+        res->qp[i].rx_msgs = workers[i].rx_stats.msgs;
+    }
+    res->cpu_ns = rdma_cpu_time_ns() - cpu_start;
+    return ret;
+}
+
+struct bw_point {
+    uint32_t size;
+    uint32_t depth;
+    uint64_t iters;             // Per QP and direction
+    double gbps;                // All QPs, both directions with -b
+    double mpps;
+    uint64_t lost;
+    double local_cycles;        // Client CPU cycles per message handled
+    double remote_cycles;       // Server CPU cycles per message handled
+    double qp_gbps[BW_MAX_THREADS];
+};
+
+static double cycles_per_msg(const struct bw_side_result *res, uint32_t n) {
+    uint64_t msgs = 0;
+    for(uint32_t i = 0; i < n; i++) {
+        msgs += res->qp[i].tx_msgs + res->qp[i].rx_msgs;
+    }
+    return msgs ? res->cpu_ns / rdma_tsc_ns_per_tick() / msgs : 0;
+}
+
+// Messages delivered in one direction over the slowest sender's run time
+static double direction_mpps(const struct bw_side_result *tx,
+                             const struct bw_side_result *rx, uint32_t n) {
+    uint64_t msgs = 0;
+    uint64_t ns = 0;
+    for(uint32_t i = 0; i < n; i++) {
+        msgs += rx->qp[i].rx_msgs;
+        if(tx->qp[i].tx_ns > ns) {
+            ns = tx->qp[i].tx_ns;
+        }
+    }
+    return ns ? msgs / (ns / 1e9) / 1e6 : 0;
+}
+
+static double qp_mpps(const struct bw_qp_result *tx, const struct bw_qp_result *rx) {
+    return tx->tx_ns ? rx->rx_msgs / (tx->tx_ns / 1e9) / 1e6 : 0;
+}
+
+static void combine(const struct bw_side_result *client,
+                    const struct bw_side_result *server, uint32_t n,
+                    struct bw_point *pt) {
+    // Client to server, plus server to client when bidirectional
+    pt->mpps = direction_mpps(client, server, n) + direction_mpps(server, client, n);
+    pt->gbps = pt->mpps * 1e6 * pt->size / 1e9;
+    pt->lost = 0;
+    for(uint32_t i = 0; i < n; i++) {
+        const struct bw_qp_result *c = &client->qp[i];
+        const struct bw_qp_result *s = &server->qp[i];
+
+        // Only UC loses messages; RC retransmits until they are placed
+        pt->lost += (c->tx_msgs - s->rx_msgs) + (s->tx_msgs - c->rx_msgs);
+        pt->qp_gbps[i] = (qp_mpps(c, s) + qp_mpps(s, c)) * 1e6 * pt->size / 1e9;
+    }
+    pt->local_cycles = cycles_per_msg(client, n);
+    pt->remote_cycles = cycles_per_msg(server, n);
+}
+
+static int write_json(const char *path, const struct bw_config *cfg,
+                      const struct rdma_device *dev, const struct rdma_numa *numa,
+                      const struct rdma_endpoint *ep,
+                      const struct bw_point *pts, size_t npts) {
+    const struct rdma_mem *mem = &ep->mem;
+    FILE *f = fopen(path, "w");
+    if(!f) {
+        perror(path);
+        return -1;
+    }
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"benchmark\": \"rdma_bw\",\n");
+    fprintf(f, "  \"config\": {\n");
+    fprintf(f, "    \"device\": \"%s\",\n", dev->name);
+    fprintf(f, "    \"transport\": \"%s\",\n", cfg->qp_type == IBV_QPT_UC ? "uc" : "rc");
+    fprintf(f, "    \"op\": \"%s\",\n", rdma_op_str(RDMA_OP_WRITE_IMM));
+    fprintf(f, "    \"direction\": \"%s\",\n", cfg->bidirectional ? "bidirectional" : "unidirectional");
+    fprintf(f, "    \"threads\": %u,\n", cfg->threads);
+    fprintf(f, "    \"numa\": \"%s\",\n", rdma_numa_mode_str(numa->mode));
+    fprintf(f, "    \"device_node\": %d,\n", numa->dev_node);
+    fprintf(f, "    \"placement_node\": %d,\n", numa->node);
+    fprintf(f, "    \"page_size\": %zu,\n", mem->page_size);
+    fprintf(f, "    \"backing\": \"%s\",\n", rdma_backing_str(mem->backing));
+    fprintf(f, "    \"translations_per_qp\": %lu,\n", mem->translations);
+    fprintf(f, "    \"reg_us_per_qp\": %.1f,\n", mem->reg_ns / 1000.0);
+    fprintf(f, "    \"mtu\": %d,\n", 128 << ep->params.mtu);
+    fprintf(f, "    \"max_rd_atomic\": %u,\n", ep->params.max_rd_atomic);
+    fprintf(f, "    \"max_inline\": %u,\n", ep->max_inline);
+    fprintf(f, "    \"signal_every\": %u,\n", cfg->signal_every);
+    fprintf(f, "    \"post_batch\": %u,\n", cfg->post_batch);
+    fprintf(f, "    \"tsc_ghz\": %.3f\n", 1.0 / rdma_tsc_ns_per_tick());
+    fprintf(f, "  },\n");
+    fprintf(f, "  \"results\": [\n");
+    for(size_t i = 0; i < npts; i++) {
+        const struct bw_point *pt = &pts[i];
+        fprintf(f, "    {\"msg_size\": %u, \"depth\": %u, \"iters\": %lu, "
+                   "\"gb_per_s\": %.6f, \"mpps\": %.6f, \"lost\": %lu, "
+                   "\"client_cycles_per_msg\": %.1f, \"server_cycles_per_msg\": %.1f, "
+                   "\"per_qp_gb_per_s\": [",
+                pt->size, pt->depth, pt->iters, pt->gbps, pt->mpps, pt->lost,
+                pt->local_cycles, pt->remote_cycles);
+        for(uint32_t q = 0; q < cfg->threads; q++) {
+            fprintf(f, "%s%.6f", q ? ", " : "", pt->qp_gbps[q]);
+        }
+        fprintf(f, "]}%s\n", i + 1 < npts ? "," : "");
+    }
+    fprintf(f, "  ]\n");
+    fprintf(f, "}\n");
+
+    if(fclose(f)) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+// Create worker i's QP, ring and pollers and pick its CPUs from the
+// placement: with -b the sender and receiver threads get a core each
+static int worker_init(struct bw_worker *w, struct rdma_endpoint *ep,
+                       struct rdma_device *dev, const struct rdma_numa *numa,
+                       enum rdma_page page, enum rdma_reg_mode reg,
+                       const struct bw_config *cfg,
+                       int poll_batch, uint32_t idx) {
+    // Every write-with-immediate consumes a receive WQE, so the ring stays
+    // well ahead of the deepest send window
+    uint32_t rx_depth = 2 * cfg->max_depth < 64 ? 64 : 2 * cfg->max_depth;
+    uint32_t src_slots = BW_SRC_BYTES / cfg->max_size;
+    if(src_slots > cfg->max_depth) {
+        src_slots = cfg->max_depth;
+    }
+    if(src_slots == 0) {
+        src_slots = 1;
+    }
+
+    // Buffer: source slots, then the peer's landing area
+    struct rdma_endpoint_attr attr = {
+        .qp_type = cfg->qp_type,
+        .buf_size = (size_t)cfg->max_size * (src_slots + 1),
+        .send_depth = cfg->max_depth,
+        .recv_depth = rx_depth,
+        .cq_depth = cfg->max_depth,
+        .recv_cq_depth = rx_depth,
+        .use_inline = cfg->use_inline,
+        .numa = numa,
+        .page = page,
+        .reg = reg
+    };
+
+    w->ep = ep;
+    w->cfg = cfg;
+    w->src_slots = src_slots;
+    w->tx_cpu = rdma_numa_cpu(numa, cfg->bidirectional ? 2 * idx : idx);
+    w->rx_cpu = rdma_numa_cpu(numa, cfg->bidirectional ? 2 * idx + 1 : idx);
+    if(rdma_endpoint_create(ep, dev, &attr) ||
+       recv_ring_init(&w->ring, ep->qp, NULL, 0, 0, rx_depth, rx_depth / 8) ||
+       recv_ring_fill(&w->ring) ||
+       cq_poller_init(&w->tx_poller, ep->cq, poll_batch) ||
+       cq_poller_init(&w->rx_poller, ep->recv_cq, poll_batch)) {
+        return -1;
+    }
+    return 0;
+}
+
+static void worker_destroy(struct bw_worker *w) {
+    cq_poller_destroy(&w->tx_poller);
+    cq_poller_destroy(&w->rx_poller);
+    recv_ring_destroy(&w->ring);
+    rdma_endpoint_destroy(w->ep);
+}
+
+static void print_point(const struct bw_point *pt, uint32_t threads) {
+    printf("%10u %6u %10lu %10.3f %10.3f %8lu %14.1f %14.1f\n",
+           pt->size, pt->depth, pt->iters, pt->gbps, pt->mpps, pt->lost,
+           pt->local_cycles, pt->remote_cycles);
+    if(threads > 1) {
+        for(uint32_t i = 0; i < threads; i++) {
+            printf("%14s %3u %10s %10.3f\n", "QP", i, "", pt->qp_gbps[i]);
+        }
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    const char *server_ip = NULL;
+    struct rdma_opts opts;
+
+    // 0 means "sweep" for -s and -q and "size it per point" for -n
+    rdma_opts_init(&opts);
+    opts.iters = 0;
+    opts.depth = 0;
+    int ret = rdma_parse_opts(argc, argv, "[server_ip]", &opts);
+    if(ret) {
+        return ret < 0 ? 1 : 0;
+    }
+    if(argc > optind) {
+        server_ip = argv[optind];
+    }
+    if(opts.msg_size > BW_MAX_SIZE) {
+        fprintf(stderr, "Message size is limited to %u bytes\n", BW_MAX_SIZE);
+        return 1;
+    }
+    if(opts.threads > BW_MAX_THREADS) {
+        fprintf(stderr, "At most %d threads\n", BW_MAX_THREADS);
+        return 1;
+    }
+    if(opts.op != RDMA_OP_WRITE_IMM) {
+        fprintf(stderr, "rdma_bw streams RDMA writes with immediate only\n");
+        return 1;
+    }
+    if(rdma_install_stop_handler()) {
+        return 1;
+    }
+    srand(time(NULL) ^ getpid());
+
+    struct rdma_device dev;
+    if(rdma_device_open(&dev, opts.dev_name, opts.gid_index)) {
+        return 1;
+    }
+
+    // Placement is each host's own choice, so it is not part of bw_config
+    struct rdma_numa numa;
+    if(rdma_numa_init(&numa, dev.name, opts.numa_mode)) {
+        return 1;
+    }
+
+    // The client decides what to measure and tells the server
+    struct bw_config cfg;
+    int sock;
+    if(server_ip) {
+        cfg = (struct bw_config) {
+            .qp_type = opts.qp_type,
+            .bidirectional = opts.bidirectional,
+            .threads = opts.threads,
+            .min_size = opts.msg_size ? opts.msg_size : BW_MIN_SIZE,
+            .max_size = opts.msg_size ? opts.msg_size : BW_MAX_SIZE,
+            .min_depth = opts.depth ? opts.depth : 1,
+            .max_depth = opts.depth ? opts.depth : BW_MAX_DEPTH,
+            .iters = opts.iters,
+            .use_inline = opts.use_inline,
+            .signal_every = opts.signal_every,
+            .post_batch = opts.post_batch
+        };
+        sock = setup_tcp_client(server_ip, opts.tcp_port);
+        if(sock < 0 || rdma_wire_send_fields(sock, bw_config_fields, &cfg)) {
+            return 1;
+        }
+    } else {
+        int listen_sock = setup_tcp_server(opts.tcp_port);
+        if(listen_sock < 0) {
+            return 1;
+        }
+        sock = accept(listen_sock, NULL, NULL);
+        close(listen_sock);
+        if(sock < 0) {
+            perror("accept");
+            return 1;
+        }
+        if(rdma_wire_recv_fields(sock, bw_config_fields, &cfg)) {
+            return 1;
+        }
+        if(cfg.min_size == 0 || cfg.min_size > cfg.max_size ||
+           cfg.max_size > BW_MAX_SIZE || cfg.min_depth == 0 ||
+           cfg.min_depth > cfg.max_depth ||
+           cfg.threads == 0 || cfg.threads > BW_MAX_THREADS ||
+           (cfg.qp_type != IBV_QPT_UC && cfg.qp_type != IBV_QPT_RC)) {
+            fprintf(stderr, "Client sent an invalid test configuration\n");
+            return 1;
+        }
+    }
+
+    // Endpoints are contiguous so one handshake covers them all
+    struct rdma_endpoint *eps = calloc(cfg.threads, sizeof(*eps));
+    struct bw_worker *workers = calloc(cfg.threads, sizeof(*workers));
+    if(!eps || !workers) {
+        perror("calloc");
+        return 1;
+    }
+    for(uint32_t i = 0; i < cfg.threads; i++) {
+        if(worker_init(&workers[i], &eps[i], &dev, &numa, opts.page, opts.reg_mode,
+                       &cfg, opts.poll_batch, i)) {
+            return 1;
+        }
+    }
+
+    if(rdma_endpoint_handshake(eps, cfg.threads, sock, !server_ip)) {
+        return 1;
+    }
+
+    printf("%s write_imm bandwidth over %u %s QP%s on %s (GID index %d, MTU %d), "
+           "inline up to %u bytes\n",
+           cfg.bidirectional ? "Bidirectional" : "Unidirectional", cfg.threads,
+           cfg.qp_type == IBV_QPT_UC ? "UC" : "RC", cfg.threads > 1 ? "s" : "",
+           dev.name, dev.gid_index, 128 << eps[0].params.mtu, eps[0].max_inline);
+    rdma_endpoint_print_params(&eps[0]);
+    printf("Device on NUMA node %d, buffers and threads on node %d (%s)\n",
+           numa.dev_node, numa.node, rdma_numa_mode_str(numa.mode));
+    rdma_mem_print(&eps[0].mem, cfg.threads > 1 ? "QP 0 buffer" : "Buffer");
+    for(uint32_t i = 0; i < cfg.threads; i++) {
+        struct bw_worker *w = &workers[i];
+        if(cfg.bidirectional) {
+            printf("    QP %u: sender on CPU %d, receiver on CPU %d\n", i, w->tx_cpu, w->rx_cpu);
+        } else {
+            printf("    QP %u: worker on CPU %d\n", i, w->tx_cpu);
+        }
+    }
+
+    size_t max_pts = 0;
+    for(uint32_t s = cfg.min_size; s <= cfg.max_size; s *= 2) {
+        for(uint32_t d = cfg.min_depth; d <= cfg.max_depth; d *= 2) {
+            max_pts++;
+        }
+    }
+    struct bw_point *pts = calloc(max_pts, sizeof(*pts));
+    struct bw_side_result *local = malloc(sizeof(*local));
+    struct bw_side_result *remote = malloc(sizeof(*remote));
+    size_t npts = 0;
+    if(!pts || !local || !remote) {
+        perror("calloc");
+        return 1;
+    }
+
+    if(server_ip) {
+        printf("%10s %6s %10s %10s %10s %8s %14s %14s\n", "#bytes", "depth",
+               "iters", "GB/s", "Mpps", "lost", "cycles/msg(c)", "cycles/msg(s)");
+    }
+
+    ret = 0;
+    for(uint32_t size = cfg.min_size; size <= cfg.max_size && !ret; size *= 2) {
+        for(uint32_t depth = cfg.min_depth; depth <= cfg.max_depth; depth *= 2) {
+            uint64_t iters = point_iters(&cfg, size);
+
+            ret = run_point(workers, &cfg, !server_ip, sock, size, depth, iters, local);
+            if(ret || rdma_stop_requested) {
+                ret = -1;
+                break;
+            }
+
+            // The server reports its side; the client does the bookkeeping
+            if(!server_ip) {
+                ret = rdma_wire_send_fields(sock, bw_side_result_fields, local);
+                if(ret) {
+                    break;
+                }
+                continue;
+            }
+            ret = rdma_wire_recv_fields(sock, bw_side_result_fields, remote);
+            if(ret) {
+                break;
+            }
+
+            struct bw_point *pt = &pts[npts++];
+            pt->size = size;
+            pt->depth = depth;
+            pt->iters = iters;
+            combine(local, remote, cfg.threads, pt);
+            print_point(pt, cfg.threads);
+        }
+    }
+
+    if(ret == 0 && server_ip && opts.json_path) {
+        ret = write_json(opts.json_path, &cfg, &dev, &numa, &eps[0], pts, npts);
+        if(ret == 0) {
+            printf("Results written to %s\n", opts.json_path);
+        }
+    }
+
+    free(pts);
+    free(local);
+    free(remote);
+    close(sock);
+    for(uint32_t i = 0; i < cfg.threads; i++) {
+        worker_destroy(&workers[i]);
+    }
+    free(workers);
+    free(eps);
+    rdma_numa_destroy(&numa);
+    rdma_device_close(&dev);
+    return ret ? 1 : 0;
+}
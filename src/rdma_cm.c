@@ -0,0 +1,412 @@
+#include "rdma_cm.h"
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#ifdef HAVE_RDMACM
+#include <rdma/rdma_cma.h>
+#endif
+
+// Address and route resolution timeout
+#define CM_RESOLVE_TIMEOUT_MS 2000
+
+// Private data a connect request carries on RDMA_PS_TCP
+#define CM_PRIVATE_DATA_MAX 56
+
+const char *rdma_conn_mode_str(enum rdma_conn_mode mode) {
+    return mode == RDMA_CONN_CM ? "cm" : "tcp";
+}
+
+#ifdef HAVE_RDMACM
+
+int rdma_cm_supported(void) {
+    return 1;
+}
+
+// Wait for an event of type `expected` and hand it over unacknowledged.
+// Disconnects and time-wait exits of earlier connections on a shared
+// channel are acknowledged and skipped; anything else is an error.
+static int wait_event(struct rdma_event_channel *channel,
+                      enum rdma_cm_event_type expected, struct rdma_cm_event **out) {
+    for(;;) {
+        struct rdma_cm_event *ev;
+        if(rdma_get_cm_event(channel, &ev)) {
+            perror("rdma_get_cm_event");
+            return -1;
+        }
+        if(ev->event == expected) {
+            *out = ev;
+            return 0;
+        }
+
+        enum rdma_cm_event_type type = ev->event;
+        int status = ev->status;
+        rdma_ack_cm_event(ev);
+        if(type != RDMA_CM_EVENT_DISCONNECTED && type != RDMA_CM_EVENT_TIMEWAIT_EXIT) {
+            fprintf(stderr, "rdma_cm: waiting for %s, got %s (status %d)\n",
+                    rdma_event_str(expected), rdma_event_str(type), status);
+            return -1;
+        }
+    }
+}
+
+// The private data is an rdma_wire message with the buffer's MR and no
+// QP (rdma_cm carries the QP's side itself): 44 bytes, within the 56 a
+// connect request has room for
+static size_t put_private_data(uint8_t *buf, size_t len, const struct rdma_endpoint *ep) {
+    struct rdma_qp_desc qp;
+    struct rdma_mr_desc mr;
+    rdma_endpoint_describe(ep, &qp, &mr);
+
+    struct rdma_wire_msg msg = {
+        .version = RDMA_WIRE_VERSION,
+        .caps = rdma_endpoint_caps(ep),
+        .nmrs = 1,
+        .mrs = &mr
+    };
+    return rdma_wire_encode(&msg, buf, len);
+}
+
+static int take_private_data(struct rdma_cm_conn *conn, const struct rdma_conn_param *param) {
+    struct rdma_wire_msg msg;
+
+    // The transport may pad private data, never shorten it
+    if(!param->private_data ||
+       rdma_wire_decode(&msg, param->private_data, param->private_data_len)) {
+        fprintf(stderr, "rdma_cm: no connection descriptor in the private data\n");
+        return -1;
+    }
+    int ret = 0;
+    if(msg.nmrs != 1) {
+        fprintf(stderr, "rdma_cm: peer described %u MRs, one expected\n", msg.nmrs);
+        ret = -1;
+    } else {
+        rdma_wire_to_conn_info(NULL, &msg.mrs[0], &conn->remote);
+        conn->remote_len = msg.mrs[0].len;
+        conn->caps = msg.caps;
+    }
+    rdma_wire_msg_free(&msg);
+    return ret;
+}
+
+// Endpoints live on RDMA_PORT_NUM; a connection resolved to another port
+// would need its QP initialized there
+static int check_port(const struct rdma_cm_conn *conn) {
+    if(conn->id->port_num != RDMA_PORT_NUM) {
+        fprintf(stderr, "rdma_cm resolved the peer to port %u; endpoints use port %d\n",
+                conn->id->port_num, RDMA_PORT_NUM);
+        return -1;
+    }
+    return 0;
+}
+
+// Move the QP to `state` with the attributes rdma_cm derived for the
+// connection (path, MTU, PSNs, timeouts and read/atomic depths, which the
+// CM exchange has already settled between the two sides) and keep them
+static int modify_qp(struct rdma_cm_conn *conn, struct rdma_endpoint *ep,
+                     enum ibv_qp_state state) {
+    struct ibv_qp_attr attr = { .qp_state = state };
+    int mask;
+
+    if(rdma_init_qp_attr(conn->id, &attr, &mask)) {
+        perror("rdma_init_qp_attr");
+        return -1;
+    }
+    if(ibv_modify_qp(ep->qp, &attr, mask)) {
+        perror(state == IBV_QPS_RTR ? "Failed to modify QP to RTR" :
+                                      "Failed to modify QP to RTS");
+        return -1;
+    }
+    if(state == IBV_QPS_RTR) {
+        ep->params.mtu = attr.path_mtu;
+        ep->params.max_dest_rd_atomic = attr.max_dest_rd_atomic;
+    } else {
+        ep->params.max_rd_atomic = attr.max_rd_atomic;
+        ep->params.timeout = attr.timeout;
+        ep->params.retry_cnt = attr.retry_cnt;
+        ep->params.rnr_retry = attr.rnr_retry;
+    }
+    return 0;
+}
+
+// Offer what the device can do, as the TCP path's description does. The
+// passive side answers within the request's offer: no more responder
+// resources than the peer will use, no deeper than the peer can serve.
+static void conn_param(struct rdma_conn_param *param, const struct rdma_cm_conn *conn,
+                       const struct rdma_endpoint *ep, const uint8_t *private_data,
+                       size_t len) {
+    struct rdma_qp_desc qp;
+    struct rdma_mr_desc mr;
+    rdma_endpoint_describe(ep, &qp, &mr);
+
+    *param = (struct rdma_conn_param) {
+        .private_data = private_data,
+        .private_data_len = (uint8_t)len,
+        .responder_resources = qp.rd_atom,
+        .initiator_depth = qp.init_rd_atom,
+        .retry_count = qp.retry_cnt,
+        .rnr_retry_count = qp.rnr_retry,
+        .srq = ep->qp->srq != NULL,
+        .qp_num = ep->qp->qp_num
+    };
+    if(conn->is_passive) {
+        if(param->responder_resources > conn->initiator_depth) {
+            param->responder_resources = conn->initiator_depth;
+        }
+        if(param->initiator_depth > conn->responder_resources) {
+            param->initiator_depth = conn->responder_resources;
+        }
+    }
+}
+
+int rdma_cm_listen(struct rdma_cm_listener *listener, int port, int backlog) {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY)
+    };
+
+    memset(listener, 0, sizeof(*listener));
+    listener->channel = rdma_create_event_channel();
+    if(!listener->channel) {
+        perror("rdma_create_event_channel");
+        return -1;
+    }
+    if(rdma_create_id(listener->channel, &listener->id, NULL, RDMA_PS_TCP)) {
+        perror("rdma_create_id");
+        listener->id = NULL;
+        goto err;
+    }
+    if(rdma_bind_addr(listener->id, (struct sockaddr *)&addr)) {
+        perror("rdma_bind_addr");
+        goto err;
+    }
+    if(rdma_listen(listener->id, backlog)) {
+        perror("rdma_listen");
+        goto err;
+    }
+    return 0;
+
+err:
+    rdma_cm_listener_destroy(listener);
+    return -1;
+}
+
+void rdma_cm_listener_destroy(struct rdma_cm_listener *listener) {
+    if(listener->id) {
+        rdma_destroy_id(listener->id);
+    }
+    if(listener->channel) {
+        rdma_destroy_event_channel(listener->channel);
+    }
+    memset(listener, 0, sizeof(*listener));
+}
+
+int rdma_cm_get_request(struct rdma_cm_listener *listener, struct rdma_cm_conn *conn) {
+    struct rdma_cm_event *ev;
+
+    memset(conn, 0, sizeof(*conn));
+    if(wait_event(listener->channel, RDMA_CM_EVENT_CONNECT_REQUEST, &ev)) {
+        return -1;
+    }
+    conn->channel = listener->channel;
+    conn->id = ev->id;
+    conn->verbs = ev->id->verbs;
+    conn->is_passive = 1;
+    conn->responder_resources = ev->param.conn.responder_resources;
+    conn->initiator_depth = ev->param.conn.initiator_depth;
+    int ret = take_private_data(conn, &ev->param.conn);
+    rdma_ack_cm_event(ev);
+    if(ret == 0) {
+        ret = check_port(conn);
+    }
+    if(ret) {
+        rdma_reject(conn->id, NULL, 0);
+        rdma_cm_disconnect(conn);
+    }
+    return ret;
+}
+
+int rdma_cm_accept(struct rdma_cm_conn *conn, struct rdma_endpoint *ep) {
+    uint8_t local[CM_PRIVATE_DATA_MAX];
+    struct rdma_conn_param param;
+    struct rdma_cm_event *ev;
+
+    // Ready to receive and send before the peer hears back, as rdma_accept
+    // does for QPs it owns
+    if(modify_qp(conn, ep, IBV_QPS_RTR) || modify_qp(conn, ep, IBV_QPS_RTS)) {
+        return -1;
+    }
+    conn_param(&param, conn, ep, local, put_private_data(local, sizeof(local), ep));
+    if(rdma_accept(conn->id, &param)) {
+        perror("rdma_accept");
+        return -1;
+    }
+    if(wait_event(conn->channel, RDMA_CM_EVENT_ESTABLISHED, &ev)) {
+        return -1;
+    }
+    rdma_ack_cm_event(ev);
+    conn->connected = 1;
+
+    ep->remote_rkey = conn->remote.rkey;
+    ep->remote_addr = conn->remote.remote_addr;
+    ep->remote_len = conn->remote_len;
+    ep->caps = rdma_endpoint_caps(ep) & conn->caps;
+    return 0;
+}
+
+int rdma_cm_resolve(struct rdma_cm_conn *conn, const char *server_ip, int port) {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port)
+    };
+    struct rdma_cm_event *ev;
+
+    memset(conn, 0, sizeof(*conn));
+    if(inet_pton(AF_INET, server_ip, &addr.sin_addr) <= 0) {
+        fprintf(stderr, "Invalid server IP address: %s\n", server_ip);
+        return -1;
+    }
+
+    conn->channel = rdma_create_event_channel();
+    if(!conn->channel) {
+        perror("rdma_create_event_channel");
+        return -1;
+    }
+    conn->own_channel = 1;
+    if(rdma_create_id(conn->channel, &conn->id, conn, RDMA_PS_TCP)) {
+        perror("rdma_create_id");
+        conn->id = NULL;
+        goto err;
+    }
+
+    if(rdma_resolve_addr(conn->id, NULL, (struct sockaddr *)&addr, CM_RESOLVE_TIMEOUT_MS)) {
+        perror("rdma_resolve_addr");
+        goto err;
+    }
+    if(wait_event(conn->channel, RDMA_CM_EVENT_ADDR_RESOLVED, &ev)) {
+        goto err;
+    }
+    rdma_ack_cm_event(ev);
+
+    if(rdma_resolve_route(conn->id, CM_RESOLVE_TIMEOUT_MS)) {
+        perror("rdma_resolve_route");
+        goto err;
+    }
+    if(wait_event(conn->channel, RDMA_CM_EVENT_ROUTE_RESOLVED, &ev)) {
+        goto err;
+    }
+    rdma_ack_cm_event(ev);
+
+    conn->verbs = conn->id->verbs;
+    if(check_port(conn)) {
+        goto err;
+    }
+    return 0;
+
+err:
+    rdma_cm_disconnect(conn);
+    return -1;
+}
+
+int rdma_cm_connect(struct rdma_cm_conn *conn, struct rdma_endpoint *ep) {
+    uint8_t local[CM_PRIVATE_DATA_MAX];
+    struct rdma_conn_param param;
+    struct rdma_cm_event *ev;
+
+    conn_param(&param, conn, ep, local, put_private_data(local, sizeof(local), ep));
+    if(rdma_connect(conn->id, &param)) {
+        perror("rdma_connect");
+        return -1;
+    }
+
+    // With a QP of our own the CM stops at the response and leaves the
+    // transitions and the final handshake message to us
+    if(wait_event(conn->channel, RDMA_CM_EVENT_CONNECT_RESPONSE, &ev)) {
+        return -1;
+    }
+    int ret = take_private_data(conn, &ev->param.conn);
+    rdma_ack_cm_event(ev);
+    if(ret ||
+       modify_qp(conn, ep, IBV_QPS_RTR) ||
+       modify_qp(conn, ep, IBV_QPS_RTS)) {
+        return -1;
+    }
+    if(rdma_establish(conn->id)) {
+        perror("rdma_establish");
+        return -1;
+    }
+    conn->connected = 1;
+
+    ep->remote_rkey = conn->remote.rkey;
+    ep->remote_addr = conn->remote.remote_addr;
+    ep->remote_len = conn->remote_len;
+    ep->caps = rdma_endpoint_caps(ep) & conn->caps;
+    return 0;
+}
+
+void rdma_cm_disconnect(struct rdma_cm_conn *conn) {
+    if(conn->id) {
+        // The peer may have disconnected first; nothing to report then
+        if(conn->connected) {
+            rdma_disconnect(conn->id);
+        }
+        rdma_destroy_id(conn->id);
+    }
+    if(conn->own_channel && conn->channel) {
+        rdma_destroy_event_channel(conn->channel);
+    }
+    memset(conn, 0, sizeof(*conn));
+}
+
+#else // !HAVE_RDMACM
+
+int rdma_cm_supported(void) {
+    return 0;
+}
+
+static int unsupported(void) {
+    fprintf(stderr, "Built without librdmacm: rdma_cm connections are unavailable\n");
+    return -1;
+}
+
+int rdma_cm_listen(struct rdma_cm_listener *listener, int port, int backlog) {
+    (void)port;
+    (void)backlog;
+    memset(listener, 0, sizeof(*listener));
+    return unsupported();
+}
+
+void rdma_cm_listener_destroy(struct rdma_cm_listener *listener) {
+    memset(listener, 0, sizeof(*listener));
+}
+
+int rdma_cm_get_request(struct rdma_cm_listener *listener, struct rdma_cm_conn *conn) {
+    (void)listener;
+    memset(conn, 0, sizeof(*conn));
+    return unsupported();
+}
+
+int rdma_cm_accept(struct rdma_cm_conn *conn, struct rdma_endpoint *ep) {
+    (void)conn;
+    (void)ep;
+    return unsupported();
+}
+
+int rdma_cm_resolve(struct rdma_cm_conn *conn, const char *server_ip, int port) {
+    (void)server_ip;
+    (void)port;
+    memset(conn, 0, sizeof(*conn));
+    return unsupported();
+}
+
+int rdma_cm_connect(struct rdma_cm_conn *conn, struct rdma_endpoint *ep) {
+    (void)conn;
+    (void)ep;
+    return unsupported();
+}
+
+void rdma_cm_disconnect(struct rdma_cm_conn *conn) {
+    memset(conn, 0, sizeof(*conn));
+}
+
+#endif // HAVE_RDMACM
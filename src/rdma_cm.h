@@ -0,0 +1,81 @@
+#ifndef RDMA_CM_H
+#define RDMA_CM_H
+
+#include <infiniband/verbs.h>
+#include "rdma_common.h"
+#include "rdma_endpoint.h"
+
+// How a QP gets connected to its peer
+enum rdma_conn_mode {
+    RDMA_CONN_TCP,              // rdma_conn_info over a TCP socket, QP moved by hand
+    RDMA_CONN_CM,               // librdmacm
+};
+
+const char *rdma_conn_mode_str(enum rdma_conn_mode mode);
+
+// Connection setup through librdmacm instead of the TCP exchange.
+// rdma_cm resolves the peer's IP address to a local device, port and GID,
+// works out the path, and supplies the RTR/RTS attributes
+// (rdma_init_qp_attr) that rdma_endpoint_connect otherwise builds from
+// rdma_conn_info. The CM exchange settles the path MTU and the read/atomic
+// depths between the two sides itself. The QP itself is still an endpoint's, created on a
+// device attached to the context rdma_cm resolved to (rdma_device_attach);
+// the buffer's MR and the capabilities travel as the CM private data, in
+// an rdma_wire message like the TCP path's.
+//
+// Only RC connects this way (the RDMA_PS_TCP port space). Without
+// librdmacm at build time every call fails and rdma_cm_supported() is 0.
+
+// rdma_cm listens this far above the TCP handshake port, clear of the
+// socket still carrying the benchmark's configuration.
+#define RDMA_CM_PORT_OFFSET 1
+
+struct rdma_event_channel;
+struct rdma_cm_id;
+
+struct rdma_cm_listener {
+    struct rdma_event_channel *channel;
+    struct rdma_cm_id *id;
+};
+
+// One connection, from either side
+struct rdma_cm_conn {
+    struct rdma_event_channel *channel; // The listener's on the passive side
+    int own_channel;
+    struct rdma_cm_id *id;
+    struct ibv_context *verbs;  // Device the connection resolved to
+    struct rdma_conn_info remote; // The peer's buffer (rkey, remote_addr)
+    uint64_t remote_len;
+    uint32_t caps;              // RDMA_CAP_* the peer advertised
+    int is_passive;
+    uint8_t responder_resources; // The connect request's offer (passive side)
+    uint8_t initiator_depth;
+    int connected;
+};
+
+// Built with librdmacm
+int rdma_cm_supported(void);
+
+// Listen for connect requests on every address
+int rdma_cm_listen(struct rdma_cm_listener *listener, int port, int backlog);
+
+void rdma_cm_listener_destroy(struct rdma_cm_listener *listener);
+
+// Passive side: wait for the next connect request. `conn->verbs` tells
+// which device to create the endpoint on. Requests are taken one at a
+// time: each must be accepted before the next is waited for.
+int rdma_cm_get_request(struct rdma_cm_listener *listener, struct rdma_cm_conn *conn);
+
+// Accept a request with `ep`, whose QP must still be in INIT
+int rdma_cm_accept(struct rdma_cm_conn *conn, struct rdma_endpoint *ep);
+
+// Active side: resolve the server's address and a route to it
+int rdma_cm_resolve(struct rdma_cm_conn *conn, const char *server_ip, int port);
+
+// Connect `ep`, created on `conn->verbs` and still in INIT
+int rdma_cm_connect(struct rdma_cm_conn *conn, struct rdma_endpoint *ep);
+
+// Disconnect and release the CM side; the endpoint is left to its owner
+void rdma_cm_disconnect(struct rdma_cm_conn *conn);
+
+#endif // RDMA_CM_H
@@ -1,4 +1,8 @@
+#define _GNU_SOURCE
 #include "rdma_common.h"
+#include "rdma_wire.h"
+#include <sched.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -7,9 +11,13 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <sys/resource.h>
 
-// Setup TCP server socket (for receiver)
-int setup_tcp_server(int port) {
+// How long rdma_tsc_ns_per_tick spins to calibrate
+#define TSC_CALIBRATE_NS 20000000ULL
+
+int rdma_tcp_listen(int port, int backlog) {
     int sockfd;
     struct sockaddr_in server_addr;
     
@@ -37,18 +45,24 @@ int setup_tcp_server(int port) {
         return -1;
     }
     
-    if(listen(sockfd, 1) < 0) {
+    if(listen(sockfd, backlog) < 0) {
         perror("listen");
         close(sockfd);
         return -1;
     }
-    
-    printf("TCP server listening on port %d\n", port);
     return sockfd;
 }
 
-// Setup TCP client socket and connect to server (for sender)
-int setup_tcp_client(const char *server_ip, int port) {
+// Setup TCP server socket (for receiver)
+int setup_tcp_server(int port) {
+    int sockfd = rdma_tcp_listen(port, 1);
+    if(sockfd >= 0) {
+        printf("TCP server listening on port %d\n", port);
+    }
+    return sockfd;
+}
+
+int rdma_tcp_connect(const char *server_ip, int port) {
     int sockfd;
     struct sockaddr_in server_addr;
     struct hostent *server;
@@ -76,28 +90,60 @@ int setup_tcp_client(const char *server_ip, int port) {
         close(sockfd);
         return -1;
     }
-    
-    printf("Connected to receiver at %s:%d\n", server_ip, port);
     return sockfd;
 }
 
+// Setup TCP client socket and connect to server (for sender)
+int setup_tcp_client(const char *server_ip, int port) {
+    int sockfd = rdma_tcp_connect(server_ip, port);
+    if(sockfd >= 0) {
+        printf("Connected to receiver at %s:%d\n", server_ip, port);
+    }
+    return sockfd;
+}
+
+// Both directions carry one QP and one MR in the rdma_wire format
+static int send_conn_info(int sockfd, const struct rdma_conn_info *info) {
+    struct rdma_qp_desc qp;
+    struct rdma_mr_desc mr;
+    rdma_wire_from_conn_info(info, &qp, &mr);
+
+    struct rdma_wire_msg msg = {
+        .version = RDMA_WIRE_VERSION,
+        .nqps = 1,
+        .nmrs = 1,
+        .qps = &qp,
+        .mrs = &mr
+    };
+    return rdma_wire_send(sockfd, &msg);
+}
+
+static int recv_conn_info(int sockfd, struct rdma_conn_info *info) {
+    struct rdma_wire_msg msg;
+    int ret = 0;
+
+    if(rdma_wire_recv(sockfd, &msg)) {
+        return -1;
+    }
+    if(msg.nqps != 1 || msg.nmrs != 1) {
+        fprintf(stderr, "Peer described %u QPs and %u MRs, one of each expected\n",
+                msg.nqps, msg.nmrs);
+        ret = -1;
+    } else {
+        rdma_wire_to_conn_info(&msg.qps[0], &msg.mrs[0], info);
+    }
+    rdma_wire_msg_free(&msg);
+    return ret;
+}
+
 // Exchange RDMA connection information via TCP
 // Receiver version: sends first, then receives
 int exchange_conn_info_as_receiver(int sockfd, struct rdma_conn_info *local_info, 
                                     struct rdma_conn_info *remote_info) {
-    // Send local info first
-    if(send(sockfd, local_info, sizeof(*local_info), 0) != sizeof(*local_info)) {
-        perror("send");
-        return -1;
-    }
-    
-    // Receive remote info
-    if(recv(sockfd, remote_info, sizeof(*remote_info), MSG_WAITALL) != sizeof(*remote_info)) {
-        perror("recv");
+    if(send_conn_info(sockfd, local_info)) {
         return -1;
     }
-    
-    return 0;
+    return recv_conn_info(sockfd, remote_info);
 }
 
 // Exchange RDMA connection information via TCP
@@ -105,17 +151,89 @@ int exchange_conn_info_as_receiver(int sockfd, struct rdma_conn_info *local_info
 int exchange_conn_info_as_sender(int sockfd, struct rdma_conn_info *local_info, 
                                   struct rdma_conn_info *remote_info) {
     // Receive remote info first (receiver sends first)
-    if(recv(sockfd, remote_info, sizeof(*remote_info), MSG_WAITALL) != sizeof(*remote_info)) {
-        perror("recv");
+    if(recv_conn_info(sockfd, remote_info)) {
         return -1;
     }
-    
-    // Send local info
-    if(send(sockfd, local_info, sizeof(*local_info), 0) != sizeof(*local_info)) {
+    return send_conn_info(sockfd, local_info);
+}
+
+int rdma_sock_send(int sockfd, const void *buf, size_t len) {
+    if(send(sockfd, buf, len, 0) != (ssize_t)len) {
         perror("send");
         return -1;
     }
-    
     return 0;
 }
 
+int rdma_sock_recv(int sockfd, void *buf, size_t len) {
+    if(recv(sockfd, buf, len, MSG_WAITALL) != (ssize_t)len) {
+        perror("recv");
+        return -1;
+    }
+    return 0;
+}
+
+int rdma_sock_barrier(int sockfd) {
+    char token = 'B';
+    if(rdma_sock_send(sockfd, &token, 1) || rdma_sock_recv(sockfd, &token, 1)) {
+        return -1;
+    }
+    return token == 'B' ? 0 : -1;
+}
+
+volatile sig_atomic_t rdma_stop_requested = 0;
+
+static void stop_handler(int sig) {
+    (void)sig;
+    rdma_stop_requested = 1;
+}
+
+// Install SIGINT/SIGTERM handlers that ask long-running loops to stop
+int rdma_install_stop_handler(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_handler;
+    sigemptyset(&sa.sa_mask);
+    if(sigaction(SIGINT, &sa, NULL) < 0 || sigaction(SIGTERM, &sa, NULL) < 0) {
+        perror("sigaction");
+        return -1;
+    }
+    return 0;
+}
+
+int rdma_pin_self(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if(ret) {
+        fprintf(stderr, "Failed to pin thread to CPU %d: %s\n", cpu, strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
+uint64_t rdma_cpu_time_ns(void) {
+    struct rusage ru;
+    if(getrusage(RUSAGE_SELF, &ru) < 0) {
+        return 0;
+    }
+    return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+           (uint64_t)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+double rdma_tsc_ns_per_tick(void) {
+    static double ns_per_tick;
+
+    if(ns_per_tick == 0) {
+        uint64_t ns0 = rdma_now_ns();
+        uint64_t tsc0 = rdma_tsc();
+        uint64_t ns1;
+        do {
+            ns1 = rdma_now_ns();
+        } while(ns1 - ns0 < TSC_CALIBRATE_NS);
+        uint64_t tsc1 = rdma_tsc();
+        ns_per_tick = (double)(ns1 - ns0) / (double)(tsc1 - tsc0);
+    }
+    return ns_per_tick;
+}
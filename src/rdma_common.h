@@ -2,12 +2,19 @@
 #define RDMA_COMMON_H
 
 #include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <stddef.h>
 #include <infiniband/verbs.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 // Default TCP port for RDMA connection establishment
 #define RDMA_TCP_PORT 18515
 
-// Structure for exchanging RDMA connection information
+// Connection information for one QP and its MR. It is never sent as is:
+// rdma_wire encodes it in a fixed byte order.
 struct rdma_conn_info {
     uint32_t qpn;           // Queue Pair Number
     uint32_t psn;           // Packet Sequence Number
@@ -24,7 +31,13 @@ int setup_tcp_server(int port);
 // Setup TCP client socket and connect to server (for sender)
 int setup_tcp_client(const char *server_ip, int port);
 
-// Exchange RDMA connection information via TCP
+// The same without the progress message, for programs that open many
+// connections; rdma_tcp_listen takes the accept backlog
+int rdma_tcp_listen(int port, int backlog);
+int rdma_tcp_connect(const char *server_ip, int port);
+
+// Exchange RDMA connection information via TCP, as an rdma_wire message
+// describing one QP and one MR
 // Receiver version: sends first, then receives
 int exchange_conn_info_as_receiver(int sockfd, struct rdma_conn_info *local_info, 
                                     struct rdma_conn_info *remote_info);
@@ -34,5 +47,45 @@ int exchange_conn_info_as_receiver(int sockfd, struct rdma_conn_info *local_info
 int exchange_conn_info_as_sender(int sockfd, struct rdma_conn_info *local_info, 
                                  struct rdma_conn_info *remote_info);
 
+// Send or receive exactly `len` bytes on a TCP socket
+int rdma_sock_send(int sockfd, const void *buf, size_t len);
+int rdma_sock_recv(int sockfd, void *buf, size_t len);
+
+// Wait until the peer reaches the same point (both sides call it)
+int rdma_sock_barrier(int sockfd);
+
+// Set by SIGINT/SIGTERM once rdma_install_stop_handler() has been called;
+// long-running loops check it to shut down cleanly
+extern volatile sig_atomic_t rdma_stop_requested;
+
+int rdma_install_stop_handler(void);
+
+// Monotonic clock in nanoseconds, used for throughput and latency reporting
+static inline uint64_t rdma_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Pin the calling thread to one CPU
+int rdma_pin_self(int cpu);
+
+// CPU time (user + system) consumed by this process, in nanoseconds
+uint64_t rdma_cpu_time_ns(void);
+
+// Time-stamp counter for per-message timing: a single instruction instead
+// of a clock_gettime call. Other architectures fall back to rdma_now_ns.
+static inline uint64_t rdma_tsc(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return rdma_now_ns();
+#endif
+}
+
+// Nanoseconds per rdma_tsc tick, calibrated against CLOCK_MONOTONIC on
+// first use. Assumes an invariant TSC, as on any recent x86 server.
+double rdma_tsc_ns_per_tick(void);
+
 #endif // RDMA_COMMON_H
 
@@ -0,0 +1,279 @@
+#include "rdma_cq.h"
+#include "rdma_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <inttypes.h>
+
+int cq_poller_init(struct cq_poller *poller, struct ibv_cq *cq, int batch) {
+    memset(poller, 0, sizeof(*poller));
+    if(batch <= 0 || batch > CQ_POLL_BATCH_MAX) {
+        batch = CQ_POLL_BATCH_DEFAULT;
+    }
+    poller->cq = cq;
+    poller->batch = batch;
+
+    // Align to a cache line so the array does not share lines with the
+    // counters the poll loop updates
+    if(posix_memalign((void **)&poller->wc, 64, batch * sizeof(*poller->wc))) {
+        perror("posix_memalign");
+        return -1;
+    }
+    memset(poller->wc, 0, batch * sizeof(*poller->wc));
+    return 0;
+}
+
+void cq_poller_enable_events(struct cq_poller *poller,
+                             struct ibv_comp_channel *channel,
+                             uint64_t spin_ns) {
+    poller->channel = channel;
+    poller->spin_ns = spin_ns;
+}
+
+int cq_poller_enable_timestamps(struct cq_poller *poller,
+                                struct ibv_cq_ex *cqx,
+                                struct hw_clock *clock) {
+    poller->ts = calloc(poller->batch, sizeof(*poller->ts));
+    if(!poller->ts) {
+        perror("calloc");
+        return -1;
+    }
+    poller->cqx = cqx;
+    poller->clock = clock;
+    return 0;
+}
+
+void cq_poller_destroy(struct cq_poller *poller) {
+    if(poller->unacked) {
+        ibv_ack_cq_events(poller->cq, poller->unacked);
+        poller->unacked = 0;
+    }
+    free(poller->wc);
+    free(poller->ts);
+    poller->wc = NULL;
+    poller->ts = NULL;
+}
+
+// Copy up to `batch` CQEs out of an extended CQ into the wc/ts arrays.
+// Dispatch happens after ibv_end_poll so handlers never run under the
+// provider's poll lock.
+static int poll_ex(struct cq_poller *poller) {
+    struct ibv_cq_ex *cqx = poller->cqx;
+    struct ibv_poll_cq_attr attr = {};
+    int n = 0;
+
+    int ret = ibv_start_poll(cqx, &attr);
+    if(ret == ENOENT) {
+        return 0;
+    }
+    if(ret) {
+        return -1;
+    }
+
+    do {
+        struct ibv_wc *wc = &poller->wc[n];
+        wc->wr_id = cqx->wr_id;
+        wc->status = cqx->status;
+        wc->opcode = ibv_wc_read_opcode(cqx);
+        wc->byte_len = ibv_wc_read_byte_len(cqx);
+        wc->wc_flags = ibv_wc_read_wc_flags(cqx);
+        wc->imm_data = (wc->wc_flags & IBV_WC_WITH_IMM) ?
+                       ibv_wc_read_imm_data(cqx) : 0;
+        poller->ts[n] = ibv_wc_read_completion_ts(cqx);
+        n++;
+        if(n == poller->batch) {
+            break;
+        }
+        ret = ibv_next_poll(cqx);
+    } while(ret == 0);
+
+    ibv_end_poll(cqx);
+    if(ret && ret != ENOENT) {
+        return -1;
+    }
+    return n;
+}
+
+int cq_poller_poll(struct cq_poller *poller, cq_handler_fn handler, void *arg) {
+    int n = poller->cqx ? poll_ex(poller) :
+            ibv_poll_cq(poller->cq, poller->batch, poller->wc);
+    poller->polls++;
+    if(n < 0) {
+        fprintf(stderr, "ibv_poll_cq failed\n");
+        return -1;
+    }
+    poller->hist[n]++;
+    poller->cqes += n;
+
+    // Keep the NIC-to-host mapping fresh; convert after re-anchoring
+    if(n > 0 && poller->clock &&
+       rdma_now_ns() - poller->clock->host0 > HW_CLOCK_RESYNC_NS &&
+       hw_clock_sync(poller->clock)) {
+        return -1;
+    }
+
+    for(int i = 0; i < n; i++) {
+        const struct ibv_wc *wc = &poller->wc[i];
+        if(wc->status != IBV_WC_SUCCESS) {
+            fprintf(stderr, "Work completion error: %s (status=%d, wr_id: %lu)\n",
+                    ibv_wc_status_str(wc->status), wc->status, wc->wr_id);
+            return -1;
+        }
+        uint64_t nic_ns = poller->clock ?
+                          hw_clock_to_host_ns(poller->clock, poller->ts[i]) : 0;
+        if(handler(arg, wc, nic_ns)) {
+            return -1;
+        }
+    }
+    return n;
+}
+
+int cq_poller_wait(struct cq_poller *poller, cq_handler_fn handler, void *arg) {
+    int n;
+
+    if(!poller->channel) {
+        return cq_poller_poll(poller, handler, arg);
+    }
+
+    // Spin first: a completion arriving within the budget costs no wakeup
+    uint64_t start = rdma_now_ns();
+    do {
+        n = cq_poller_poll(poller, handler, arg);
+        if(n != 0) {
+            return n;
+        }
+    } while(rdma_now_ns() - start < poller->spin_ns);
+
+    // Arm, then poll once more: a CQE that landed between the last poll and
+    // the arm raises no event, so sleeping without this check could hang
+    if(ibv_req_notify_cq(poller->cq, 0)) {
+        fprintf(stderr, "ibv_req_notify_cq failed\n");
+        return -1;
+    }
+    n = cq_poller_poll(poller, handler, arg);
+    if(n != 0) {
+        // The CQ stays armed; its event is consumed as a spurious wakeup later
+        return n;
+    }
+
+    struct pollfd pfd = { .fd = poller->channel->fd, .events = POLLIN };
+    poller->sleeps++;
+    int ready = poll(&pfd, 1, CQ_EVENT_TIMEOUT_MS);
+    if(ready < 0) {
+        if(errno == EINTR) {
+            return 0;
+        }
+        perror("poll");
+        return -1;
+    }
+    if(ready == 0) {
+        return 0;
+    }
+
+    struct ibv_cq *ev_cq;
+    void *ev_ctx;
+    if(ibv_get_cq_event(poller->channel, &ev_cq, &ev_ctx)) {
+        perror("ibv_get_cq_event");
+        return -1;
+    }
+    poller->events++;
+    if(++poller->unacked >= CQ_EVENT_ACK_BATCH) {
+        ibv_ack_cq_events(poller->cq, poller->unacked);
+        poller->unacked = 0;
+    }
+
+    return cq_poller_poll(poller, handler, arg);
+}
+
+struct ibv_cq *create_cq_timestamped(struct ibv_context *ctx, int cqe,
+                                     struct ibv_comp_channel *channel,
+                                     struct ibv_cq_ex **cqx) {
+    struct ibv_cq_init_attr_ex attr = {
+        .cqe = cqe,
+        .channel = channel,
+        .comp_vector = 0,
+        .wc_flags = IBV_WC_EX_WITH_BYTE_LEN | IBV_WC_EX_WITH_IMM |
+                    IBV_WC_EX_WITH_COMPLETION_TIMESTAMP
+    };
+
+    *cqx = ibv_create_cq_ex(ctx, &attr);
+    if(!*cqx) {
+        perror("ibv_create_cq_ex");
+        return NULL;
+    }
+    return ibv_cq_ex_to_cq(*cqx);
+}
+
+// Read the NIC free-running clock
+static int read_nic_clock(struct ibv_context *ctx, uint64_t *ticks) {
+    struct ibv_values_ex values = { .comp_mask = IBV_VALUES_MASK_RAW_CLOCK };
+    int ret = ibv_query_rt_values_ex(ctx, &values);
+    if(ret) {
+        errno = ret;
+        perror("ibv_query_rt_values_ex");
+        return -1;
+    }
+    *ticks = (uint64_t)values.raw_clock.tv_sec * 1000000000ULL +
+             (uint64_t)values.raw_clock.tv_nsec;
+    return 0;
+}
+
+int hw_clock_sync(struct hw_clock *clock) {
+    uint64_t ticks;
+
+    // Bracket the NIC read with host reads and anchor at the midpoint
+    uint64_t before = rdma_now_ns();
+    if(read_nic_clock(clock->ctx, &ticks)) {
+        return -1;
+    }
+    uint64_t after = rdma_now_ns();
+
+    clock->tick0 = ticks;
+    clock->host0 = before + (after - before) / 2;
+    return 0;
+}
+
+int hw_clock_init(struct hw_clock *clock, struct ibv_context *ctx) {
+    struct ibv_device_attr_ex attr = {};
+
+    memset(clock, 0, sizeof(*clock));
+    if(ibv_query_device_ex(ctx, NULL, &attr)) {
+        perror("ibv_query_device_ex");
+        return -1;
+    }
+    if(!attr.completion_timestamp_mask || !attr.hca_core_clock) {
+        fprintf(stderr, "Device does not support completion timestamps\n");
+        return -1;
+    }
+
+    clock->ctx = ctx;
+    clock->mask = attr.completion_timestamp_mask;
+    clock->ns_per_tick = 1e6 / attr.hca_core_clock;  // hca_core_clock is in kHz
+    printf("Completion timestamps: hca_core_clock %" PRIu64 " kHz, mask 0x%" PRIx64 "\n",
+           attr.hca_core_clock, attr.completion_timestamp_mask);
+    return hw_clock_sync(clock);
+}
+
+void cq_poller_print(const struct cq_poller *poller) {
+    uint64_t busy = poller->polls - poller->hist[0];
+
+    printf("CQ polling: %lu calls (%lu empty), %lu CQEs, batch %d\n",
+           poller->polls, poller->hist[0], poller->cqes, poller->batch);
+    if(poller->channel) {
+        printf("    Event mode: spin %lu us, %lu sleeps, %lu CQ events\n",
+               poller->spin_ns / 1000, poller->sleeps, poller->events);
+    }
+    if(busy == 0) {
+        return;
+    }
+    printf("    Average CQEs per non-empty call: %.2f\n",
+           (double)poller->cqes / busy);
+    for(int i = 1; i <= poller->batch; i++) {
+        if(poller->hist[i]) {
+            printf("    %2d CQEs: %10lu calls (%5.1f%%)\n", i, poller->hist[i],
+                   100.0 * poller->hist[i] / busy);
+        }
+    }
+}
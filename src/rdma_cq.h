@@ -0,0 +1,122 @@
+#ifndef RDMA_CQ_H
+#define RDMA_CQ_H
+
+#include <stdint.h>
+#include <infiniband/verbs.h>
+
+// Most CQEs drained by a single ibv_poll_cq call
+#define CQ_POLL_BATCH_MAX 64
+
+// Default CQEs per ibv_poll_cq call
+#define CQ_POLL_BATCH_DEFAULT 16
+
+// CQ events acknowledged per ibv_ack_cq_events call (it takes a mutex)
+#define CQ_EVENT_ACK_BATCH 64
+
+// Longest a sleeping poller blocks before returning to let callers check
+// for a stop request
+#define CQ_EVENT_TIMEOUT_MS 100
+
+// How often the NIC-to-host clock mapping is refreshed to bound drift
+#define HW_CLOCK_RESYNC_NS 100000000ULL
+
+// Maps raw NIC completion timestamps onto the host CLOCK_MONOTONIC timeline.
+// The NIC free-running clock ticks at hca_core_clock kHz; one paired sample
+// of (NIC ticks, host ns) anchors the mapping, refreshed every
+// HW_CLOCK_RESYNC_NS so clock drift stays well below a microsecond.
+struct hw_clock {
+    struct ibv_context *ctx;
+    double ns_per_tick;         // From hca_core_clock
+    uint64_t mask;              // completion_timestamp_mask (counter width)
+    uint64_t tick0;             // NIC clock at the anchor
+    uint64_t host0;             // Host ns at the anchor
+};
+
+// Check the device reports completion timestamps and take the first anchor
+int hw_clock_init(struct hw_clock *clock, struct ibv_context *ctx);
+
+// Re-anchor the mapping
+int hw_clock_sync(struct hw_clock *clock);
+
+// Convert a raw completion timestamp to host monotonic ns
+static inline uint64_t hw_clock_to_host_ns(const struct hw_clock *clock,
+                                           uint64_t ticks) {
+    // Signed so that timestamps taken just before the anchor still work
+    int64_t delta = (int64_t)((ticks - clock->tick0) & clock->mask);
+    if((uint64_t)delta > clock->mask / 2) {
+        delta -= (int64_t)clock->mask + 1;
+    }
+    return clock->host0 + (int64_t)(delta * clock->ns_per_tick);
+}
+
+// Create a CQ through ibv_create_cq_ex that records completion timestamps.
+// Returns the ibv_cq view (for QP creation and notification) and stores the
+// extended handle in *cqx for polling.
+struct ibv_cq *create_cq_timestamped(struct ibv_context *ctx, int cqe,
+                                     struct ibv_comp_channel *channel,
+                                     struct ibv_cq_ex **cqx);
+
+// Completion engine: drains up to `batch` CQEs per ibv_poll_cq call into a
+// reusable, cache-aligned ibv_wc array and hands each one to a handler,
+// which dispatches on wr_id. Records how many CQEs each call returned.
+// With a completion channel attached, cq_poller_wait busy-polls for
+// `spin_ns` and then arms the CQ and sleeps until the next CQ event.
+// With an extended CQ attached, CQEs are read through ibv_start_poll and
+// their NIC completion timestamps, converted to host ns, are handed to the
+// handler.
+struct cq_poller {
+    struct ibv_cq *cq;
+    int batch;                          // CQEs requested per call
+    struct ibv_wc *wc;                  // `batch` entries, 64-byte aligned
+
+    uint64_t polls;                     // ibv_poll_cq calls
+    uint64_t cqes;                      // CQEs drained
+    uint64_t hist[CQ_POLL_BATCH_MAX + 1]; // Calls that returned n CQEs
+
+    struct ibv_cq_ex *cqx;              // NULL: plain ibv_poll_cq
+    struct hw_clock *clock;             // Converts completion timestamps
+    uint64_t *ts;                       // Raw timestamps, one per wc entry
+
+    struct ibv_comp_channel *channel;   // NULL: busy-poll only
+    uint64_t spin_ns;                   // Busy-poll budget before sleeping
+    uint64_t sleeps;                    // Times the poller blocked
+    uint64_t events;                    // CQ events consumed
+    unsigned int unacked;               // Events not yet acknowledged
+};
+
+// Called once per successful CQE with the time the NIC completed it, on the
+// host CLOCK_MONOTONIC timeline (0 unless timestamps are enabled). A nonzero
+// return stops dispatch and is passed back from cq_poller_poll as an error.
+typedef int (*cq_handler_fn)(void *arg, const struct ibv_wc *wc,
+                             uint64_t nic_ns);
+
+int cq_poller_init(struct cq_poller *poller, struct ibv_cq *cq, int batch);
+
+// Switch to hybrid spin-then-sleep mode on `channel`, which the CQ must
+// have been created with
+void cq_poller_enable_events(struct cq_poller *poller,
+                             struct ibv_comp_channel *channel,
+                             uint64_t spin_ns);
+
+// Poll `cqx` (created by create_cq_timestamped for this poller's CQ) with
+// the extended API and convert completion timestamps through `clock`
+int cq_poller_enable_timestamps(struct cq_poller *poller,
+                                struct ibv_cq_ex *cqx,
+                                struct hw_clock *clock);
+
+// Acknowledges outstanding CQ events, so call it before destroying the CQ
+void cq_poller_destroy(struct cq_poller *poller);
+
+// Poll once and dispatch what came back. Returns the number of CQEs, or -1
+// on a poll failure, a completion error or a handler failure.
+int cq_poller_poll(struct cq_poller *poller, cq_handler_fn handler, void *arg);
+
+// Like cq_poller_poll, but in event mode spins for the budget and then
+// sleeps until a completion arrives. May return 0 after CQ_EVENT_TIMEOUT_MS
+// or a signal so the caller can check whether it should stop.
+int cq_poller_wait(struct cq_poller *poller, cq_handler_fn handler, void *arg);
+
+// Print the distribution of CQEs returned per call
+void cq_poller_print(const struct cq_poller *poller);
+
+#endif // RDMA_CQ_H
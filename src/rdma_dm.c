@@ -0,0 +1,82 @@
+#include "rdma_dm.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+size_t rdma_dm_max_size(struct ibv_context *ctx) {
+    struct ibv_device_attr_ex attr;
+
+    if(ibv_query_device_ex(ctx, NULL, &attr)) {
+        return 0;
+    }
+    return attr.max_dm_size;
+}
+
+int rdma_dm_alloc(struct rdma_dm *dm, struct ibv_context *ctx,
+                  struct ibv_pd *pd, size_t size, int access) {
+    memset(dm, 0, sizeof(*dm));
+
+    // Providers allocate device memory in blocks and copy it in 4-byte
+    // words; whole cache lines keep every copy aligned
+    size = (size + 63) & ~(size_t)63;
+    size_t max = rdma_dm_max_size(ctx);
+    if(max < size) {
+        fprintf(stderr, "Device memory: %zu bytes wanted, the device offers %zu\n",
+                size, max);
+        return 1;
+    }
+
+    struct ibv_alloc_dm_attr attr = { .length = size };
+    dm->dm = ibv_alloc_dm(ctx, &attr);
+    if(!dm->dm) {
+        // ENOMEM: other processes hold the rest of it
+        perror("ibv_alloc_dm");
+        return errno == ENOMEM || errno == EOPNOTSUPP ? 1 : -1;
+    }
+    dm->size = size;
+
+    dm->mr = ibv_reg_dm_mr(pd, dm->dm, 0, size, access | IBV_ACCESS_ZERO_BASED);
+    if(!dm->mr) {
+        perror("ibv_reg_dm_mr");
+        rdma_dm_free(dm);
+        return -1;
+    }
+
+    // Start from zeroed flags, like a fresh host buffer
+    char zero[256] = { 0 };
+    for(size_t off = 0; off < size; off += sizeof(zero)) {
+        size_t len = size - off < sizeof(zero) ? size - off : sizeof(zero);
+        if(rdma_dm_write(dm, off, zero, len)) {
+            rdma_dm_free(dm);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void rdma_dm_free(struct rdma_dm *dm) {
+    if(dm->mr && ibv_dereg_mr(dm->mr)) {
+        perror("ibv_dereg_mr");
+    }
+    if(dm->dm && ibv_free_dm(dm->dm)) {
+        perror("ibv_free_dm");
+    }
+    memset(dm, 0, sizeof(*dm));
+}
+
+int rdma_dm_read(const struct rdma_dm *dm, uint64_t offset, void *dst, size_t len) {
+    if(ibv_memcpy_from_dm(dst, dm->dm, offset, len)) {
+        perror("ibv_memcpy_from_dm");
+        return -1;
+    }
+    return 0;
+}
+
+int rdma_dm_write(const struct rdma_dm *dm, uint64_t offset, const void *src,
+                  size_t len) {
+    if(ibv_memcpy_to_dm(dm->dm, offset, src, len)) {
+        perror("ibv_memcpy_to_dm");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef RDMA_DM_H
+#define RDMA_DM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <infiniband/verbs.h>
+
+// On-NIC device memory (ibv_alloc_dm), registered as a zero-based MR.
+// RDMA writes into it are placed by the NIC without a PCIe round trip to
+// host DRAM, which suits small, latency-critical targets such as flags,
+// credits and sequence counters. Peers address it by offset: remote
+// address 0 is its first byte. The host reaches it only through
+// rdma_dm_read and rdma_dm_write, which are MMIO copies and slow.
+struct rdma_dm {
+    struct ibv_dm *dm;
+    struct ibv_mr *mr;
+    size_t size;
+};
+
+// Device memory the device offers in total (0: none)
+size_t rdma_dm_max_size(struct ibv_context *ctx);
+
+// Allocate and register `size` bytes of device memory with `access`.
+// Returns 1 if the device has none or not that much, -1 on other errors.
+int rdma_dm_alloc(struct rdma_dm *dm, struct ibv_context *ctx,
+                  struct ibv_pd *pd, size_t size, int access);
+
+void rdma_dm_free(struct rdma_dm *dm);
+
+// Copy between the host and device memory. Providers may need the offset
+// and length to be multiples of 4.
+int rdma_dm_read(const struct rdma_dm *dm, uint64_t offset, void *dst, size_t len);
+int rdma_dm_write(const struct rdma_dm *dm, uint64_t offset, const void *src,
+                  size_t len);
+
+#endif // RDMA_DM_H
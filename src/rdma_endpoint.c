@@ -0,0 +1,527 @@
+#include "rdma_endpoint.h"
+#include "rdma_send.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// ::ffff:a.b.c.d, the form RoCE v2 GIDs take for IPv4 addresses
+static int gid_is_ipv4_mapped(const union ibv_gid *gid) {
+    static const uint8_t prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+    return memcmp(gid->raw, prefix, sizeof(prefix)) == 0;
+}
+
+static int pick_gid_index(struct rdma_device *dev) {
+    int fallback = -1;
+    int roce_v2 = -1;
+
+    for(int i = 0; i < dev->portinfo.gid_tbl_len; i++) {
+        struct ibv_gid_entry entry;
+        if(ibv_query_gid_ex(dev->ctx, RDMA_PORT_NUM, i, &entry, 0)) {
+            continue;       // Unpopulated entries fail with ENODATA
+        }
+        if(fallback < 0) {
+            fallback = i;
+        }
+        if(entry.gid_type == IBV_GID_TYPE_ROCE_V2) {
+            if(gid_is_ipv4_mapped(&entry.gid)) {
+                return i;
+            }
+            if(roce_v2 < 0) {
+                roce_v2 = i;
+            }
+        }
+    }
+    return roce_v2 >= 0 ? roce_v2 : fallback;
+}
+
+// Query the opened context's device and port, pick the GID and allocate
+// the PD
+static int device_setup(struct rdma_device *dev, int gid_index) {
+    if(ibv_query_device(dev->ctx, &dev->attr)) {
+        perror("ibv_query_device");
+        return -1;
+    }
+    if(ibv_query_port(dev->ctx, RDMA_PORT_NUM, &dev->portinfo)) {
+        perror("ibv_query_port");
+        return -1;
+    }
+
+    dev->gid_index = gid_index >= 0 ? gid_index : pick_gid_index(dev);
+    if(dev->gid_index < 0 ||
+       ibv_query_gid(dev->ctx, RDMA_PORT_NUM, dev->gid_index, &dev->gid)) {
+        fprintf(stderr, "No usable GID on %s port %d\n", dev->name, RDMA_PORT_NUM);
+        return -1;
+    }
+
+    dev->pd = ibv_alloc_pd(dev->ctx);
+    if(!dev->pd) {
+        perror("ibv_alloc_pd");
+        return -1;
+    }
+    return 0;
+}
+
+int rdma_device_open(struct rdma_device *dev, const char *dev_name,
+                     int gid_index) {
+    struct ibv_device **dev_list;
+    int num_devices = 0;
+
+    memset(dev, 0, sizeof(*dev));
+    dev_list = ibv_get_device_list(&num_devices);
+    if(!dev_list) {
+        perror("ibv_get_device_list");
+        return -1;
+    }
+
+    struct ibv_device *ibdev = NULL;
+    for(int i = 0; i < num_devices; i++) {
+        if(!dev_name || strcmp(ibv_get_device_name(dev_list[i]), dev_name) == 0) {
+            ibdev = dev_list[i];
+            break;
+        }
+    }
+    if(!ibdev) {
+        fprintf(stderr, "No RDMA device %s\n", dev_name ? dev_name : "found");
+        ibv_free_device_list(dev_list);
+        return -1;
+    }
+
+    snprintf(dev->name, sizeof(dev->name), "%s", ibv_get_device_name(ibdev));
+    dev->ctx = ibv_open_device(ibdev);
+    ibv_free_device_list(dev_list);
+    if(!dev->ctx) {
+        perror("ibv_open_device");
+        return -1;
+    }
+
+    dev->own_ctx = 1;
+    if(device_setup(dev, gid_index)) {
+        ibv_close_device(dev->ctx);
+        dev->ctx = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int rdma_device_attach(struct rdma_device *dev, struct ibv_context *ctx,
+                       int gid_index) {
+    memset(dev, 0, sizeof(*dev));
+    snprintf(dev->name, sizeof(dev->name), "%s", ibv_get_device_name(ctx->device));
+    dev->ctx = ctx;
+    if(device_setup(dev, gid_index)) {
+        dev->ctx = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void rdma_device_close(struct rdma_device *dev) {
+    if(dev->pd) {
+        ibv_dealloc_pd(dev->pd);
+    }
+    if(dev->ctx && dev->own_ctx) {
+        ibv_close_device(dev->ctx);
+    }
+    memset(dev, 0, sizeof(*dev));
+}
+
+// The endpoint's own CQs (and completion channel)
+static int create_cqs(struct rdma_endpoint *ep, const struct rdma_endpoint_attr *attr) {
+    struct rdma_device *dev = ep->dev;
+
+    ep->own_cq = 1;
+    if(attr->use_channel) {
+        ep->channel = ibv_create_comp_channel(dev->ctx);
+        if(!ep->channel) {
+            perror("ibv_create_comp_channel");
+            return -1;
+        }
+    }
+
+    ep->cq = ibv_create_cq(dev->ctx, attr->cq_depth, NULL, ep->channel, 0);
+    if(!ep->cq) {
+        perror("ibv_create_cq");
+        return -1;
+    }
+    ep->recv_cq = ep->cq;
+
+    // A separate receive CQ lets one thread send while another receives
+    if(attr->recv_cq_depth) {
+        ep->recv_cq = ibv_create_cq(dev->ctx, attr->recv_cq_depth, NULL,
+                                    ep->channel, 0);
+        if(!ep->recv_cq) {
+            perror("ibv_create_cq");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int rdma_endpoint_create(struct rdma_endpoint *ep, struct rdma_device *dev,
+                         const struct rdma_endpoint_attr *attr) {
+    memset(ep, 0, sizeof(*ep));
+    ep->dev = dev;
+    ep->qp_type = attr->qp_type;
+    ep->size = attr->buf_size;
+
+    uint32_t recv_depth = attr->srq ? 0 : attr->recv_depth;
+    uint32_t max_wr = attr->send_depth > recv_depth ? attr->send_depth : recv_depth;
+    if(max_wr > (uint32_t)dev->attr.max_qp_wr ||
+       attr->cq_depth > (uint32_t)dev->attr.max_cqe ||
+       attr->recv_cq_depth > (uint32_t)dev->attr.max_cqe) {
+        fprintf(stderr, "Queue depth %u / CQ depth %u exceed device limits (%d / %d)\n",
+                max_wr, attr->cq_depth, dev->attr.max_qp_wr, dev->attr.max_cqe);
+        return -1;
+    }
+
+    // RC QPs on a device that executes atomics accept them too
+    int atomics = attr->qp_type == IBV_QPT_RC && dev->attr.atomic_cap != IBV_ATOMIC_NONE;
+
+    // Endpoints without a buffer move messages in and out of memory
+    // registered elsewhere (a slab, an SRQ's pool)
+    if(ep->size) {
+        if(attr->reg == RDMA_REG_PINNED) {
+            if(rdma_mem_alloc(&ep->mem, ep->size, attr->page, attr->numa)) {
+                return -1;
+            }
+        } else if(rdma_odp_check(dev->ctx, attr->qp_type, attr->reg) ||
+                  rdma_mem_alloc_odp(&ep->mem, ep->size, attr->page, attr->numa,
+                                     attr->reg)) {
+            return -1;
+        }
+        ep->buf = ep->mem.addr;
+
+        ep->mr = rdma_mem_reg(&ep->mem, dev->pd,
+                              IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+                              IBV_ACCESS_REMOTE_READ |
+                              (atomics && attr->reg == RDMA_REG_PINNED ?
+                               IBV_ACCESS_REMOTE_ATOMIC : 0));
+        if(!ep->mr) {
+            perror("ibv_reg_mr");
+            goto err;
+        }
+    }
+
+    if(attr->shared_cq) {
+        ep->cq = attr->shared_cq;
+        ep->recv_cq = attr->shared_cq;
+    } else if(create_cqs(ep, attr)) {
+        goto err;
+    }
+
+    struct ibv_qp_init_attr_ex init_attr = {
+        .send_cq = ep->cq,
+        .recv_cq = ep->recv_cq,
+        .srq = attr->srq,
+        .cap = {
+            .max_send_wr = attr->send_depth,
+            .max_recv_wr = recv_depth,
+            .max_send_sge = 1,
+            .max_recv_sge = attr->srq ? 0 : 1,
+        },
+        .qp_type = attr->qp_type,
+        .comp_mask = IBV_QP_INIT_ATTR_PD | IBV_QP_INIT_ATTR_SEND_OPS_FLAGS,
+        .pd = dev->pd,
+        .send_ops_flags = IBV_QP_EX_WITH_SEND | IBV_QP_EX_WITH_SEND_WITH_IMM |
+                          IBV_QP_EX_WITH_RDMA_WRITE |
+                          IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM
+    };
+    if(attr->qp_type == IBV_QPT_RC) {
+        init_attr.send_ops_flags |= IBV_QP_EX_WITH_RDMA_READ;
+    }
+    if(atomics) {
+        init_attr.send_ops_flags |= IBV_QP_EX_WITH_ATOMIC_CMP_AND_SWP |
+                                    IBV_QP_EX_WITH_ATOMIC_FETCH_AND_ADD;
+    }
+
+    if(attr->use_inline) {
+        ep->qp = create_qp_ex_inline(dev->ctx, &init_attr);
+    } else {
+        ep->qp = ibv_create_qp_ex(dev->ctx, &init_attr);
+    }
+    if(!ep->qp) {
+        perror("ibv_create_qp_ex");
+        goto err;
+    }
+    ep->qpx = ibv_qp_to_qp_ex(ep->qp);
+    if(attr->use_inline) {
+        ep->max_inline = init_attr.cap.max_inline_data;
+    }
+
+    // UC has no responder for reads or atomics, so only RC grants them
+    struct ibv_qp_attr qp_attr = {
+        .qp_state = IBV_QPS_INIT,
+        .pkey_index = 0,
+        .port_num = RDMA_PORT_NUM,
+        .qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE
+    };
+    if(attr->qp_type == IBV_QPT_RC) {
+        qp_attr.qp_access_flags |= IBV_ACCESS_REMOTE_READ;
+    }
+    if(atomics) {
+        qp_attr.qp_access_flags |= IBV_ACCESS_REMOTE_ATOMIC;
+    }
+    if(ibv_modify_qp(ep->qp, &qp_attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX |
+                                       IBV_QP_PORT | IBV_QP_ACCESS_FLAGS)) {
+        perror("Failed to modify QP to INIT");
+        goto err;
+    }
+
+    // Any 24-bit PSN works as long as both sides agree; random values keep
+    // stale packets from an earlier connection from matching
+    ep->psn = (uint32_t)rand() & 0xFFFFFF;
+    return 0;
+
+err:
+    rdma_endpoint_destroy(ep);
+    return -1;
+}
+
+void rdma_endpoint_destroy(struct rdma_endpoint *ep) {
+    if(ep->qp) {
+        ibv_destroy_qp(ep->qp);
+    }
+    if(ep->own_cq && ep->recv_cq && ep->recv_cq != ep->cq) {
+        ibv_destroy_cq(ep->recv_cq);
+    }
+    if(ep->own_cq && ep->cq) {
+        ibv_destroy_cq(ep->cq);
+    }
+    if(ep->channel) {
+        ibv_destroy_comp_channel(ep->channel);
+    }
+    if(ep->mr) {
+        ibv_dereg_mr(ep->mr);
+    }
+    rdma_mem_free(&ep->mem);
+    memset(ep, 0, sizeof(*ep));
+}
+
+void rdma_endpoint_local_info(const struct rdma_endpoint *ep,
+                              struct rdma_conn_info *info) {
+    memset(info, 0, sizeof(*info));
+    info->qpn = ep->qp->qp_num;
+    info->psn = ep->psn;
+    info->gid = ep->dev->gid;
+    info->lid = ep->dev->portinfo.lid;
+    if(ep->mr) {
+        info->rkey = ep->mr->rkey;
+        info->remote_addr = (uint64_t)(uintptr_t)ep->buf;
+    }
+}
+
+void rdma_endpoint_describe(const struct rdma_endpoint *ep, struct rdma_qp_desc *qp,
+                            struct rdma_mr_desc *mr) {
+    struct rdma_conn_info info;
+
+    rdma_endpoint_local_info(ep, &info);
+    rdma_wire_from_conn_info(&info, qp, mr);
+    qp->mtu = ep->dev->portinfo.active_mtu;
+    qp->rd_atom = rdma_clamp_rd_atomic(ep->dev->attr.max_qp_rd_atom);
+    qp->init_rd_atom = rdma_clamp_rd_atomic(ep->dev->attr.max_qp_init_rd_atom);
+    qp->timeout = RDMA_QP_TIMEOUT;
+    qp->retry_cnt = RDMA_QP_RETRY_CNT;
+    qp->rnr_retry = RDMA_QP_RNR_RETRY;
+    mr->len = ep->mr ? ep->size : 0;
+}
+
+uint32_t rdma_endpoint_caps(const struct rdma_endpoint *ep) {
+    uint32_t caps = 0;
+
+    if(ep->mr) {
+        caps |= RDMA_CAP_REMOTE_WRITE;
+        // The QP grants remote reads on RC only
+        if(ep->qp_type == IBV_QPT_RC) {
+            caps |= RDMA_CAP_REMOTE_READ;
+        }
+        if(ep->mem.reg != RDMA_REG_PINNED) {
+            caps |= RDMA_CAP_ODP;
+        }
+    }
+    if(ep->qp_type == IBV_QPT_RC && ep->dev->attr.atomic_cap != IBV_ATOMIC_NONE &&
+       (!ep->mr || ep->mem.reg == RDMA_REG_PINNED)) {
+        caps |= RDMA_CAP_ATOMIC;
+    }
+    return caps;
+}
+
+// The peer's value where it gave one
+static uint8_t peer_or(int given, uint8_t peer, uint8_t local) {
+    return given ? peer : local;
+}
+
+static uint8_t min_u8(uint8_t a, uint8_t b) {
+    return a < b ? a : b;
+}
+
+static uint8_t max_u8(uint8_t a, uint8_t b) {
+    return a > b ? a : b;
+}
+
+void rdma_endpoint_negotiate(const struct rdma_endpoint *ep,
+                             const struct rdma_qp_desc *remote, uint16_t version,
+                             struct rdma_qp_params *params) {
+    struct rdma_qp_desc local, peer = { 0 };
+    struct rdma_mr_desc mr;
+
+    rdma_endpoint_describe(ep, &local, &mr);
+    if(remote) {
+        peer = *remote;
+    }
+    // An MTU of 0 is never valid; the depths were only sent from version 2
+    int has_mtu = peer.mtu != 0;
+    int has_depths = remote && version >= 2;
+
+    // Each direction's reads are bounded by the initiator's outstanding
+    // limit and the responder's resources; both sides compute the same
+    // pair, mirrored. A read depth of 1 would serialize every RDMA read
+    // on the round trip, so this matters as much as the MTU.
+    *params = (struct rdma_qp_params) {
+        .mtu = min_u8(local.mtu, peer_or(has_mtu, peer.mtu, local.mtu)),
+        .max_rd_atomic = min_u8(local.init_rd_atom,
+                                peer_or(has_depths, peer.rd_atom, local.init_rd_atom)),
+        .max_dest_rd_atomic = min_u8(local.rd_atom,
+                                     peer_or(has_depths, peer.init_rd_atom, local.rd_atom)),
+        .timeout = max_u8(local.timeout, peer.timeout),
+        .retry_cnt = max_u8(local.retry_cnt, peer.retry_cnt),
+        .rnr_retry = max_u8(local.rnr_retry, peer.rnr_retry)
+    };
+    // The fields are 5 and 3 bits wide
+    params->timeout = min_u8(params->timeout, 31);
+    params->retry_cnt = min_u8(params->retry_cnt, 7);
+    params->rnr_retry = min_u8(params->rnr_retry, 7);
+}
+
+int rdma_endpoint_connect(struct rdma_endpoint *ep,
+                          const struct rdma_conn_info *remote,
+                          const struct rdma_qp_params *params) {
+    struct rdma_device *dev = ep->dev;
+    int is_rc = ep->qp_type == IBV_QPT_RC;
+    struct rdma_qp_params local;
+
+    if(!params) {
+        rdma_endpoint_negotiate(ep, NULL, 0, &local);
+        params = &local;
+    }
+
+    struct ibv_qp_attr attr = {
+        .qp_state = IBV_QPS_RTR,
+        .path_mtu = params->mtu,
+        .dest_qp_num = remote->qpn,
+        .rq_psn = remote->psn,
+        .ah_attr = {
+            .is_global = 1,
+            .dlid = remote->lid,
+            .port_num = RDMA_PORT_NUM,
+            .grh = {
+                .dgid = remote->gid,
+                .sgid_index = dev->gid_index,
+                .hop_limit = 255
+            }
+        }
+    };
+    int mask = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+               IBV_QP_DEST_QPN | IBV_QP_RQ_PSN;
+
+    // RC also needs the responder resources and RNR NAK timer
+    if(is_rc) {
+        attr.max_dest_rd_atomic = params->max_dest_rd_atomic;
+        attr.min_rnr_timer = RDMA_QP_MIN_RNR_TIMER;
+        mask |= IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
+    }
+    if(ibv_modify_qp(ep->qp, &attr, mask)) {
+        perror("Failed to modify QP to RTR");
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = ep->psn;
+    mask = IBV_QP_STATE | IBV_QP_SQ_PSN;
+    if(is_rc) {
+        attr.timeout = params->timeout;
+        attr.retry_cnt = params->retry_cnt;
+        attr.rnr_retry = params->rnr_retry;
+        attr.max_rd_atomic = params->max_rd_atomic;
+        mask |= IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY |
+                IBV_QP_MAX_QP_RD_ATOMIC;
+    }
+    if(ibv_modify_qp(ep->qp, &attr, mask)) {
+        perror("Failed to modify QP to RTS");
+        return -1;
+    }
+
+    ep->remote_rkey = remote->rkey;
+    ep->remote_addr = remote->remote_addr;
+    ep->params = *params;
+    return 0;
+}
+
+void rdma_endpoint_print_params(const struct rdma_endpoint *ep) {
+    const struct rdma_qp_params *p = &ep->params;
+
+    if(ep->qp_type != IBV_QPT_RC) {
+        return;
+    }
+    printf("RC: %u reads/atomics outstanding, %u served for the peer, "
+           "ACK timeout %.1f ms, retry %u, RNR retry %u%s\n",
+           p->max_rd_atomic, p->max_dest_rd_atomic,
+           p->timeout ? 4.096e-3 * (1ull << p->timeout) : 0.0,
+           p->retry_cnt, p->rnr_retry, p->rnr_retry == 7 ? " (forever)" : "");
+}
+
+int rdma_endpoint_handshake(struct rdma_endpoint *eps, int n, int sockfd,
+                            int is_server) {
+    struct rdma_wire_msg local = {
+        .version = RDMA_WIRE_VERSION,
+        .caps = rdma_endpoint_caps(&eps[0]),
+        .nqps = n,
+        .nmrs = n,
+        .qps = calloc(n, sizeof(*local.qps)),
+        .mrs = calloc(n, sizeof(*local.mrs))
+    };
+    struct rdma_wire_msg remote = { 0 };
+    int ret = -1;
+
+    if(!local.qps || !local.mrs) {
+        perror("calloc");
+        goto out;
+    }
+    for(int i = 0; i < n; i++) {
+        rdma_endpoint_describe(&eps[i], &local.qps[i], &local.mrs[i]);
+    }
+
+    if(is_server) {
+        if(rdma_wire_send(sockfd, &local) || rdma_wire_recv(sockfd, &remote)) {
+            goto out;
+        }
+    } else {
+        if(rdma_wire_recv(sockfd, &remote) || rdma_wire_send(sockfd, &local)) {
+            goto out;
+        }
+    }
+    if(remote.nqps != (uint32_t)n || remote.nmrs != (uint32_t)n) {
+        fprintf(stderr, "Peer described %u QPs and %u MRs, %d of each expected\n",
+                remote.nqps, remote.nmrs, n);
+        goto out;
+    }
+
+    for(int i = 0; i < n; i++) {
+        struct rdma_conn_info info;
+        struct rdma_qp_params params;
+        rdma_wire_to_conn_info(&remote.qps[i], &remote.mrs[i], &info);
+        rdma_endpoint_negotiate(&eps[i], &remote.qps[i], remote.version, &params);
+        if(rdma_endpoint_connect(&eps[i], &info, &params)) {
+            goto out;
+        }
+        eps[i].remote_len = remote.mrs[i].len;
+        eps[i].caps = local.caps & remote.caps;
+    }
+    ret = 0;
+out:
+    free(local.qps);
+    free(local.mrs);
+    rdma_wire_msg_free(&remote);
+    return ret;
+}
@@ -0,0 +1,152 @@
+#ifndef RDMA_ENDPOINT_H
+#define RDMA_ENDPOINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <infiniband/verbs.h>
+#include "rdma_common.h"
+#include "rdma_mem.h"
+#include "rdma_wire.h"
+
+// Port every endpoint uses (the demos are single-port too)
+#define RDMA_PORT_NUM 1
+
+// RC transport settings a side asks for. The connection uses the more
+// patient of the two sides' values.
+#define RDMA_QP_TIMEOUT       0x12  // Local ACK timeout, 4.096 us << 18: ~1 s
+#define RDMA_QP_RETRY_CNT     6
+#define RDMA_QP_RNR_RETRY     7     // Retry RNR NAKs forever
+#define RDMA_QP_MIN_RNR_TIMER 0x12  // Our own receiver's NAK delay, not negotiated
+
+// A device's read/atomic depth as the QP attributes hold it
+static inline uint8_t rdma_clamp_rd_atomic(int dev_max) {
+    return dev_max < 0 ? 0 : dev_max > UINT8_MAX ? UINT8_MAX : (uint8_t)dev_max;
+}
+
+// An opened device: context, protection domain and the port/GID that
+// connections are addressed through. Shared by every endpoint on it.
+struct rdma_device {
+    struct ibv_context *ctx;
+    struct ibv_pd *pd;
+    struct ibv_device_attr attr;
+    struct ibv_port_attr portinfo;
+    int gid_index;              // GID table entry used for the GRH
+    union ibv_gid gid;
+    char name[IBV_SYSFS_NAME_MAX];
+    int own_ctx;                // ctx was opened here (not by rdma_cm)
+};
+
+// Open `dev_name` (NULL: the first device) and allocate a PD. A negative
+// `gid_index` picks one automatically: a RoCE v2 IPv4-mapped GID if there
+// is one (what rdma_rxe on a plain Ethernet interface exposes), else the
+// first valid entry.
+int rdma_device_open(struct rdma_device *dev, const char *dev_name,
+                     int gid_index);
+
+// Set up a device on a context someone else opened, such as the one
+// rdma_cm resolved a connection to. rdma_device_close leaves it open.
+int rdma_device_attach(struct rdma_device *dev, struct ibv_context *ctx,
+                       int gid_index);
+
+void rdma_device_close(struct rdma_device *dev);
+
+// What an endpoint needs sized up front
+struct rdma_endpoint_attr {
+    enum ibv_qp_type qp_type;   // IBV_QPT_UC or IBV_QPT_RC
+    size_t buf_size;            // Registered buffer, shared by both directions (0: none)
+    uint32_t send_depth;        // max_send_wr
+    uint32_t recv_depth;        // max_recv_wr
+    uint32_t cq_depth;          // CQ for both queues, or sends only
+    uint32_t recv_cq_depth;     // Nonzero: receives get a CQ of their own
+    int use_inline;             // Ask for the largest inline size granted
+    int use_channel;            // Create the CQ on a completion channel
+    const struct rdma_numa *numa; // Place the buffer (NULL: anywhere)
+    enum rdma_page page;        // Page size backing the buffer
+    enum rdma_reg_mode reg;     // Pinned, or faulted in on demand (ODP)
+    struct ibv_cq *shared_cq;   // Use for both queues instead of creating CQs
+    struct ibv_srq *srq;        // Receive from this SRQ (recv_depth is ignored)
+};
+
+// Attributes a QP is connected with, settled from both sides' descriptions
+struct rdma_qp_params {
+    enum ibv_mtu mtu;           // path_mtu: the smaller active MTU
+    uint8_t max_rd_atomic;      // Reads/atomics we keep outstanding
+    uint8_t max_dest_rd_atomic; // The peer's we serve at once
+    uint8_t timeout;
+    uint8_t retry_cnt;
+    uint8_t rnr_retry;
+};
+
+// One connected QP with its CQ and registered buffer. The buffer is both
+// the local source/sink and the target of the peer's RDMA operations.
+struct rdma_endpoint {
+    struct rdma_device *dev;
+    enum ibv_qp_type qp_type;
+    struct ibv_comp_channel *channel;   // NULL unless use_channel
+    struct ibv_cq *cq;
+    struct ibv_cq *recv_cq;     // Same as cq unless recv_cq_depth was set
+    int own_cq;                 // cq and recv_cq were created here
+    struct ibv_qp *qp;
+    struct ibv_qp_ex *qpx;
+    struct ibv_mr *mr;
+    char *buf;                  // mem.addr
+    size_t size;
+    struct rdma_mem mem;
+    uint32_t max_inline;        // 0 unless use_inline
+    uint32_t psn;               // Our initial send PSN
+
+    // Filled in by rdma_endpoint_connect (and rdma_cm)
+    uint32_t remote_rkey;
+    uint64_t remote_addr;
+    struct rdma_qp_params params;
+
+    // Filled in by rdma_endpoint_handshake and rdma_cm
+    uint64_t remote_len;        // Bytes behind remote_addr (0: not given)
+    uint32_t caps;              // RDMA_CAP_* both sides advertised
+};
+
+// Allocate and register the buffer, create the CQ and an extended QP and
+// move the QP to INIT
+int rdma_endpoint_create(struct rdma_endpoint *ep, struct rdma_device *dev,
+                         const struct rdma_endpoint_attr *attr);
+
+void rdma_endpoint_destroy(struct rdma_endpoint *ep);
+
+// Describe this endpoint to the peer
+void rdma_endpoint_local_info(const struct rdma_endpoint *ep,
+                              struct rdma_conn_info *info);
+
+// Describe this endpoint in the wire format, with its port's MTU and the
+// device's read/atomic depths
+void rdma_endpoint_describe(const struct rdma_endpoint *ep, struct rdma_qp_desc *qp,
+                            struct rdma_mr_desc *mr);
+
+// RDMA_CAP_* this endpoint can offer its peer
+uint32_t rdma_endpoint_caps(const struct rdma_endpoint *ep);
+
+// Settle the connection's attributes against the peer's QP description:
+// the smaller MTU, read/atomic depths neither side's device exceeds in
+// either direction, and the larger timeout and retry counts. Fields the
+// peer's wire `version` predates (remote NULL: all of them) take our own
+// values.
+void rdma_endpoint_negotiate(const struct rdma_endpoint *ep,
+                             const struct rdma_qp_desc *remote, uint16_t version,
+                             struct rdma_qp_params *params);
+
+// Move the QP through RTR to RTS against the peer's description, with
+// `params` from rdma_endpoint_negotiate (NULL: our own values)
+int rdma_endpoint_connect(struct rdma_endpoint *ep,
+                          const struct rdma_conn_info *remote,
+                          const struct rdma_qp_params *params);
+
+// One line on the attributes an RC connection settled on (nothing for UC)
+void rdma_endpoint_print_params(const struct rdma_endpoint *ep);
+
+// Swap descriptions of `n` endpoints over an established TCP socket in one
+// round trip (a single rdma_wire message each way) and connect endpoint i
+// to the peer's endpoint i. Both sides must pass the same n; the server
+// sends first, as in exchange_conn_info_as_receiver.
+int rdma_endpoint_handshake(struct rdma_endpoint *eps, int n, int sockfd,
+                            int is_server);
+
+#endif // RDMA_ENDPOINT_H
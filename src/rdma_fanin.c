@@ -0,0 +1,462 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <infiniband/verbs.h>
+#include "rdma_common.h"
+#include "rdma_opts.h"
+#include "rdma_endpoint.h"
+#include "rdma_recv.h"
+#include "rdma_srq.h"
+#include "rdma_slab.h"
+#include "rdma_cq.h"
+
+// Fan-in benchmark: many senders, one receiver.
+// The client connects N RC QPs and sends two-sided messages round robin
+// over all of them; the server receives them either into a receive ring
+// per QP or into one shared receive queue every QP is attached to. N
+// doubles from 1 up to -j. Each row puts the server's receive footprint
+// next to the rate it sustained, so the memory the SRQ saves can be
+// weighed against the RNR stalls of a pool too small for all senders.
+//
+//   server: rdma_fanin [options]
+//   client: rdma_fanin [options] <server_ip>
+//
+// -q sets the receive WRs per ring and in the SRQ alike.
+
+#define FANIN_DEFAULT_SIZE  1024
+#define FANIN_DEFAULT_DEPTH 128
+#define FANIN_DEFAULT_QPS   64
+#define FANIN_MAX_QPS       1024
+#define FANIN_DEFAULT_ITERS 200000      // Messages per point, over all QPs
+
+// Sends in flight per QP
+#define FANIN_TX_DEPTH      8
+
+// How long the SRQ event thread blocks before checking for the end
+#define FANIN_EVENT_POLL_MS 10
+
+// Test parameters the client hands to the server before QPs are created
+struct fanin_config {
+    uint32_t msg_size;
+    uint32_t depth;
+    uint32_t max_qps;
+    uint64_t iters;
+};
+
+// What goes over the socket, field by field, in rdma_wire's encoding
+static void fanin_config_fields(struct rdma_wire_codec *c, void *obj) {
+    struct fanin_config *cfg = obj;
+    rdma_wire_u32(c, &cfg->msg_size);
+    rdma_wire_u32(c, &cfg->depth);
+    rdma_wire_u32(c, &cfg->max_qps);
+    rdma_wire_u64(c, &cfg->iters);
+}
+
+enum fanin_mode {
+    FANIN_RINGS,                // A receive ring per QP
+    FANIN_SRQ,                  // One SRQ shared by every QP
+};
+
+static const char *fanin_mode_str(enum fanin_mode mode) {
+    return mode == FANIN_SRQ ? "srq" : "rings";
+}
+
+// The server's side of one point, sent to the client
+struct fanin_result {
+    uint64_t msgs;
+    uint64_t elapsed_ns;        // First to last receive completion
+    uint64_t wqes;              // Receive WRs posted over all QPs
+    uint64_t buf_bytes;         // Receive buffers behind them
+    uint64_t limit_events;      // SRQ watermark events
+    uint64_t forced;            // SRQ reposts that did not wait for one
+    uint64_t post_calls;        // ibv_post_recv / ibv_post_srq_recv calls
+};
+
+static void fanin_result_fields(struct rdma_wire_codec *c, void *obj) {
+    struct fanin_result *res = obj;
+    rdma_wire_u64(c, &res->msgs);
+    rdma_wire_u64(c, &res->elapsed_ns);
+    rdma_wire_u64(c, &res->wqes);
+    rdma_wire_u64(c, &res->buf_bytes);
+    rdma_wire_u64(c, &res->limit_events);
+    rdma_wire_u64(c, &res->forced);
+    rdma_wire_u64(c, &res->post_calls);
+}
+
+// One point: N QPs on one shared CQ, and on the server their receive side
+struct fanin_point {
+    const struct fanin_config *cfg;
+    enum fanin_mode mode;
+    uint32_t nqps;
+    struct rdma_endpoint *eps;
+    struct ibv_cq *cq;
+    struct cq_poller poller;
+    struct slab_cache *cache;
+    struct recv_ring *rings;    // FANIN_RINGS
+    struct rdma_srq srq;        // FANIN_SRQ
+    int events_stop;            // Tells event_thread to return (atomic)
+
+    // Client
+    struct slab_buf tx_buf;
+    uint32_t *outstanding;      // Sends in flight per QP
+    uint64_t posted;
+    uint64_t completed;
+
+    // Server
+    uint64_t received;
+    uint64_t first_ns;
+    uint64_t last_ns;
+};
+
+static int on_send_completion(void *arg, const struct ibv_wc *wc, uint64_t nic_ns) {
+    struct fanin_point *pt = arg;
+    (void)nic_ns;
+
+    pt->outstanding[wc->wr_id]--;
+    pt->completed++;
+    return 0;
+}
+
+// Ring WRs carry their QP's index in the upper half of wr_id
+static int on_recv_completion(void *arg, const struct ibv_wc *wc, uint64_t nic_ns) {
+    struct fanin_point *pt = arg;
+    (void)nic_ns;
+
+    pt->last_ns = rdma_now_ns();
+    if(pt->received++ == 0) {
+        pt->first_ns = pt->last_ns;
+    }
+    if(pt->mode == FANIN_SRQ) {
+        return rdma_srq_consumed(&pt->srq, wc->wr_id);
+    }
+    return recv_ring_consumed(&pt->rings[wc->wr_id >> 32], 1);
+}
+
+// Reads SRQ watermark events for the receiving thread
+static void *event_thread(void *arg) {
+    struct fanin_point *pt = arg;
+
+    while(!__atomic_load_n(&pt->events_stop, __ATOMIC_ACQUIRE)) {
+        if(rdma_srq_poll_events(&pt->srq, FANIN_EVENT_POLL_MS) < 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Top every QP's window up, one doorbell per QP, then reap completions
+static int run_client(struct fanin_point *pt) {
+    uint64_t iters = pt->cfg->iters;
+
+    while(pt->completed < iters) {
+        for(uint32_t i = 0; i < pt->nqps && pt->posted < iters; i++) {
+            struct ibv_qp_ex *qpx = pt->eps[i].qpx;
+            if(pt->outstanding[i] == FANIN_TX_DEPTH) {
+                continue;
+            }
+            ibv_wr_start(qpx);
+            while(pt->outstanding[i] < FANIN_TX_DEPTH && pt->posted < iters) {
+                qpx->wr_id = i;
+                qpx->wr_flags = IBV_SEND_SIGNALED;
+                ibv_wr_send(qpx);
+                ibv_wr_set_sge(qpx, pt->tx_buf.lkey, (uintptr_t)pt->tx_buf.addr,
+                               pt->cfg->msg_size);
+                pt->outstanding[i]++;
+                pt->posted++;
+            }
+            if(ibv_wr_complete(qpx)) {
+                fprintf(stderr, "ibv_wr_complete failed\n");
+                return -1;
+            }
+        }
+        if(cq_poller_poll(&pt->poller, on_send_completion, pt) < 0 || rdma_stop_requested) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int run_server(struct fanin_point *pt, struct fanin_result *res) {
+    pthread_t events;
+    int ret = 0;
+
+    if(pt->mode == FANIN_SRQ && pthread_create(&events, NULL, event_thread, pt)) {
+        perror("pthread_create");
+        return -1;
+    }
+    while(pt->received < pt->cfg->iters) {
+        if(cq_poller_poll(&pt->poller, on_recv_completion, pt) < 0 || rdma_stop_requested) {
+            ret = -1;
+            break;
+        }
+    }
+    if(pt->mode == FANIN_SRQ) {
+        __atomic_store_n(&pt->events_stop, 1, __ATOMIC_RELEASE);
+        pthread_join(events, NULL);
+    }
+
+    memset(res, 0, sizeof(*res));
+    res->msgs = pt->received;
+    res->elapsed_ns = pt->last_ns - pt->first_ns;
+    if(pt->mode == FANIN_SRQ) {
+        res->wqes = pt->srq.depth;
+        res->buf_bytes = rdma_srq_footprint(&pt->srq);
+        res->limit_events = pt->srq.limit_events;
+        res->forced = pt->srq.forced;
+        res->post_calls = pt->srq.post_calls;
+    } else {
+        uint32_t slot = SLAB_MIN_SIZE << slab_class(pt->cfg->msg_size);
+        for(uint32_t i = 0; i < pt->nqps; i++) {
+            res->wqes += pt->rings[i].depth;
+            res->buf_bytes += (uint64_t)pt->rings[i].depth * slot;
+            res->post_calls += pt->rings[i].post_calls;
+        }
+    }
+    return ret;
+}
+
+static void point_destroy(struct fanin_point *pt) {
+    for(uint32_t i = 0; pt->eps && i < pt->nqps; i++) {
+        if(pt->rings) {
+            recv_ring_destroy(&pt->rings[i]);
+        }
+        rdma_endpoint_destroy(&pt->eps[i]);
+    }
+    if(pt->srq.srq) {
+        rdma_srq_destroy(&pt->srq);
+    }
+    if(pt->tx_buf.addr) {
+        slab_free(pt->cache, &pt->tx_buf);
+    }
+    cq_poller_destroy(&pt->poller);
+    if(pt->cq) {
+        ibv_destroy_cq(pt->cq);
+    }
+    free(pt->eps);
+    free(pt->rings);
+    free(pt->outstanding);
+}
+
+// Create and connect N QPs on a shared CQ, with the server's receive side
+// either as a ring per QP or as one SRQ
+static int point_setup(struct fanin_point *pt, struct rdma_device *dev, int is_server,
+                       int sock, int poll_batch) {
+    const struct fanin_config *cfg = pt->cfg;
+    uint32_t n = pt->nqps;
+    int shared = is_server && pt->mode == FANIN_SRQ;
+
+    uint64_t cq_depth = !is_server ? (uint64_t)n * FANIN_TX_DEPTH :
+                        shared ? cfg->depth : (uint64_t)n * cfg->depth;
+    if(cq_depth > (uint64_t)dev->attr.max_cqe) {
+        fprintf(stderr, "%lu CQEs exceed the device's %d\n", cq_depth, dev->attr.max_cqe);
+        return -1;
+    }
+    pt->cq = ibv_create_cq(dev->ctx, (int)cq_depth, NULL, NULL, 0);
+    pt->eps = calloc(n, sizeof(*pt->eps));
+    if(!pt->cq || !pt->eps) {
+        perror(pt->cq ? "calloc" : "ibv_create_cq");
+        return -1;
+    }
+    if(cq_poller_init(&pt->poller, pt->cq, poll_batch)) {
+        return -1;
+    }
+
+    if(shared && rdma_srq_create(&pt->srq, dev->ctx, dev->pd, pt->cache,
+                                 cfg->msg_size, cfg->depth, 0)) {
+        return -1;
+    }
+
+    struct rdma_endpoint_attr attr = {
+        .qp_type = IBV_QPT_RC,
+        .send_depth = is_server ? 1 : FANIN_TX_DEPTH,
+        .recv_depth = is_server ? cfg->depth : 1,
+        .shared_cq = pt->cq,
+        .srq = shared ? pt->srq.srq : NULL
+    };
+    for(uint32_t i = 0; i < n; i++) {
+        if(rdma_endpoint_create(&pt->eps[i], dev, &attr)) {
+            return -1;
+        }
+    }
+
+    if(shared) {
+        if(rdma_srq_fill(&pt->srq)) {
+            return -1;
+        }
+    } else if(is_server) {
+        pt->rings = calloc(n, sizeof(*pt->rings));
+        if(!pt->rings) {
+            perror("calloc");
+            return -1;
+        }
+        for(uint32_t i = 0; i < n; i++) {
+            struct recv_ring *ring = &pt->rings[i];
+            if(recv_ring_init_slab(ring, pt->eps[i].qp, pt->cache, cfg->msg_size,
+                                   cfg->depth, cfg->depth / 4)) {
+                return -1;
+            }
+            for(uint32_t s = 0; s < ring->depth; s++) {
+                ring->wrs[s].wr_id |= (uint64_t)i << 32;
+            }
+            if(recv_ring_fill(ring)) {
+                return -1;
+            }
+        }
+    } else {
+        pt->outstanding = calloc(n, sizeof(*pt->outstanding));
+        if(!pt->outstanding || slab_alloc(pt->cache, cfg->msg_size, &pt->tx_buf)) {
+            return -1;
+        }
+    }
+
+    return rdma_endpoint_handshake(pt->eps, n, sock, is_server);
+}
+
+static int run_point(struct rdma_device *dev, struct slab_cache *cache,
+                     const struct fanin_config *cfg, enum fanin_mode mode,
+                     uint32_t nqps, int is_server, int sock, int poll_batch) {
+    struct fanin_point pt = {
+        .cfg = cfg,
+        .mode = mode,
+        .nqps = nqps,
+        .cache = cache
+    };
+    struct fanin_result res;
+    int ret = point_setup(&pt, dev, is_server, sock, poll_batch);
+
+    if(ret == 0) {
+        ret = rdma_sock_barrier(sock);
+    }
+    if(ret == 0) {
+        ret = is_server ? run_server(&pt, &res) : run_client(&pt);
+    }
+
+    // The server reports; the client prints
+    if(ret == 0 && is_server) {
+        ret = rdma_wire_send_fields(sock, fanin_result_fields, &res);
+    } else if(ret == 0) {
+        ret = rdma_wire_recv_fields(sock, fanin_result_fields, &res);
+        if(ret == 0) {
+            double secs = res.elapsed_ns ? res.elapsed_ns / 1e9 : 1e-9;
+            printf("%6u %6s %10lu %12.1f %10.3f %10.3f %9lu %9lu %10lu\n",
+                   nqps, fanin_mode_str(mode), res.wqes, res.buf_bytes / 1024.0,
+                   res.msgs / secs / 1e6, res.msgs * (double)cfg->msg_size / secs / 1e9,
+                   res.limit_events, res.forced, res.post_calls);
+            fflush(stdout);
+        }
+    }
+
+    // Let the last sends' acknowledgements land before tearing down
+    if(ret == 0) {
+        ret = rdma_sock_barrier(sock);
+    }
+    point_destroy(&pt);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    const char *server_ip = NULL;
+    struct rdma_opts opts;
+
+    rdma_opts_init(&opts);
+    opts.iters = FANIN_DEFAULT_ITERS;
+    opts.depth = FANIN_DEFAULT_DEPTH;
+    opts.threads = FANIN_DEFAULT_QPS;
+    int ret = rdma_parse_opts(argc, argv, "[server_ip]", &opts);
+    if(ret) {
+        return ret < 0 ? 1 : 0;
+    }
+    if(argc > optind) {
+        server_ip = argv[optind];
+    }
+    if(opts.iters == 0 || opts.threads > FANIN_MAX_QPS || opts.depth < 4 ||
+       opts.msg_size > SLAB_MAX_SIZE) {
+        fprintf(stderr, "Needs -n > 0, -j up to %d, -q of at least 4 and -s up to %u\n",
+                FANIN_MAX_QPS, SLAB_MAX_SIZE);
+        return 1;
+    }
+    if(rdma_install_stop_handler()) {
+        return 1;
+    }
+    srand(time(NULL) ^ getpid());
+
+    struct rdma_device dev;
+    if(rdma_device_open(&dev, opts.dev_name, opts.gid_index)) {
+        return 1;
+    }
+
+    // The client decides what to measure and tells the server
+    struct fanin_config cfg;
+    int sock;
+    if(server_ip) {
+        cfg = (struct fanin_config) {
+            .msg_size = opts.msg_size ? opts.msg_size : FANIN_DEFAULT_SIZE,
+            .depth = opts.depth,
+            .max_qps = opts.threads,
+            .iters = opts.iters
+        };
+        sock = setup_tcp_client(server_ip, opts.tcp_port);
+        if(sock < 0 || rdma_wire_send_fields(sock, fanin_config_fields, &cfg)) {
+            return 1;
+        }
+    } else {
+        int listen_sock = setup_tcp_server(opts.tcp_port);
+        if(listen_sock < 0) {
+            return 1;
+        }
+        sock = accept(listen_sock, NULL, NULL);
+        close(listen_sock);
+        if(sock < 0) {
+            perror("accept");
+            return 1;
+        }
+        if(rdma_wire_recv_fields(sock, fanin_config_fields, &cfg)) {
+            return 1;
+        }
+        if(cfg.msg_size == 0 || cfg.msg_size > SLAB_MAX_SIZE || cfg.depth < 4 ||
+           cfg.max_qps == 0 || cfg.max_qps > FANIN_MAX_QPS || cfg.iters == 0) {
+            fprintf(stderr, "Client sent an invalid test configuration\n");
+            return 1;
+        }
+    }
+
+    // Receive buffers for the widest ring point, plus room to carve more
+    // classes than one
+    size_t slot = SLAB_MIN_SIZE << slab_class(cfg.msg_size);
+    size_t need = server_ip ? slot : (size_t)cfg.max_qps * cfg.depth * slot;
+    struct rdma_slab slab;
+    struct slab_cache cache;
+    if(rdma_slab_init(&slab, dev.pd, IBV_ACCESS_LOCAL_WRITE, 0,
+                      need / SLAB_REGION_BYTES + 2, opts.page, NULL)) {
+        return 1;
+    }
+    slab_cache_init(&cache, &slab);
+
+    printf("%u-byte sends over 1-%u RC QPs on %s, %u receive WRs per ring and in the SRQ\n",
+           cfg.msg_size, cfg.max_qps, dev.name, cfg.depth);
+    if(server_ip) {
+        printf("%6s %6s %10s %12s %10s %10s %9s %9s %10s\n", "#qps", "mode",
+               "recv_wqes", "buffers[KiB]", "Mmsg/s", "GB/s", "limit_ev", "forced",
+               "post_calls");
+    }
+
+    ret = 0;
+    for(uint32_t n = 1; n <= cfg.max_qps && ret == 0; n *= 2) {
+        ret = run_point(&dev, &cache, &cfg, FANIN_RINGS, n, !server_ip, sock,
+                        opts.poll_batch);
+        if(ret == 0) {
+            ret = run_point(&dev, &cache, &cfg, FANIN_SRQ, n, !server_ip, sock,
+                            opts.poll_batch);
+        }
+    }
+
+    close(sock);
+    slab_cache_destroy(&cache);
+    rdma_slab_destroy(&slab);
+    rdma_device_close(&dev);
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,86 @@
+#include "rdma_hist.h"
+#include <stdio.h>
+#include <string.h>
+
+void hist_init(struct rdma_hist *hist) {
+    memset(hist, 0, sizeof(*hist));
+    hist->min = UINT64_MAX;
+}
+
+void hist_merge(struct rdma_hist *dst, const struct rdma_hist *src) {
+    for(unsigned i = 0; i < HIST_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if(src->min < dst->min) {
+        dst->min = src->min;
+    }
+    if(src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+// Highest value that maps to bucket `idx`
+static uint64_t bucket_high(unsigned idx) {
+    if(idx < HIST_SUB_BUCKETS) {
+        return idx;
+    }
+    unsigned k = idx - HIST_SUB_BUCKETS;
+    unsigned shift = k / HIST_SUB_BUCKETS;
+    uint64_t sub = k % HIST_SUB_BUCKETS;
+    uint64_t next = (uint64_t)(HIST_SUB_BUCKETS + sub + 1) << shift;
+    return next - 1;
+}
+
+uint64_t hist_percentile(const struct rdma_hist *hist, double p) {
+    if(hist->total == 0) {
+        return 0;
+    }
+    if(p <= 0) {
+        return hist->min;
+    }
+
+    // Nearest rank: the 1-based rank of the sample we are looking for,
+    // rounded up. The slack keeps p * total landing a hair above a whole
+    // number from skipping to the next rank.
+    double exact = p * hist->total / 100.0;
+    uint64_t rank = (uint64_t)exact;
+    if(exact - rank > 1e-9) {
+        rank++;
+    }
+    if(rank == 0) {
+        rank = 1;
+    }
+    if(rank > hist->total) {
+        rank = hist->total;
+    }
+
+    uint64_t seen = 0;
+    for(unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if(seen >= rank) {
+            uint64_t high = bucket_high(i);
+            return high < hist->max ? high : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+void hist_print(const struct rdma_hist *hist, const char *label,
+                double scale, const char *unit) {
+    if(hist->total == 0) {
+        printf("%s: no samples\n", label);
+        return;
+    }
+    printf("%s (%s, %lu samples): min %.2f  p50 %.2f  p99 %.2f  p99.9 %.2f  "
+           "p99.99 %.2f  max %.2f  mean %.2f\n",
+           label, unit, hist->total,
+           hist->min * scale,
+           hist_percentile(hist, 50.0) * scale,
+           hist_percentile(hist, 99.0) * scale,
+           hist_percentile(hist, 99.9) * scale,
+           hist_percentile(hist, 99.99) * scale,
+           hist->max * scale,
+           hist->sum / hist->total * scale);
+}
@@ -0,0 +1,60 @@
+#ifndef RDMA_HIST_H
+#define RDMA_HIST_H
+
+#include <stdint.h>
+
+// Log-bucketed latency histogram (HdrHistogram-style).
+// Values below HIST_SUB_BUCKETS get one bucket each; above that every power
+// of two is split into HIST_SUB_BUCKETS linear sub-buckets, so any recorded
+// value is reported within 1/HIST_SUB_BUCKETS (~6%) of its true value.
+// Recording is a count-leading-zeros and an increment.
+#define HIST_SUB_BITS    4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS     (HIST_SUB_BUCKETS + (64 - HIST_SUB_BITS) * HIST_SUB_BUCKETS)
+
+struct rdma_hist {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;             // Values recorded
+    uint64_t min;
+    uint64_t max;
+    double sum;                 // For the mean
+};
+
+void hist_init(struct rdma_hist *hist);
+
+static inline unsigned hist_bucket(uint64_t value) {
+    if(value < HIST_SUB_BUCKETS) {
+        return (unsigned)value;
+    }
+    unsigned msb = 63 - __builtin_clzll(value);
+    unsigned shift = msb - HIST_SUB_BITS;
+    unsigned sub = (unsigned)(value >> shift) - HIST_SUB_BUCKETS;
+    return HIST_SUB_BUCKETS + shift * HIST_SUB_BUCKETS + sub;
+}
+
+static inline void hist_record(struct rdma_hist *hist, uint64_t value) {
+    hist->counts[hist_bucket(value)]++;
+    hist->total++;
+    hist->sum += (double)value;
+    if(value < hist->min) {
+        hist->min = value;
+    }
+    if(value > hist->max) {
+        hist->max = value;
+    }
+}
+
+// Add every sample of src into dst
+void hist_merge(struct rdma_hist *dst, const struct rdma_hist *src);
+
+// Value at percentile p (0-100): the highest value equivalent to the bucket
+// holding that rank, clamped to the recorded max
+uint64_t hist_percentile(const struct rdma_hist *hist, double p);
+
+// Print min/p50/p99/p99.9/p99.99/max on one line. Recorded values are
+// multiplied by `scale` (e.g. ns per TSC tick, or 1e-3 for ns -> us) and
+// printed in `unit`.
+void hist_print(const struct rdma_hist *hist, const char *label,
+                double scale, const char *unit);
+
+#endif // RDMA_HIST_H
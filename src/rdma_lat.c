@@ -0,0 +1,499 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <infiniband/verbs.h>
+#include "rdma_common.h"
+#include "rdma_opts.h"
+#include "rdma_endpoint.h"
+#include "rdma_send.h"
+#include "rdma_recv.h"
+#include "rdma_slab.h"
+#include "rdma_dm.h"
+#include "rdma_cq.h"
+#include "rdma_hist.h"
+#include "rdma_cm.h"
+
+// Ping-pong latency benchmark.
+// The client sends a message, the server answers with one of the same size
+// as soon as it arrives, and the client times the round trip with the TSC.
+// Half the round trip is reported as the one-way latency, per message size.
+//
+//   server: rdma_lat [options]
+//   client: rdma_lat [options] <server_ip>
+//
+// The client's -x/-o/-s/-n/-I/-D/-C choices are sent to the server, so only
+// the client needs them. With -D every size is run twice: writes landing
+// in host memory, then in on-NIC device memory. With -C cm the QPs are
+// connected through rdma_cm; the TCP socket still carries the
+// configuration and the barriers.
+
+#define LAT_MIN_SIZE      2
+#define LAT_MAX_SIZE      (1u << 20)
+#define LAT_DM_MAX_SIZE   4096      // Default top of the sweep with -D
+#define LAT_DEFAULT_ITERS 1000
+#define LAT_WARMUP_ITERS  100
+
+// Send queue: only one WR in LAT_SIGNAL_EVERY asks for a CQE
+#define LAT_TX_DEPTH      64
+#define LAT_SIGNAL_EVERY  16
+
+// Receive ring; one message is in flight, so a few slots are plenty
+#define LAT_RX_DEPTH      8
+#define LAT_RX_BATCH      4
+
+// Message buffers come from a slab: the send buffer and, for send/recv,
+// the receive slots, LAT_RX_DEPTH + 1 of at most LAT_MAX_SIZE
+#define LAT_SLAB_REGIONS  1
+
+// UC does not retransmit, so a lost ping would otherwise hang the client
+#define LAT_REPLY_TIMEOUT_NS 1000000000ULL
+
+// Test parameters the client hands to the server before QPs are created
+struct lat_config {
+    uint32_t qp_type;
+    uint32_t op;
+    uint32_t min_size;
+    uint32_t max_size;
+    uint64_t iters;
+    uint32_t use_inline;
+    uint32_t dm;                // Also land writes in device memory
+    uint32_t conn_mode;         // enum rdma_conn_mode
+};
+
+// What goes over the socket, field by field, in rdma_wire's encoding
+static void lat_config_fields(struct rdma_wire_codec *c, void *obj) {
+    struct lat_config *cfg = obj;
+    rdma_wire_u32(c, &cfg->qp_type);
+    rdma_wire_u32(c, &cfg->op);
+    rdma_wire_u32(c, &cfg->min_size);
+    rdma_wire_u32(c, &cfg->max_size);
+    rdma_wire_u64(c, &cfg->iters);
+    rdma_wire_u32(c, &cfg->use_inline);
+    rdma_wire_u32(c, &cfg->dm);
+    rdma_wire_u32(c, &cfg->conn_mode);
+}
+
+// Where the peer's writes land
+struct lat_target {
+    const char *name;
+    uint32_t rkey;
+    uint64_t addr;
+};
+
+struct lat_run {
+    struct rdma_endpoint *ep;
+    struct slab_cache cache;
+    struct slab_buf tx_buf;     // Source of every message sent
+    struct recv_ring ring;
+    struct cq_poller poller;
+    enum rdma_op op;
+    struct lat_target targets[2];   // Host memory, then device memory (-D)
+    uint32_t ntargets;
+    const struct lat_target *target;    // The one being measured
+    uint64_t tx_posted;
+    uint64_t tx_completed;
+    uint32_t rx_ready;          // Messages received and not yet answered
+};
+
+static int on_lat_completion(void *arg, const struct ibv_wc *wc,
+                             uint64_t nic_ns) {
+    struct lat_run *run = arg;
+    (void)nic_ns;
+
+    if(wc->opcode & IBV_WC_RECV) {
+        run->rx_ready++;
+    } else {
+        // Send WRs complete in order, so this retires every earlier one
+        run->tx_completed = wc->wr_id + 1;
+    }
+    return 0;
+}
+
+static int post_message(struct lat_run *run, uint32_t size) {
+    struct rdma_endpoint *ep = run->ep;
+    struct ibv_qp_ex *qpx = ep->qpx;
+
+    while(run->tx_posted - run->tx_completed >= LAT_TX_DEPTH) {
+        if(cq_poller_poll(&run->poller, on_lat_completion, run) < 0) {
+            return -1;
+        }
+    }
+
+    ibv_wr_start(qpx);
+    qpx->wr_id = run->tx_posted;
+    qpx->wr_flags = (run->tx_posted + 1) % LAT_SIGNAL_EVERY == 0 ?
+                    IBV_SEND_SIGNALED : 0;
+
+    send_wr_op(qpx, run->op, run->target->rkey, run->target->addr,
+               htonl((uint32_t)run->tx_posted));
+
+    if(size <= ep->max_inline) {
+        ibv_wr_set_inline_data(qpx, run->tx_buf.addr, size);
+    } else {
+        ibv_wr_set_sge(qpx, run->tx_buf.lkey, (uint64_t)(uintptr_t)run->tx_buf.addr, size);
+    }
+
+    if(ibv_wr_complete(qpx)) {
+        fprintf(stderr, "ibv_wr_complete failed\n");
+        return -1;
+    }
+    run->tx_posted++;
+    return 0;
+}
+
+// Spin on the CQ until a message arrives, then give its WQE back. The
+// timeout is checked on the TSC so it adds nothing measurable to the loop.
+static int wait_message(struct lat_run *run, uint64_t timeout_ticks) {
+    uint64_t start = timeout_ticks ? rdma_tsc() : 0;
+
+    while(!run->rx_ready) {
+        if(cq_poller_poll(&run->poller, on_lat_completion, run) < 0) {
+            return -1;
+        }
+        if(rdma_stop_requested) {
+            return -1;
+        }
+        if(timeout_ticks && rdma_tsc() - start > timeout_ticks) {
+            fprintf(stderr, "No reply within %llu ms (lost on UC?)\n",
+                    LAT_REPLY_TIMEOUT_NS / 1000000ULL);
+            return -1;
+        }
+    }
+    run->rx_ready--;
+    return recv_ring_consumed(&run->ring, 1);
+}
+
+static void print_header(int with_target) {
+    printf("%10s ", "#bytes");
+    if(with_target) {
+        printf("%6s ", "target");
+    }
+    printf("%10s %9s %9s %9s %9s %9s %9s %9s\n", "iters",
+           "min[us]", "p50[us]", "p99[us]", "p99.9[us]", "p99.99[us]",
+           "max[us]", "mean[us]");
+}
+
+// Table row in one-way microseconds from round trips recorded in ticks
+static void print_row(uint32_t size, const char *target,
+                      const struct rdma_hist *hist) {
+    double scale = rdma_tsc_ns_per_tick() / 2 / 1000.0;
+
+    printf("%10u ", size);
+    if(target) {
+        printf("%6s ", target);
+    }
+    printf("%10lu %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f\n",
+           hist->total,
+           hist->min * scale,
+           hist_percentile(hist, 50.0) * scale,
+           hist_percentile(hist, 99.0) * scale,
+           hist_percentile(hist, 99.9) * scale,
+           hist_percentile(hist, 99.99) * scale,
+           hist->max * scale,
+           hist->sum / hist->total * scale);
+    fflush(stdout);
+}
+
+static int run_client(struct lat_run *run, const struct lat_config *cfg, int sock) {
+    uint64_t timeout = cfg->qp_type == IBV_QPT_UC ?
+                       LAT_REPLY_TIMEOUT_NS / rdma_tsc_ns_per_tick() : 0;
+    struct rdma_hist hist;
+
+    print_header(run->ntargets > 1);
+    for(uint32_t size = cfg->min_size; size <= cfg->max_size; size *= 2) {
+        for(uint32_t t = 0; t < run->ntargets; t++) {
+            run->target = &run->targets[t];
+            if(rdma_sock_barrier(sock)) {
+                return -1;
+            }
+            hist_init(&hist);
+            for(uint64_t i = 0; i < LAT_WARMUP_ITERS + cfg->iters; i++) {
+                uint64_t t0 = rdma_tsc();
+                if(post_message(run, size) || wait_message(run, timeout)) {
+                    return -1;
+                }
+                uint64_t t1 = rdma_tsc();
+                if(i >= LAT_WARMUP_ITERS) {
+                    hist_record(&hist, t1 - t0);
+                }
+            }
+            print_row(size, run->ntargets > 1 ? run->target->name : NULL, &hist);
+        }
+    }
+    return 0;
+}
+
+static int run_server(struct lat_run *run, const struct lat_config *cfg, int sock) {
+    for(uint32_t size = cfg->min_size; size <= cfg->max_size; size *= 2) {
+        for(uint32_t t = 0; t < run->ntargets; t++) {
+            run->target = &run->targets[t];
+            if(rdma_sock_barrier(sock)) {
+                return -1;
+            }
+            for(uint64_t i = 0; i < LAT_WARMUP_ITERS + cfg->iters; i++) {
+                if(wait_message(run, 0) || post_message(run, size)) {
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// Give the peer a device-memory landing area of `size` bytes and learn
+// its. If either side has no device memory only host targets are run.
+static int setup_dm(struct lat_run *run, struct rdma_device *dev,
+                    struct rdma_dm *dm, uint32_t size, int sock) {
+    int ret = rdma_dm_alloc(dm, dev->ctx, dev->pd, size,
+                            IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    char ok = ret == 0;
+    char peer_ok;
+    if(rdma_sock_send(sock, &ok, 1) || rdma_sock_recv(sock, &peer_ok, 1) || ret < 0) {
+        return -1;
+    }
+    if(!ok || !peer_ok) {
+        printf("Device memory is not available on both sides; host targets only\n");
+        rdma_dm_free(dm);
+        return 0;
+    }
+
+    // Zero-based: the peer addresses the area from offset 0
+    struct rdma_mr_desc mr = { .addr = 0, .len = dm->size, .rkey = dm->mr->rkey };
+    struct rdma_wire_msg local = { .version = RDMA_WIRE_VERSION, .nmrs = 1, .mrs = &mr };
+    struct rdma_wire_msg peer;
+    if(rdma_wire_send(sock, &local) || rdma_wire_recv(sock, &peer)) {
+        return -1;
+    }
+    if(peer.nmrs != 1) {
+        fprintf(stderr, "Peer described %u device memory MRs, one expected\n", peer.nmrs);
+        rdma_wire_msg_free(&peer);
+        return -1;
+    }
+    run->targets[run->ntargets++] = (struct lat_target) { "dm", peer.mrs[0].rkey, 0 };
+    rdma_wire_msg_free(&peer);
+    printf("Device memory: %zu of %zu bytes on the NIC as a write target\n",
+           dm->size, rdma_dm_max_size(dev->ctx));
+    return 0;
+}
+
+// With rdma_cm the device is whichever one the peer's address resolves
+// to. The server listens before the client resolves, then takes its
+// request; the client connects once its endpoint is set up.
+static int open_cm_device(struct rdma_device *dev, struct rdma_cm_listener *listener,
+                          struct rdma_cm_conn *cm, const char *server_ip, int port,
+                          int gid_index, int sock) {
+    if(server_ip) {
+        if(rdma_sock_barrier(sock) || rdma_cm_resolve(cm, server_ip, port)) {
+            return -1;
+        }
+    } else if(rdma_cm_listen(listener, port, 1) ||
+              rdma_sock_barrier(sock) ||
+              rdma_cm_get_request(listener, cm)) {
+        return -1;
+    }
+    return rdma_device_attach(dev, cm->verbs, gid_index);
+}
+
+int main(int argc, char *argv[]) {
+    const char *server_ip = NULL;
+    struct rdma_opts opts;
+
+    rdma_opts_init(&opts);
+    opts.iters = LAT_DEFAULT_ITERS;
+    int ret = rdma_parse_opts(argc, argv, "[server_ip]", &opts);
+    if(ret) {
+        return ret < 0 ? 1 : 0;
+    }
+    if(argc > optind) {
+        server_ip = argv[optind];
+    }
+    if(opts.msg_size > LAT_MAX_SIZE) {
+        fprintf(stderr, "Message size is limited to %u bytes\n", LAT_MAX_SIZE);
+        return 1;
+    }
+    if(opts.iters == 0) {
+        fprintf(stderr, "Latency runs need a finite message count (-n)\n");
+        return 1;
+    }
+    if(opts.use_dm && opts.op != RDMA_OP_WRITE_IMM) {
+        fprintf(stderr, "Device memory is a write target: it needs -o write_imm\n");
+        return 1;
+    }
+    if(opts.conn_mode == RDMA_CONN_CM && opts.qp_type != IBV_QPT_RC) {
+        fprintf(stderr, "rdma_cm connects RC QPs only\n");
+        return 1;
+    }
+    if(rdma_install_stop_handler()) {
+        return 1;
+    }
+    srand(time(NULL) ^ getpid());
+
+    // The client decides what to measure and tells the server
+    struct lat_config cfg;
+    int sock;
+    if(server_ip) {
+        cfg = (struct lat_config) {
+            .qp_type = opts.qp_type,
+            .op = opts.op,
+            .min_size = opts.msg_size ? opts.msg_size : LAT_MIN_SIZE,
+            .max_size = opts.msg_size ? opts.msg_size :
+                        opts.use_dm ? LAT_DM_MAX_SIZE : LAT_MAX_SIZE,
+            .iters = opts.iters,
+            .use_inline = opts.use_inline,
+            .dm = opts.use_dm,
+            .conn_mode = opts.conn_mode
+        };
+        sock = setup_tcp_client(server_ip, opts.tcp_port);
+        if(sock < 0 || rdma_wire_send_fields(sock, lat_config_fields, &cfg)) {
+            return 1;
+        }
+    } else {
+        int listen_sock = setup_tcp_server(opts.tcp_port);
+        if(listen_sock < 0) {
+            return 1;
+        }
+        sock = accept(listen_sock, NULL, NULL);
+        close(listen_sock);
+        if(sock < 0) {
+            perror("accept");
+            return 1;
+        }
+        if(rdma_wire_recv_fields(sock, lat_config_fields, &cfg)) {
+            return 1;
+        }
+        if(cfg.min_size == 0 || cfg.min_size > cfg.max_size ||
+           cfg.max_size > LAT_MAX_SIZE ||
+           cfg.op > RDMA_OP_SEND_IMM ||
+           (cfg.dm && cfg.op != RDMA_OP_WRITE_IMM) ||
+           (cfg.qp_type != IBV_QPT_UC && cfg.qp_type != IBV_QPT_RC) ||
+           (cfg.conn_mode == RDMA_CONN_CM && cfg.qp_type != IBV_QPT_RC) ||
+           cfg.conn_mode > RDMA_CONN_CM) {
+            fprintf(stderr, "Client sent an invalid test configuration\n");
+            return 1;
+        }
+    }
+
+    struct rdma_device dev;
+    struct rdma_cm_listener listener = { 0 };
+    struct rdma_cm_conn cm = { 0 };
+    if(cfg.conn_mode == RDMA_CONN_CM) {
+        ret = open_cm_device(&dev, &listener, &cm, server_ip,
+                             opts.tcp_port + RDMA_CM_PORT_OFFSET, opts.gid_index, sock);
+    } else {
+        ret = rdma_device_open(&dev, opts.dev_name, opts.gid_index);
+    }
+    if(ret) {
+        return 1;
+    }
+
+    // One thread does all the polling; keep it and the buffer by the device
+    struct rdma_numa numa;
+    if(rdma_numa_init(&numa, dev.name, opts.numa_mode) ||
+       rdma_pin_self(rdma_numa_cpu(&numa, 0))) {
+        return 1;
+    }
+
+    // The endpoint buffer is the landing area for write-with-immediate;
+    // sends go out of and arrive in slab buffers
+    struct rdma_endpoint_attr attr = {
+        .qp_type = cfg.qp_type,
+        .buf_size = cfg.max_size,
+        .send_depth = LAT_TX_DEPTH,
+        .recv_depth = LAT_RX_DEPTH,
+        .cq_depth = LAT_TX_DEPTH + LAT_RX_DEPTH,
+        .use_inline = cfg.use_inline,
+        .numa = &numa,
+        .page = opts.page,
+        .reg = opts.reg_mode
+    };
+    struct rdma_endpoint ep;
+    if(rdma_endpoint_create(&ep, &dev, &attr)) {
+        return 1;
+    }
+
+    struct rdma_slab slab;
+    if(rdma_slab_init(&slab, dev.pd, IBV_ACCESS_LOCAL_WRITE, 0, LAT_SLAB_REGIONS,
+                      opts.page, &numa)) {
+        return 1;
+    }
+    struct lat_run run = {
+        .ep = &ep,
+        .op = cfg.op
+    };
+    slab_cache_init(&run.cache, &slab);
+    if(slab_alloc(&run.cache, cfg.max_size, &run.tx_buf)) {
+        return 1;
+    }
+    if(cfg.op != RDMA_OP_WRITE_IMM) {
+        ret = recv_ring_init_slab(&run.ring, ep.qp, &run.cache, cfg.max_size,
+                                  LAT_RX_DEPTH, LAT_RX_BATCH);
+    } else {
+        ret = recv_ring_init(&run.ring, ep.qp, NULL, 0, 0, LAT_RX_DEPTH, LAT_RX_BATCH);
+    }
+    if(ret ||
+       recv_ring_fill(&run.ring) ||
+       cq_poller_init(&run.poller, ep.cq, opts.poll_batch)) {
+        return 1;
+    }
+
+    if(cfg.conn_mode == RDMA_CONN_CM) {
+        ret = server_ip ? rdma_cm_connect(&cm, &ep) : rdma_cm_accept(&cm, &ep);
+    } else {
+        ret = rdma_endpoint_handshake(&ep, 1, sock, !server_ip);
+    }
+    if(ret) {
+        return 1;
+    }
+
+    // Writes land in the peer's endpoint buffer, and with -D also in its
+    // device memory
+    struct rdma_dm dm = { 0 };
+    run.targets[0] = (struct lat_target) { "host", ep.remote_rkey, ep.remote_addr };
+    run.ntargets = 1;
+    run.target = &run.targets[0];
+    if(cfg.dm && setup_dm(&run, &dev, &dm, cfg.max_size, sock)) {
+        return 1;
+    }
+
+    printf("%s ping-pong over %s on %s (GID index %d, MTU %d), inline up to %u bytes\n",
+           rdma_op_str(cfg.op), cfg.qp_type == IBV_QPT_UC ? "UC" : "RC",
+           dev.name, dev.gid_index, 128 << ep.params.mtu, ep.max_inline);
+    printf("Connected over %s\n", cfg.conn_mode == RDMA_CONN_CM ? "rdma_cm" : "the TCP exchange");
+    rdma_endpoint_print_params(&ep);
+    printf("Device on NUMA node %d, buffer and thread on node %d (%s), CPU %d\n",
+           numa.dev_node, numa.node, rdma_numa_mode_str(numa.mode),
+           rdma_numa_cpu(&numa, 0));
+    rdma_mem_print(&ep.mem, "Buffer");
+    rdma_mem_print(&slab.regions[0].mem, "Slab");
+    if(server_ip) {
+        printf("One-way latency = round trip / 2, TSC at %.3f GHz\n",
+               1.0 / rdma_tsc_ns_per_tick());
+    }
+
+    ret = server_ip ? run_client(&run, &cfg, sock) : run_server(&run, &cfg, sock);
+
+    // Let the last reply's acknowledgement land before tearing down
+    if(ret == 0) {
+        ret = rdma_sock_barrier(sock);
+    }
+    if(ret == 0) {
+        slab_stats_print(&slab);
+    }
+    close(sock);
+    cq_poller_destroy(&run.poller);
+    recv_ring_destroy(&run.ring);
+    slab_free(&run.cache, &run.tx_buf);
+    slab_cache_destroy(&run.cache);
+    rdma_slab_destroy(&slab);
+    rdma_dm_free(&dm);
+    rdma_cm_disconnect(&cm);
+    rdma_endpoint_destroy(&ep);
+    rdma_cm_listener_destroy(&listener);
+    rdma_numa_destroy(&numa);
+    rdma_device_close(&dev);
+    return ret ? 1 : 0;
+}
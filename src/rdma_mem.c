@@ -0,0 +1,310 @@
+#define _GNU_SOURCE
+#include "rdma_mem.h"
+#include "rdma_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+#define PAGE_2M (2UL << 20)
+#define PAGE_1G (1UL << 30)
+
+static size_t round_up(size_t n, size_t align) {
+    return (n + align - 1) / align * align;
+}
+
+static size_t page_bytes(enum rdma_page page) {
+    switch(page) {
+    case RDMA_PAGE_2M: return PAGE_2M;
+    case RDMA_PAGE_1G: return PAGE_1G;
+    case RDMA_PAGE_BASE: break;
+    }
+    return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// log2 of a power of two
+static int page_shift(size_t page_size) {
+    return __builtin_ctzl(page_size);
+}
+
+static void *map_hugetlb(size_t mapped, size_t page_size) {
+    void *addr = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                      (page_shift(page_size) << MAP_HUGE_SHIFT), -1, 0);
+    return addr == MAP_FAILED ? NULL : addr;
+}
+
+// Map `mapped` bytes aligned to a 2 MiB boundary, so THP can back all of it
+static void *map_thp(size_t mapped) {
+    size_t span = mapped + PAGE_2M;
+    char *raw = mmap(NULL, span, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(raw == MAP_FAILED) {
+        return NULL;
+    }
+    char *addr = (char *)round_up((uintptr_t)raw, PAGE_2M);
+    if(addr > raw) {
+        munmap(raw, addr - raw);
+    }
+    if(raw + span > addr + mapped) {
+        munmap(addr + mapped, raw + span - (addr + mapped));
+    }
+    if(madvise(addr, mapped, MADV_HUGEPAGE)) {
+        perror("madvise(MADV_HUGEPAGE)");
+    }
+    return addr;
+}
+
+// Bytes of the mapping at `addr` that THP backs, from /proc/self/smaps
+static size_t thp_bytes(const void *addr) {
+    char line[256];
+    size_t kb = 0;
+    int in_vma = 0;
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if(!f) {
+        return 0;
+    }
+    while(fgets(line, sizeof(line), f)) {
+        unsigned long start;
+        unsigned long end;
+        if(sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            in_vma = (uintptr_t)addr >= start && (uintptr_t)addr < end;
+        } else if(in_vma && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb * 1024;
+}
+
+// Map and place the buffer without touching it
+static int mem_map(struct rdma_mem *mem, size_t size, enum rdma_page page,
+                   const struct rdma_numa *numa) {
+    memset(mem, 0, sizeof(*mem));
+    mem->size = size;
+    mem->page_size = page_bytes(page);
+    mem->mapped = round_up(size, mem->page_size);
+
+    if(page != RDMA_PAGE_BASE) {
+        mem->addr = map_hugetlb(mem->mapped, mem->page_size);
+        if(mem->addr) {
+            mem->backing = RDMA_BACKING_HUGETLB;
+        } else {
+            // THP only comes in 2 MiB pages
+            fprintf(stderr, "No %s hugetlb pages for %zu bytes (%s), trying THP\n",
+                    rdma_page_str(page), mem->mapped, strerror(errno));
+            mem->page_size = PAGE_2M;
+            mem->mapped = round_up(size, PAGE_2M);
+            mem->addr = map_thp(mem->mapped);
+            mem->backing = RDMA_BACKING_THP;
+        }
+    } else {
+        void *addr = mmap(NULL, mem->mapped, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        mem->addr = addr == MAP_FAILED ? NULL : addr;
+        mem->backing = RDMA_BACKING_BASE;
+    }
+    if(!mem->addr) {
+        perror("mmap");
+        return -1;
+    }
+
+    if(rdma_numa_bind(numa, mem->addr, mem->mapped)) {
+        munmap(mem->addr, mem->mapped);
+        mem->addr = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int rdma_mem_alloc(struct rdma_mem *mem, size_t size, enum rdma_page page,
+                   const struct rdma_numa *numa) {
+    size_t base = (size_t)sysconf(_SC_PAGESIZE);
+
+    if(mem_map(mem, size, page, numa)) {
+        return -1;
+    }
+
+    // Fault everything in now so neither registration nor the first
+    // messages pay for it
+    uint64_t start = rdma_now_ns();
+    rdma_numa_fault(numa, mem->addr, mem->mapped,
+                    mem->backing == RDMA_BACKING_HUGETLB ? mem->page_size : base);
+    mem->fault_ns = rdma_now_ns() - start;
+
+    // ibv_reg_mr pins the pages too; locking them here keeps them resident
+    // between allocation and registration and across re-registrations
+    static int mlock_warned;
+    if(mlock(mem->addr, mem->mapped) == 0) {
+        mem->locked = 1;
+    } else if(!mlock_warned) {
+        mlock_warned = 1;
+        fprintf(stderr, "mlock of %zu bytes failed (%s); raise RLIMIT_MEMLOCK to lock buffers\n",
+                mem->mapped, strerror(errno));
+    }
+
+    if(mem->backing == RDMA_BACKING_HUGETLB) {
+        mem->translations = mem->mapped / mem->page_size;
+    } else if(mem->backing == RDMA_BACKING_THP) {
+        size_t huge = thp_bytes(mem->addr);
+        if(huge > mem->mapped) {
+            huge = mem->mapped;     // The VMA was merged with a neighbour
+        }
+        if(huge == 0) {
+            mem->backing = RDMA_BACKING_BASE;
+            mem->page_size = base;
+        }
+        mem->translations = huge / PAGE_2M + (mem->mapped - huge) / base;
+    } else {
+        mem->translations = mem->mapped / base;
+    }
+    return 0;
+}
+
+int rdma_mem_alloc_odp(struct rdma_mem *mem, size_t size, enum rdma_page page,
+                       const struct rdma_numa *numa, enum rdma_reg_mode reg) {
+    if(mem_map(mem, size, page, numa)) {
+        return -1;
+    }
+    mem->reg = reg;
+    return 0;
+}
+
+struct ibv_mr *rdma_mem_reg(struct rdma_mem *mem, struct ibv_pd *pd, int access) {
+    struct ibv_mr *mr;
+
+    uint64_t start = rdma_now_ns();
+    switch(mem->reg) {
+    case RDMA_REG_ODP:
+        mr = ibv_reg_mr(pd, mem->addr, mem->size, access | IBV_ACCESS_ON_DEMAND);
+        break;
+    case RDMA_REG_ODP_IMPLICIT:
+        mr = ibv_reg_mr(pd, NULL, SIZE_MAX, access | IBV_ACCESS_ON_DEMAND);
+        break;
+    default:
+        mr = ibv_reg_mr(pd, mem->addr, mem->size, access);
+        break;
+    }
+    mem->reg_ns = rdma_now_ns() - start;
+    return mr;
+}
+
+// ibv_advise_mr takes 32-bit lengths
+#define PREFETCH_CHUNK (1u << 30)
+
+int rdma_mem_prefetch(struct rdma_mem *mem, struct ibv_pd *pd,
+                      const struct ibv_mr *mr, int for_write) {
+    uint64_t start = rdma_now_ns();
+
+    for(size_t off = 0; off < mem->size; off += PREFETCH_CHUNK) {
+        struct ibv_sge sge = {
+            .addr = (uintptr_t)mem->addr + off,
+            .length = mem->size - off < PREFETCH_CHUNK ? mem->size - off : PREFETCH_CHUNK,
+            .lkey = mr->lkey
+        };
+        int ret = ibv_advise_mr(pd, for_write ? IBV_ADVISE_MR_ADVICE_PREFETCH_WRITE :
+                                                IBV_ADVISE_MR_ADVICE_PREFETCH,
+                                IBV_ADVISE_MR_FLAG_FLUSH, &sge, 1);
+        if(ret) {
+            fprintf(stderr, "ibv_advise_mr failed: %s\n", strerror(ret));
+            return -1;
+        }
+    }
+    mem->prefetch_ns += rdma_now_ns() - start;
+    return 0;
+}
+
+int rdma_odp_check(struct ibv_context *ctx, enum ibv_qp_type qp_type,
+                   enum rdma_reg_mode reg) {
+    struct ibv_device_attr_ex attr;
+
+    if(reg == RDMA_REG_PINNED) {
+        return 0;
+    }
+    if(ibv_query_device_ex(ctx, NULL, &attr)) {
+        perror("ibv_query_device_ex");
+        return -1;
+    }
+
+    // Write-with-immediate needs the source read (send), the target
+    // written and a receive WQE consumed
+    uint32_t needed = IBV_ODP_SUPPORT_SEND | IBV_ODP_SUPPORT_WRITE |
+                      IBV_ODP_SUPPORT_RECV;
+    uint32_t trans = qp_type == IBV_QPT_UC ? attr.odp_caps.per_transport_caps.uc_odp_caps :
+                                             attr.odp_caps.per_transport_caps.rc_odp_caps;
+    if(!(attr.odp_caps.general_caps & IBV_ODP_SUPPORT)) {
+        fprintf(stderr, "Device does not support on-demand paging\n");
+        return -1;
+    }
+    if(reg == RDMA_REG_ODP_IMPLICIT &&
+       !(attr.odp_caps.general_caps & IBV_ODP_SUPPORT_IMPLICIT)) {
+        fprintf(stderr, "Device does not support implicit ODP\n");
+        return -1;
+    }
+    if((trans & needed) != needed) {
+        fprintf(stderr, "Device lacks %s ODP support for send/write/recv (caps 0x%x)\n",
+                qp_type == IBV_QPT_UC ? "UC" : "RC", trans);
+        return -1;
+    }
+    return 0;
+}
+
+void rdma_mem_free(struct rdma_mem *mem) {
+    if(mem->addr) {
+        munmap(mem->addr, mem->mapped);
+    }
+    memset(mem, 0, sizeof(*mem));
+}
+
+void rdma_mem_print(const struct rdma_mem *mem, const char *what) {
+    if(mem->reg != RDMA_REG_PINNED) {
+        printf("%s: %zu bytes on %s (%s), faulted on demand, %s registered in %.1f us\n",
+               what, mem->size,
+               mem->page_size >= PAGE_1G ? "1 GiB pages" :
+               mem->page_size >= PAGE_2M ? "2 MiB pages" : "base pages",
+               rdma_backing_str(mem->backing), rdma_reg_mode_str(mem->reg),
+               mem->reg_ns / 1000.0);
+        return;
+    }
+    printf("%s: %zu bytes on %s (%s), %lu translations, faulted in %.1f us, "
+           "registered in %.1f us%s\n",
+           what, mem->size,
+           mem->page_size >= PAGE_1G ? "1 GiB pages" :
+           mem->page_size >= PAGE_2M ? "2 MiB pages" : "base pages",
+           rdma_backing_str(mem->backing), mem->translations,
+           mem->fault_ns / 1000.0, mem->reg_ns / 1000.0,
+           mem->locked ? ", locked" : "");
+}
+
+const char *rdma_page_str(enum rdma_page page) {
+    switch(page) {
+    case RDMA_PAGE_BASE: return "4k";
+    case RDMA_PAGE_2M:   return "2m";
+    case RDMA_PAGE_1G:   return "1g";
+    }
+    return "unknown";
+}
+
+const char *rdma_backing_str(enum rdma_backing backing) {
+    switch(backing) {
+    case RDMA_BACKING_BASE:    return "base";
+    case RDMA_BACKING_HUGETLB: return "hugetlb";
+    case RDMA_BACKING_THP:     return "thp";
+    }
+    return "unknown";
+}
+
+const char *rdma_reg_mode_str(enum rdma_reg_mode reg) {
+    switch(reg) {
+    case RDMA_REG_PINNED:       return "pinned";
+    case RDMA_REG_ODP:          return "odp";
+    case RDMA_REG_ODP_IMPLICIT: return "implicit";
+    }
+    return "unknown";
+}
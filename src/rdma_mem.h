@@ -0,0 +1,89 @@
+#ifndef RDMA_MEM_H
+#define RDMA_MEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <infiniband/verbs.h>
+#include "rdma_numa.h"
+
+// Page size asked for a registered buffer. The NIC keeps one translation
+// per page, so larger pages mean smaller MTTs and fewer translation-cache
+// misses on large buffers.
+enum rdma_page {
+    RDMA_PAGE_BASE,         // System page size (4 KiB)
+    RDMA_PAGE_2M,
+    RDMA_PAGE_1G,
+};
+
+// What actually backs a buffer
+enum rdma_backing {
+    RDMA_BACKING_BASE,      // Base pages
+    RDMA_BACKING_HUGETLB,   // MAP_HUGETLB from the reserved pool
+    RDMA_BACKING_THP,       // Transparent huge pages (MADV_HUGEPAGE)
+};
+
+// How a buffer is registered
+enum rdma_reg_mode {
+    RDMA_REG_PINNED,        // Pre-faulted, locked and pinned by ibv_reg_mr
+    RDMA_REG_ODP,           // On-demand paging MR over the buffer
+    RDMA_REG_ODP_IMPLICIT,  // Implicit ODP MR over the whole address space
+};
+
+// A mapped buffer ready for ibv_reg_mr: pre-faulted and locked, or left
+// for the NIC to fault in with on-demand paging
+struct rdma_mem {
+    char *addr;
+    size_t size;            // Bytes asked for
+    size_t mapped;          // Bytes mapped, a multiple of page_size
+    size_t page_size;       // Page size asked for (or granted by hugetlb)
+    enum rdma_backing backing;
+    uint64_t translations;  // Pages the buffer actually spans
+    int locked;             // mlock succeeded
+    enum rdma_reg_mode reg;
+    uint64_t fault_ns;      // Time to fault every page in
+    uint64_t reg_ns;        // Time spent in ibv_reg_mr (rdma_mem_reg)
+    uint64_t prefetch_ns;   // Time spent in ibv_advise_mr (rdma_mem_prefetch)
+};
+
+// Map `size` bytes on `page`-sized pages and fault and lock them in, on
+// the placement node if `numa` is given. Huge pages come from the hugetlb
+// pool when it has enough reserved, else from THP; with neither the buffer
+// ends up on base pages, which `backing` and `translations` tell.
+int rdma_mem_alloc(struct rdma_mem *mem, size_t size, enum rdma_page page,
+                   const struct rdma_numa *numa);
+
+// Map a buffer for an ODP registration: placed like rdma_mem_alloc, but
+// neither faulted in nor locked, so the first access to each page pays for
+// it (or rdma_mem_prefetch does)
+int rdma_mem_alloc_odp(struct rdma_mem *mem, size_t size, enum rdma_page page,
+                       const struct rdma_numa *numa, enum rdma_reg_mode reg);
+
+// Register the buffer, timed into reg_ns: pinned over the buffer, with
+// IBV_ACCESS_ON_DEMAND for ODP, or over the whole address space for
+// implicit ODP (whose keys then cover any address in the process)
+struct ibv_mr *rdma_mem_reg(struct rdma_mem *mem, struct ibv_pd *pd, int access);
+
+// Fault an ODP buffer's pages into the NIC's page tables ahead of use with
+// ibv_advise_mr, waiting for it to finish. Timed into prefetch_ns.
+int rdma_mem_prefetch(struct rdma_mem *mem, struct ibv_pd *pd,
+                      const struct ibv_mr *mr, int for_write);
+
+// Check the device can serve `reg` registrations for write-with-immediate
+// traffic on `qp_type` QPs, printing what is missing if not
+int rdma_odp_check(struct ibv_context *ctx, enum ibv_qp_type qp_type,
+                   enum rdma_reg_mode reg);
+
+void rdma_mem_free(struct rdma_mem *mem);
+
+// One line: size, backing, translations, fault and registration times
+void rdma_mem_print(const struct rdma_mem *mem, const char *what);
+
+// Name of a page size, as accepted by -H
+const char *rdma_page_str(enum rdma_page page);
+
+const char *rdma_backing_str(enum rdma_backing backing);
+
+// Name of a registration mode, as accepted by -R
+const char *rdma_reg_mode_str(enum rdma_reg_mode reg);
+
+#endif // RDMA_MEM_H
@@ -0,0 +1,527 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <infiniband/verbs.h>
+#include "rdma_common.h"
+#include "rdma_opts.h"
+#include "rdma_endpoint.h"
+#include "rdma_send.h"
+#include "rdma_recv.h"
+#include "rdma_cq.h"
+#include "rdma_hist.h"
+
+// Two-sided sends vs write-with-immediate, head to head over one RC QP.
+// Each side posts a pool of fixed-size receive buffers. A send or
+// send_imm lands in whichever buffer the peer posted next, so the sender
+// needs no remote address; a write_imm consumes a receive WR without
+// touching its buffer and places the data at a pool slot the sender picks.
+// For every message size each of the three is measured for ping-pong
+// latency (half the round trip) and for streaming throughput through a
+// send window of -q WRs, with the receiver's CPU cost per message.
+//
+//   server: rdma_msg [options]
+//   client: rdma_msg [-s bytes] [-q depth] [-n count] [-I] <server_ip>
+//
+// Without -s the client sweeps message sizes by factors of two; without
+// -n each streaming point is sized to move about MSG_TARGET_BYTES.
+
+#define MSG_MIN_SIZE      2
+#define MSG_MAX_SIZE      (64u << 10)
+#define MSG_DEFAULT_DEPTH 32
+#define MSG_MAX_DEPTH     128
+#define MSG_LAT_ITERS     1000
+#define MSG_WARMUP_ITERS  100
+
+// Only one ping-pong WR in MSG_LAT_SIGNAL_EVERY (or in -q, if fewer)
+// asks for a CQE
+#define MSG_LAT_SIGNAL_EVERY 16
+
+#define MSG_TARGET_BYTES  (256ULL << 20)
+#define MSG_MIN_ITERS     5000
+#define MSG_MAX_ITERS     200000
+
+static const enum rdma_op msg_ops[] = {
+    RDMA_OP_WRITE_IMM, RDMA_OP_SEND, RDMA_OP_SEND_IMM
+};
+#define MSG_NOPS (sizeof(msg_ops) / sizeof(msg_ops[0]))
+
+// Test parameters the client hands to the server before QPs are created
+struct msg_config {
+    uint32_t min_size;
+    uint32_t max_size;
+    uint32_t depth;             // Send window while streaming
+    uint64_t iters;             // Streamed messages per point; 0: sized per point
+    uint32_t use_inline;
+    uint32_t signal_every;
+    uint32_t post_batch;
+};
+
+// What goes over the socket, field by field, in rdma_wire's encoding
+static void msg_config_fields(struct rdma_wire_codec *c, void *obj) {
+    struct msg_config *cfg = obj;
+    rdma_wire_u32(c, &cfg->min_size);
+    rdma_wire_u32(c, &cfg->max_size);
+    rdma_wire_u32(c, &cfg->depth);
+    rdma_wire_u64(c, &cfg->iters);
+    rdma_wire_u32(c, &cfg->use_inline);
+    rdma_wire_u32(c, &cfg->signal_every);
+    rdma_wire_u32(c, &cfg->post_batch);
+}
+
+// The receiver's side of one streaming point
+struct msg_rx_result {
+    uint64_t msgs;
+    uint64_t bytes;
+    uint64_t cpu_ns;
+};
+
+static void msg_rx_result_fields(struct rdma_wire_codec *c, void *obj) {
+    struct msg_rx_result *res = obj;
+    rdma_wire_u64(c, &res->msgs);
+    rdma_wire_u64(c, &res->bytes);
+    rdma_wire_u64(c, &res->cpu_ns);
+}
+
+struct msg_point {
+    uint32_t size;
+    enum rdma_op op;
+    uint64_t iters;
+    double p50_us;              // One-way
+    double p99_us;
+    double gbps;
+    double mmsgs;
+    double rx_cycles;           // Receiver CPU cycles per message
+};
+
+struct msg_run {
+    struct rdma_endpoint *ep;
+    const struct msg_config *cfg;
+    struct recv_ring ring;      // The pool of receive buffers
+    struct cq_poller tx_poller;
+    struct cq_poller rx_poller;
+    uint32_t pool_slots;
+    char *src;                  // Source slots, past the pool
+    uint64_t tx_posted;
+    uint64_t tx_completed;
+    uint32_t rx_ready;          // Messages received and not yet answered
+};
+
+static uint64_t point_iters(const struct msg_config *cfg, uint32_t size) {
+    if(cfg->iters) {
+        return cfg->iters;
+    }
+    uint64_t iters = MSG_TARGET_BYTES / size;
+    if(iters < MSG_MIN_ITERS) {
+        return MSG_MIN_ITERS;
+    }
+    return iters > MSG_MAX_ITERS ? MSG_MAX_ITERS : iters;
+}
+
+static int on_tx_completion(void *arg, const struct ibv_wc *wc, uint64_t nic_ns) {
+    struct msg_run *run = arg;
+    (void)nic_ns;
+
+    // Send WRs complete in order, so this retires every earlier one
+    run->tx_completed = wc->wr_id + 1;
+    return 0;
+}
+
+static int on_rx_completion(void *arg, const struct ibv_wc *wc, uint64_t nic_ns) {
+    struct msg_run *run = arg;
+    (void)wc;
+    (void)nic_ns;
+
+    run->rx_ready++;
+    return 0;
+}
+
+// Post one ping-pong message. `last` asks for a CQE so that nothing is
+// left unretired on the send queue once the point is over.
+static int post_message(struct msg_run *run, enum rdma_op op, uint32_t size, int last) {
+    struct rdma_endpoint *ep = run->ep;
+    struct ibv_qp_ex *qpx = ep->qpx;
+    uint32_t depth = run->cfg->depth;
+
+    // A window with no signaled WR in it would never drain
+    uint32_t signal_every = depth < MSG_LAT_SIGNAL_EVERY ? depth : MSG_LAT_SIGNAL_EVERY;
+
+    while(run->tx_posted - run->tx_completed >= depth) {
+        if(cq_poller_poll(&run->tx_poller, on_tx_completion, run) < 0) {
+            return -1;
+        }
+        if(rdma_stop_requested) {
+            return -1;
+        }
+    }
+
+    ibv_wr_start(qpx);
+    qpx->wr_id = run->tx_posted;
+    qpx->wr_flags = last || (run->tx_posted + 1) % signal_every == 0 ?
+                    IBV_SEND_SIGNALED : 0;
+    send_wr_op(qpx, op, ep->remote_rkey, ep->remote_addr,
+               htonl((uint32_t)run->tx_posted));
+    if(size <= ep->max_inline) {
+        ibv_wr_set_inline_data(qpx, run->src, size);
+    } else {
+        ibv_wr_set_sge(qpx, ep->mr->lkey, (uintptr_t)run->src, size);
+    }
+    if(ibv_wr_complete(qpx)) {
+        fprintf(stderr, "ibv_wr_complete failed\n");
+        return -1;
+    }
+    run->tx_posted++;
+    return 0;
+}
+
+static int wait_message(struct msg_run *run) {
+    while(!run->rx_ready) {
+        if(cq_poller_poll(&run->rx_poller, on_rx_completion, run) < 0) {
+            return -1;
+        }
+        if(rdma_stop_requested) {
+            return -1;
+        }
+    }
+    run->rx_ready--;
+    return recv_ring_consumed(&run->ring, 1);
+}
+
+static int drain_sends(struct msg_run *run) {
+    while(run->tx_completed < run->tx_posted) {
+        if(cq_poller_wait(&run->tx_poller, on_tx_completion, run) < 0 ||
+           rdma_stop_requested) {
+            return -1;
+        }
+    }
+    run->tx_posted = 0;
+    run->tx_completed = 0;
+    return 0;
+}
+
+// Round trips in ticks on the client; the server echoes each message
+static int run_pingpong(struct msg_run *run, enum rdma_op op, uint32_t size,
+                        int is_client, struct rdma_hist *hist) {
+    uint64_t n = MSG_WARMUP_ITERS + MSG_LAT_ITERS;
+
+    hist_init(hist);
+    for(uint64_t i = 0; i < n; i++) {
+        if(is_client) {
+            uint64_t t0 = rdma_tsc();
+            if(post_message(run, op, size, i + 1 == n) || wait_message(run)) {
+                return -1;
+            }
+            if(i >= MSG_WARMUP_ITERS) {
+                hist_record(hist, rdma_tsc() - t0);
+            }
+        } else if(wait_message(run) || post_message(run, op, size, i + 1 == n)) {
+            return -1;
+        }
+    }
+    return drain_sends(run);
+}
+
+// The client streams through a send window while the server drains its
+// pool; RC delivers everything, so the server knows when it is done
+static int run_stream(struct msg_run *run, enum rdma_op op, uint32_t size,
+                      uint64_t iters, int is_client, struct send_stats *tx,
+                      struct msg_rx_result *rx) {
+    struct rdma_endpoint *ep = run->ep;
+
+    if(!is_client) {
+        struct recv_stats stats;
+        if(recv_ring_run(&run->ring, &run->rx_poller, iters, NULL,
+                         &stats)) {
+            return -1;
+        }
+        rx->msgs = stats.msgs;
+        rx->bytes = stats.bytes;
+        rx->cpu_ns = stats.cpu_ns;
+        return 0;
+    }
+
+    // Writes cycle over the peer's pool the way sends fill it. Source and
+    // destination slots are `size` apart, which keeps them inside the
+    // depth x max_size source area and the pool.
+    struct send_window win = {
+        .qpx = ep->qpx,
+        .op = op,
+        .poller = &run->tx_poller,
+        .buf = run->src,
+        .lkey = ep->mr->lkey,
+        .msg_size = size,
+        .remote_rkey = ep->remote_rkey,
+        .remote_addr = ep->remote_addr,
+        .remote_slots = run->pool_slots,
+        .depth = run->cfg->depth,
+        .signal_every = run->cfg->signal_every,
+        .max_inline = ep->max_inline,
+        .batch = run->cfg->post_batch
+    };
+    return send_window_run(&win, iters, tx);
+}
+
+static void print_point(const struct msg_point *pt) {
+    printf("%10u %9s %9.2f %9.2f %10lu %10.3f %10.3f %12.1f\n",
+           pt->size, rdma_op_str(pt->op), pt->p50_us, pt->p99_us, pt->iters,
+           pt->gbps, pt->mmsgs, pt->rx_cycles);
+    fflush(stdout);
+}
+
+static int write_json(const char *path, const struct msg_config *cfg,
+                      const struct rdma_device *dev, const struct rdma_endpoint *ep,
+                      uint32_t pool_slots, const struct msg_point *pts, size_t npts) {
+    FILE *f = fopen(path, "w");
+    if(!f) {
+        perror(path);
+        return -1;
+    }
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"settings\": {\n");
+    fprintf(f, "    \"device\": \"%s\",\n", dev->name);
+    fprintf(f, "    \"depth\": %u,\n", cfg->depth);
+    fprintf(f, "    \"pool_slots\": %u,\n", pool_slots);
+    fprintf(f, "    \"slot_size\": %u,\n", cfg->max_size);
+    fprintf(f, "    \"max_inline\": %u,\n", ep->max_inline);
+    fprintf(f, "    \"signal_every\": %u,\n", cfg->signal_every);
+    fprintf(f, "    \"post_batch\": %u,\n", cfg->post_batch);
+    fprintf(f, "    \"mtu\": %d\n", 128 << ep->params.mtu);
+    fprintf(f, "  },\n");
+    fprintf(f, "  \"results\": [\n");
+    for(size_t i = 0; i < npts; i++) {
+        const struct msg_point *pt = &pts[i];
+        fprintf(f, "    {\"msg_size\": %u, \"op\": \"%s\", "
+                   "\"lat_p50_us\": %.3f, \"lat_p99_us\": %.3f, \"iters\": %lu, "
+                   "\"gb_per_s\": %.6f, \"mmsg_per_s\": %.6f, "
+                   "\"rx_cycles_per_msg\": %.1f}%s\n",
+                pt->size, rdma_op_str(pt->op), pt->p50_us, pt->p99_us, pt->iters,
+                pt->gbps, pt->mmsgs, pt->rx_cycles, i + 1 < npts ? "," : "");
+    }
+    fprintf(f, "  ]\n");
+    fprintf(f, "}\n");
+
+    if(fclose(f)) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+// Both sides walk the same (size, op) grid. Each point is a ping-pong, then
+// a stream whose receiver reports back what it took.
+static int run_grid(struct msg_run *run, int is_client, int sock,
+                    struct msg_point *pts, size_t *npts) {
+    const struct msg_config *cfg = run->cfg;
+    double scale = rdma_tsc_ns_per_tick() / 2 / 1000.0;
+    struct rdma_hist hist;
+
+    for(uint32_t size = cfg->min_size; size <= cfg->max_size; size *= 2) {
+        for(size_t o = 0; o < MSG_NOPS; o++) {
+            enum rdma_op op = msg_ops[o];
+            uint64_t iters = point_iters(cfg, size);
+            struct send_stats tx;
+            struct msg_rx_result rx;
+
+            if(rdma_sock_barrier(sock) ||
+               run_pingpong(run, op, size, is_client, &hist) ||
+               rdma_sock_barrier(sock) ||
+               run_stream(run, op, size, iters, is_client, &tx, &rx)) {
+                return -1;
+            }
+            if(rdma_stop_requested) {
+                return -1;
+            }
+
+            // The server reports its side; the client does the bookkeeping
+            if(!is_client) {
+                if(rdma_wire_send_fields(sock, msg_rx_result_fields, &rx)) {
+                    return -1;
+                }
+                continue;
+            }
+            if(rdma_wire_recv_fields(sock, msg_rx_result_fields, &rx)) {
+                return -1;
+            }
+
+            struct msg_point *pt = &pts[(*npts)++];
+            pt->size = size;
+            pt->op = op;
+            pt->iters = iters;
+            pt->p50_us = hist_percentile(&hist, 50.0) * scale;
+            pt->p99_us = hist_percentile(&hist, 99.0) * scale;
+            pt->gbps = tx.elapsed_ns ? (double)rx.bytes / tx.elapsed_ns : 0;
+            pt->mmsgs = tx.elapsed_ns ? rx.msgs * 1e3 / tx.elapsed_ns : 0;
+            pt->rx_cycles = rx.msgs ? rx.cpu_ns / rdma_tsc_ns_per_tick() / rx.msgs : 0;
+            print_point(pt);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *server_ip = NULL;
+    struct rdma_opts opts;
+
+    // 0 means "sweep" for -s and "size it per point" for -n
+    rdma_opts_init(&opts);
+    opts.iters = 0;
+    opts.depth = MSG_DEFAULT_DEPTH;
+    int ret = rdma_parse_opts(argc, argv, "[server_ip]", &opts);
+    if(ret) {
+        return ret < 0 ? 1 : 0;
+    }
+    if(argc > optind) {
+        server_ip = argv[optind];
+    }
+    if(opts.msg_size > MSG_MAX_SIZE) {
+        fprintf(stderr, "Message size is limited to %u bytes\n", MSG_MAX_SIZE);
+        return 1;
+    }
+    if(opts.depth > MSG_MAX_DEPTH) {
+        fprintf(stderr, "At most a depth of %d\n", MSG_MAX_DEPTH);
+        return 1;
+    }
+    if(opts.qp_type != IBV_QPT_RC) {
+        fprintf(stderr, "rdma_msg compares over RC only: it relies on every message arriving\n");
+        return 1;
+    }
+    if(rdma_install_stop_handler()) {
+        return 1;
+    }
+    srand(time(NULL) ^ getpid());
+
+    struct rdma_device dev;
+    if(rdma_device_open(&dev, opts.dev_name, opts.gid_index)) {
+        return 1;
+    }
+    struct rdma_numa numa;
+    if(rdma_numa_init(&numa, dev.name, opts.numa_mode) ||
+       rdma_pin_self(rdma_numa_cpu(&numa, 0))) {
+        return 1;
+    }
+
+    // The client decides what to measure and tells the server
+    struct msg_config cfg;
+    int sock;
+    if(server_ip) {
+        cfg = (struct msg_config) {
+            .min_size = opts.msg_size ? opts.msg_size : MSG_MIN_SIZE,
+            .max_size = opts.msg_size ? opts.msg_size : MSG_MAX_SIZE,
+            .depth = opts.depth,
+            .iters = opts.iters,
+            .use_inline = opts.use_inline,
+            .signal_every = opts.signal_every,
+            .post_batch = opts.post_batch
+        };
+        sock = setup_tcp_client(server_ip, opts.tcp_port);
+        if(sock < 0 || rdma_wire_send_fields(sock, msg_config_fields, &cfg)) {
+            return 1;
+        }
+    } else {
+        int listen_sock = setup_tcp_server(opts.tcp_port);
+        if(listen_sock < 0) {
+            return 1;
+        }
+        sock = accept(listen_sock, NULL, NULL);
+        close(listen_sock);
+        if(sock < 0) {
+            perror("accept");
+            return 1;
+        }
+        if(rdma_wire_recv_fields(sock, msg_config_fields, &cfg)) {
+            return 1;
+        }
+        if(cfg.min_size == 0 || cfg.min_size > cfg.max_size ||
+           cfg.max_size > MSG_MAX_SIZE ||
+           cfg.depth == 0 || cfg.depth > MSG_MAX_DEPTH) {
+            fprintf(stderr, "Client sent an invalid test configuration\n");
+            return 1;
+        }
+    }
+
+    // Every message, sent or written, consumes a receive WR, so the pool
+    // stays well ahead of the send window. Buffer: the pool of
+    // max_size slots, then the source slots.
+    uint32_t pool_slots = 2 * cfg.depth < 64 ? 64 : 2 * cfg.depth;
+    struct rdma_endpoint_attr attr = {
+        .qp_type = IBV_QPT_RC,
+        .buf_size = (size_t)cfg.max_size * (pool_slots + cfg.depth),
+        .send_depth = cfg.depth,
+        .recv_depth = pool_slots,
+        .cq_depth = cfg.depth,
+        .recv_cq_depth = pool_slots,
+        .use_inline = cfg.use_inline,
+        .numa = &numa,
+        .page = opts.page,
+        .reg = opts.reg_mode
+    };
+    struct rdma_endpoint ep;
+    if(rdma_endpoint_create(&ep, &dev, &attr)) {
+        return 1;
+    }
+    struct msg_run run = {
+        .ep = &ep,
+        .cfg = &cfg,
+        .pool_slots = pool_slots,
+        .src = ep.buf + (size_t)cfg.max_size * pool_slots
+    };
+    if(recv_ring_init(&run.ring, ep.qp, ep.buf, ep.mr->lkey, cfg.max_size,
+                      pool_slots, pool_slots / 8) ||
+       recv_ring_fill(&run.ring) ||
+       cq_poller_init(&run.tx_poller, ep.cq, opts.poll_batch) ||
+       cq_poller_init(&run.rx_poller, ep.recv_cq, opts.poll_batch)) {
+        return 1;
+    }
+
+    if(rdma_endpoint_handshake(&ep, 1, sock, !server_ip)) {
+        return 1;
+    }
+
+    printf("write_imm vs send vs send_imm over RC on %s (GID index %d, MTU %d), "
+           "inline up to %u bytes\n",
+           dev.name, dev.gid_index, 128 << ep.params.mtu, ep.max_inline);
+    rdma_endpoint_print_params(&ep);
+    printf("Receive pool: %u buffers of %u bytes, send window %u, CPU %d\n",
+           pool_slots, cfg.max_size, cfg.depth, rdma_numa_cpu(&numa, 0));
+    rdma_mem_print(&ep.mem, "Buffer");
+
+    size_t max_pts = 0;
+    for(uint32_t s = cfg.min_size; s <= cfg.max_size; s *= 2) {
+        max_pts += MSG_NOPS;
+    }
+    struct msg_point *pts = calloc(max_pts, sizeof(*pts));
+    size_t npts = 0;
+    if(!pts) {
+        perror("calloc");
+        return 1;
+    }
+
+    if(server_ip) {
+        printf("One-way latency = round trip / 2, TSC at %.3f GHz\n",
+               1.0 / rdma_tsc_ns_per_tick());
+        printf("%10s %9s %9s %9s %10s %10s %10s %12s\n", "#bytes", "op",
+               "p50[us]", "p99[us]", "iters", "GB/s", "Mmsg/s", "rx cyc/msg");
+    }
+    ret = run_grid(&run, server_ip != NULL, sock, pts, &npts);
+
+    if(ret == 0 && server_ip && opts.json_path) {
+        ret = write_json(opts.json_path, &cfg, &dev, &ep, pool_slots, pts, npts);
+        if(ret == 0) {
+            printf("Results written to %s\n", opts.json_path);
+        }
+    }
+
+    free(pts);
+    close(sock);
+    cq_poller_destroy(&run.tx_poller);
+    cq_poller_destroy(&run.rx_poller);
+    recv_ring_destroy(&run.ring);
+    rdma_endpoint_destroy(&ep);
+    rdma_numa_destroy(&numa);
+    rdma_device_close(&dev);
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include "rdma_numa.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sched.h>
+#include <pthread.h>
+#ifdef HAVE_LIBNUMA
+#include <numaif.h>
+#endif
+
+#define SYSFS_IB_CLASS   "/sys/class/infiniband"
+#define SYSFS_NODE_DIR   "/sys/devices/system/node"
+#define SYSFS_CPU_ONLINE "/sys/devices/system/cpu/online"
+
+// Parse a sysfs list such as "0-3,8-11" into an array of numbers
+static int read_list(const char *path, int **out, int *count) {
+    char line[4096];
+    FILE *f = fopen(path, "r");
+    if(!f) {
+        return -1;
+    }
+    char *ok = fgets(line, sizeof(line), f);
+    fclose(f);
+    if(!ok) {
+        return -1;
+    }
+
+    int cap = 0;
+    int n = 0;
+    int *vals = NULL;
+    char *p = line;
+    while(*p && *p != '\n') {
+        char *end;
+        long lo = strtol(p, &end, 10);
+        long hi = lo;
+        if(end == p) {
+            break;
+        }
+        if(*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+        }
+        for(long v = lo; v <= hi; v++) {
+            if(n == cap) {
+                cap = cap ? 2 * cap : 64;
+                int *grown = realloc(vals, cap * sizeof(*vals));
+                if(!grown) {
+                    free(vals);
+                    return -1;
+                }
+                vals = grown;
+            }
+            vals[n++] = (int)v;
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    if(n == 0) {
+        free(vals);
+        return -1;
+    }
+    *out = vals;
+    *count = n;
+    return 0;
+}
+
+static int device_node(const char *dev_name) {
+    char path[PATH_MAX];
+    int node = -1;
+
+    snprintf(path, sizeof(path), SYSFS_IB_CLASS "/%s/device/numa_node", dev_name);
+    FILE *f = fopen(path, "r");
+    if(!f) {
+        return -1;          // Virtual devices (rxe, siw) have no PCI parent
+    }
+    if(fscanf(f, "%d", &node) != 1) {
+        node = -1;
+    }
+    fclose(f);
+    return node;
+}
+
+// First node with CPUs other than `avoid`
+static int other_node(int avoid) {
+    int *nodes;
+    int n;
+    int node = -1;
+
+    if(read_list(SYSFS_NODE_DIR "/has_cpu", &nodes, &n)) {
+        return -1;
+    }
+    for(int i = 0; i < n && node < 0; i++) {
+        if(nodes[i] != avoid) {
+            node = nodes[i];
+        }
+    }
+    free(nodes);
+    return node;
+}
+
+int rdma_numa_init(struct rdma_numa *numa, const char *dev_name,
+                   enum rdma_numa_mode mode) {
+    memset(numa, 0, sizeof(*numa));
+    numa->mode = mode;
+    numa->dev_node = device_node(dev_name);
+    numa->node = -1;
+
+    if(mode != RDMA_NUMA_OFF && numa->dev_node < 0) {
+        fprintf(stderr, "%s reports no NUMA node; threads and buffers are not placed\n",
+                dev_name);
+    } else if(mode == RDMA_NUMA_LOCAL) {
+        numa->node = numa->dev_node;
+    } else if(mode == RDMA_NUMA_REMOTE) {
+        numa->node = other_node(numa->dev_node);
+        if(numa->node < 0) {
+            fprintf(stderr, "No NUMA node besides %d; threads and buffers are not placed\n",
+                    numa->dev_node);
+        }
+    }
+
+    if(numa->node >= 0) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), SYSFS_NODE_DIR "/node%d/cpulist", numa->node);
+        if(read_list(path, &numa->cpus, &numa->ncpus) == 0) {
+            return 0;
+        }
+        fprintf(stderr, "Cannot read the CPUs of NUMA node %d\n", numa->node);
+        numa->node = -1;
+    }
+
+    if(read_list(SYSFS_CPU_ONLINE, &numa->cpus, &numa->ncpus)) {
+        // Keep going on CPU 0 alone rather than fail the run
+        numa->cpus = malloc(sizeof(*numa->cpus));
+        if(!numa->cpus) {
+            perror("malloc");
+            return -1;
+        }
+        numa->cpus[0] = 0;
+        numa->ncpus = 1;
+    }
+    return 0;
+}
+
+void rdma_numa_destroy(struct rdma_numa *numa) {
+    free(numa->cpus);
+    memset(numa, 0, sizeof(*numa));
+}
+
+int rdma_numa_cpu(const struct rdma_numa *numa, int idx) {
+    return numa->cpus[idx % numa->ncpus];
+}
+
+int rdma_numa_bind(const struct rdma_numa *numa, void *buf, size_t size) {
+#ifdef HAVE_LIBNUMA
+    if(numa && numa->node >= 0) {
+        unsigned long mask[numa->node / (8 * sizeof(unsigned long)) + 1];
+        memset(mask, 0, sizeof(mask));
+        mask[numa->node / (8 * sizeof(unsigned long))] =
+            1UL << (numa->node % (8 * sizeof(unsigned long)));
+        if(mbind(buf, size, MPOL_BIND, mask, 8 * sizeof(mask) + 1, 0)) {
+            perror("mbind");
+            return -1;
+        }
+    }
+#else
+    (void)numa;
+    (void)buf;
+    (void)size;
+#endif
+    return 0;
+}
+
+void rdma_numa_fault(const struct rdma_numa *numa, void *buf, size_t size,
+                     size_t step) {
+    cpu_set_t saved;
+    cpu_set_t set;
+    int pinned = 0;
+
+    if(numa && numa->node >= 0 &&
+       pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved) == 0) {
+        CPU_ZERO(&set);
+        for(int i = 0; i < numa->ncpus; i++) {
+            CPU_SET(numa->cpus[i], &set);
+        }
+        pinned = pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    }
+
+    // A write, not a read: reads of untouched anonymous memory map the
+    // shared zero page instead of allocating
+    for(size_t off = 0; off < size; off += step) {
+        ((volatile char *)buf)[off] = 0;
+    }
+
+    if(pinned) {
+        pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+    }
+}
+
+const char *rdma_numa_mode_str(enum rdma_numa_mode mode) {
+    switch(mode) {
+    case RDMA_NUMA_LOCAL:  return "local";
+    case RDMA_NUMA_REMOTE: return "remote";
+    case RDMA_NUMA_OFF:    return "off";
+    }
+    return "unknown";
+}
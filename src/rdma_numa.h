@@ -0,0 +1,48 @@
+#ifndef RDMA_NUMA_H
+#define RDMA_NUMA_H
+
+#include <stddef.h>
+
+// Where registered buffers and polling threads go relative to the NUMA node
+// the RDMA device's PCI function is attached to
+enum rdma_numa_mode {
+    RDMA_NUMA_LOCAL,        // On the device's node (default)
+    RDMA_NUMA_REMOTE,       // On another node, to measure the cross-socket cost
+    RDMA_NUMA_OFF,          // Wherever the allocator and scheduler put them
+};
+
+// Placement resolved for one device
+struct rdma_numa {
+    enum rdma_numa_mode mode;
+    int dev_node;           // Device's node from sysfs (-1 = unknown)
+    int node;               // Node buffers and threads go on (-1 = none)
+    int *cpus;              // Online CPUs of `node`, or all online CPUs
+    int ncpus;
+};
+
+// Look up the device's node in /sys/class/infiniband/<dev_name>/device and
+// pick the node to place on. Falls back to no placement, with a note, when
+// the device has no affinity (single socket, soft-RoCE) or remote mode has
+// no other node to use.
+int rdma_numa_init(struct rdma_numa *numa, const char *dev_name,
+                   enum rdma_numa_mode mode);
+
+void rdma_numa_destroy(struct rdma_numa *numa);
+
+// CPU for the idx-th polling thread: the placement's CPUs in order,
+// wrapping around
+int rdma_numa_cpu(const struct rdma_numa *numa, int idx);
+
+// Bind a fresh mapping to the placement node before it is touched. A no-op
+// without a placement or without libnuma, where first touch places it.
+int rdma_numa_bind(const struct rdma_numa *numa, void *buf, size_t size);
+
+// Fault in every `step` bytes of `buf` from the placement's CPUs, so pages
+// land on their node by first touch even when not bound. NULL: in place.
+void rdma_numa_fault(const struct rdma_numa *numa, void *buf, size_t size,
+                     size_t step);
+
+// Name of a mode, as accepted by -N
+const char *rdma_numa_mode_str(enum rdma_numa_mode mode);
+
+#endif // RDMA_NUMA_H
@@ -0,0 +1,345 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <infiniband/verbs.h>
+#include "rdma_common.h"
+#include "rdma_opts.h"
+#include "rdma_endpoint.h"
+#include "rdma_send.h"
+#include "rdma_recv.h"
+#include "rdma_cq.h"
+
+// On-demand paging benchmark.
+// The client streams RDMA writes with immediate from a fresh dataset into
+// a fresh dataset on the server, sweeping both once per pass. The first
+// pass pays for every page fault the NIC takes; later passes show the
+// steady state. This is repeated per registration mode: pinned up front,
+// explicit ODP, implicit ODP, and either ODP mode prefetched with
+// ibv_advise_mr. Modes either side's device lacks are skipped.
+//
+//   server: rdma_odp [options]
+//   client: rdma_odp [options] <server_ip>
+//
+// RC only: a UC packet that hits a page fault is dropped, not retried.
+
+#define ODP_DATASET_BYTES  (256u << 20)
+#define ODP_DEFAULT_SIZE   (64u << 10)
+#define ODP_DEFAULT_DEPTH  32
+#define ODP_DEFAULT_PASSES 4
+#define ODP_MAX_PASSES     64
+
+// Test parameters the client hands to the server before QPs are created
+struct odp_config {
+    uint32_t msg_size;
+    uint32_t depth;
+    uint32_t passes;
+    uint32_t page;
+};
+
+// What goes over the socket, field by field, in rdma_wire's encoding
+static void odp_config_fields(struct rdma_wire_codec *c, void *obj) {
+    struct odp_config *cfg = obj;
+    rdma_wire_u32(c, &cfg->msg_size);
+    rdma_wire_u32(c, &cfg->depth);
+    rdma_wire_u32(c, &cfg->passes);
+    rdma_wire_u32(c, &cfg->page);
+}
+
+struct odp_mode {
+    enum rdma_reg_mode reg;
+    int prefetch;
+};
+
+static const struct odp_mode odp_modes[] = {
+    { RDMA_REG_PINNED,       0 },
+    { RDMA_REG_ODP,          0 },
+    { RDMA_REG_ODP,          1 },
+    { RDMA_REG_ODP_IMPLICIT, 0 },
+    { RDMA_REG_ODP_IMPLICIT, 1 },
+};
+
+static void mode_name(const struct odp_mode *mode, char *name, size_t len) {
+    snprintf(name, len, "%s%s", rdma_reg_mode_str(mode->reg),
+             mode->prefetch ? "+prefetch" : "");
+}
+
+// Time from mapping the dataset to being able to send from it
+static uint64_t setup_ns(const struct rdma_mem *mem) {
+    return mem->fault_ns + mem->reg_ns + mem->prefetch_ns;
+}
+
+// One pass over the dataset on either side. Returns the sender's GB/s.
+static int run_pass(struct rdma_endpoint *ep, struct recv_ring *ring,
+                    struct cq_poller *tx_poller, struct cq_poller *rx_poller,
+                    const struct odp_config *cfg, int is_server, int sock,
+                    double *gbps) {
+    uint32_t slots = ODP_DATASET_BYTES / cfg->msg_size;
+
+    if(rdma_sock_barrier(sock)) {
+        return -1;
+    }
+    if(is_server) {
+        struct recv_stats rx;
+        return recv_ring_run(ring, rx_poller, slots, NULL, &rx);
+    }
+
+    struct send_window win = {
+        .qpx = ep->qpx,
+        .poller = tx_poller,
+        .buf = ep->buf,
+        .buf_slots = slots,
+        .lkey = ep->mr->lkey,
+        .msg_size = cfg->msg_size,
+        .remote_rkey = ep->remote_rkey,
+        .remote_addr = ep->remote_addr,
+        .remote_slots = slots,
+        .depth = cfg->depth,
+        .signal_every = cfg->depth < 16 ? cfg->depth : 16,
+        .max_inline = 0,
+        .batch = 1
+    };
+    struct send_stats tx;
+    if(send_window_run(&win, slots, &tx)) {
+        return -1;
+    }
+    *gbps = tx.elapsed_ns ? (double)tx.bytes / tx.elapsed_ns : 0;
+    return 0;
+}
+
+// Set up one mode, run every pass and tear it down again. Returns 1 if
+// either side cannot run the mode.
+static int run_mode(struct rdma_device *dev, const struct odp_mode *mode,
+                    const struct odp_config *cfg, int is_server, int sock,
+                    int poll_batch) {
+    uint32_t rx_depth = 2 * cfg->depth < 64 ? 64 : 2 * cfg->depth;
+    double gbps[ODP_MAX_PASSES];
+    int ret = 0;
+
+    // Both sides must support the mode
+    char ok = rdma_odp_check(dev->ctx, IBV_QPT_RC, mode->reg) == 0;
+    char peer_ok;
+    if(rdma_sock_send(sock, &ok, 1) || rdma_sock_recv(sock, &peer_ok, 1)) {
+        return -1;
+    }
+    if(!ok || !peer_ok) {
+        return 1;
+    }
+
+    struct rdma_endpoint_attr attr = {
+        .qp_type = IBV_QPT_RC,
+        .buf_size = ODP_DATASET_BYTES,
+        .send_depth = cfg->depth,
+        .recv_depth = rx_depth,
+        .cq_depth = cfg->depth,
+        .recv_cq_depth = rx_depth,
+        .page = cfg->page,
+        .reg = mode->reg
+    };
+    struct rdma_endpoint ep;
+    struct recv_ring ring;
+    struct cq_poller tx_poller;
+    struct cq_poller rx_poller;
+    if(rdma_endpoint_create(&ep, dev, &attr) ||
+       recv_ring_init(&ring, ep.qp, NULL, 0, 0, rx_depth, rx_depth / 8) ||
+       recv_ring_fill(&ring) ||
+       cq_poller_init(&tx_poller, ep.cq, poll_batch) ||
+       cq_poller_init(&rx_poller, ep.recv_cq, poll_batch)) {
+        return -1;
+    }
+
+    // The client's dataset is read by the NIC, the server's written
+    if(mode->prefetch && rdma_mem_prefetch(&ep.mem, dev->pd, ep.mr, is_server)) {
+        ret = -1;
+        goto out;
+    }
+    if(rdma_endpoint_handshake(&ep, 1, sock, is_server)) {
+        ret = -1;
+        goto out;
+    }
+
+    for(uint32_t p = 0; p < cfg->passes && ret == 0; p++) {
+        ret = run_pass(&ep, &ring, &tx_poller, &rx_poller, cfg, is_server, sock,
+                       &gbps[p]);
+    }
+    if(ret == 0) {
+        ret = rdma_sock_barrier(sock);
+    }
+
+    if(ret == 0) {
+        char name[32];
+        mode_name(mode, name, sizeof(name));
+        if(is_server) {
+            printf("%-18s setup %10.2f ms\n", name, setup_ns(&ep.mem) / 1e6);
+        } else {
+            double steady = 0;
+            for(uint32_t p = 1; p < cfg->passes; p++) {
+                steady += gbps[p];
+            }
+            steady /= cfg->passes - 1;
+            printf("%-18s %10.2f %12.3f %12.3f %10.2f\n", name,
+                   setup_ns(&ep.mem) / 1e6, gbps[0], steady,
+                   steady ? gbps[0] / steady : 0);
+        }
+        fflush(stdout);
+    }
+
+out:
+    cq_poller_destroy(&tx_poller);
+    cq_poller_destroy(&rx_poller);
+    recv_ring_destroy(&ring);
+    rdma_endpoint_destroy(&ep);
+    return ret;
+}
+
+// Per-transport ODP operations, in the layout ibv_devinfo -v uses
+static void print_odp_trans_caps(const char *name, uint32_t trans) {
+    static const struct {
+        uint32_t flag;
+        const char *name;
+    } flags[] = {
+        { IBV_ODP_SUPPORT_SEND, "SUPPORT_SEND" },
+        { IBV_ODP_SUPPORT_RECV, "SUPPORT_RECV" },
+        { IBV_ODP_SUPPORT_WRITE, "SUPPORT_WRITE" },
+        { IBV_ODP_SUPPORT_READ, "SUPPORT_READ" },
+        { IBV_ODP_SUPPORT_ATOMIC, "SUPPORT_ATOMIC" },
+        { IBV_ODP_SUPPORT_SRQ_RECV, "SUPPORT_SRQ" },
+    };
+
+    printf("\t%s:\n", name);
+    if(!trans) {
+        printf("\t\t\t\t\tNO SUPPORT\n");
+        return;
+    }
+    for(size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        if(trans & flags[i].flag) {
+            printf("\t\t\t\t\t%s\n", flags[i].name);
+        }
+        trans &= ~flags[i].flag;
+    }
+    // Bits newer than this build's verbs.h (FLUSH, ATOMIC_WRITE, ...)
+    if(trans) {
+        printf("\t\t\t\t\tUnknown flags: 0x%" PRIX32 "\n", trans);
+    }
+}
+
+static void print_odp_support(struct rdma_device *dev) {
+    struct ibv_device_attr_ex attr;
+    if(ibv_query_device_ex(dev->ctx, NULL, &attr)) {
+        return;
+    }
+
+    const struct ibv_odp_caps *caps = &attr.odp_caps;
+    uint64_t general = caps->general_caps;
+    printf("ODP capabilities of %s:\n", dev->name);
+    printf("\tgeneral_odp_caps:\n");
+    if(general & IBV_ODP_SUPPORT) {
+        printf("\t\t\t\t\tODP_SUPPORT\n");
+    }
+    if(general & IBV_ODP_SUPPORT_IMPLICIT) {
+        printf("\t\t\t\t\tODP_SUPPORT_IMPLICIT\n");
+    }
+    general &= ~(uint64_t)(IBV_ODP_SUPPORT | IBV_ODP_SUPPORT_IMPLICIT);
+    if(general) {
+        printf("\t\t\t\t\tUnknown flags: 0x%" PRIX64 "\n", general);
+    }
+    print_odp_trans_caps("rc_odp_caps", caps->per_transport_caps.rc_odp_caps);
+    print_odp_trans_caps("uc_odp_caps", caps->per_transport_caps.uc_odp_caps);
+    print_odp_trans_caps("ud_odp_caps", caps->per_transport_caps.ud_odp_caps);
+    print_odp_trans_caps("xrc_odp_caps", attr.xrc_odp_caps);
+}
+
+int main(int argc, char *argv[]) {
+    const char *server_ip = NULL;
+    struct rdma_opts opts;
+
+    rdma_opts_init(&opts);
+    opts.iters = ODP_DEFAULT_PASSES;
+    opts.depth = ODP_DEFAULT_DEPTH;
+    int ret = rdma_parse_opts(argc, argv, "[server_ip]", &opts);
+    if(ret) {
+        return ret < 0 ? 1 : 0;
+    }
+    if(argc > optind) {
+        server_ip = argv[optind];
+    }
+    if(opts.qp_type != IBV_QPT_RC) {
+        fprintf(stderr, "ODP needs RC: faults on UC drop packets\n");
+        return 1;
+    }
+    if(opts.iters < 2 || opts.iters > ODP_MAX_PASSES) {
+        fprintf(stderr, "Passes (-n) must be 2-%d: one first-touch pass and steady ones\n",
+                ODP_MAX_PASSES);
+        return 1;
+    }
+    if(rdma_install_stop_handler()) {
+        return 1;
+    }
+    srand(time(NULL) ^ getpid());
+
+    struct rdma_device dev;
+    if(rdma_device_open(&dev, opts.dev_name, opts.gid_index)) {
+        return 1;
+    }
+
+    // The client decides what to measure and tells the server
+    struct odp_config cfg;
+    int sock;
+    if(server_ip) {
+        cfg = (struct odp_config) {
+            .msg_size = opts.msg_size ? opts.msg_size : ODP_DEFAULT_SIZE,
+            .depth = opts.depth,
+            .passes = (uint32_t)opts.iters,
+            .page = opts.page
+        };
+        sock = setup_tcp_client(server_ip, opts.tcp_port);
+        if(sock < 0 || rdma_wire_send_fields(sock, odp_config_fields, &cfg)) {
+            return 1;
+        }
+    } else {
+        int listen_sock = setup_tcp_server(opts.tcp_port);
+        if(listen_sock < 0) {
+            return 1;
+        }
+        sock = accept(listen_sock, NULL, NULL);
+        close(listen_sock);
+        if(sock < 0) {
+            perror("accept");
+            return 1;
+        }
+        if(rdma_wire_recv_fields(sock, odp_config_fields, &cfg)) {
+            return 1;
+        }
+        if(cfg.msg_size == 0 || cfg.msg_size > ODP_DATASET_BYTES || cfg.depth == 0 ||
+           cfg.passes < 2 || cfg.passes > ODP_MAX_PASSES || cfg.page > RDMA_PAGE_1G) {
+            fprintf(stderr, "Client sent an invalid test configuration\n");
+            return 1;
+        }
+    }
+
+    print_odp_support(&dev);
+    printf("%u MiB dataset per side, %u-byte writes, depth %u, %u passes, %s pages\n",
+           ODP_DATASET_BYTES >> 20, cfg.msg_size, cfg.depth, cfg.passes,
+           rdma_page_str(cfg.page));
+    if(server_ip) {
+        printf("%-18s %10s %12s %12s %10s\n", "#registration", "setup[ms]",
+               "first[GB/s]", "steady[GB/s]", "first/st");
+    }
+
+    ret = 0;
+    for(size_t i = 0; i < sizeof(odp_modes) / sizeof(odp_modes[0]) && ret >= 0; i++) {
+        ret = run_mode(&dev, &odp_modes[i], &cfg, !server_ip, sock, opts.poll_batch);
+        if(ret > 0 && server_ip) {
+            char name[32];
+            mode_name(&odp_modes[i], name, sizeof(name));
+            printf("%-18s not supported by both sides\n", name);
+        }
+    }
+
+    close(sock);
+    rdma_device_close(&dev);
+    return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,309 @@
+#include "rdma_opts.h"
+#include "rdma_cq.h"
+#include "rdma_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+
+void rdma_opts_init(struct rdma_opts *opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->iters = 1;
+    opts->depth = 1;
+    opts->msg_size = 0;
+    opts->recv_batch = 0;
+    opts->signal_every = 1;
+    opts->use_inline = 0;
+    opts->post_batch = 1;
+    opts->batch_usec = 0;
+    opts->poll_batch = CQ_POLL_BATCH_DEFAULT;
+    opts->use_events = 0;
+    opts->spin_usec = 50;
+    opts->hw_timestamps = 0;
+    opts->page = RDMA_PAGE_BASE;
+    opts->reg_mode = RDMA_REG_PINNED;
+    opts->qp_type = IBV_QPT_RC;
+    opts->op = RDMA_OP_WRITE_IMM;
+    opts->dev_name = NULL;
+    opts->gid_index = -1;
+    opts->tcp_port = RDMA_TCP_PORT;
+    opts->bidirectional = 0;
+    opts->threads = 1;
+    opts->numa_mode = RDMA_NUMA_LOCAL;
+    opts->pin_cap = 0;
+    opts->use_dm = 0;
+    opts->conn_mode = RDMA_CONN_TCP;
+    opts->chunk_size = 0;
+    opts->json_path = NULL;
+}
+
+const char *rdma_op_str(enum rdma_op op) {
+    switch(op) {
+    case RDMA_OP_WRITE_IMM: return "write_imm";
+    case RDMA_OP_SEND:      return "send";
+    case RDMA_OP_SEND_IMM:  return "send_imm";
+    }
+    return "unknown";
+}
+
+static void print_usage(const char *prog, const char *positional) {
+    fprintf(stderr, "Usage: %s [options] %s\n", prog, positional);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -n <count>   Number of messages to transfer (0 = until stopped, default 1)\n");
+    fprintf(stderr, "  -q <depth>   Outstanding work requests in flight (default 1)\n");
+    fprintf(stderr, "  -s <bytes>   Message size in bytes (default: demo string length)\n");
+    fprintf(stderr, "  -r <batch>   Receive WRs reposted per linked chain (default depth/4)\n");
+    fprintf(stderr, "  -c <n>       Signal every Nth send WR, capped at the depth (default 1)\n");
+    fprintf(stderr, "  -I           Send payloads up to the device's max inline size inline\n");
+    fprintf(stderr, "  -k <count>   Send WRs posted per doorbell (default 1)\n");
+    fprintf(stderr, "  -t <usec>    Wait up to this long to fill a partial batch (default 0)\n");
+    fprintf(stderr, "  -p <count>   CQEs drained per ibv_poll_cq call, 1-%d (default %d)\n",
+            CQ_POLL_BATCH_MAX, CQ_POLL_BATCH_DEFAULT);
+    fprintf(stderr, "  -e           Event mode: spin, then sleep on the completion channel\n");
+    fprintf(stderr, "  -w <usec>    Busy-poll budget before sleeping in event mode (default 50)\n");
+    fprintf(stderr, "  -T           Read NIC completion timestamps (ibv_create_cq_ex)\n");
+    fprintf(stderr, "  -H <page>    Page size backing registered buffers: 4k, 2m or 1g\n");
+    fprintf(stderr, "               (default 4k); huge pages come from hugetlb, else THP\n");
+    fprintf(stderr, "  -R <mode>    Register buffers pinned, as ODP MRs (odp) or through one\n");
+    fprintf(stderr, "               implicit ODP MR (implicit); default pinned\n");
+    fprintf(stderr, "Benchmark options:\n");
+    fprintf(stderr, "  -x <uc|rc>   QP transport (default rc)\n");
+    fprintf(stderr, "  -o <op>      write_imm, send or send_imm (default write_imm)\n");
+    fprintf(stderr, "  -d <device>  RDMA device name (default: first device)\n");
+    fprintf(stderr, "  -g <index>   GID index (default: RoCE v2 IPv4 GID if present)\n");
+    fprintf(stderr, "  -P <port>    TCP handshake port (default %d)\n", RDMA_TCP_PORT);
+    fprintf(stderr, "  -b           Bidirectional: both sides send and receive\n");
+    fprintf(stderr, "  -j <threads> QPs per side, one pinned worker thread each (default 1)\n");
+    fprintf(stderr, "  -N <mode>    Buffers and threads on the device's NUMA node (local),\n");
+    fprintf(stderr, "               another node (remote) or anywhere (off); default local\n");
+    fprintf(stderr, "  -M <MiB>     Cap on memory the registration cache keeps pinned (default none)\n");
+    fprintf(stderr, "  -D           Compare host-memory write targets with on-NIC device memory\n");
+    fprintf(stderr, "  -C <tcp|cm>  Connect QPs over the TCP exchange or through rdma_cm\n");
+    fprintf(stderr, "               (default tcp); cm needs RC and the address of an RDMA port\n");
+    fprintf(stderr, "  -K <bytes>   Chunk size when reading or writing a whole object (rdma_pull)\n");
+    fprintf(stderr, "  -J <file>    Write results as JSON to this file\n");
+    fprintf(stderr, "  -h           Show this help\n");
+}
+
+// Parse an unsigned decimal value, rejecting trailing garbage and overflow
+static int parse_u64(const char *str, uint64_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long val = strtoull(str, &end, 0);
+    if(errno || end == str || *end != '\0' || str[0] == '-') {
+        return -1;
+    }
+    *out = val;
+    return 0;
+}
+
+int rdma_parse_opts(int argc, char *argv[], const char *positional,
+                    struct rdma_opts *opts) {
+    uint64_t val;
+    int c;
+
+    while((c = getopt(argc, argv, "n:q:s:r:c:Ik:t:p:ew:TH:R:x:o:d:g:P:bj:N:M:DC:K:J:h")) != -1) {
+        switch(c) {
+        case 'n':
+            if(parse_u64(optarg, &val)) {
+                fprintf(stderr, "Invalid message count: %s\n", optarg);
+                return -1;
+            }
+            opts->iters = val;
+            break;
+        case 'q':
+            if(parse_u64(optarg, &val) || val == 0 || val > UINT32_MAX) {
+                fprintf(stderr, "Invalid queue depth: %s\n", optarg);
+                return -1;
+            }
+            opts->depth = (uint32_t)val;
+            break;
+        case 's':
+            if(parse_u64(optarg, &val) || val == 0 || val > UINT32_MAX) {
+                fprintf(stderr, "Invalid message size: %s\n", optarg);
+                return -1;
+            }
+            opts->msg_size = (uint32_t)val;
+            break;
+        case 'r':
+            if(parse_u64(optarg, &val) || val == 0 || val > UINT32_MAX) {
+                fprintf(stderr, "Invalid receive batch: %s\n", optarg);
+                return -1;
+            }
+            opts->recv_batch = (uint32_t)val;
+            break;
+        case 'c':
+            if(parse_u64(optarg, &val) || val == 0 || val > UINT32_MAX) {
+                fprintf(stderr, "Invalid signal interval: %s\n", optarg);
+                return -1;
+            }
+            opts->signal_every = (uint32_t)val;
+            break;
+        case 'I':
+            opts->use_inline = 1;
+            break;
+        case 'k':
+            if(parse_u64(optarg, &val) || val == 0 || val > UINT32_MAX) {
+                fprintf(stderr, "Invalid post batch: %s\n", optarg);
+                return -1;
+            }
+            opts->post_batch = (uint32_t)val;
+            break;
+        case 't':
+            if(parse_u64(optarg, &val) || val > UINT32_MAX) {
+                fprintf(stderr, "Invalid batch deadline: %s\n", optarg);
+                return -1;
+            }
+            opts->batch_usec = (uint32_t)val;
+            break;
+        case 'p':
+            if(parse_u64(optarg, &val) || val == 0 || val > CQ_POLL_BATCH_MAX) {
+                fprintf(stderr, "Invalid poll batch: %s\n", optarg);
+                return -1;
+            }
+            opts->poll_batch = (int)val;
+            break;
+        case 'e':
+            opts->use_events = 1;
+            break;
+        case 'w':
+            if(parse_u64(optarg, &val) || val > UINT32_MAX) {
+                fprintf(stderr, "Invalid spin budget: %s\n", optarg);
+                return -1;
+            }
+            opts->spin_usec = (uint32_t)val;
+            break;
+        case 'T':
+            opts->hw_timestamps = 1;
+            break;
+        case 'H':
+            if(strcmp(optarg, rdma_page_str(RDMA_PAGE_BASE)) == 0) {
+                opts->page = RDMA_PAGE_BASE;
+            } else if(strcmp(optarg, rdma_page_str(RDMA_PAGE_2M)) == 0) {
+                opts->page = RDMA_PAGE_2M;
+            } else if(strcmp(optarg, rdma_page_str(RDMA_PAGE_1G)) == 0) {
+                opts->page = RDMA_PAGE_1G;
+            } else {
+                fprintf(stderr, "Invalid page size: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'R':
+            if(strcmp(optarg, rdma_reg_mode_str(RDMA_REG_PINNED)) == 0) {
+                opts->reg_mode = RDMA_REG_PINNED;
+            } else if(strcmp(optarg, rdma_reg_mode_str(RDMA_REG_ODP)) == 0) {
+                opts->reg_mode = RDMA_REG_ODP;
+            } else if(strcmp(optarg, rdma_reg_mode_str(RDMA_REG_ODP_IMPLICIT)) == 0) {
+                opts->reg_mode = RDMA_REG_ODP_IMPLICIT;
+            } else {
+                fprintf(stderr, "Invalid registration mode: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'x':
+            if(strcmp(optarg, "uc") == 0) {
+                opts->qp_type = IBV_QPT_UC;
+            } else if(strcmp(optarg, "rc") == 0) {
+                opts->qp_type = IBV_QPT_RC;
+            } else {
+                fprintf(stderr, "Invalid transport: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'o':
+            if(strcmp(optarg, rdma_op_str(RDMA_OP_WRITE_IMM)) == 0) {
+                opts->op = RDMA_OP_WRITE_IMM;
+            } else if(strcmp(optarg, rdma_op_str(RDMA_OP_SEND)) == 0) {
+                opts->op = RDMA_OP_SEND;
+            } else if(strcmp(optarg, rdma_op_str(RDMA_OP_SEND_IMM)) == 0) {
+                opts->op = RDMA_OP_SEND_IMM;
+            } else {
+                fprintf(stderr, "Invalid operation: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'd':
+            opts->dev_name = optarg;
+            break;
+        case 'g':
+            if(parse_u64(optarg, &val) || val > INT32_MAX) {
+                fprintf(stderr, "Invalid GID index: %s\n", optarg);
+                return -1;
+            }
+            opts->gid_index = (int)val;
+            break;
+        case 'P':
+            if(parse_u64(optarg, &val) || val == 0 || val > 65535) {
+                fprintf(stderr, "Invalid port number: %s\n", optarg);
+                return -1;
+            }
+            opts->tcp_port = (int)val;
+            break;
+        case 'b':
+            opts->bidirectional = 1;
+            break;
+        case 'j':
+            if(parse_u64(optarg, &val) || val == 0 || val > UINT32_MAX) {
+                fprintf(stderr, "Invalid thread count: %s\n", optarg);
+                return -1;
+            }
+            opts->threads = (uint32_t)val;
+            break;
+        case 'N':
+            if(strcmp(optarg, rdma_numa_mode_str(RDMA_NUMA_LOCAL)) == 0) {
+                opts->numa_mode = RDMA_NUMA_LOCAL;
+            } else if(strcmp(optarg, rdma_numa_mode_str(RDMA_NUMA_REMOTE)) == 0) {
+                opts->numa_mode = RDMA_NUMA_REMOTE;
+            } else if(strcmp(optarg, rdma_numa_mode_str(RDMA_NUMA_OFF)) == 0) {
+                opts->numa_mode = RDMA_NUMA_OFF;
+            } else {
+                fprintf(stderr, "Invalid NUMA placement: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'M':
+            if(parse_u64(optarg, &val) || val > SIZE_MAX >> 20) {
+                fprintf(stderr, "Invalid pin cap: %s\n", optarg);
+                return -1;
+            }
+            opts->pin_cap = (size_t)val << 20;
+            break;
+        case 'D':
+            opts->use_dm = 1;
+            break;
+        case 'C':
+            if(strcmp(optarg, rdma_conn_mode_str(RDMA_CONN_TCP)) == 0) {
+                opts->conn_mode = RDMA_CONN_TCP;
+            } else if(strcmp(optarg, rdma_conn_mode_str(RDMA_CONN_CM)) == 0) {
+                if(!rdma_cm_supported()) {
+                    fprintf(stderr, "Built without librdmacm: -C cm is unavailable\n");
+                    return -1;
+                }
+                opts->conn_mode = RDMA_CONN_CM;
+            } else {
+                fprintf(stderr, "Invalid connection mode: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'K':
+            if(parse_u64(optarg, &val) || val == 0 || val > UINT32_MAX) {
+                fprintf(stderr, "Invalid chunk size: %s\n", optarg);
+                return -1;
+            }
+            opts->chunk_size = (uint32_t)val;
+            break;
+        case 'J':
+            opts->json_path = optarg;
+            break;
+        case 'h':
+            print_usage(argv[0], positional);
+            return 1;
+        default:
+            print_usage(argv[0], positional);
+            return -1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,62 @@
+#ifndef RDMA_OPTS_H
+#define RDMA_OPTS_H
+
+#include <stdint.h>
+#include <infiniband/verbs.h>
+#include "rdma_mem.h"
+#include "rdma_cm.h"
+
+// Operation the benchmarks move messages with
+enum rdma_op {
+    RDMA_OP_WRITE_IMM,      // RDMA write with immediate (one receive WQE each)
+    RDMA_OP_SEND,           // Two-sided send into a posted receive buffer
+    RDMA_OP_SEND_IMM,       // Two-sided send carrying an immediate
+};
+
+// Command-line options shared by the sender and receiver programs.
+// Positional arguments (receiver IP, TCP port) are left for the caller
+// starting at optind after rdma_parse_opts() returns.
+struct rdma_opts {
+    uint64_t iters;         // Messages to transfer (0 = run until stopped)
+    uint32_t depth;         // Outstanding work requests (queue depth)
+    uint32_t msg_size;      // Payload size in bytes (0 = demo string length)
+    uint32_t recv_batch;    // Receive WRs reposted per chain (0 = depth / 4)
+    uint32_t signal_every;  // Request a CQE on every Nth send WR
+    int use_inline;         // Send payloads that fit inline with the WQE
+    uint32_t post_batch;    // Send WRs posted per doorbell
+    uint32_t batch_usec;    // Deadline for flushing a partial batch
+    int poll_batch;         // CQEs drained per ibv_poll_cq call
+    int use_events;         // Sleep on the completion channel after spinning
+    uint32_t spin_usec;     // Busy-poll budget before sleeping (event mode)
+    int hw_timestamps;      // Break latency down with NIC completion timestamps
+    enum rdma_page page;    // Page size backing registered buffers
+    enum rdma_reg_mode reg_mode; // Pinned or on-demand paging registrations
+
+    // Benchmark programs only; the demos fix these per binary
+    enum ibv_qp_type qp_type; // IBV_QPT_UC or IBV_QPT_RC
+    enum rdma_op op;        // How messages are moved
+    const char *dev_name;   // RDMA device (NULL = first one)
+    int gid_index;          // GID table entry (-1 = pick automatically)
+    int tcp_port;           // Handshake port
+    int bidirectional;      // Both sides send and receive at once
+    uint32_t threads;       // QPs per side, each driven by a pinned worker
+    enum rdma_numa_mode numa_mode; // Buffer and thread placement
+    size_t pin_cap;         // Registration cache pinned-byte cap (0 = none)
+    int use_dm;             // Also target on-NIC device memory (rdma_lat)
+    enum rdma_conn_mode conn_mode; // TCP exchange or rdma_cm
+    uint32_t chunk_size;    // Bytes per WR when moving a whole object (0 = default)
+    const char *json_path;  // Write machine-readable results here
+};
+
+// Fill in defaults: one message, queue depth 1 (the original one-shot demo)
+void rdma_opts_init(struct rdma_opts *opts);
+
+// Name of an operation, as accepted by -o
+const char *rdma_op_str(enum rdma_op op);
+
+// Parse options with getopt. Returns 0 on success, -1 on bad input
+// (an error is printed), 1 if help was requested.
+int rdma_parse_opts(int argc, char *argv[], const char *positional,
+                    struct rdma_opts *opts);
+
+#endif // RDMA_OPTS_H
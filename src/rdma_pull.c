@@ -0,0 +1,413 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <infiniband/verbs.h>
+#include "rdma_common.h"
+#include "rdma_opts.h"
+#include "rdma_endpoint.h"
+#include "rdma_cq.h"
+#include "rdma_xfer.h"
+
+// Pull vs push bandwidth for whole objects over RC.
+// The server owns an object buffer and advertises it in the handshake
+// (address, rkey and length). For each object size the client first pulls
+// objects out of it with pipelined RDMA reads, then pushes the same
+// objects back with RDMA writes, both through rdma_xfer: -K byte chunks
+// striped over -j QPs, each QP keeping up to -q WRs in flight. Reads are
+// capped at the QP's negotiated max_rd_atomic, which is also the default
+// depth for both modes so they run with the same number of WRs
+// outstanding. Objects move one after another, each completing before the
+// next starts, so small objects show the round trip and large ones the
+// link.
+//
+//   server: rdma_pull [options]
+//   client: rdma_pull [-s bytes] [-K chunk] [-q depth] [-j qps] <server_ip>
+//
+// Without -s the client sweeps object sizes by factors of four.
+
+#define PULL_MIN_SIZE       4096
+#define PULL_MAX_SIZE       (64u << 20)
+#define PULL_DEFAULT_CHUNK  (64u << 10)
+#define PULL_MAX_QPS        64
+#define PULL_MAX_DEPTH      256   // Send queue size; max_rd_atomic fits in 8 bits
+
+// Without -n each point moves about PULL_TARGET_BYTES per mode, within
+// these bounds
+#define PULL_TARGET_BYTES   (1ULL << 30)
+#define PULL_MIN_ITERS      16
+#define PULL_MAX_ITERS      100000
+
+// Test parameters the client hands to the server before QPs are created
+struct pull_config {
+    uint32_t qps;
+    uint32_t min_size;
+    uint32_t max_size;
+    uint32_t chunk;
+    uint32_t depth;             // 0: the negotiated max_rd_atomic
+    uint64_t iters;             // Per mode and size; 0: sized per point
+};
+
+// What goes over the socket, field by field, in rdma_wire's encoding
+static void pull_config_fields(struct rdma_wire_codec *c, void *obj) {
+    struct pull_config *cfg = obj;
+    rdma_wire_u32(c, &cfg->qps);
+    rdma_wire_u32(c, &cfg->min_size);
+    rdma_wire_u32(c, &cfg->max_size);
+    rdma_wire_u32(c, &cfg->chunk);
+    rdma_wire_u32(c, &cfg->depth);
+    rdma_wire_u64(c, &cfg->iters);
+}
+
+struct pull_point {
+    uint32_t size;
+    uint64_t iters;
+    struct xfer_stats pull;
+    struct xfer_stats push;
+};
+
+static uint64_t point_iters(const struct pull_config *cfg, uint32_t size) {
+    if(cfg->iters) {
+        return cfg->iters;
+    }
+    uint64_t iters = PULL_TARGET_BYTES / size;
+    if(iters < PULL_MIN_ITERS) {
+        return PULL_MIN_ITERS;
+    }
+    return iters > PULL_MAX_ITERS ? PULL_MAX_ITERS : iters;
+}
+
+// The owner's object content, so the reader can check what it pulled
+static char pattern_byte(size_t i) {
+    return (char)((i * 2654435761u) >> 24);
+}
+
+static void fill_pattern(char *buf, size_t len) {
+    for(size_t i = 0; i < len; i++) {
+        buf[i] = pattern_byte(i);
+    }
+}
+
+static int check_pattern(const char *buf, size_t len) {
+    for(size_t i = 0; i < len; i++) {
+        if(buf[i] != pattern_byte(i)) {
+            fprintf(stderr, "Pulled object differs from the owner's at byte %zu\n", i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int run_point(struct xfer_engine *x, struct xfer_lane *pull_lanes,
+                     struct xfer_lane *push_lanes, struct pull_point *pt) {
+    memset(x->buf, 0, pt->size);
+
+    x->mode = XFER_PULL;
+    x->lanes = pull_lanes;
+    if(xfer_run(x, pt->size, pt->iters, &pt->pull) || check_pattern(x->buf, pt->size)) {
+        return -1;
+    }
+
+    // Writing the object back leaves the owner's copy as it was
+    x->mode = XFER_PUSH;
+    x->lanes = push_lanes;
+    return xfer_run(x, pt->size, pt->iters, &pt->push);
+}
+
+static void print_point(const struct pull_point *pt) {
+    double pull = xfer_gbps(&pt->pull);
+    double push = xfer_gbps(&pt->push);
+
+    printf("%10u %8lu %10.3f %10.3f %9.2f %12.1f %12.1f %10.1f\n",
+           pt->size, pt->iters, pull, push, push > 0 ? pull / push : 0,
+           hist_percentile(&pt->pull.lat, 50) / 1e3,
+           hist_percentile(&pt->push.lat, 50) / 1e3,
+           pt->pull.objects ? (double)pt->pull.wrs / pt->pull.objects : 0);
+    fflush(stdout);
+}
+
+static int write_json(const char *path, const struct pull_config *cfg,
+                      const struct rdma_device *dev, const struct rdma_endpoint *ep,
+                      uint32_t pull_depth, uint32_t push_depth,
+                      const struct pull_point *pts, size_t npts) {
+    FILE *f = fopen(path, "w");
+    if(!f) {
+        perror(path);
+        return -1;
+    }
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"settings\": {\n");
+    fprintf(f, "    \"device\": \"%s\",\n", dev->name);
+    fprintf(f, "    \"qps\": %u,\n", cfg->qps);
+    fprintf(f, "    \"chunk\": %u,\n", cfg->chunk);
+    fprintf(f, "    \"pull_depth\": %u,\n", pull_depth);
+    fprintf(f, "    \"push_depth\": %u,\n", push_depth);
+    fprintf(f, "    \"max_rd_atomic\": %u,\n", ep->params.max_rd_atomic);
+    fprintf(f, "    \"mtu\": %d\n", 128 << ep->params.mtu);
+    fprintf(f, "  },\n");
+    fprintf(f, "  \"results\": [\n");
+    for(size_t i = 0; i < npts; i++) {
+        const struct pull_point *pt = &pts[i];
+        fprintf(f, "    {\"object_size\": %u, \"objects\": %lu, "
+                   "\"pull_gb_per_s\": %.6f, \"push_gb_per_s\": %.6f, "
+                   "\"pull_p50_us\": %.3f, \"push_p50_us\": %.3f}%s\n",
+                pt->size, pt->iters, xfer_gbps(&pt->pull), xfer_gbps(&pt->push),
+                hist_percentile(&pt->pull.lat, 50) / 1e3,
+                hist_percentile(&pt->push.lat, 50) / 1e3,
+                i + 1 < npts ? "," : "");
+    }
+    fprintf(f, "  ]\n");
+    fprintf(f, "}\n");
+
+    if(fclose(f)) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+// The client drives both modes; the server only owns the object
+static int run_client(const struct pull_config *cfg, const struct rdma_opts *opts,
+                      const struct rdma_device *dev, struct rdma_endpoint *eps,
+                      struct ibv_cq *cq) {
+    struct xfer_lane *pull_lanes = calloc(cfg->qps, sizeof(*pull_lanes));
+    struct xfer_lane *push_lanes = calloc(cfg->qps, sizeof(*push_lanes));
+    size_t max_pts = 0;
+    for(uint32_t s = cfg->min_size; s <= cfg->max_size; s *= 4) {
+        max_pts++;
+    }
+    struct pull_point *pts = calloc(max_pts, sizeof(*pts));
+    struct cq_poller poller;
+    int ret = -1;
+
+    if(!pull_lanes || !push_lanes || !pts) {
+        perror("calloc");
+        goto out_free;
+    }
+    if(cq_poller_init(&poller, cq, opts->poll_batch)) {
+        goto out_free;
+    }
+
+    // Reads stop at what both ends agreed on; -q can only ask for less
+    uint32_t pull_depth = PULL_MAX_DEPTH;
+    for(uint32_t i = 0; i < cfg->qps; i++) {
+        if(eps[i].params.max_rd_atomic < pull_depth) {
+            pull_depth = eps[i].params.max_rd_atomic;
+        }
+    }
+    if(pull_depth == 0) {
+        fprintf(stderr, "The QPs settled on no outstanding reads\n");
+        goto out;
+    }
+    if(cfg->depth && cfg->depth < pull_depth) {
+        pull_depth = cfg->depth;
+    }
+    uint32_t push_depth = cfg->depth ? cfg->depth : pull_depth;
+    for(uint32_t i = 0; i < cfg->qps; i++) {
+        pull_lanes[i] = (struct xfer_lane) { .qpx = eps[i].qpx, .depth = pull_depth };
+        push_lanes[i] = (struct xfer_lane) { .qpx = eps[i].qpx, .depth = push_depth };
+    }
+    printf("%u-byte chunks, up to %u reads (max_rd_atomic %u) and %u writes "
+           "in flight per QP\n", cfg->chunk, pull_depth, eps[0].params.max_rd_atomic,
+           push_depth);
+
+    // Every QP reaches the one object through the same rkey, as MRs belong
+    // to the PD rather than to a QP
+    struct xfer_engine x = {
+        .nlanes = cfg->qps,
+        .poller = &poller,
+        .buf = eps[0].buf,
+        .lkey = eps[0].mr->lkey,
+        .remote_rkey = eps[0].remote_rkey,
+        .remote_addr = eps[0].remote_addr,
+        .chunk = cfg->chunk
+    };
+
+    printf("%10s %8s %10s %10s %9s %12s %12s %10s\n", "#bytes", "objects",
+           "pull GB/s", "push GB/s", "pull/push", "pull p50 us", "push p50 us",
+           "WRs/obj");
+    size_t npts = 0;
+    ret = 0;
+    for(uint32_t size = cfg->min_size; size <= cfg->max_size; size *= 4) {
+        struct pull_point *pt = &pts[npts];
+        pt->size = size;
+        pt->iters = point_iters(cfg, size);
+        ret = run_point(&x, pull_lanes, push_lanes, pt);
+        if(ret || rdma_stop_requested) {
+            ret = -1;
+            break;
+        }
+        npts++;
+        print_point(pt);
+    }
+
+    if(ret == 0 && opts->json_path) {
+        ret = write_json(opts->json_path, cfg, dev, &eps[0], pull_depth, push_depth,
+                         pts, npts);
+        if(ret == 0) {
+            printf("Results written to %s\n", opts->json_path);
+        }
+    }
+
+out:
+    cq_poller_destroy(&poller);
+out_free:
+    free(pts);
+    free(pull_lanes);
+    free(push_lanes);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    const char *server_ip = NULL;
+    struct rdma_opts opts;
+
+    // 0 means "sweep" for -s, "max_rd_atomic" for -q and "size it per
+    // point" for -n
+    rdma_opts_init(&opts);
+    opts.iters = 0;
+    opts.depth = 0;
+    opts.chunk_size = PULL_DEFAULT_CHUNK;
+    int ret = rdma_parse_opts(argc, argv, "[server_ip]", &opts);
+    if(ret) {
+        return ret < 0 ? 1 : 0;
+    }
+    if(argc > optind) {
+        server_ip = argv[optind];
+    }
+    if(opts.msg_size > PULL_MAX_SIZE) {
+        fprintf(stderr, "Object size is limited to %u bytes\n", PULL_MAX_SIZE);
+        return 1;
+    }
+    if(opts.threads > PULL_MAX_QPS || opts.depth > PULL_MAX_DEPTH) {
+        fprintf(stderr, "At most %d QPs and a depth of %d\n", PULL_MAX_QPS, PULL_MAX_DEPTH);
+        return 1;
+    }
+    if(opts.qp_type != IBV_QPT_RC) {
+        fprintf(stderr, "RDMA reads need RC\n");
+        return 1;
+    }
+    if(rdma_install_stop_handler()) {
+        return 1;
+    }
+    srand(time(NULL) ^ getpid());
+
+    struct rdma_device dev;
+    if(rdma_device_open(&dev, opts.dev_name, opts.gid_index)) {
+        return 1;
+    }
+    struct rdma_numa numa;
+    if(rdma_numa_init(&numa, dev.name, opts.numa_mode)) {
+        return 1;
+    }
+
+    // The client decides what to measure and tells the server
+    struct pull_config cfg;
+    int sock;
+    if(server_ip) {
+        cfg = (struct pull_config) {
+            .qps = opts.threads,
+            .min_size = opts.msg_size ? opts.msg_size : PULL_MIN_SIZE,
+            .max_size = opts.msg_size ? opts.msg_size : PULL_MAX_SIZE,
+            .chunk = opts.chunk_size,
+            .depth = opts.depth,
+            .iters = opts.iters
+        };
+        sock = setup_tcp_client(server_ip, opts.tcp_port);
+        if(sock < 0 || rdma_wire_send_fields(sock, pull_config_fields, &cfg)) {
+            return 1;
+        }
+    } else {
+        int listen_sock = setup_tcp_server(opts.tcp_port);
+        if(listen_sock < 0) {
+            return 1;
+        }
+        sock = accept(listen_sock, NULL, NULL);
+        close(listen_sock);
+        if(sock < 0) {
+            perror("accept");
+            return 1;
+        }
+        if(rdma_wire_recv_fields(sock, pull_config_fields, &cfg)) {
+            return 1;
+        }
+        if(cfg.min_size == 0 || cfg.min_size > cfg.max_size ||
+           cfg.max_size > PULL_MAX_SIZE || cfg.chunk == 0 ||
+           cfg.qps == 0 || cfg.qps > PULL_MAX_QPS || cfg.depth > PULL_MAX_DEPTH) {
+            fprintf(stderr, "Client sent an invalid test configuration\n");
+            return 1;
+        }
+    }
+
+    // One CQ for every QP's sends. Only QP 0 has a buffer: it holds the
+    // object on both sides, and the other QPs reach it through its MR.
+    uint32_t send_depth = cfg.depth ? cfg.depth : PULL_MAX_DEPTH;
+    struct ibv_cq *cq = ibv_create_cq(dev.ctx, cfg.qps * send_depth, NULL, NULL, 0);
+    struct rdma_endpoint *eps = calloc(cfg.qps, sizeof(*eps));
+    if(!cq) {
+        perror("Failed to create CQ");
+        return 1;
+    }
+    if(!eps) {
+        perror("calloc");
+        return 1;
+    }
+    for(uint32_t i = 0; i < cfg.qps; i++) {
+        struct rdma_endpoint_attr attr = {
+            .qp_type = IBV_QPT_RC,
+            .buf_size = i == 0 ? cfg.max_size : 0,
+            .send_depth = send_depth,
+            .recv_depth = 1,
+            .shared_cq = cq,
+            .numa = &numa,
+            .page = opts.page,
+            .reg = opts.reg_mode
+        };
+        if(rdma_endpoint_create(&eps[i], &dev, &attr)) {
+            return 1;
+        }
+    }
+    if(!server_ip) {
+        fill_pattern(eps[0].buf, cfg.max_size);
+    }
+
+    // The server's description of QP 0's MR is the object's advertisement
+    if(rdma_endpoint_handshake(eps, cfg.qps, sock, !server_ip)) {
+        return 1;
+    }
+    if(eps[0].remote_len < cfg.max_size || !(eps[0].caps & RDMA_CAP_REMOTE_READ)) {
+        fprintf(stderr, "The peer's buffer cannot be read remotely up to %u bytes\n",
+                cfg.max_size);
+        return 1;
+    }
+
+    printf("Object pull/push over %u RC QP%s on %s (GID index %d, MTU %d)\n",
+           cfg.qps, cfg.qps > 1 ? "s" : "", dev.name, dev.gid_index,
+           128 << eps[0].params.mtu);
+    rdma_endpoint_print_params(&eps[0]);
+    rdma_mem_print(&eps[0].mem, "Object buffer");
+
+    // The server idles until the client is done with its object
+    char token = 'D';
+    if(server_ip) {
+        ret = run_client(&cfg, &opts, &dev, eps, cq);
+        if(rdma_sock_send(sock, &token, 1)) {
+            ret = -1;
+        }
+    } else {
+        ret = rdma_sock_recv(sock, &token, 1);
+    }
+
+    close(sock);
+    for(uint32_t i = 0; i < cfg.qps; i++) {
+        rdma_endpoint_destroy(&eps[i]);
+    }
+    free(eps);
+    ibv_destroy_cq(cq);
+    rdma_numa_destroy(&numa);
+    rdma_device_close(&dev);
+    return ret ? 1 : 0;
+}
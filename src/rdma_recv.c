@@ -0,0 +1,211 @@
+#include "rdma_recv.h"
+#include "rdma_common.h"
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int recv_ring_init(struct recv_ring *ring, struct ibv_qp *qp, char *buf,
+                   uint32_t lkey, uint32_t slot_size, uint32_t depth,
+                   uint32_t batch) {
+    memset(ring, 0, sizeof(*ring));
+    ring->qp = qp;
+    ring->buf = buf;
+    ring->lkey = lkey;
+    ring->slot_size = slot_size;
+    ring->depth = depth;
+    ring->batch = (batch == 0 || batch > depth) ? depth : batch;
+
+    ring->wrs = calloc(depth, sizeof(*ring->wrs));
+    ring->sges = calloc(depth, sizeof(*ring->sges));
+    if(!ring->wrs || !ring->sges) {
+        perror("calloc");
+        recv_ring_destroy(ring);
+        return -1;
+    }
+
+    for(uint32_t i = 0; i < depth; i++) {
+        ring->wrs[i].wr_id = i;
+        if(buf) {
+            ring->sges[i].addr = (uintptr_t)(buf + (size_t)i * slot_size);
+            ring->sges[i].length = slot_size;
+            ring->sges[i].lkey = lkey;
+            ring->wrs[i].sg_list = &ring->sges[i];
+            ring->wrs[i].num_sge = 1;
+        }
+    }
+    return 0;
+}
+
+int recv_ring_init_slab(struct recv_ring *ring, struct ibv_qp *qp,
+                        struct slab_cache *slab, uint32_t slot_size,
+                        uint32_t depth, uint32_t batch) {
+    if(recv_ring_init(ring, qp, NULL, 0, slot_size, depth, batch)) {
+        return -1;
+    }
+    ring->slab_bufs = calloc(depth, sizeof(*ring->slab_bufs));
+    if(!ring->slab_bufs) {
+        perror("calloc");
+        recv_ring_destroy(ring);
+        return -1;
+    }
+    ring->slab = slab;
+
+    for(uint32_t i = 0; i < depth; i++) {
+        struct slab_buf *b = &ring->slab_bufs[i];
+        if(slab_alloc(slab, slot_size, b)) {
+            recv_ring_destroy(ring);
+            return -1;
+        }
+        ring->sges[i].addr = (uintptr_t)b->addr;
+        ring->sges[i].length = slot_size;
+        ring->sges[i].lkey = b->lkey;
+        ring->wrs[i].sg_list = &ring->sges[i];
+        ring->wrs[i].num_sge = 1;
+    }
+    return 0;
+}
+
+// Link `n` slots starting at `first` (wrapping) into one chain and post it
+static int post_chain(struct recv_ring *ring, uint32_t first, uint32_t n) {
+    struct ibv_recv_wr *bad_wr;
+    uint32_t idx = first;
+
+    for(uint32_t k = 0; k < n; k++) {
+        uint32_t next = (idx + 1) % ring->depth;
+        ring->wrs[idx].next = (k + 1 < n) ? &ring->wrs[next] : NULL;
+        idx = next;
+    }
+
+    ring->post_calls++;
+    if(ibv_post_recv(ring->qp, &ring->wrs[first], &bad_wr)) {
+        perror("ibv_post_recv");
+        return -1;
+    }
+    return 0;
+}
+
+int recv_ring_fill(struct recv_ring *ring) {
+    ring->head = 0;
+    ring->pending = 0;
+    return post_chain(ring, 0, ring->depth);
+}
+
+int recv_ring_consumed(struct recv_ring *ring, uint32_t n) {
+    ring->pending += n;
+    while(ring->pending >= ring->batch) {
+        if(post_chain(ring, ring->head, ring->batch)) {
+            return -1;
+        }
+        ring->head = (ring->head + ring->batch) % ring->depth;
+        ring->pending -= ring->batch;
+    }
+    return 0;
+}
+
+void recv_ring_destroy(struct recv_ring *ring) {
+    for(uint32_t i = 0; ring->slab_bufs && i < ring->depth; i++) {
+        if(ring->slab_bufs[i].addr) {
+            slab_free(ring->slab, &ring->slab_bufs[i]);
+        }
+    }
+    free(ring->slab_bufs);
+    ring->slab_bufs = NULL;
+    free(ring->wrs);
+    free(ring->sges);
+    ring->wrs = NULL;
+    ring->sges = NULL;
+}
+
+// Per-run state shared with the completion handler
+struct recv_run {
+    struct recv_stats *stats;
+    uint32_t expected_imm;      // Next immediate sequence number expected
+    uint64_t last_nic_ns;       // Previous NIC completion time
+};
+
+static int on_recv_completion(void *arg, const struct ibv_wc *wc,
+                              uint64_t nic_ns) {
+    struct recv_run *run = arg;
+    struct recv_stats *stats = run->stats;
+
+    // NIC timestamps separate host-side delay from arrival jitter
+    if(nic_ns) {
+        uint64_t now = rdma_now_ns();
+        hist_record(&stats->poll_lat, now > nic_ns ? now - nic_ns : 0);
+        if(run->last_nic_ns) {
+            hist_record(&stats->nic_gap, nic_ns > run->last_nic_ns ?
+                                         nic_ns - run->last_nic_ns : 0);
+        }
+        run->last_nic_ns = nic_ns;
+    }
+
+    stats->msgs++;
+    stats->bytes += wc->byte_len;
+
+    if(wc->wc_flags & IBV_WC_WITH_IMM) {
+        uint32_t imm = ntohl(wc->imm_data);
+        stats->gaps += (uint32_t)(imm - run->expected_imm);
+        run->expected_imm = imm + 1;
+        stats->last_imm = imm;
+    }
+    return 0;
+}
+
+int recv_ring_run(struct recv_ring *ring, struct cq_poller *poller,
+                  uint64_t iters, int *stop,
+                  struct recv_stats *stats) {
+    struct recv_run run = { .stats = stats, .expected_imm = 0 };
+    uint64_t first = 0;
+    uint64_t last = 0;
+
+    memset(stats, 0, sizeof(*stats));
+    hist_init(&stats->poll_lat);
+    hist_init(&stats->nic_gap);
+    uint64_t start = rdma_now_ns();
+    uint64_t cpu_start = rdma_cpu_time_ns();
+
+    while(!rdma_stop_requested && !(stop && __atomic_load_n(stop, __ATOMIC_ACQUIRE)) &&
+          (iters == 0 || stats->msgs < iters)) {
+        int n = cq_poller_wait(poller, on_recv_completion, &run);
+        if(n < 0) {
+            return -1;
+        }
+        if(n == 0) {
+            continue;
+        }
+
+        last = rdma_now_ns();
+        if(first == 0) {
+            first = last;
+        }
+
+        // Repost the whole drained batch in one go
+        if(recv_ring_consumed(ring, n)) {
+            return -1;
+        }
+    }
+
+    stats->elapsed_ns = last - first;
+    stats->wall_ns = rdma_now_ns() - start;
+    stats->cpu_ns = rdma_cpu_time_ns() - cpu_start;
+    return 0;
+}
+
+void recv_stats_print(const struct recv_stats *stats) {
+    double secs = stats->elapsed_ns / 1e9;
+    printf("Received %lu messages, %lu bytes (%lu sequence gaps)\n",
+           stats->msgs, stats->bytes, stats->gaps);
+    if(stats->msgs > 1 && secs > 0) {
+        printf("    Throughput: %.3f GB/s, %.3f Mmsg/s\n",
+               stats->bytes / secs / 1e9, stats->msgs / secs / 1e6);
+    }
+    if(stats->wall_ns) {
+        printf("    CPU utilisation: %.1f%% of one core over %.3f s\n",
+               100.0 * stats->cpu_ns / stats->wall_ns, stats->wall_ns / 1e9);
+    }
+    if(stats->poll_lat.total) {
+        hist_print(&stats->poll_lat, "    NIC completion to handling", 1e-3, "us");
+        hist_print(&stats->nic_gap, "    NIC inter-arrival", 1e-3, "us");
+    }
+}
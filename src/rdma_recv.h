@@ -0,0 +1,72 @@
+#ifndef RDMA_RECV_H
+#define RDMA_RECV_H
+
+#include <stdint.h>
+#include <infiniband/verbs.h>
+#include "rdma_cq.h"
+#include "rdma_hist.h"
+#include "rdma_slab.h"
+
+// Ring of pre-posted receive WRs.
+// Every write-with-immediate consumes one receive WQE, so the ring keeps
+// `depth` WRs posted and reposts consumed ones as linked chains of `batch`.
+// Receive WRs complete in posting order, so slot i is always WR i.
+struct recv_ring {
+    struct ibv_qp *qp;
+    char *buf;                  // Slot buffers (NULL: WRs carry no SGE)
+    uint32_t lkey;              // Local key of buf
+    uint32_t slot_size;         // Bytes per slot when buf is set
+    struct slab_cache *slab;    // Source of the slot buffers (recv_ring_init_slab)
+    struct slab_buf *slab_bufs; // One per slot, given back on destroy
+    uint32_t depth;             // WRs kept posted
+    uint32_t batch;             // Consumed WRs reposted per ibv_post_recv
+    struct ibv_recv_wr *wrs;    // One WR per slot, wr_id = slot index
+    struct ibv_sge *sges;       // One SGE per slot
+    uint32_t head;              // Oldest consumed slot not yet reposted
+    uint32_t pending;           // Consumed slots awaiting repost
+    uint64_t post_calls;        // ibv_post_recv calls made
+};
+
+// Results of a receive run
+struct recv_stats {
+    uint64_t msgs;              // Completions received
+    uint64_t bytes;             // Sum of byte_len
+    uint64_t gaps;              // Immediate sequence numbers skipped (UC drops)
+    uint64_t elapsed_ns;        // First completion to last completion
+    uint64_t wall_ns;           // Whole run, including idle time
+    uint64_t cpu_ns;            // Process CPU time spent in the run
+    uint32_t last_imm;          // Last immediate value seen (host order)
+    struct rdma_hist poll_lat;  // NIC completion timestamp to handling (ns)
+    struct rdma_hist nic_gap;   // Gap between consecutive NIC completions (ns)
+};
+
+// Allocate the ring. With buf == NULL the WRs carry no scatter list, which
+// is all RDMA write-with-immediate needs: the data lands via the RDMA address.
+int recv_ring_init(struct recv_ring *ring, struct ibv_qp *qp, char *buf,
+                   uint32_t lkey, uint32_t slot_size, uint32_t depth,
+                   uint32_t batch);
+
+// Allocate the ring with one slab buffer of `slot_size` bytes per slot,
+// taken once here so reposting never allocates
+int recv_ring_init_slab(struct recv_ring *ring, struct ibv_qp *qp,
+                        struct slab_cache *slab, uint32_t slot_size,
+                        uint32_t depth, uint32_t batch);
+
+// Post every slot as one linked chain
+int recv_ring_fill(struct recv_ring *ring);
+
+// Account for `n` consumed WRs and repost them once a full batch is pending
+int recv_ring_consumed(struct recv_ring *ring, uint32_t n);
+
+void recv_ring_destroy(struct recv_ring *ring);
+
+// Drain the CQ until `iters` messages have arrived (0 = forever), a stop is
+// requested, or *stop is set by another thread (stop may be NULL),
+// replenishing the ring as completions come in.
+int recv_ring_run(struct recv_ring *ring, struct cq_poller *poller,
+                  uint64_t iters, int *stop,
+                  struct recv_stats *stats);
+
+void recv_stats_print(const struct recv_stats *stats);
+
+#endif // RDMA_RECV_H
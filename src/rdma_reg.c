@@ -0,0 +1,170 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <infiniband/verbs.h>
+#include "rdma_common.h"
+#include "rdma_opts.h"
+#include "rdma_endpoint.h"
+#include "rdma_regcache.h"
+#include "rdma_hist.h"
+
+// Registration cost benchmark.
+// Picks buffers at random from a pool of heap allocations, as an
+// application sending from its own memory would, and compares registering
+// each one per send (ibv_reg_mr + ibv_dereg_mr) with going through the
+// registration cache. Every REG_FREE_EVERY sends one buffer is freed and
+// allocated again, invalidated in the cache first. Nothing is sent, so no
+// peer is needed.
+//
+//   rdma_reg [-n sends] [-s max_bytes] [-M cap_mib] [-d device]
+
+#define REG_DEFAULT_ITERS  100000
+#define REG_DEFAULT_SIZE   (64u << 10)
+#define REG_BUFFERS        256
+#define REG_FREE_EVERY     1000
+
+// Registering per send is slow enough that a sample of it will do
+#define REG_BASELINE_ITERS 2000
+
+#define REG_ACCESS (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | \
+                    IBV_ACCESS_REMOTE_READ)
+
+struct reg_pool {
+    char *bufs[REG_BUFFERS];
+    size_t sizes[REG_BUFFERS];
+    uint32_t max_size;
+};
+
+static int pool_alloc_one(struct reg_pool *pool, int i) {
+    pool->sizes[i] = 1 + (size_t)rand() % pool->max_size;
+    pool->bufs[i] = malloc(pool->sizes[i]);
+    if(!pool->bufs[i]) {
+        perror("malloc");
+        return -1;
+    }
+    memset(pool->bufs[i], 0, pool->sizes[i]);
+    return 0;
+}
+
+static void print_row(const char *name, const struct rdma_hist *hist) {
+    double scale = rdma_tsc_ns_per_tick() / 1000.0;
+
+    printf("%-16s %10lu %9.2f %9.2f %9.2f %9.2f %9.2f\n", name, hist->total,
+           hist->min * scale,
+           hist_percentile(hist, 50.0) * scale,
+           hist_percentile(hist, 99.0) * scale,
+           hist->max * scale,
+           hist->sum / hist->total * scale);
+}
+
+// ibv_reg_mr + ibv_dereg_mr around every send
+static int run_baseline(struct reg_pool *pool, struct ibv_pd *pd, uint64_t iters,
+                        struct rdma_hist *hist) {
+    for(uint64_t n = 0; n < iters && !rdma_stop_requested; n++) {
+        int i = rand() % REG_BUFFERS;
+        uint64_t t0 = rdma_tsc();
+        struct ibv_mr *mr = ibv_reg_mr(pd, pool->bufs[i], pool->sizes[i], REG_ACCESS);
+        if(!mr) {
+            perror("ibv_reg_mr");
+            return -1;
+        }
+        if(ibv_dereg_mr(mr)) {
+            perror("ibv_dereg_mr");
+            return -1;
+        }
+        hist_record(hist, rdma_tsc() - t0);
+    }
+    return 0;
+}
+
+static int run_cached(struct reg_pool *pool, struct rdma_regcache *cache,
+                      uint64_t iters, struct rdma_hist *hist) {
+    for(uint64_t n = 0; n < iters && !rdma_stop_requested; n++) {
+        int i = rand() % REG_BUFFERS;
+
+        if(n % REG_FREE_EVERY == REG_FREE_EVERY - 1) {
+            rdma_regcache_invalidate(cache, pool->bufs[i], pool->sizes[i]);
+            free(pool->bufs[i]);
+            if(pool_alloc_one(pool, i)) {
+                return -1;
+            }
+        }
+
+        uint64_t t0 = rdma_tsc();
+        struct regcache_entry *e = rdma_regcache_get(cache, pool->bufs[i], pool->sizes[i]);
+        if(!e) {
+            return -1;
+        }
+        rdma_regcache_put(cache, e);
+        hist_record(hist, rdma_tsc() - t0);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct rdma_opts opts;
+
+    rdma_opts_init(&opts);
+    opts.iters = REG_DEFAULT_ITERS;
+    int ret = rdma_parse_opts(argc, argv, "", &opts);
+    if(ret) {
+        return ret < 0 ? 1 : 0;
+    }
+    if(opts.iters == 0) {
+        fprintf(stderr, "Needs a finite send count (-n)\n");
+        return 1;
+    }
+    if(rdma_install_stop_handler()) {
+        return 1;
+    }
+    srand(time(NULL) ^ getpid());
+
+    struct rdma_device dev;
+    if(rdma_device_open(&dev, opts.dev_name, opts.gid_index)) {
+        return 1;
+    }
+
+    struct reg_pool pool = {
+        .max_size = opts.msg_size ? opts.msg_size : REG_DEFAULT_SIZE
+    };
+    for(int i = 0; i < REG_BUFFERS; i++) {
+        if(pool_alloc_one(&pool, i)) {
+            return 1;
+        }
+    }
+
+    struct rdma_regcache cache;
+    if(rdma_regcache_init(&cache, dev.pd, REG_ACCESS, opts.pin_cap)) {
+        return 1;
+    }
+
+    printf("%d heap buffers of 1-%u bytes on %s, pin cap %zu bytes%s\n",
+           REG_BUFFERS, pool.max_size, dev.name, opts.pin_cap,
+           opts.pin_cap ? "" : " (none)");
+    printf("%-16s %10s %9s %9s %9s %9s %9s\n", "#mode", "sends",
+           "min[us]", "p50[us]", "p99[us]", "max[us]", "mean[us]");
+
+    struct rdma_hist baseline;
+    struct rdma_hist cached;
+    hist_init(&baseline);
+    hist_init(&cached);
+    uint64_t base_iters = opts.iters < REG_BASELINE_ITERS ? opts.iters : REG_BASELINE_ITERS;
+    ret = run_baseline(&pool, dev.pd, base_iters, &baseline);
+    if(ret == 0) {
+        print_row("reg_per_send", &baseline);
+        ret = run_cached(&pool, &cache, opts.iters, &cached);
+    }
+    if(ret == 0) {
+        print_row("regcache", &cached);
+        regcache_stats_print(&cache);
+    }
+
+    rdma_regcache_destroy(&cache);
+    for(int i = 0; i < REG_BUFFERS; i++) {
+        free(pool.bufs[i]);
+    }
+    rdma_device_close(&dev);
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,248 @@
+#include "rdma_regcache.h"
+#include "rdma_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define REGCACHE_INITIAL_CAP 64
+
+int rdma_regcache_init(struct rdma_regcache *cache, struct ibv_pd *pd,
+                       int access, size_t max_pinned) {
+    memset(cache, 0, sizeof(*cache));
+    cache->pd = pd;
+    cache->access = access;
+    cache->max_pinned = max_pinned;
+    cache->page_size = (size_t)sysconf(_SC_PAGESIZE);
+    cache->cap = REGCACHE_INITIAL_CAP;
+    cache->index = malloc(cache->cap * sizeof(*cache->index));
+    if(!cache->index) {
+        perror("malloc");
+        return -1;
+    }
+    return 0;
+}
+
+static void lru_remove(struct rdma_regcache *cache, struct regcache_entry *e) {
+    if(e->lru_prev) {
+        e->lru_prev->lru_next = e->lru_next;
+    } else {
+        cache->lru_head = e->lru_next;
+    }
+    if(e->lru_next) {
+        e->lru_next->lru_prev = e->lru_prev;
+    } else {
+        cache->lru_tail = e->lru_prev;
+    }
+    e->lru_prev = NULL;
+    e->lru_next = NULL;
+}
+
+static void lru_append(struct rdma_regcache *cache, struct regcache_entry *e) {
+    e->lru_prev = cache->lru_tail;
+    e->lru_next = NULL;
+    if(cache->lru_tail) {
+        cache->lru_tail->lru_next = e;
+    } else {
+        cache->lru_head = e;
+    }
+    cache->lru_tail = e;
+}
+
+// Deregister and free an entry that is neither indexed nor on the LRU list
+static void entry_release(struct rdma_regcache *cache, struct regcache_entry *e) {
+    uint64_t start = rdma_now_ns();
+    if(ibv_dereg_mr(e->mr)) {
+        perror("ibv_dereg_mr");
+    }
+    cache->stats.dereg_ns += rdma_now_ns() - start;
+    cache->pinned -= e->end - e->start;
+    free(e);
+}
+
+// Take index[i] out of the index: idle entries are deregistered right away,
+// held ones once their last holder puts them back
+static void index_drop(struct rdma_regcache *cache, size_t i) {
+    struct regcache_entry *e = cache->index[i];
+
+    memmove(&cache->index[i], &cache->index[i + 1],
+            (cache->count - i - 1) * sizeof(*cache->index));
+    cache->count--;
+    if(e->refs) {
+        e->retired = 1;
+    } else {
+        lru_remove(cache, e);
+        entry_release(cache, e);
+    }
+}
+
+static int index_insert(struct rdma_regcache *cache, size_t i,
+                        struct regcache_entry *e) {
+    if(cache->count == cache->cap) {
+        size_t cap = cache->cap * 2;
+        struct regcache_entry **grown = realloc(cache->index, cap * sizeof(*grown));
+        if(!grown) {
+            perror("realloc");
+            return -1;
+        }
+        cache->index = grown;
+        cache->cap = cap;
+    }
+    memmove(&cache->index[i + 1], &cache->index[i],
+            (cache->count - i) * sizeof(*cache->index));
+    cache->index[i] = e;
+    cache->count++;
+    return 0;
+}
+
+// First entry ending after `addr`. Entries are disjoint, so ends are
+// sorted like starts.
+static size_t index_search(const struct rdma_regcache *cache, uintptr_t addr) {
+    size_t lo = 0;
+    size_t hi = cache->count;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(cache->index[mid]->end <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void index_remove(struct rdma_regcache *cache, struct regcache_entry *e) {
+    size_t i = index_search(cache, e->start);
+    if(i < cache->count && cache->index[i] == e) {
+        index_drop(cache, i);
+    }
+}
+
+struct regcache_entry *rdma_regcache_get(struct rdma_regcache *cache,
+                                         const void *addr, size_t len) {
+    uintptr_t start = (uintptr_t)addr & ~(uintptr_t)(cache->page_size - 1);
+    uintptr_t end = ((uintptr_t)addr + len + cache->page_size - 1) &
+                    ~(uintptr_t)(cache->page_size - 1);
+
+    size_t i = index_search(cache, start);
+    if(i < cache->count && cache->index[i]->start <= start &&
+       cache->index[i]->end >= end) {
+        struct regcache_entry *e = cache->index[i];
+        if(e->refs++ == 0) {
+            lru_remove(cache, e);       // Busy entries are not evictable
+        }
+        cache->stats.hits++;
+        return e;
+    }
+
+    // Miss: register the pages together with every cached registration
+    // they overlap or touch, evicting idle ones until it fits under the cap
+    size_t first;
+    size_t last;
+    uintptr_t ustart;
+    uintptr_t uend;
+    for(;;) {
+        first = index_search(cache, start - 1);
+        ustart = start;
+        uend = end;
+        size_t idle = 0;
+        for(last = first; last < cache->count && cache->index[last]->start <= end; last++) {
+            struct regcache_entry *e = cache->index[last];
+            if(e->start < ustart) {
+                ustart = e->start;
+            }
+            if(e->end > uend) {
+                uend = e->end;
+            }
+            if(e->refs == 0) {
+                idle += e->end - e->start;
+            }
+        }
+
+        if(!cache->max_pinned || cache->pinned - idle + (uend - ustart) <= cache->max_pinned) {
+            break;
+        }
+        if(!cache->lru_head) {
+            fprintf(stderr, "Registering %lu bytes would exceed the %zu byte pin cap\n",
+                    (unsigned long)(uend - ustart), cache->max_pinned);
+            return NULL;
+        }
+        index_remove(cache, cache->lru_head);
+        cache->stats.evictions++;
+    }
+
+    struct regcache_entry *e = calloc(1, sizeof(*e));
+    if(!e) {
+        perror("calloc");
+        return NULL;
+    }
+    uint64_t t0 = rdma_now_ns();
+    e->mr = ibv_reg_mr(cache->pd, (void *)ustart, uend - ustart, cache->access);
+    cache->stats.reg_ns += rdma_now_ns() - t0;
+    if(!e->mr) {
+        perror("ibv_reg_mr");
+        free(e);
+        return NULL;
+    }
+    e->start = ustart;
+    e->end = uend;
+    e->refs = 1;
+    cache->pinned += uend - ustart;
+    cache->stats.misses++;
+
+    // The new registration supersedes the ones it absorbed
+    cache->stats.merges += last - first;
+    while(last > first) {
+        index_drop(cache, --last);
+    }
+    if(index_insert(cache, first, e)) {
+        entry_release(cache, e);
+        return NULL;
+    }
+    return e;
+}
+
+void rdma_regcache_put(struct rdma_regcache *cache, struct regcache_entry *entry) {
+    if(--entry->refs) {
+        return;
+    }
+    if(entry->retired) {
+        entry_release(cache, entry);
+    } else {
+        lru_append(cache, entry);
+    }
+}
+
+void rdma_regcache_invalidate(struct rdma_regcache *cache, const void *addr,
+                              size_t len) {
+    uintptr_t start = (uintptr_t)addr;
+    uintptr_t end = start + len;
+
+    size_t i = index_search(cache, start);
+    while(i < cache->count && cache->index[i]->start < end) {
+        index_drop(cache, i);
+        cache->stats.invalidations++;
+    }
+}
+
+void rdma_regcache_destroy(struct rdma_regcache *cache) {
+    while(cache->count) {
+        struct regcache_entry *e = cache->index[--cache->count];
+        entry_release(cache, e);
+    }
+    free(cache->index);
+    memset(cache, 0, sizeof(*cache));
+}
+
+void regcache_stats_print(const struct rdma_regcache *cache) {
+    const struct regcache_stats *st = &cache->stats;
+    uint64_t lookups = st->hits + st->misses;
+    double reg_us = st->misses ? st->reg_ns / 1000.0 / st->misses : 0;
+
+    printf("Registration cache: %lu lookups, %lu hits (%.1f%%), %lu misses\n",
+           lookups, st->hits, lookups ? 100.0 * st->hits / lookups : 0, st->misses);
+    printf("    %lu merged, %lu evicted, %lu invalidated; %zu entries, %zu bytes pinned\n",
+           st->merges, st->evictions, st->invalidations, cache->count, cache->pinned);
+    printf("    ibv_reg_mr: %.1f us mean, %.1f ms total; about %.1f ms avoided by hits\n",
+           reg_us, st->reg_ns / 1e6, st->hits * reg_us / 1000.0);
+}
@@ -0,0 +1,79 @@
+#ifndef RDMA_REGCACHE_H
+#define RDMA_REGCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <infiniband/verbs.h>
+
+// Pin-down cache: memory registrations of arbitrary user buffers, keyed by
+// address range, so sending from the same heap memory again costs a lookup
+// instead of an ibv_reg_mr.
+//
+// Cached registrations are page-aligned and never overlap, so they are kept
+// in an array sorted by start address and looked up by binary search. A
+// miss registers the requested pages together with every cached
+// registration they overlap or touch, so neighbouring buffers coalesce into
+// one MR. Registrations not in use sit on an LRU list and are evicted from
+// its head while the pinned total would exceed the cap.
+//
+// The cache does not watch the allocator: memory must be handed to
+// rdma_regcache_invalidate before it is freed or unmapped. Not thread-safe;
+// give each thread its own cache.
+
+struct regcache_entry {
+    uintptr_t start;            // Page-aligned [start, end)
+    uintptr_t end;
+    struct ibv_mr *mr;
+    uint32_t refs;              // rdma_regcache_get calls not yet put
+    int retired;                // Out of the index, deregistered on last put
+    struct regcache_entry *lru_prev;    // Idle list, least recently used first
+    struct regcache_entry *lru_next;
+};
+
+struct regcache_stats {
+    uint64_t hits;              // Lookups served by a cached registration
+    uint64_t misses;            // Lookups that had to register
+    uint64_t merges;            // Cached registrations absorbed by a miss
+    uint64_t evictions;         // Idle registrations dropped for the cap
+    uint64_t invalidations;     // Registrations dropped by invalidate
+    uint64_t reg_ns;            // Time spent in ibv_reg_mr
+    uint64_t dereg_ns;          // Time spent in ibv_dereg_mr
+};
+
+struct rdma_regcache {
+    struct ibv_pd *pd;
+    int access;                 // ibv_reg_mr access flags
+    size_t max_pinned;          // Cap on registered bytes (0 = none)
+    size_t pinned;              // Registered bytes, retired entries included
+    size_t page_size;
+    struct regcache_entry **index;  // Sorted by start, disjoint
+    size_t count;
+    size_t cap;
+    struct regcache_entry *lru_head;
+    struct regcache_entry *lru_tail;
+    struct regcache_stats stats;
+};
+
+int rdma_regcache_init(struct rdma_regcache *cache, struct ibv_pd *pd,
+                       int access, size_t max_pinned);
+
+// Deregister everything. Every entry must have been put back.
+void rdma_regcache_destroy(struct rdma_regcache *cache);
+
+// Registration covering [addr, addr + len), registering on a miss. The
+// entry stays registered until it is put back. Returns NULL if it cannot be
+// registered or would not fit under the cap.
+struct regcache_entry *rdma_regcache_get(struct rdma_regcache *cache,
+                                         const void *addr, size_t len);
+
+void rdma_regcache_put(struct rdma_regcache *cache, struct regcache_entry *entry);
+
+// Drop every registration overlapping [addr, addr + len). Call before
+// freeing or unmapping registered memory; entries still held stay valid
+// until their last put.
+void rdma_regcache_invalidate(struct rdma_regcache *cache, const void *addr,
+                              size_t len);
+
+void regcache_stats_print(const struct rdma_regcache *cache);
+
+#endif // RDMA_REGCACHE_H
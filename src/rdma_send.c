@@ -0,0 +1,233 @@
+#include "rdma_send.h"
+#include "rdma_common.h"
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void send_wr_op(struct ibv_qp_ex *qpx, enum rdma_op op, uint32_t rkey,
+                uint64_t addr, __be32 imm) {
+    switch(op) {
+    case RDMA_OP_SEND:
+        ibv_wr_send(qpx);
+        break;
+    case RDMA_OP_SEND_IMM:
+        ibv_wr_send_imm(qpx, imm);
+        break;
+    case RDMA_OP_WRITE_IMM:
+        ibv_wr_rdma_write_imm(qpx, rkey, addr, imm);
+        break;
+    }
+}
+
+// Build one message WR into the open batch. The immediate carries the low
+// 32 bits of the sequence number so the receiver can detect drops (UC) and
+// reordering.
+static void build_one(struct send_window *win, uint64_t iters) {
+    uint64_t seq = win->posted;
+    uint32_t slot = seq % win->depth;
+    struct ibv_qp_ex *qpx = win->qpx;
+
+    if(win->batch_count == 0) {
+        ibv_wr_start(qpx);
+        win->batch_opened_ns = rdma_now_ns();
+    }
+
+    // The last WR is always signaled so the final batch gets retired.
+    // Only signaled WRs are timestamped: they are the ones we see complete.
+    int signaled = (seq + 1) % win->signal_every == 0 || seq + 1 == iters;
+    qpx->wr_id = seq;
+    qpx->wr_flags = signaled ? IBV_SEND_SIGNALED : 0;
+    if(signaled) {
+        win->post_ns[slot] = rdma_now_ns();
+        win->signaled = seq + 1;
+    }
+
+    uint32_t src_slot = win->buf_slots ? seq % win->buf_slots : slot;
+    char *src;
+    uint32_t lkey;
+    if(win->slots) {
+        src = win->slots[src_slot].addr;
+        lkey = win->slots[src_slot].lkey;
+    } else {
+        src = win->buf + (size_t)src_slot * win->msg_size;
+        lkey = win->lkey;
+    }
+    uint64_t dst = win->remote_addr;
+    if(win->remote_slots) {
+        dst += (seq % win->remote_slots) * win->msg_size;
+    }
+    send_wr_op(qpx, win->op, win->remote_rkey, dst, htonl((uint32_t)seq));
+    if(win->msg_size <= win->max_inline) {
+        ibv_wr_set_inline_data(qpx, src, win->msg_size);
+    } else {
+        ibv_wr_set_sge(qpx, lkey, (uintptr_t)src, win->msg_size);
+    }
+
+    win->posted++;
+    win->batch_count++;
+}
+
+// Close the open batch: one ibv_wr_complete rings one doorbell for all of it
+static int flush_batch(struct send_window *win) {
+    if(ibv_wr_complete(win->qpx)) {
+        perror("ibv_wr_complete");
+        return -1;
+    }
+    win->flushed = win->posted;
+    win->signaled_flushed = win->signaled;
+    win->batch_count = 0;
+    win->doorbells++;
+    return 0;
+}
+
+// Decide whether the open batch has to go out now
+static int batch_due(struct send_window *win, uint64_t iters) {
+    if(win->batch_count >= win->batch || win->posted == iters) {
+        return 1;
+    }
+    // Without a signaled WR on the wire no completion will ever free more
+    // slots; unsignaled ones never advance `completed` on their own
+    if(win->completed >= win->signaled_flushed) {
+        return 1;
+    }
+    if(win->batch_timeout_ns == 0) {
+        return 1;
+    }
+    return rdma_now_ns() - win->batch_opened_ns >= win->batch_timeout_ns;
+}
+
+struct ibv_qp *create_qp_ex_inline(struct ibv_context *ctx,
+                                   struct ibv_qp_init_attr_ex *attr) {
+    for(uint32_t want = SEND_MAX_INLINE_PROBE; want > 0; want /= 2) {
+        attr->cap.max_inline_data = want;
+        struct ibv_qp *qp = ibv_create_qp_ex(ctx, attr);
+        if(qp) {
+            // Providers write the granted (possibly rounded up) size back
+            return qp;
+        }
+    }
+
+    attr->cap.max_inline_data = 0;
+    return ibv_create_qp_ex(ctx, attr);
+}
+
+// Per-run state shared with the completion handler
+struct send_run {
+    struct send_window *win;
+    struct send_stats *stats;
+};
+
+// One CQE retires its WR and every unsignaled WR posted before it.
+// With NIC timestamps the software latency splits into the part spent
+// before the NIC completed the WR (wire and remote side) and the part spent
+// before the host noticed (polling).
+static int on_send_completion(void *arg, const struct ibv_wc *wc,
+                              uint64_t nic_ns) {
+    struct send_run *run = arg;
+    struct send_window *win = run->win;
+    uint64_t post = win->post_ns[wc->wr_id % win->depth];
+    uint64_t now = rdma_now_ns();
+
+    hist_record(&run->stats->lat, now - post);
+    if(nic_ns) {
+        hist_record(&run->stats->nic_lat, nic_ns > post ? nic_ns - post : 0);
+        hist_record(&run->stats->poll_lat, now > nic_ns ? now - nic_ns : 0);
+    }
+    win->completed = wc->wr_id + 1;
+    return 0;
+}
+
+int send_window_run(struct send_window *win, uint64_t iters,
+                    struct send_stats *stats) {
+    struct send_run run = { .win = win, .stats = stats };
+
+    memset(stats, 0, sizeof(*stats));
+    hist_init(&stats->lat);
+    hist_init(&stats->nic_lat);
+    hist_init(&stats->poll_lat);
+    win->post_ns = calloc(win->depth, sizeof(*win->post_ns));
+    if(!win->post_ns) {
+        perror("calloc");
+        return -1;
+    }
+    win->posted = 0;
+    win->flushed = 0;
+    win->completed = 0;
+    win->signaled = 0;
+    win->signaled_flushed = 0;
+    win->batch_count = 0;
+    win->doorbells = 0;
+    if(win->batch == 0) {
+        win->batch = 1;
+    }
+
+    // A window with no signaled WR in it would never drain
+    if(win->signal_every == 0 || win->signal_every > win->depth) {
+        win->signal_every = win->depth;
+    }
+
+    uint64_t start = rdma_now_ns();
+    uint64_t cpu_start = rdma_cpu_time_ns();
+    int ret = 0;
+
+    while(win->completed < iters) {
+        // Top the window back up, ringing one doorbell per full batch
+        while(win->posted < iters && win->posted - win->completed < win->depth) {
+            build_one(win, iters);
+            if(win->batch_count >= win->batch && flush_batch(win)) {
+                ret = -1;
+                goto out;
+            }
+        }
+        // A partial batch waits for more window space until it is due
+        if(win->batch_count && batch_due(win, iters)) {
+            if(flush_batch(win)) {
+                ret = -1;
+                goto out;
+            }
+        }
+
+        int n = cq_poller_wait(win->poller, on_send_completion, &run);
+        stats->polls++;
+        if(n < 0) {
+            ret = -1;
+            goto out;
+        }
+        stats->cqes += n;
+    }
+
+    stats->elapsed_ns = rdma_now_ns() - start;
+    stats->cpu_ns = rdma_cpu_time_ns() - cpu_start;
+    stats->msgs = win->completed;
+    stats->bytes = win->completed * win->msg_size;
+    stats->doorbells = win->doorbells;
+out:
+    free(win->post_ns);
+    win->post_ns = NULL;
+    return ret;
+}
+
+void send_stats_print(const struct send_stats *stats, uint32_t msg_size) {
+    double secs = stats->elapsed_ns / 1e9;
+    if(secs <= 0) {
+        secs = 1e-9;
+    }
+    printf("Sent %lu messages of %u bytes in %.6f s\n",
+           stats->msgs, msg_size, secs);
+    printf("    Throughput: %.3f GB/s, %.3f Mmsg/s (%lu polls)\n",
+           stats->bytes / secs / 1e9, stats->msgs / secs / 1e6, stats->polls);
+    if(stats->msgs) {
+        printf("    Completions: %lu CQEs, %.3f per message\n",
+               stats->cqes, (double)stats->cqes / stats->msgs);
+        printf("    Doorbells: %lu, %.3f per message\n",
+               stats->doorbells, (double)stats->doorbells / stats->msgs);
+    }
+    printf("    CPU utilisation: %.1f%% of one core\n",
+           100.0 * stats->cpu_ns / (secs * 1e9));
+    hist_print(&stats->lat, "    Completion latency", 1e-3, "us");
+    if(stats->nic_lat.total) {
+        hist_print(&stats->nic_lat, "    Post to NIC completion", 1e-3, "us");
+        hist_print(&stats->poll_lat, "    NIC completion to poll", 1e-3, "us");
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef RDMA_SEND_H
+#define RDMA_SEND_H
+
+#include <stdint.h>
+#include <infiniband/verbs.h>
+#include "rdma_cq.h"
+#include "rdma_hist.h"
+#include "rdma_slab.h"
+#include "rdma_opts.h"
+
+// Pipelined message sender: RDMA write-with-immediate by default, or with
+// `op` a two-sided send (with or without immediate) into whichever receive
+// buffer the peer posted next, in which case the remote fields are unused.
+// Keeps up to `depth` WRs in flight and tops the window back up as
+// completions arrive, instead of waiting a full round trip per message.
+// Only every `signal_every`-th WR (and the last one) requests a CQE; since
+// send WRs complete in order, that CQE retires every slot up to its wr_id.
+// Payloads of at most `max_inline` bytes are copied into the WQE with
+// ibv_wr_set_inline_data, saving the NIC a DMA read of the source buffer.
+// Up to `batch` WRs are built inside one ibv_wr_start/ibv_wr_complete pair,
+// so they share a single doorbell. A partial batch is flushed once
+// `batch_timeout_ns` has passed since it was opened, or at once if nothing
+// else is in flight.
+struct send_window {
+    struct ibv_qp_ex *qpx;      // Extended QP (created with ibv_create_qp_ex)
+    enum rdma_op op;            // How messages are moved
+    struct cq_poller *poller;   // Completion engine on the send CQ
+    char *buf;                  // Local source buffer: depth slots of msg_size
+    uint32_t buf_slots;         // Source slots if fewer than depth (0 = depth)
+    uint32_t lkey;              // Local key of buf
+    const struct slab_buf *slots;   // Else one source buffer per slot (slab)
+    uint32_t msg_size;          // Bytes per message
+    uint32_t remote_rkey;       // Remote memory region key
+    uint64_t remote_addr;       // Remote buffer address (every write lands here)
+    uint32_t remote_slots;      // Else cycle over this many msg_size slots from it
+    uint32_t depth;             // Max WRs outstanding
+    uint32_t signal_every;      // Signal one WR in N (1 = every WR, <= depth)
+    uint32_t max_inline;        // Inline threshold in bytes (0 = never inline)
+    uint32_t batch;             // Max WRs per doorbell (1 = no batching)
+    uint64_t batch_timeout_ns;  // Flush deadline for a partial batch (0 = none)
+
+    uint64_t posted;            // WRs built (flushed or in the open batch)
+    uint64_t flushed;           // WRs handed to the NIC by ibv_wr_complete
+    uint64_t completed;         // WRs retired by a completion
+    uint64_t signaled;          // One past the last signaled WR built
+    uint64_t signaled_flushed;  // One past the last signaled WR handed to the NIC
+    uint32_t batch_count;       // WRs in the open batch
+    uint64_t batch_opened_ns;   // When the open batch was started
+    uint64_t doorbells;         // ibv_wr_complete calls
+    uint64_t *post_ns;          // Build time of each slot's signaled WR
+};
+
+// Results of a streaming run
+struct send_stats {
+    uint64_t msgs;              // Messages completed
+    uint64_t bytes;             // Payload bytes completed
+    uint64_t elapsed_ns;        // Wall time from first post to last completion
+    uint64_t polls;             // ibv_poll_cq calls (including empty ones)
+    uint64_t cqes;              // Send completions reaped
+    uint64_t doorbells;         // Doorbells rung (ibv_wr_complete calls)
+    uint64_t cpu_ns;            // Process CPU time spent in the run
+    struct rdma_hist lat;       // Post-to-completion latency of signaled WRs (ns)
+    struct rdma_hist nic_lat;   // Post to NIC completion timestamp (ns)
+    struct rdma_hist poll_lat;  // NIC completion timestamp to poll (ns)
+};
+
+// Largest inline size probed for when creating a QP with inline support
+#define SEND_MAX_INLINE_PROBE 1024
+
+// Create an extended QP, asking for as much inline data as the device will
+// grant. Starts at SEND_MAX_INLINE_PROBE and halves until creation succeeds;
+// the granted size is written back to attr->cap.max_inline_data.
+struct ibv_qp *create_qp_ex_inline(struct ibv_context *ctx,
+                                   struct ibv_qp_init_attr_ex *attr);
+
+// Start one message WR on `qpx`, inside ibv_wr_start: a write-with-
+// immediate to (rkey, addr), or a send that needs no remote address.
+// `imm` (network order) goes out with write_imm and send_imm only.
+void send_wr_op(struct ibv_qp_ex *qpx, enum rdma_op op, uint32_t rkey,
+                uint64_t addr, __be32 imm);
+
+// Stream `iters` messages through the window. Returns 0 on success, -1 on
+// a post failure or a completion error.
+int send_window_run(struct send_window *win, uint64_t iters,
+                    struct send_stats *stats);
+
+// Print sustained GB/s and msg/s for a finished run
+void send_stats_print(const struct send_stats *stats, uint32_t msg_size);
+
+#endif // RDMA_SEND_H
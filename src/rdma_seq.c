@@ -0,0 +1,402 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <infiniband/verbs.h>
+#include "rdma_common.h"
+#include "rdma_opts.h"
+#include "rdma_endpoint.h"
+#include "rdma_cq.h"
+#include "rdma_atomic.h"
+
+// Atomics sequencer benchmark.
+// The server registers an array of counters and advertises it in the
+// handshake, then leaves it to its NIC: it only zeroes the counters
+// between points. The client opens -j RC QPs, one client thread each, and
+// for 1, 2, 4 ... -j clients takes -n values per client with
+// fetch-and-add (pipelined -q deep) and with compare-and-swap (one at a
+// time, retrying on a lost race), once with every client on one counter
+// and once with a counter per client. Each row gives the values per
+// second over all clients, the atomics executed per value, per-value
+// latency, and the server CPU time spent meanwhile. After each point the
+// client reads the counters back through the atomics and checks they add
+// up to exactly the values handed out, and that every client's values
+// increased.
+//
+//   server: rdma_seq [options]
+//   client: rdma_seq [-j clients] [-q depth] [-n values] <server_ip>
+
+#define SEQ_DEFAULT_CLIENTS 16
+#define SEQ_MAX_CLIENTS     64
+#define SEQ_DEFAULT_DEPTH   16
+#define SEQ_MAX_DEPTH       128
+#define SEQ_DEFAULT_ITERS   100000      // Values per client per point
+
+// Test parameters the client hands to the server before QPs are created
+struct seq_config {
+    uint32_t max_clients;
+    uint32_t depth;
+    uint64_t iters;
+};
+
+// What goes over the socket, field by field, in rdma_wire's encoding
+static void seq_config_fields(struct rdma_wire_codec *c, void *obj) {
+    struct seq_config *cfg = obj;
+    rdma_wire_u32(c, &cfg->max_clients);
+    rdma_wire_u32(c, &cfg->depth);
+    rdma_wire_u64(c, &cfg->iters);
+}
+
+enum seq_layout {
+    SEQ_CONTENDED,              // Every client on counter 0
+    SEQ_SHARDED,                // Client i on counter i
+};
+
+static const char *seq_layout_str(enum seq_layout layout) {
+    return layout == SEQ_SHARDED ? "sharded" : "contended";
+}
+
+// What the server's CPU did while a point ran
+struct seq_server_result {
+    uint64_t cpu_ns;
+    uint64_t wall_ns;
+};
+
+static void seq_server_result_fields(struct rdma_wire_codec *c, void *obj) {
+    struct seq_server_result *res = obj;
+    rdma_wire_u64(c, &res->cpu_ns);
+    rdma_wire_u64(c, &res->wall_ns);
+}
+
+// One client: a QP with its CQ, driven by a pinned thread
+struct seq_client {
+    struct rdma_endpoint *ep;
+    struct cq_poller poller;
+    struct atomic_window win;
+    int cpu;
+    pthread_t thread;
+
+    // The point being run
+    enum atomic_op op;
+    uint64_t iters;
+    int ret;
+    struct atomic_stats stats;
+};
+
+static void *client_thread(void *arg) {
+    struct seq_client *c = arg;
+
+    if(rdma_pin_self(c->cpu)) {
+        c->ret = -1;
+        return NULL;
+    }
+    c->ret = atomic_window_run(&c->win, c->op, c->iters, &c->stats);
+    return NULL;
+}
+
+// The counter array is described by the server's QP 0
+static uint64_t counter_addr(const struct rdma_endpoint *ep, uint32_t idx) {
+    return ep->remote_addr + (uint64_t)idx * ATOMIC_COUNTER_STRIDE;
+}
+
+// Read the counters back through client 0 and compare them with what the
+// clients were handed
+static int verify_point(struct seq_client *clients, uint32_t n, enum seq_layout layout) {
+    struct atomic_window *win = &clients[0].win;
+    uint32_t ncounters = layout == SEQ_SHARDED ? n : 1;
+    uint64_t saved = win->remote_addr;
+    uint64_t total = 0;
+    int ret = 0;
+
+    for(uint32_t i = 0; i < n; i++) {
+        total += clients[i].stats.values;
+        if(clients[i].stats.disorder) {
+            fprintf(stderr, "Client %u got %lu values out of order\n",
+                    i, clients[i].stats.disorder);
+            ret = -1;
+        }
+    }
+    for(uint32_t i = 0; i < ncounters && ret == 0; i++) {
+        uint64_t value;
+        uint64_t want = layout == SEQ_SHARDED ? clients[i].stats.values : total;
+        win->remote_addr = counter_addr(clients[0].ep, i);
+        ret = atomic_fetch_add_once(win, 0, &value);
+        if(ret == 0 && value != want) {
+            fprintf(stderr, "Counter %u holds %lu after handing out %lu values\n",
+                    i, value, want);
+            ret = -1;
+        }
+    }
+    win->remote_addr = saved;
+    return ret;
+}
+
+static int run_point(struct seq_client *clients, uint32_t n, enum atomic_op op,
+                     enum seq_layout layout, uint64_t iters, int sock) {
+    uint32_t started = 0;
+    int ret = 0;
+
+    for(uint32_t i = 0; i < n; i++) {
+        struct seq_client *c = &clients[i];
+        c->op = op;
+        c->iters = iters;
+        c->ret = 0;
+        c->win.remote_addr = counter_addr(clients[0].ep, layout == SEQ_SHARDED ? i : 0);
+        c->win.expected = 0;        // The server zeroes the counters per point
+    }
+
+    // Once past the barrier the server has zeroed the counters
+    char token = 'P';
+    if(rdma_sock_send(sock, &token, 1) || rdma_sock_barrier(sock)) {
+        return -1;
+    }
+    for(; started < n; started++) {
+        if(pthread_create(&clients[started].thread, NULL, client_thread,
+                          &clients[started])) {
+            perror("pthread_create");
+            ret = -1;
+            break;
+        }
+    }
+    for(uint32_t i = 0; i < started; i++) {
+        pthread_join(clients[i].thread, NULL);
+        if(clients[i].ret) {
+            ret = -1;
+        }
+    }
+    if(ret == 0 && !rdma_stop_requested) {
+        ret = verify_point(clients, n, layout);
+    }
+    if(rdma_sock_barrier(sock)) {
+        ret = -1;
+    }
+    return ret;
+}
+
+static void print_point(struct seq_client *clients, uint32_t n, enum atomic_op op,
+                        enum seq_layout layout, const struct seq_server_result *srv) {
+    struct rdma_hist lat;
+    uint64_t values = 0;
+    uint64_t attempts = 0;
+    uint64_t ns = 0;
+
+    hist_init(&lat);
+    for(uint32_t i = 0; i < n; i++) {
+        const struct atomic_stats *s = &clients[i].stats;
+        values += s->values;
+        attempts += s->attempts;
+        if(s->elapsed_ns > ns) {
+            ns = s->elapsed_ns;
+        }
+        hist_merge(&lat, &s->lat);
+    }
+    printf("%9s %9s %7u %10.3f %9.2f %10.2f %10.2f %10.1f\n",
+           atomic_op_str(op), seq_layout_str(layout), n,
+           ns ? values / (ns / 1e9) / 1e6 : 0,
+           values ? (double)attempts / values : 0,
+           hist_percentile(&lat, 50) / 1e3, hist_percentile(&lat, 99) / 1e3,
+           srv->wall_ns ? 100.0 * srv->cpu_ns / srv->wall_ns : 0);
+    fflush(stdout);
+}
+
+// Zero the counters for each point and stay out of the way
+static int serve(struct rdma_endpoint *counters, int sock) {
+    for(;;) {
+        char token;
+        if(rdma_sock_recv(sock, &token, 1)) {
+            return -1;
+        }
+        if(token == 'D') {
+            return 0;
+        }
+
+        memset(counters->buf, 0, counters->size);
+        if(rdma_sock_barrier(sock)) {
+            return -1;
+        }
+        uint64_t wall_start = rdma_now_ns();
+        uint64_t cpu_start = rdma_cpu_time_ns();
+        if(rdma_sock_barrier(sock)) {
+            return -1;
+        }
+        struct seq_server_result res = {
+            .cpu_ns = rdma_cpu_time_ns() - cpu_start,
+            .wall_ns = rdma_now_ns() - wall_start
+        };
+        if(rdma_wire_send_fields(sock, seq_server_result_fields, &res)) {
+            return -1;
+        }
+    }
+}
+
+static int run_client(const struct seq_config *cfg, struct seq_client *clients, int sock) {
+    printf("%9s %9s %7s %10s %9s %10s %10s %10s\n", "op", "counters", "clients",
+           "Mvalues/s", "ops/value", "p50 us", "p99 us", "server CPU%");
+
+    for(int op = ATOMIC_FETCH_ADD; op <= ATOMIC_CMP_SWP; op++) {
+        for(int layout = SEQ_CONTENDED; layout <= SEQ_SHARDED; layout++) {
+            for(uint32_t n = 1; n <= cfg->max_clients; n *= 2) {
+                struct seq_server_result srv;
+                if(run_point(clients, n, op, layout, cfg->iters, sock) ||
+                   rdma_wire_recv_fields(sock, seq_server_result_fields, &srv)) {
+                    return -1;
+                }
+                if(rdma_stop_requested) {
+                    return -1;
+                }
+                print_point(clients, n, op, layout, &srv);
+            }
+        }
+    }
+
+    char token = 'D';
+    return rdma_sock_send(sock, &token, 1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *server_ip = NULL;
+    struct rdma_opts opts;
+
+    rdma_opts_init(&opts);
+    opts.iters = SEQ_DEFAULT_ITERS;
+    opts.depth = SEQ_DEFAULT_DEPTH;
+    opts.threads = SEQ_DEFAULT_CLIENTS;
+    int ret = rdma_parse_opts(argc, argv, "[server_ip]", &opts);
+    if(ret) {
+        return ret < 0 ? 1 : 0;
+    }
+    if(argc > optind) {
+        server_ip = argv[optind];
+    }
+    if(opts.iters == 0 || opts.threads > SEQ_MAX_CLIENTS || opts.depth > SEQ_MAX_DEPTH) {
+        fprintf(stderr, "Needs -n > 0, at most %d clients and a depth of at most %d\n",
+                SEQ_MAX_CLIENTS, SEQ_MAX_DEPTH);
+        return 1;
+    }
+    if(opts.qp_type != IBV_QPT_RC) {
+        fprintf(stderr, "Atomics need RC\n");
+        return 1;
+    }
+    if(rdma_install_stop_handler()) {
+        return 1;
+    }
+    srand(time(NULL) ^ getpid());
+
+    struct rdma_device dev;
+    if(rdma_device_open(&dev, opts.dev_name, opts.gid_index)) {
+        return 1;
+    }
+    struct rdma_numa numa;
+    if(rdma_numa_init(&numa, dev.name, opts.numa_mode)) {
+        return 1;
+    }
+
+    // The client decides what to measure and tells the server
+    struct seq_config cfg;
+    int sock;
+    if(server_ip) {
+        cfg = (struct seq_config) {
+            .max_clients = opts.threads,
+            .depth = opts.depth,
+            .iters = opts.iters
+        };
+        sock = setup_tcp_client(server_ip, opts.tcp_port);
+        if(sock < 0 || rdma_wire_send_fields(sock, seq_config_fields, &cfg)) {
+            return 1;
+        }
+    } else {
+        int listen_sock = setup_tcp_server(opts.tcp_port);
+        if(listen_sock < 0) {
+            return 1;
+        }
+        sock = accept(listen_sock, NULL, NULL);
+        close(listen_sock);
+        if(sock < 0) {
+            perror("accept");
+            return 1;
+        }
+        if(rdma_wire_recv_fields(sock, seq_config_fields, &cfg)) {
+            return 1;
+        }
+        if(cfg.max_clients == 0 || cfg.max_clients > SEQ_MAX_CLIENTS ||
+           cfg.depth == 0 || cfg.depth > SEQ_MAX_DEPTH || cfg.iters == 0) {
+            fprintf(stderr, "Client sent an invalid test configuration\n");
+            return 1;
+        }
+    }
+
+    // The server's QP 0 holds the counter array, which every QP reaches
+    // through its rkey. Each client's buffer takes the values it fetches.
+    struct rdma_endpoint *eps = calloc(cfg.max_clients, sizeof(*eps));
+    struct seq_client *clients = calloc(cfg.max_clients, sizeof(*clients));
+    if(!eps || !clients) {
+        perror("calloc");
+        return 1;
+    }
+    for(uint32_t i = 0; i < cfg.max_clients; i++) {
+        size_t buf_size = server_ip ? cfg.depth * sizeof(uint64_t) :
+                          i == 0 ? (size_t)cfg.max_clients * ATOMIC_COUNTER_STRIDE : 0;
+        struct rdma_endpoint_attr attr = {
+            .qp_type = IBV_QPT_RC,
+            .buf_size = buf_size,
+            .send_depth = cfg.depth,
+            .recv_depth = 1,
+            .cq_depth = cfg.depth,
+            .numa = &numa,
+            .page = opts.page
+        };
+        if(rdma_endpoint_create(&eps[i], &dev, &attr)) {
+            return 1;
+        }
+    }
+    if(rdma_endpoint_handshake(eps, cfg.max_clients, sock, !server_ip)) {
+        return 1;
+    }
+    if(!(eps[0].caps & RDMA_CAP_ATOMIC)) {
+        fprintf(stderr, "Remote atomics are unavailable (%s here)\n",
+                atomic_cap_str(dev.attr.atomic_cap));
+        return 1;
+    }
+
+    printf("Atomics sequencer over up to %u RC QPs on %s (GID index %d), %s\n",
+           cfg.max_clients, dev.name, dev.gid_index, atomic_cap_str(dev.attr.atomic_cap));
+    printf("%lu values per client per point, fetch_add %u deep\n", cfg.iters, cfg.depth);
+
+    if(server_ip) {
+        for(uint32_t i = 0; i < cfg.max_clients; i++) {
+            struct seq_client *c = &clients[i];
+            c->ep = &eps[i];
+            c->cpu = rdma_numa_cpu(&numa, i);
+            if(cq_poller_init(&c->poller, eps[i].cq, opts.poll_batch)) {
+                return 1;
+            }
+            c->win = (struct atomic_window) {
+                .qpx = eps[i].qpx,
+                .poller = &c->poller,
+                .results = (uint64_t *)eps[i].buf,
+                .lkey = eps[i].mr->lkey,
+                .remote_rkey = eps[0].remote_rkey,
+                .depth = cfg.depth
+            };
+        }
+        ret = run_client(&cfg, clients, sock);
+        for(uint32_t i = 0; i < cfg.max_clients; i++) {
+            cq_poller_destroy(&clients[i].poller);
+        }
+    } else {
+        ret = serve(&eps[0], sock);
+    }
+
+    close(sock);
+    for(uint32_t i = 0; i < cfg.max_clients; i++) {
+        rdma_endpoint_destroy(&eps[i]);
+    }
+    free(clients);
+    free(eps);
+    rdma_numa_destroy(&numa);
+    rdma_device_close(&dev);
+    return ret ? 1 : 0;
+}
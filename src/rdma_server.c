@@ -0,0 +1,698 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include <infiniband/verbs.h>
+#include "rdma_common.h"
+#include "rdma_opts.h"
+#include "rdma_endpoint.h"
+#include "rdma_srq.h"
+#include "rdma_cq.h"
+#include "rdma_hist.h"
+
+// Multi-client receiver.
+// The server accepts senders concurrently from one epoll loop: the
+// connection info exchange runs as a small non-blocking state machine per
+// client, so a slow client never holds up the others. Every client gets
+// an RC QP attached to one shared CQ and one SRQ, and a landing slot in a
+// shared registered buffer. The server stays up as clients come and go,
+// tearing a client's QP down when its TCP connection closes, and reports
+// connections set up per second, setup latency and the message rate.
+//
+//   server: rdma_server [-q srq_depth] [-P port]
+//   client: rdma_server [-j conns] [-n rounds] [-s bytes] <server_ip>
+//
+// The client is a load generator: each round it connects -j QPs one after
+// another, streams writes with immediate round robin over all of them and
+// disconnects them again.
+
+#define SERVER_MAX_CLIENTS    1024
+#define SERVER_LANDING_BYTES  4096      // Per client; messages must fit
+#define SERVER_SRQ_DEPTH      4096
+#define SERVER_MAX_EVENTS     64
+#define SERVER_REPORT_NS      1000000000ULL
+
+// Longest client description accepted: one QP and one MR, with room for
+// records a later rdma_wire version has grown
+#define SERVER_WIRE_MAX       256
+
+// epoll tags that are not client slots
+#define SERVER_EV_LISTEN      UINT64_MAX
+#define SERVER_EV_CQ          (UINT64_MAX - 1)
+#define SERVER_EV_ASYNC       (UINT64_MAX - 2)
+
+#define CHURN_DEFAULT_CONNS   16
+#define CHURN_DEFAULT_ROUNDS  10
+#define CHURN_DEFAULT_SIZE    64
+#define CHURN_MSGS_PER_CONN   1000
+#define CHURN_TX_DEPTH        16
+
+enum client_state {
+    CLIENT_FREE,
+    CLIENT_SENDING,             // Writing our rdma_conn_info
+    CLIENT_RECEIVING,           // Reading the client's
+    CLIENT_CONNECTED,           // QP at RTS; waiting for the client to leave
+};
+
+struct server_client {
+    enum client_state state;
+    int fd;
+    struct rdma_endpoint ep;
+    uint8_t local[SERVER_WIRE_MAX];   // Our rdma_wire description
+    size_t local_len;
+    uint8_t remote[SERVER_WIRE_MAX];  // The client's, as it arrives
+    uint32_t remote_len;        // Known once its prefix is in (0: not yet)
+    size_t done;                // Bytes of the current message sent or read
+    uint64_t accept_ns;
+};
+
+struct server {
+    struct rdma_device *dev;
+    int epfd;
+    int listen_fd;
+    struct ibv_comp_channel *channel;
+    struct ibv_cq *cq;
+    struct cq_poller poller;
+    struct rdma_srq srq;
+    struct rdma_mem landing;    // SERVER_LANDING_BYTES per client slot
+    struct ibv_mr *landing_mr;
+    struct server_client *clients;
+    uint32_t *free_slots;
+    uint32_t nfree;
+
+    uint64_t accepted;
+    uint64_t connected;
+    uint64_t departed;
+    uint64_t rejected;          // No free slot, or setup failed
+    uint64_t msgs;
+    struct rdma_hist setup;     // Accept to RTS (ns)
+
+    uint64_t start_ns;
+    uint64_t report_ns;         // Start of the current report interval
+    uint64_t report_connected;
+    uint64_t report_msgs;
+};
+
+static int epoll_set(struct server *srv, int op, int fd, uint32_t events, uint64_t tag) {
+    struct epoll_event ev = { .events = events, .data.u64 = tag };
+    if(epoll_ctl(srv->epfd, op, fd, &ev)) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+static void client_drop(struct server *srv, uint32_t idx, int departed) {
+    struct server_client *c = &srv->clients[idx];
+
+    close(c->fd);               // Also takes it out of the epoll set
+    rdma_endpoint_destroy(&c->ep);
+    if(departed) {
+        srv->departed++;
+    } else {
+        srv->rejected++;
+    }
+    c->state = CLIENT_FREE;
+    srv->free_slots[srv->nfree++] = idx;
+}
+
+// Move a client's exchange along as far as its socket allows. Returns -1
+// if the client has to go.
+static int client_progress(struct server *srv, uint32_t idx) {
+    struct server_client *c = &srv->clients[idx];
+
+    if(c->state == CLIENT_SENDING) {
+        while(c->done < c->local_len) {
+            ssize_t n = send(c->fd, c->local + c->done, c->local_len - c->done,
+                             MSG_NOSIGNAL);
+            if(n < 0) {
+                return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+            }
+            c->done += n;
+        }
+        c->state = CLIENT_RECEIVING;
+        c->done = 0;
+        c->remote_len = 0;
+        if(epoll_set(srv, EPOLL_CTL_MOD, c->fd, EPOLLIN, idx)) {
+            return -1;
+        }
+    }
+
+    if(c->state == CLIENT_RECEIVING) {
+        // The length prefix first, then the rest of the message
+        for(;;) {
+            size_t want = c->remote_len ? c->remote_len : RDMA_WIRE_PREFIX_LEN;
+            if(c->done == want && c->remote_len) {
+                break;
+            }
+            if(c->done == want) {
+                if(rdma_wire_msg_len(c->remote, &c->remote_len) ||
+                   c->remote_len > SERVER_WIRE_MAX) {
+                    return -1;
+                }
+                continue;
+            }
+            ssize_t n = recv(c->fd, c->remote + c->done, want - c->done, 0);
+            if(n == 0) {
+                return -1;
+            }
+            if(n < 0) {
+                return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+            }
+            c->done += n;
+        }
+
+        struct rdma_wire_msg msg;
+        struct rdma_conn_info remote;
+        struct rdma_qp_params params;
+        if(rdma_wire_decode(&msg, c->remote, c->remote_len)) {
+            return -1;
+        }
+        int ret = msg.nqps == 1 ? 0 : -1;
+        if(ret == 0) {
+            rdma_wire_to_conn_info(&msg.qps[0], NULL, &remote);
+            rdma_endpoint_negotiate(&c->ep, &msg.qps[0], msg.version, &params);
+            c->ep.caps = msg.caps & rdma_endpoint_caps(&c->ep);
+        }
+        rdma_wire_msg_free(&msg);
+        if(ret || rdma_endpoint_connect(&c->ep, &remote, &params)) {
+            return -1;
+        }
+        c->state = CLIENT_CONNECTED;
+        srv->connected++;
+        hist_record(&srv->setup, rdma_now_ns() - c->accept_ns);
+        return 0;
+    }
+
+    // Connected clients only ever close their end
+    char buf[64];
+    ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+    if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        return -1;
+    }
+    return 0;
+}
+
+static void accept_clients(struct server *srv) {
+    for(;;) {
+        int fd = accept4(srv->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if(fd < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept4");
+            }
+            return;
+        }
+        srv->accepted++;
+        if(srv->nfree == 0) {
+            close(fd);
+            srv->rejected++;
+            continue;
+        }
+
+        uint32_t idx = srv->free_slots[--srv->nfree];
+        struct server_client *c = &srv->clients[idx];
+        struct rdma_endpoint_attr attr = {
+            .qp_type = IBV_QPT_RC,
+            .send_depth = 1,
+            .shared_cq = srv->cq,
+            .srq = srv->srq.srq
+        };
+        c->fd = fd;
+        c->accept_ns = rdma_now_ns();
+        c->done = 0;
+        c->state = CLIENT_SENDING;
+        if(rdma_endpoint_create(&c->ep, srv->dev, &attr)) {
+            close(fd);
+            c->state = CLIENT_FREE;
+            srv->free_slots[srv->nfree++] = idx;
+            srv->rejected++;
+            continue;
+        }
+
+        // The client writes into its own slot of the shared landing buffer
+        struct rdma_qp_desc qp;
+        struct rdma_mr_desc mr;
+        rdma_endpoint_describe(&c->ep, &qp, &mr);
+        mr = (struct rdma_mr_desc) {
+            .addr = (uintptr_t)srv->landing.addr + (uint64_t)idx * SERVER_LANDING_BYTES,
+            .len = SERVER_LANDING_BYTES,
+            .rkey = srv->landing_mr->rkey
+        };
+        struct rdma_wire_msg msg = {
+            .version = RDMA_WIRE_VERSION,
+            .caps = RDMA_CAP_REMOTE_WRITE,
+            .nqps = 1,
+            .nmrs = 1,
+            .qps = &qp,
+            .mrs = &mr
+        };
+        c->local_len = rdma_wire_encode(&msg, c->local, sizeof(c->local));
+
+        if(epoll_set(srv, EPOLL_CTL_ADD, fd, EPOLLIN | EPOLLOUT, idx) ||
+           client_progress(srv, idx)) {
+            client_drop(srv, idx, 0);
+        }
+    }
+}
+
+static int on_recv_completion(void *arg, const struct ibv_wc *wc, uint64_t nic_ns) {
+    struct server *srv = arg;
+    (void)nic_ns;
+
+    srv->msgs++;
+    return rdma_srq_consumed(&srv->srq, wc->wr_id);
+}
+
+// Take the CQ event, re-arm and drain everything that is there
+static int drain_cq(struct server *srv) {
+    struct ibv_cq *cq;
+    void *cq_ctx;
+
+    if(ibv_get_cq_event(srv->channel, &cq, &cq_ctx)) {
+        return errno == EAGAIN ? 0 : -1;
+    }
+    ibv_ack_cq_events(cq, 1);
+    if(ibv_req_notify_cq(cq, 0)) {
+        perror("ibv_req_notify_cq");
+        return -1;
+    }
+    int n;
+    while((n = cq_poller_poll(&srv->poller, on_recv_completion, srv)) > 0) {
+    }
+    return n;
+}
+
+static uint32_t active_clients(const struct server *srv) {
+    return SERVER_MAX_CLIENTS - srv->nfree;
+}
+
+static void report(struct server *srv, uint64_t now) {
+    double secs = (now - srv->report_ns) / 1e9;
+    uint64_t connected = srv->connected - srv->report_connected;
+    uint64_t msgs = srv->msgs - srv->report_msgs;
+
+    if(connected || msgs) {
+        printf("[%7.1f s] %4u clients, +%lu connected (%.0f conn/s), %lu departed, "
+               "%.3f Mmsg/s\n", (now - srv->start_ns) / 1e9, active_clients(srv),
+               connected, connected / secs, srv->departed, msgs / secs / 1e6);
+        fflush(stdout);
+    }
+    srv->report_ns = now;
+    srv->report_connected = srv->connected;
+    srv->report_msgs = srv->msgs;
+}
+
+static int server_init(struct server *srv, struct rdma_device *dev, uint32_t srq_depth,
+                       int port) {
+    memset(srv, 0, sizeof(*srv));
+    srv->dev = dev;
+    srv->epfd = -1;
+    srv->listen_fd = -1;
+    hist_init(&srv->setup);
+
+    srv->clients = calloc(SERVER_MAX_CLIENTS, sizeof(*srv->clients));
+    srv->free_slots = calloc(SERVER_MAX_CLIENTS, sizeof(*srv->free_slots));
+    if(!srv->clients || !srv->free_slots) {
+        perror("calloc");
+        return -1;
+    }
+    for(uint32_t i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        srv->free_slots[srv->nfree++] = SERVER_MAX_CLIENTS - 1 - i;
+    }
+
+    if(rdma_mem_alloc(&srv->landing, (size_t)SERVER_MAX_CLIENTS * SERVER_LANDING_BYTES,
+                      RDMA_PAGE_BASE, NULL)) {
+        return -1;
+    }
+    srv->landing_mr = rdma_mem_reg(&srv->landing, dev->pd,
+                                   IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    if(!srv->landing_mr) {
+        return -1;
+    }
+
+    // One CQ for every client: a receive completion per SRQ WR at most
+    srv->channel = ibv_create_comp_channel(dev->ctx);
+    if(!srv->channel) {
+        perror("ibv_create_comp_channel");
+        return -1;
+    }
+    srv->cq = ibv_create_cq(dev->ctx, srq_depth, NULL, srv->channel, 0);
+    if(!srv->cq) {
+        perror("ibv_create_cq");
+        return -1;
+    }
+    if(cq_poller_init(&srv->poller, srv->cq, CQ_POLL_BATCH_MAX) ||
+       ibv_req_notify_cq(srv->cq, 0)) {
+        return -1;
+    }
+    int flags = fcntl(srv->channel->fd, F_GETFL);
+    if(flags < 0 || fcntl(srv->channel->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        return -1;
+    }
+
+    // Writes with immediate need receive WRs but no buffers behind them
+    if(rdma_srq_create(&srv->srq, dev->ctx, dev->pd, NULL, 0, srq_depth, 0) ||
+       rdma_srq_fill(&srv->srq)) {
+        return -1;
+    }
+
+    srv->listen_fd = rdma_tcp_listen(port, SOMAXCONN);
+    if(srv->listen_fd < 0) {
+        return -1;
+    }
+    flags = fcntl(srv->listen_fd, F_GETFL);
+    if(flags < 0 || fcntl(srv->listen_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        return -1;
+    }
+
+    srv->epfd = epoll_create1(0);
+    if(srv->epfd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    if(epoll_set(srv, EPOLL_CTL_ADD, srv->listen_fd, EPOLLIN, SERVER_EV_LISTEN) ||
+       epoll_set(srv, EPOLL_CTL_ADD, srv->channel->fd, EPOLLIN, SERVER_EV_CQ) ||
+       epoll_set(srv, EPOLL_CTL_ADD, dev->ctx->async_fd, EPOLLIN, SERVER_EV_ASYNC)) {
+        return -1;
+    }
+    return 0;
+}
+
+static void server_destroy(struct server *srv) {
+    for(uint32_t i = 0; srv->clients && i < SERVER_MAX_CLIENTS; i++) {
+        if(srv->clients[i].state != CLIENT_FREE) {
+            client_drop(srv, i, 1);
+        }
+    }
+    if(srv->epfd >= 0) {
+        close(srv->epfd);
+    }
+    if(srv->listen_fd >= 0) {
+        close(srv->listen_fd);
+    }
+    if(srv->srq.srq) {
+        rdma_srq_destroy(&srv->srq);
+    }
+    cq_poller_destroy(&srv->poller);
+    if(srv->cq) {
+        ibv_destroy_cq(srv->cq);
+    }
+    if(srv->channel) {
+        ibv_destroy_comp_channel(srv->channel);
+    }
+    if(srv->landing_mr) {
+        ibv_dereg_mr(srv->landing_mr);
+    }
+    rdma_mem_free(&srv->landing);
+    free(srv->clients);
+    free(srv->free_slots);
+}
+
+static int run_server(struct rdma_device *dev, uint32_t srq_depth, int port) {
+    struct server srv;
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    int ret = 0;
+
+    if(server_init(&srv, dev, srq_depth, port)) {
+        server_destroy(&srv);
+        return -1;
+    }
+    printf("Serving up to %d clients on port %d: RC QPs on one CQ and a %u-WR SRQ\n",
+           SERVER_MAX_CLIENTS, port, srq_depth);
+    fflush(stdout);
+    srv.start_ns = srv.report_ns = rdma_now_ns();
+
+    while(!rdma_stop_requested && ret == 0) {
+        int n = epoll_wait(srv.epfd, events, SERVER_MAX_EVENTS,
+                           SERVER_REPORT_NS / 1000000);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            ret = -1;
+            break;
+        }
+
+        for(int i = 0; i < n && ret == 0; i++) {
+            uint64_t tag = events[i].data.u64;
+            if(tag == SERVER_EV_LISTEN) {
+                accept_clients(&srv);
+            } else if(tag == SERVER_EV_CQ) {
+                ret = drain_cq(&srv) < 0 ? -1 : 0;
+            } else if(tag == SERVER_EV_ASYNC) {
+                ret = rdma_srq_poll_events(&srv.srq, 0) < 0 ? -1 : 0;
+            } else if(srv.clients[tag].state != CLIENT_FREE &&
+                      client_progress(&srv, (uint32_t)tag)) {
+                uint32_t idx = (uint32_t)tag;
+                client_drop(&srv, idx, srv.clients[idx].state == CLIENT_CONNECTED);
+            }
+        }
+
+        // Reposts waiting on an SRQ event that has since come in
+        if(rdma_srq_is_low(&srv.srq) && srv.srq.nfree && rdma_srq_replenish(&srv.srq)) {
+            ret = -1;
+        }
+
+        uint64_t now = rdma_now_ns();
+        if(now - srv.report_ns >= SERVER_REPORT_NS) {
+            report(&srv, now);
+        }
+    }
+
+    double secs = (rdma_now_ns() - srv.start_ns) / 1e9;
+    printf("Accepted %lu, connected %lu (%.1f conn/s over %.1f s), departed %lu, "
+           "rejected %lu, %lu messages\n", srv.accepted, srv.connected,
+           srv.connected / secs, secs, srv.departed, srv.rejected, srv.msgs);
+    printf("    SRQ: %lu watermark events, %lu forced reposts, %lu post calls\n",
+           srv.srq.limit_events, srv.srq.forced, srv.srq.post_calls);
+    if(srv.setup.total) {
+        hist_print(&srv.setup, "    Accept to RTS", 1e-3, "us");
+    }
+    server_destroy(&srv);
+    return ret;
+}
+
+// One connection of the load generator
+struct churn_conn {
+    int fd;
+    struct rdma_endpoint ep;
+    uint32_t outstanding;
+};
+
+struct churn {
+    struct rdma_device *dev;
+    const char *server_ip;
+    int port;
+    uint32_t nconns;
+    uint32_t msg_size;
+    struct churn_conn *conns;
+    struct ibv_cq *cq;
+    struct cq_poller poller;
+    struct rdma_mem src;
+    struct ibv_mr *src_mr;
+    uint64_t completed;
+    struct rdma_hist setup;     // Connect to RTS (ns)
+};
+
+static int churn_connect(struct churn *ch, struct churn_conn *conn) {
+    uint64_t t0 = rdma_now_ns();
+    struct rdma_endpoint_attr attr = {
+        .qp_type = IBV_QPT_RC,
+        .send_depth = CHURN_TX_DEPTH,
+        .recv_depth = 1,
+        .shared_cq = ch->cq
+    };
+
+    conn->fd = rdma_tcp_connect(ch->server_ip, ch->port);
+    if(conn->fd < 0) {
+        return -1;
+    }
+    // The server sends first, as with exchange_conn_info_as_sender
+    if(rdma_endpoint_create(&conn->ep, ch->dev, &attr) ||
+       rdma_endpoint_handshake(&conn->ep, 1, conn->fd, 0)) {
+        return -1;
+    }
+    hist_record(&ch->setup, rdma_now_ns() - t0);
+    return 0;
+}
+
+static int on_send_completion(void *arg, const struct ibv_wc *wc, uint64_t nic_ns) {
+    struct churn *ch = arg;
+    (void)nic_ns;
+
+    ch->conns[wc->wr_id].outstanding--;
+    ch->completed++;
+    return 0;
+}
+
+// Writes with immediate round robin over every connection
+static int churn_stream(struct churn *ch, uint64_t iters) {
+    uint64_t posted = 0;
+
+    ch->completed = 0;
+    while(ch->completed < iters) {
+        for(uint32_t i = 0; i < ch->nconns && posted < iters; i++) {
+            struct churn_conn *conn = &ch->conns[i];
+            struct ibv_qp_ex *qpx = conn->ep.qpx;
+            if(conn->outstanding == CHURN_TX_DEPTH) {
+                continue;
+            }
+            ibv_wr_start(qpx);
+            while(conn->outstanding < CHURN_TX_DEPTH && posted < iters) {
+                qpx->wr_id = i;
+                qpx->wr_flags = IBV_SEND_SIGNALED;
+                ibv_wr_rdma_write_imm(qpx, conn->ep.remote_rkey, conn->ep.remote_addr,
+                                      htonl((uint32_t)posted));
+                ibv_wr_set_sge(qpx, ch->src_mr->lkey, (uintptr_t)ch->src.addr,
+                               ch->msg_size);
+                conn->outstanding++;
+                posted++;
+            }
+            if(ibv_wr_complete(qpx)) {
+                fprintf(stderr, "ibv_wr_complete failed\n");
+                return -1;
+            }
+        }
+        if(cq_poller_poll(&ch->poller, on_send_completion, ch) < 0 || rdma_stop_requested) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void churn_disconnect(struct churn *ch) {
+    for(uint32_t i = 0; i < ch->nconns; i++) {
+        struct churn_conn *conn = &ch->conns[i];
+        if(conn->fd >= 0) {
+            close(conn->fd);
+        }
+        rdma_endpoint_destroy(&conn->ep);
+        conn->fd = -1;
+        conn->outstanding = 0;
+    }
+}
+
+static int run_client(struct rdma_device *dev, const char *server_ip, int port,
+                      uint32_t nconns, uint32_t rounds, uint32_t msg_size) {
+    struct churn ch = {
+        .dev = dev,
+        .server_ip = server_ip,
+        .port = port,
+        .nconns = nconns,
+        .msg_size = msg_size
+    };
+    int ret = -1;
+
+    hist_init(&ch.setup);
+    ch.conns = calloc(nconns, sizeof(*ch.conns));
+    ch.cq = ibv_create_cq(dev->ctx, nconns * CHURN_TX_DEPTH, NULL, NULL, 0);
+    if(!ch.conns || !ch.cq) {
+        perror(ch.conns ? "ibv_create_cq" : "calloc");
+        goto out;
+    }
+    for(uint32_t i = 0; i < nconns; i++) {
+        ch.conns[i].fd = -1;
+    }
+    if(cq_poller_init(&ch.poller, ch.cq, CQ_POLL_BATCH_DEFAULT) ||
+       rdma_mem_alloc(&ch.src, msg_size, RDMA_PAGE_BASE, NULL)) {
+        goto out;
+    }
+    ch.src_mr = rdma_mem_reg(&ch.src, dev->pd, IBV_ACCESS_LOCAL_WRITE);
+    if(!ch.src_mr) {
+        goto out;
+    }
+
+    printf("%u rounds of %u connections to %s:%d, %d %u-byte writes each\n",
+           rounds, nconns, server_ip, port, CHURN_MSGS_PER_CONN, msg_size);
+    for(uint32_t r = 0; r < rounds && !rdma_stop_requested; r++) {
+        uint64_t t0 = rdma_now_ns();
+        for(uint32_t i = 0; i < nconns; i++) {
+            if(churn_connect(&ch, &ch.conns[i])) {
+                goto out;
+            }
+        }
+        uint64_t t1 = rdma_now_ns();
+        if(churn_stream(&ch, (uint64_t)nconns * CHURN_MSGS_PER_CONN)) {
+            goto out;
+        }
+        uint64_t t2 = rdma_now_ns();
+        churn_disconnect(&ch);
+
+        printf("Round %u: %u connections in %.2f ms (%.0f conn/s), %.3f Mmsg/s\n",
+               r, nconns, (t1 - t0) / 1e6, nconns / ((t1 - t0) / 1e9),
+               ch.completed / ((t2 - t1) / 1e9) / 1e6);
+        fflush(stdout);
+    }
+    hist_print(&ch.setup, "Connect to RTS", 1e-3, "us");
+    ret = 0;
+
+out:
+    if(ch.conns) {
+        churn_disconnect(&ch);
+    }
+    cq_poller_destroy(&ch.poller);
+    if(ch.cq) {
+        ibv_destroy_cq(ch.cq);
+    }
+    if(ch.src_mr) {
+        ibv_dereg_mr(ch.src_mr);
+    }
+    rdma_mem_free(&ch.src);
+    free(ch.conns);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    const char *server_ip = NULL;
+    struct rdma_opts opts;
+
+    rdma_opts_init(&opts);
+    opts.iters = CHURN_DEFAULT_ROUNDS;
+    opts.depth = SERVER_SRQ_DEPTH;
+    opts.threads = CHURN_DEFAULT_CONNS;
+    int ret = rdma_parse_opts(argc, argv, "[server_ip]", &opts);
+    if(ret) {
+        return ret < 0 ? 1 : 0;
+    }
+    if(argc > optind) {
+        server_ip = argv[optind];
+    }
+    if(opts.qp_type != IBV_QPT_RC) {
+        fprintf(stderr, "The server attaches every QP to an SRQ, which needs RC\n");
+        return 1;
+    }
+    uint32_t msg_size = opts.msg_size ? opts.msg_size : CHURN_DEFAULT_SIZE;
+    if(msg_size > SERVER_LANDING_BYTES || opts.threads > SERVER_MAX_CLIENTS ||
+       opts.iters == 0 || opts.iters > UINT32_MAX) {
+        fprintf(stderr, "Needs -s up to %d, -j up to %d and -n > 0\n",
+                SERVER_LANDING_BYTES, SERVER_MAX_CLIENTS);
+        return 1;
+    }
+    if(rdma_install_stop_handler()) {
+        return 1;
+    }
+    srand(time(NULL) ^ getpid());
+
+    struct rdma_device dev;
+    if(rdma_device_open(&dev, opts.dev_name, opts.gid_index)) {
+        return 1;
+    }
+    if(server_ip) {
+        ret = run_client(&dev, server_ip, opts.tcp_port, opts.threads,
+                         (uint32_t)opts.iters, msg_size);
+    } else {
+        ret = run_server(&dev, opts.depth, opts.tcp_port);
+    }
+    rdma_device_close(&dev);
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,337 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <infiniband/verbs.h>
+#include "rdma_common.h"
+#include "rdma_opts.h"
+#include "rdma_endpoint.h"
+#include "rdma_cm.h"
+#include "rdma_hist.h"
+
+// Connection-setup benchmark.
+// The client connects -j RC QPs to the server one after another, then
+// tears them all down, for -n rounds: once over the TCP exchange and once
+// through rdma_cm. Each connection is timed from nothing to an RTS QP
+// with the peer's rkey in hand, which covers the socket or address and
+// route resolution, creating the CQ, buffer and QP, the exchange, and the
+// RTR/RTS transitions. The wire part (everything but creating the
+// endpoint) is also reported on its own, as that is what differs.
+//
+//   server: rdma_setup [options]
+//   client: rdma_setup [-j conns] [-n rounds] <server_ip>
+//
+// rdma_cm rows are skipped when either side was built without librdmacm.
+
+#define SETUP_DEFAULT_CONNS   64
+#define SETUP_DEFAULT_ROUNDS  5
+#define SETUP_MAX_CONNS       4096
+#define SETUP_BUF_SIZE        4096
+#define SETUP_QUEUE_DEPTH     16
+
+// The TCP path's QP connections arrive here, clear of the rdma_cm port
+#define SETUP_TCP_PORT_OFFSET 2
+
+// Test parameters the client hands to the server, and back with the modes
+// both sides support
+struct setup_config {
+    uint32_t nconns;
+    uint32_t rounds;
+    uint32_t modes;             // Bit per enum rdma_conn_mode
+};
+
+// What goes over the socket, field by field, in rdma_wire's encoding
+static void setup_config_fields(struct rdma_wire_codec *c, void *obj) {
+    struct setup_config *cfg = obj;
+    rdma_wire_u32(c, &cfg->nconns);
+    rdma_wire_u32(c, &cfg->rounds);
+    rdma_wire_u32(c, &cfg->modes);
+}
+
+// One connection and the state that goes with each path
+struct setup_conn {
+    struct rdma_endpoint ep;
+    int fd;                     // RDMA_CONN_TCP
+    struct rdma_cm_conn cm;     // RDMA_CONN_CM
+};
+
+struct setup_run {
+    enum rdma_conn_mode mode;
+    const struct setup_config *cfg;
+    const struct rdma_opts *opts;
+    const char *server_ip;      // NULL on the server
+    struct rdma_device *dev;    // Opened, or attached to rdma_cm's context
+    int dev_ready;
+    int data_listen;            // Server, RDMA_CONN_TCP
+    struct rdma_cm_listener listener; // Server, RDMA_CONN_CM
+    struct setup_conn *conns;
+    struct rdma_hist total;     // Per connection, ns
+    struct rdma_hist wire;      // The same minus creating the endpoint
+};
+
+static int create_endpoint(struct setup_run *run, struct setup_conn *conn,
+                           struct ibv_context *verbs, uint64_t *create_ns) {
+    struct rdma_endpoint_attr attr = {
+        .qp_type = IBV_QPT_RC,
+        .buf_size = SETUP_BUF_SIZE,
+        .send_depth = SETUP_QUEUE_DEPTH,
+        .recv_depth = SETUP_QUEUE_DEPTH,
+        .cq_depth = 2 * SETUP_QUEUE_DEPTH,
+        .page = run->opts->page
+    };
+
+    // rdma_cm hands out one context per device; the first connection
+    // decides which
+    if(!run->dev_ready) {
+        int ret = verbs ? rdma_device_attach(run->dev, verbs, run->opts->gid_index) :
+                          rdma_device_open(run->dev, run->opts->dev_name,
+                                           run->opts->gid_index);
+        if(ret) {
+            return -1;
+        }
+        run->dev_ready = 1;
+    } else if(verbs && verbs != run->dev->ctx) {
+        fprintf(stderr, "rdma_cm resolved connections to different devices\n");
+        return -1;
+    }
+
+    uint64_t t0 = rdma_now_ns();
+    if(rdma_endpoint_create(&conn->ep, run->dev, &attr)) {
+        return -1;
+    }
+    *create_ns = rdma_now_ns() - t0;
+    return 0;
+}
+
+static int connect_one(struct setup_run *run, struct setup_conn *conn) {
+    int port = run->opts->tcp_port;
+    uint64_t create_ns;
+    uint64_t t0 = rdma_now_ns();
+
+    if(run->mode == RDMA_CONN_CM) {
+        if(rdma_cm_resolve(&conn->cm, run->server_ip, port + RDMA_CM_PORT_OFFSET) ||
+           create_endpoint(run, conn, conn->cm.verbs, &create_ns) ||
+           rdma_cm_connect(&conn->cm, &conn->ep)) {
+            return -1;
+        }
+    } else {
+        conn->fd = rdma_tcp_connect(run->server_ip, port + SETUP_TCP_PORT_OFFSET);
+        if(conn->fd < 0 ||
+           create_endpoint(run, conn, NULL, &create_ns) ||
+           rdma_endpoint_handshake(&conn->ep, 1, conn->fd, 0)) {
+            return -1;
+        }
+    }
+
+    uint64_t elapsed = rdma_now_ns() - t0;
+    hist_record(&run->total, elapsed);
+    hist_record(&run->wire, elapsed - create_ns);
+    return 0;
+}
+
+static int accept_one(struct setup_run *run, struct setup_conn *conn) {
+    uint64_t create_ns;
+
+    if(run->mode == RDMA_CONN_CM) {
+        return rdma_cm_get_request(&run->listener, &conn->cm) ||
+               create_endpoint(run, conn, conn->cm.verbs, &create_ns) ||
+               rdma_cm_accept(&conn->cm, &conn->ep) ? -1 : 0;
+    }
+
+    conn->fd = accept(run->data_listen, NULL, NULL);
+    if(conn->fd < 0) {
+        perror("accept");
+        return -1;
+    }
+    return create_endpoint(run, conn, NULL, &create_ns) ||
+           rdma_endpoint_handshake(&conn->ep, 1, conn->fd, 1) ? -1 : 0;
+}
+
+static void disconnect_all(struct setup_run *run) {
+    for(uint32_t i = 0; i < run->cfg->nconns; i++) {
+        struct setup_conn *conn = &run->conns[i];
+        rdma_cm_disconnect(&conn->cm);
+        rdma_endpoint_destroy(&conn->ep);
+        if(conn->fd >= 0) {
+            close(conn->fd);
+        }
+        conn->fd = -1;
+    }
+}
+
+// Both sides listen-or-connect the same sequence; the client prints
+static int run_mode(struct setup_run *run, int sock) {
+    const struct setup_config *cfg = run->cfg;
+    int is_server = !run->server_ip;
+    int ret = 0;
+
+    hist_init(&run->total);
+    hist_init(&run->wire);
+    if(is_server && run->mode == RDMA_CONN_CM) {
+        ret = rdma_cm_listen(&run->listener, run->opts->tcp_port + RDMA_CM_PORT_OFFSET,
+                             SOMAXCONN);
+    } else if(is_server) {
+        run->data_listen = rdma_tcp_listen(run->opts->tcp_port + SETUP_TCP_PORT_OFFSET,
+                                           SOMAXCONN);
+        ret = run->data_listen < 0 ? -1 : 0;
+    }
+    // The client only connects once the server listens
+    if(ret == 0) {
+        ret = rdma_sock_barrier(sock);
+    }
+
+    for(uint32_t r = 0; r < cfg->rounds && ret == 0 && !rdma_stop_requested; r++) {
+        uint64_t t0 = rdma_now_ns();
+        for(uint32_t i = 0; i < cfg->nconns && ret == 0; i++) {
+            ret = is_server ? accept_one(run, &run->conns[i]) :
+                              connect_one(run, &run->conns[i]);
+        }
+        uint64_t elapsed = rdma_now_ns() - t0;
+
+        if(ret == 0 && !is_server) {
+            printf("%4s round %2u: %5u connections in %9.2f ms, %8.0f conn/s\n",
+                   rdma_conn_mode_str(run->mode), r, cfg->nconns, elapsed / 1e6,
+                   cfg->nconns / (elapsed / 1e9));
+            fflush(stdout);
+        }
+
+        // Everyone is connected before anyone disconnects, and the next
+        // round starts from nothing on both sides
+        if(ret == 0) {
+            ret = rdma_sock_barrier(sock);
+        }
+        disconnect_all(run);
+        if(ret == 0) {
+            ret = rdma_sock_barrier(sock);
+        }
+    }
+
+    if(ret == 0 && !is_server) {
+        char label[32];
+        snprintf(label, sizeof(label), "%s setup", rdma_conn_mode_str(run->mode));
+        hist_print(&run->total, label, 1e-3, "us");
+        snprintf(label, sizeof(label), "%s wire", rdma_conn_mode_str(run->mode));
+        hist_print(&run->wire, label, 1e-3, "us");
+    }
+
+    rdma_cm_listener_destroy(&run->listener);
+    if(run->data_listen >= 0) {
+        close(run->data_listen);
+        run->data_listen = -1;
+    }
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    const char *server_ip = NULL;
+    struct rdma_opts opts;
+
+    rdma_opts_init(&opts);
+    opts.iters = SETUP_DEFAULT_ROUNDS;
+    opts.threads = SETUP_DEFAULT_CONNS;
+    int ret = rdma_parse_opts(argc, argv, "[server_ip]", &opts);
+    if(ret) {
+        return ret < 0 ? 1 : 0;
+    }
+    if(argc > optind) {
+        server_ip = argv[optind];
+    }
+    if(opts.iters == 0 || opts.iters > UINT32_MAX || opts.threads > SETUP_MAX_CONNS) {
+        fprintf(stderr, "Needs -n > 0 and -j up to %d\n", SETUP_MAX_CONNS);
+        return 1;
+    }
+    if(rdma_install_stop_handler()) {
+        return 1;
+    }
+    srand(time(NULL) ^ getpid());
+
+    uint32_t modes = 1u << RDMA_CONN_TCP;
+    if(rdma_cm_supported()) {
+        modes |= 1u << RDMA_CONN_CM;
+    }
+
+    // The client decides what to measure; the server answers with the
+    // modes both can run
+    struct setup_config cfg;
+    int sock;
+    if(server_ip) {
+        cfg = (struct setup_config) {
+            .nconns = opts.threads,
+            .rounds = (uint32_t)opts.iters,
+            .modes = modes
+        };
+        sock = setup_tcp_client(server_ip, opts.tcp_port);
+        if(sock < 0 ||
+           rdma_wire_send_fields(sock, setup_config_fields, &cfg) ||
+           rdma_wire_recv_fields(sock, setup_config_fields, &cfg)) {
+            return 1;
+        }
+    } else {
+        int listen_sock = setup_tcp_server(opts.tcp_port);
+        if(listen_sock < 0) {
+            return 1;
+        }
+        sock = accept(listen_sock, NULL, NULL);
+        close(listen_sock);
+        if(sock < 0) {
+            perror("accept");
+            return 1;
+        }
+        if(rdma_wire_recv_fields(sock, setup_config_fields, &cfg)) {
+            return 1;
+        }
+        if(cfg.nconns == 0 || cfg.nconns > SETUP_MAX_CONNS || cfg.rounds == 0) {
+            fprintf(stderr, "Client sent an invalid test configuration\n");
+            return 1;
+        }
+        cfg.modes &= modes;
+        if(rdma_wire_send_fields(sock, setup_config_fields, &cfg)) {
+            return 1;
+        }
+    }
+
+    printf("%u rounds of %u RC connections, each with a %d-byte buffer and "
+           "%d-deep queues\n", cfg.rounds, cfg.nconns, SETUP_BUF_SIZE, SETUP_QUEUE_DEPTH);
+    if(!(cfg.modes & (1u << RDMA_CONN_CM))) {
+        printf("librdmacm is missing on %s: TCP exchange only\n",
+               modes & (1u << RDMA_CONN_CM) ? "the other side" : "this side");
+    }
+
+    struct setup_conn *conns = calloc(cfg.nconns, sizeof(*conns));
+    if(!conns) {
+        perror("calloc");
+        return 1;
+    }
+    for(uint32_t i = 0; i < cfg.nconns; i++) {
+        conns[i].fd = -1;
+    }
+
+    // rdma_cm connections need the device rdma_cm opened, so each mode
+    // brings its own
+    ret = 0;
+    for(int mode = RDMA_CONN_TCP; mode <= RDMA_CONN_CM && ret == 0; mode++) {
+        if(!(cfg.modes & (1u << mode))) {
+            continue;
+        }
+        struct rdma_device dev;
+        struct setup_run run = {
+            .mode = mode,
+            .cfg = &cfg,
+            .opts = &opts,
+            .server_ip = server_ip,
+            .dev = &dev,
+            .data_listen = -1,
+            .conns = conns
+        };
+        ret = run_mode(&run, sock);
+        if(run.dev_ready) {
+            rdma_device_close(&dev);
+        }
+    }
+
+    free(conns);
+    close(sock);
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,183 @@
+#include "rdma_slab.h"
+#include "rdma_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Carved buffers are aligned to their size, up to a page
+#define SLAB_MAX_ALIGN 4096
+
+// Map and register one more region and carve from it from now on. Called
+// with the lock held; the old region's uncarved tail is left unused.
+static int add_region(struct rdma_slab *slab) {
+    if(slab->nregions == slab->max_regions) {
+        fprintf(stderr, "Slab exhausted: %u regions of %zu bytes in use\n",
+                slab->nregions, slab->region_size);
+        return -1;
+    }
+
+    struct slab_region *r = &slab->regions[slab->nregions];
+    if(rdma_mem_alloc(&r->mem, slab->region_size, slab->page, slab->numa)) {
+        return -1;
+    }
+    r->mr = rdma_mem_reg(&r->mem, slab->pd, slab->access);
+    if(!r->mr) {
+        rdma_mem_free(&r->mem);
+        return -1;
+    }
+
+    slab->nregions++;
+    slab->carve = r->mem.addr;
+    slab->carve_end = r->mem.addr + slab->region_size;
+    slab->carve_lkey = r->mr->lkey;
+    slab->stats.regions++;
+    slab->stats.reg_ns += r->mem.reg_ns;
+    return 0;
+}
+
+// Cut one buffer of class `cls` from the newest region, starting a new
+// region when it is used up
+static struct slab_node *carve_one(struct rdma_slab *slab, uint32_t cls) {
+    size_t size = (size_t)SLAB_MIN_SIZE << cls;
+    size_t align = size < SLAB_MAX_ALIGN ? size : SLAB_MAX_ALIGN;
+
+    char *p = (char *)(((uintptr_t)slab->carve + align - 1) & ~(uintptr_t)(align - 1));
+    if(!slab->carve || p + size > slab->carve_end) {
+        if(add_region(slab)) {
+            return NULL;
+        }
+        p = slab->carve;
+    }
+
+    struct slab_node *node = (struct slab_node *)p;
+    node->next = NULL;
+    node->lkey = slab->carve_lkey;
+    slab->carve = p + size;
+    slab->stats.carved++;
+    return node;
+}
+
+int rdma_slab_init(struct rdma_slab *slab, struct ibv_pd *pd, int access,
+                   size_t region_size, uint32_t max_regions,
+                   enum rdma_page page, const struct rdma_numa *numa) {
+    memset(slab, 0, sizeof(*slab));
+    slab->pd = pd;
+    slab->access = access;
+    slab->region_size = region_size ? region_size : SLAB_REGION_BYTES;
+    slab->max_regions = max_regions ? max_regions : 1;
+    slab->page = page;
+    slab->numa = numa;
+    if(slab->region_size < SLAB_MAX_SIZE) {
+        fprintf(stderr, "Slab regions must hold a %u-byte buffer\n", SLAB_MAX_SIZE);
+        return -1;
+    }
+
+    // Sized once, so regions never move while buffers point into them
+    slab->regions = calloc(slab->max_regions, sizeof(*slab->regions));
+    if(!slab->regions) {
+        perror("calloc");
+        return -1;
+    }
+    if(pthread_mutex_init(&slab->lock, NULL)) {
+        perror("pthread_mutex_init");
+        free(slab->regions);
+        return -1;
+    }
+    if(add_region(slab)) {
+        rdma_slab_destroy(slab);
+        return -1;
+    }
+    return 0;
+}
+
+void rdma_slab_destroy(struct rdma_slab *slab) {
+    for(uint32_t i = 0; i < slab->nregions; i++) {
+        if(ibv_dereg_mr(slab->regions[i].mr)) {
+            perror("ibv_dereg_mr");
+        }
+        rdma_mem_free(&slab->regions[i].mem);
+    }
+    free(slab->regions);
+    pthread_mutex_destroy(&slab->lock);
+    memset(slab, 0, sizeof(*slab));
+}
+
+void slab_cache_init(struct slab_cache *cache, struct rdma_slab *slab) {
+    memset(cache, 0, sizeof(*cache));
+    cache->slab = slab;
+}
+
+void slab_cache_destroy(struct slab_cache *cache) {
+    struct rdma_slab *slab = cache->slab;
+
+    pthread_mutex_lock(&slab->lock);
+    for(uint32_t cls = 0; cls < SLAB_CLASSES; cls++) {
+        while(cache->free[cls]) {
+            struct slab_node *node = cache->free[cls];
+            cache->free[cls] = node->next;
+            node->next = slab->free[cls];
+            slab->free[cls] = node;
+        }
+        cache->count[cls] = 0;
+    }
+    pthread_mutex_unlock(&slab->lock);
+}
+
+int slab_cache_refill(struct slab_cache *cache, uint32_t cls) {
+    struct rdma_slab *slab = cache->slab;
+    uint32_t want = slab_batch(cls);
+    uint32_t got = 0;
+
+    pthread_mutex_lock(&slab->lock);
+    while(got < want) {
+        struct slab_node *node = slab->free[cls];
+        if(node) {
+            slab->free[cls] = node->next;
+        } else if(!(node = carve_one(slab, cls))) {
+            break;
+        }
+        node->next = cache->free[cls];
+        cache->free[cls] = node;
+        got++;
+    }
+    if(got) {
+        slab->stats.refills++;
+    }
+    pthread_mutex_unlock(&slab->lock);
+
+    cache->count[cls] += got;
+    return got ? 0 : -1;
+}
+
+void slab_cache_spill(struct slab_cache *cache, uint32_t cls) {
+    struct rdma_slab *slab = cache->slab;
+    uint32_t n = slab_batch(cls);
+
+    // The most recently freed buffers stay: they are the warm ones
+    struct slab_node *keep = cache->free[cls];
+    for(uint32_t i = 1; i < cache->count[cls] - n; i++) {
+        keep = keep->next;
+    }
+    struct slab_node *first = keep->next;
+    struct slab_node *last = first;
+    while(last->next) {
+        last = last->next;
+    }
+    keep->next = NULL;
+    cache->count[cls] -= n;
+
+    pthread_mutex_lock(&slab->lock);
+    last->next = slab->free[cls];
+    slab->free[cls] = first;
+    slab->stats.spills++;
+    pthread_mutex_unlock(&slab->lock);
+}
+
+void slab_stats_print(const struct rdma_slab *slab) {
+    const struct slab_stats *st = &slab->stats;
+
+    printf("Slab: %lu regions of %zu bytes registered in %.1f ms, %lu buffers carved\n",
+           st->regions, slab->region_size, st->reg_ns / 1e6, st->carved);
+    printf("    %lu refills, %lu spills between thread caches and the shared lists\n",
+           st->refills, st->spills);
+}
@@ -0,0 +1,166 @@
+#ifndef RDMA_SLAB_H
+#define RDMA_SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <infiniband/verbs.h>
+#include "rdma_mem.h"
+
+// Slab allocator for message buffers, carved from a few large registered
+// regions so the data path never calls malloc or ibv_reg_mr.
+//
+// Buffers come in power-of-two size classes from SLAB_MIN_SIZE to
+// SLAB_MAX_SIZE. A free buffer holds its own free-list link and lkey, so
+// alloc and free are a pointer pop or push. Each thread allocates through
+// its own slab_cache, which takes no lock; only when a cache runs dry or
+// holds too many free buffers of a class does it move a batch to or from
+// the shared slab under its mutex. Regions are mapped and registered as
+// the shared lists run out, up to max_regions.
+
+#define SLAB_MIN_SHIFT    6             // 64 B: room for the free-list link
+#define SLAB_MAX_SHIFT    20            // 1 MiB
+#define SLAB_MIN_SIZE     (1u << SLAB_MIN_SHIFT)
+#define SLAB_MAX_SIZE     (1u << SLAB_MAX_SHIFT)
+#define SLAB_CLASSES      (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+
+// Default region size; every region must hold at least one largest buffer
+#define SLAB_REGION_BYTES (32u << 20)
+
+// Buffers moved between a cache and the slab at a time: SLAB_CACHE_BATCH,
+// or fewer for large classes so one refill moves at most SLAB_BATCH_BYTES.
+// A cache gives a batch back once it holds two batches' worth.
+#define SLAB_CACHE_BATCH  32
+#define SLAB_BATCH_BYTES  (1u << 20)
+
+// A buffer handed out by slab_alloc, ready for ibv_wr_set_sge or an
+// ibv_sge. Pass it back to slab_free unchanged.
+struct slab_buf {
+    char *addr;
+    uint32_t lkey;
+    uint32_t size;              // Usable bytes: the size class
+};
+
+// What a free buffer holds at its start
+struct slab_node {
+    struct slab_node *next;
+    uint32_t lkey;
+};
+
+struct slab_region {
+    struct rdma_mem mem;
+    struct ibv_mr *mr;
+};
+
+struct slab_stats {
+    uint64_t regions;           // Regions mapped and registered
+    uint64_t carved;            // Buffers cut from regions
+    uint64_t refills;           // Batches handed to caches
+    uint64_t spills;            // Batches given back by caches
+    uint64_t reg_ns;            // Time spent registering regions
+};
+
+struct rdma_slab {
+    struct ibv_pd *pd;
+    int access;                 // ibv_reg_mr access flags of every region
+    size_t region_size;
+    uint32_t max_regions;
+    enum rdma_page page;
+    const struct rdma_numa *numa;   // Placement of new regions (NULL: none)
+    struct slab_region *regions;
+    uint32_t nregions;
+    char *carve;                // Uncarved part of the newest region
+    char *carve_end;
+    uint32_t carve_lkey;
+    struct slab_node *free[SLAB_CLASSES];   // Shared free lists
+    pthread_mutex_t lock;       // Guards everything above
+    struct slab_stats stats;
+};
+
+// One thread's view of a slab. Not thread-safe: every thread allocating
+// from the slab needs a cache of its own.
+struct slab_cache {
+    struct rdma_slab *slab;
+    struct slab_node *free[SLAB_CLASSES];
+    uint32_t count[SLAB_CLASSES];
+    uint64_t allocs;
+    uint64_t frees;
+};
+
+// Set up a slab of regions of `region_size` bytes (0: SLAB_REGION_BYTES),
+// mapped on `page`-sized pages, placed on `numa`'s node if given and
+// registered with `access`. The first region is mapped right away.
+int rdma_slab_init(struct rdma_slab *slab, struct ibv_pd *pd, int access,
+                   size_t region_size, uint32_t max_regions,
+                   enum rdma_page page, const struct rdma_numa *numa);
+
+// Deregister and unmap every region. Every cache must have been destroyed.
+void rdma_slab_destroy(struct rdma_slab *slab);
+
+void slab_cache_init(struct slab_cache *cache, struct rdma_slab *slab);
+
+// Give every buffer the cache holds back to the slab. Buffers still
+// allocated must not be freed through this cache afterwards.
+void slab_cache_destroy(struct slab_cache *cache);
+
+// Slow paths of slab_alloc and slab_free
+int slab_cache_refill(struct slab_cache *cache, uint32_t cls);
+void slab_cache_spill(struct slab_cache *cache, uint32_t cls);
+
+// Buffers moved per refill or spill of a class
+static inline uint32_t slab_batch(uint32_t cls) {
+    uint32_t n = SLAB_BATCH_BYTES >> (cls + SLAB_MIN_SHIFT);
+    if(n > SLAB_CACHE_BATCH) {
+        return SLAB_CACHE_BATCH;
+    }
+    return n ? n : 1;
+}
+
+// Size class serving `size` bytes
+static inline uint32_t slab_class(size_t size) {
+    if(size <= SLAB_MIN_SIZE) {
+        return 0;
+    }
+    return 64 - __builtin_clzll(size - 1) - SLAB_MIN_SHIFT;
+}
+
+// A buffer of at least `size` bytes (at most SLAB_MAX_SIZE). Returns -1 if
+// the slab has no region left to carve it from.
+static inline int slab_alloc(struct slab_cache *cache, size_t size,
+                             struct slab_buf *buf) {
+    uint32_t cls = slab_class(size);
+    if(cls >= SLAB_CLASSES) {
+        return -1;
+    }
+    if(!cache->free[cls] && slab_cache_refill(cache, cls)) {
+        return -1;
+    }
+
+    struct slab_node *node = cache->free[cls];
+    cache->free[cls] = node->next;
+    cache->count[cls]--;
+    cache->allocs++;
+    buf->addr = (char *)node;
+    buf->lkey = node->lkey;
+    buf->size = SLAB_MIN_SIZE << cls;
+    return 0;
+}
+
+// Return a buffer to the cache, which may be another thread's than the
+// one that allocated it
+static inline void slab_free(struct slab_cache *cache, const struct slab_buf *buf) {
+    uint32_t cls = slab_class(buf->size);
+    struct slab_node *node = (struct slab_node *)buf->addr;
+
+    node->next = cache->free[cls];
+    node->lkey = buf->lkey;
+    cache->free[cls] = node;
+    cache->frees++;
+    if(++cache->count[cls] >= 2 * slab_batch(cls)) {
+        slab_cache_spill(cache, cls);
+    }
+}
+
+void slab_stats_print(const struct rdma_slab *slab);
+
+#endif // RDMA_SLAB_H
@@ -0,0 +1,192 @@
+#include "rdma_srq.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+
+static struct ibv_srq *create_srq(struct rdma_srq *srq, struct ibv_pd *pd) {
+    struct ibv_srq_init_attr_ex attr_ex = {
+        .attr = {
+            .max_wr = srq->depth,
+            .max_sge = 1,
+        },
+        .comp_mask = IBV_SRQ_INIT_ATTR_TYPE | IBV_SRQ_INIT_ATTR_PD,
+        .srq_type = IBV_SRQT_BASIC,
+        .pd = pd
+    };
+    struct ibv_srq *s = ibv_create_srq_ex(srq->ctx, &attr_ex);
+    if(s) {
+        srq->extended = 1;
+        return s;
+    }
+
+    // Providers without the extended verb still do basic SRQs
+    struct ibv_srq_init_attr attr = {
+        .attr = {
+            .max_wr = srq->depth,
+            .max_sge = 1,
+        }
+    };
+    s = ibv_create_srq(pd, &attr);
+    if(!s) {
+        perror("ibv_create_srq");
+    }
+    return s;
+}
+
+int rdma_srq_create(struct rdma_srq *srq, struct ibv_context *ctx,
+                    struct ibv_pd *pd, struct slab_cache *slab,
+                    uint32_t slot_size, uint32_t depth, uint32_t limit) {
+    memset(srq, 0, sizeof(*srq));
+    srq->ctx = ctx;
+    srq->slab = slab;
+    srq->depth = depth;
+    srq->slot_size = slot_size;
+    srq->limit = limit && limit < depth ? limit : depth / 4;
+
+    srq->wrs = calloc(depth, sizeof(*srq->wrs));
+    srq->sges = calloc(depth, sizeof(*srq->sges));
+    srq->bufs = calloc(depth, sizeof(*srq->bufs));
+    srq->free_slots = calloc(depth, sizeof(*srq->free_slots));
+    if(!srq->wrs || !srq->sges || !srq->bufs || !srq->free_slots) {
+        perror("calloc");
+        rdma_srq_destroy(srq);
+        return -1;
+    }
+
+    for(uint32_t i = 0; i < depth; i++) {
+        srq->wrs[i].wr_id = i;
+        if(!slab) {
+            continue;
+        }
+        if(slab_alloc(slab, slot_size, &srq->bufs[i])) {
+            rdma_srq_destroy(srq);
+            return -1;
+        }
+        srq->sges[i].addr = (uintptr_t)srq->bufs[i].addr;
+        srq->sges[i].length = slot_size;
+        srq->sges[i].lkey = srq->bufs[i].lkey;
+        srq->wrs[i].sg_list = &srq->sges[i];
+        srq->wrs[i].num_sge = 1;
+    }
+
+    srq->srq = create_srq(srq, pd);
+    if(!srq->srq) {
+        rdma_srq_destroy(srq);
+        return -1;
+    }
+
+    // rdma_srq_poll_events must not block once poll() has said the fd is
+    // readable but another reader got there first
+    int flags = fcntl(ctx->async_fd, F_GETFL);
+    if(flags < 0 || fcntl(ctx->async_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        rdma_srq_destroy(srq);
+        return -1;
+    }
+    return 0;
+}
+
+void rdma_srq_destroy(struct rdma_srq *srq) {
+    if(srq->srq && ibv_destroy_srq(srq->srq)) {
+        perror("ibv_destroy_srq");
+    }
+    for(uint32_t i = 0; srq->bufs && i < srq->depth; i++) {
+        if(srq->bufs[i].addr) {
+            slab_free(srq->slab, &srq->bufs[i]);
+        }
+    }
+    free(srq->wrs);
+    free(srq->sges);
+    free(srq->bufs);
+    free(srq->free_slots);
+    memset(srq, 0, sizeof(*srq));
+}
+
+static int arm(struct rdma_srq *srq) {
+    struct ibv_srq_attr attr = { .srq_limit = srq->limit };
+
+    __atomic_store_n(&srq->low, 0, __ATOMIC_RELEASE);
+    if(ibv_modify_srq(srq->srq, &attr, IBV_SRQ_LIMIT)) {
+        perror("ibv_modify_srq");
+        return -1;
+    }
+    return 0;
+}
+
+// Link the given slots into one chain and post it
+static int post_slots(struct rdma_srq *srq, const uint32_t *slots, uint32_t n) {
+    struct ibv_recv_wr *bad_wr;
+
+    for(uint32_t k = 0; k < n; k++) {
+        srq->wrs[slots[k]].next = k + 1 < n ? &srq->wrs[slots[k + 1]] : NULL;
+    }
+    srq->post_calls++;
+    if(ibv_post_srq_recv(srq->srq, &srq->wrs[slots[0]], &bad_wr)) {
+        perror("ibv_post_srq_recv");
+        return -1;
+    }
+    return 0;
+}
+
+int rdma_srq_fill(struct rdma_srq *srq) {
+    for(uint32_t i = 0; i < srq->depth; i++) {
+        srq->free_slots[i] = i;
+    }
+    srq->nfree = srq->depth;
+    if(post_slots(srq, srq->free_slots, srq->nfree)) {
+        return -1;
+    }
+    srq->nfree = 0;
+    return arm(srq);
+}
+
+int rdma_srq_replenish(struct rdma_srq *srq) {
+    if(srq->nfree == 0) {
+        return arm(srq);
+    }
+    if(post_slots(srq, srq->free_slots, srq->nfree)) {
+        return -1;
+    }
+    srq->reposted += srq->nfree;
+    srq->nfree = 0;
+    return arm(srq);
+}
+
+int rdma_srq_poll_events(struct rdma_srq *srq, int timeout_ms) {
+    struct pollfd pfd = { .fd = srq->ctx->async_fd, .events = POLLIN };
+    int handled = 0;
+
+    int n = poll(&pfd, 1, timeout_ms);
+    if(n < 0) {
+        if(errno == EINTR) {
+            return 0;
+        }
+        perror("poll");
+        return -1;
+    }
+
+    struct ibv_async_event ev;
+    while(n > 0 && ibv_get_async_event(srq->ctx, &ev) == 0) {
+        if(ev.event_type == IBV_EVENT_SRQ_LIMIT_REACHED && ev.element.srq == srq->srq) {
+            srq->limit_events++;
+            __atomic_store_n(&srq->low, 1, __ATOMIC_RELEASE);
+        } else if(ev.event_type != IBV_EVENT_QP_LAST_WQE_REACHED) {
+            // (Last-WQE events are routine: every QP on an SRQ raises one
+            // when it is torn down)
+            fprintf(stderr, "Async event: %s\n", ibv_event_type_str(ev.event_type));
+        }
+        ibv_ack_async_event(&ev);
+        handled++;
+    }
+    return handled;
+}
+
+size_t rdma_srq_footprint(const struct rdma_srq *srq) {
+    if(!srq->slab) {
+        return 0;
+    }
+    return (size_t)srq->depth * (SLAB_MIN_SIZE << slab_class(srq->slot_size));
+}
@@ -0,0 +1,85 @@
+#ifndef RDMA_SRQ_H
+#define RDMA_SRQ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <infiniband/verbs.h>
+#include "rdma_slab.h"
+
+// Shared receive queue: one pool of receive WRs and buffers serving every
+// QP attached to it, instead of a ring per QP.
+//
+// SRQ WRs complete in whatever order senders use them, so consumed slots
+// are collected on a free stack by wr_id rather than reposted in ring
+// order. They are not reposted as they arrive: the SRQ is armed with a low
+// watermark, and once the device reports IBV_EVENT_SRQ_LIMIT_REACHED every
+// collected slot goes back in one linked chain and the watermark is armed
+// again. Events are read by whoever calls rdma_srq_poll_events, typically
+// a thread of its own; the receiving thread sees the flag it sets, which
+// is only ever touched through rdma_srq_is_low and __atomic builtins.
+struct rdma_srq {
+    struct ibv_context *ctx;
+    struct ibv_srq *srq;
+    struct slab_cache *slab;    // Source of the slot buffers (NULL: none)
+    uint32_t depth;             // WRs in the pool
+    uint32_t slot_size;         // Bytes per receive buffer
+    uint32_t limit;             // Low watermark in posted WRs
+    int extended;               // Created with ibv_create_srq_ex
+    struct ibv_recv_wr *wrs;    // One WR per slot, wr_id = slot index
+    struct ibv_sge *sges;
+    struct slab_buf *bufs;
+    uint32_t *free_slots;       // Consumed slots awaiting repost
+    uint32_t nfree;
+    int low;                    // The watermark was reached (atomic)
+
+    uint64_t limit_events;      // IBV_EVENT_SRQ_LIMIT_REACHED seen
+    uint64_t forced;            // Reposts without waiting for the event
+    uint64_t post_calls;        // ibv_post_srq_recv calls
+    uint64_t reposted;          // WRs reposted
+};
+
+// Create an SRQ of `depth` WRs, each with a `slot_size` buffer from
+// `slab`, and a low watermark of `limit` WRs (0: depth / 4). Without a
+// slab the WRs carry no SGE, which is all write-with-immediate needs. Tries
+// ibv_create_srq_ex first and falls back to ibv_create_srq.
+int rdma_srq_create(struct rdma_srq *srq, struct ibv_context *ctx,
+                    struct ibv_pd *pd, struct slab_cache *slab,
+                    uint32_t slot_size, uint32_t depth, uint32_t limit);
+
+void rdma_srq_destroy(struct rdma_srq *srq);
+
+// Post every slot and arm the watermark
+int rdma_srq_fill(struct rdma_srq *srq);
+
+// Repost every collected slot as one chain and arm the watermark again
+int rdma_srq_replenish(struct rdma_srq *srq);
+
+// Whether the watermark event has come in since the SRQ was last armed
+static inline int rdma_srq_is_low(const struct rdma_srq *srq) {
+    return __atomic_load_n(&srq->low, __ATOMIC_ACQUIRE);
+}
+
+// Collect a consumed slot, and repost what has been collected once the
+// watermark event came in. If by our own count half the watermark is all
+// that is left posted, the event is late or the device does not send it,
+// and the slots go back regardless.
+static inline int rdma_srq_consumed(struct rdma_srq *srq, uint64_t wr_id) {
+    srq->free_slots[srq->nfree++] = (uint32_t)wr_id;
+    if(rdma_srq_is_low(srq)) {
+        return rdma_srq_replenish(srq);
+    }
+    if(srq->depth - srq->nfree <= srq->limit / 2) {
+        srq->forced++;
+        return rdma_srq_replenish(srq);
+    }
+    return 0;
+}
+
+// Wait up to `timeout_ms` for asynchronous events on the SRQ's device and
+// handle them. Returns the number of events handled or -1.
+int rdma_srq_poll_events(struct rdma_srq *srq, int timeout_ms);
+
+// Bytes of receive buffers the pool holds
+size_t rdma_srq_footprint(const struct rdma_srq *srq);
+
+#endif // RDMA_SRQ_H
@@ -0,0 +1,305 @@
+#include "rdma_wire.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+// Longest message accepted: room for the largest v1 message with records
+// a later version has grown
+#define WIRE_RECV_MAX (1u << 20)
+
+static void put_u16(uint8_t *p, uint16_t v) {
+    v = htobe16(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    v = htobe32(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static void put_u64(uint8_t *p, uint64_t v) {
+    v = htobe64(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return be16toh(v);
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return be32toh(v);
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return be64toh(v);
+}
+
+size_t rdma_wire_size(uint32_t nqps, uint32_t nmrs) {
+    return RDMA_WIRE_HEADER_LEN + (size_t)nqps * RDMA_WIRE_QP_LEN +
+           (size_t)nmrs * RDMA_WIRE_MR_LEN;
+}
+
+size_t rdma_wire_encode(const struct rdma_wire_msg *msg, uint8_t *buf, size_t len) {
+    size_t total = rdma_wire_size(msg->nqps, msg->nmrs);
+
+    if(msg->nqps > RDMA_WIRE_MAX_QPS || msg->nmrs > RDMA_WIRE_MAX_MRS || total > len) {
+        return 0;
+    }
+    memset(buf, 0, total);
+    put_u32(buf, RDMA_WIRE_MAGIC);
+    put_u16(buf + 4, RDMA_WIRE_VERSION);
+    put_u16(buf + 6, RDMA_WIRE_HEADER_LEN);
+    put_u32(buf + 8, (uint32_t)total);
+    put_u32(buf + 12, msg->caps);
+    put_u16(buf + 16, (uint16_t)msg->nqps);
+    put_u16(buf + 18, (uint16_t)msg->nmrs);
+    buf[20] = RDMA_WIRE_QP_LEN;
+    buf[21] = RDMA_WIRE_MR_LEN;
+
+    uint8_t *p = buf + RDMA_WIRE_HEADER_LEN;
+    for(uint32_t i = 0; i < msg->nqps; i++, p += RDMA_WIRE_QP_LEN) {
+        const struct rdma_qp_desc *qp = &msg->qps[i];
+        put_u32(p, qp->qpn);
+        put_u32(p + 4, qp->psn);
+        memcpy(p + 8, qp->gid.raw, sizeof(qp->gid.raw));
+        put_u16(p + 24, qp->lid);
+        p[26] = qp->mtu;
+        p[28] = qp->rd_atom;
+        p[29] = qp->init_rd_atom;
+        p[30] = qp->timeout;
+        p[31] = qp->retry_cnt;
+        p[32] = qp->rnr_retry;
+    }
+    for(uint32_t i = 0; i < msg->nmrs; i++, p += RDMA_WIRE_MR_LEN) {
+        const struct rdma_mr_desc *mr = &msg->mrs[i];
+        put_u64(p, mr->addr);
+        put_u64(p + 8, mr->len);
+        put_u32(p + 16, mr->rkey);
+    }
+    return total;
+}
+
+int rdma_wire_msg_len(const uint8_t *prefix, uint32_t *total) {
+    if(get_u32(prefix) != RDMA_WIRE_MAGIC) {
+        fprintf(stderr, "Connection descriptor: bad magic 0x%08x\n", get_u32(prefix));
+        return -1;
+    }
+    if(get_u16(prefix + 4) == 0) {
+        fprintf(stderr, "Connection descriptor: version 0\n");
+        return -1;
+    }
+    *total = get_u32(prefix + 8);
+    if(*total < RDMA_WIRE_HEADER_LEN) {
+        fprintf(stderr, "Connection descriptor: %u bytes is too short\n", *total);
+        return -1;
+    }
+    return 0;
+}
+
+int rdma_wire_decode(struct rdma_wire_msg *msg, const uint8_t *buf, size_t len) {
+    uint32_t total;
+
+    memset(msg, 0, sizeof(*msg));
+    if(len < RDMA_WIRE_PREFIX_LEN || rdma_wire_msg_len(buf, &total)) {
+        return -1;
+    }
+    uint16_t version = get_u16(buf + 4);
+    uint16_t header_len = get_u16(buf + 6);
+    uint32_t nqps = get_u16(buf + 16);
+    uint32_t nmrs = get_u16(buf + 18);
+    uint8_t qp_len = buf[20];
+    uint8_t mr_len = buf[21];
+
+    // Records may be longer than we know, never shorter than version 1's,
+    // and must add up
+    if(total > len || header_len < RDMA_WIRE_HEADER_LEN ||
+       qp_len < RDMA_WIRE_QP_LEN_V1 || mr_len < RDMA_WIRE_MR_LEN ||
+       nqps > RDMA_WIRE_MAX_QPS || nmrs > RDMA_WIRE_MAX_MRS ||
+       (size_t)header_len + (size_t)nqps * qp_len + (size_t)nmrs * mr_len != total) {
+        fprintf(stderr, "Connection descriptor: malformed (%u QPs, %u MRs, %u bytes)\n",
+                nqps, nmrs, total);
+        return -1;
+    }
+
+    // Records too short for version 2's fields read as version 1
+    msg->version = version < RDMA_WIRE_VERSION ? version : RDMA_WIRE_VERSION;
+    if(qp_len < RDMA_WIRE_QP_LEN && msg->version > 1) {
+        msg->version = 1;
+    }
+    msg->caps = get_u32(buf + 12);
+    msg->nqps = nqps;
+    msg->nmrs = nmrs;
+    msg->qps = calloc(nqps ? nqps : 1, sizeof(*msg->qps));
+    msg->mrs = calloc(nmrs ? nmrs : 1, sizeof(*msg->mrs));
+    if(!msg->qps || !msg->mrs) {
+        perror("calloc");
+        rdma_wire_msg_free(msg);
+        return -1;
+    }
+
+    const uint8_t *p = buf + header_len;
+    for(uint32_t i = 0; i < nqps; i++, p += qp_len) {
+        struct rdma_qp_desc *qp = &msg->qps[i];
+        qp->qpn = get_u32(p);
+        qp->psn = get_u32(p + 4);
+        memcpy(qp->gid.raw, p + 8, sizeof(qp->gid.raw));
+        qp->lid = get_u16(p + 24);
+        qp->mtu = p[26];
+        if(qp_len >= RDMA_WIRE_QP_LEN) {
+            qp->rd_atom = p[28];
+            qp->init_rd_atom = p[29];
+            qp->timeout = p[30];
+            qp->retry_cnt = p[31];
+            qp->rnr_retry = p[32];
+        }
+    }
+    for(uint32_t i = 0; i < nmrs; i++, p += mr_len) {
+        struct rdma_mr_desc *mr = &msg->mrs[i];
+        mr->addr = get_u64(p);
+        mr->len = get_u64(p + 8);
+        mr->rkey = get_u32(p + 16);
+    }
+    return 0;
+}
+
+void rdma_wire_msg_free(struct rdma_wire_msg *msg) {
+    free(msg->qps);
+    free(msg->mrs);
+    memset(msg, 0, sizeof(*msg));
+}
+
+int rdma_wire_send(int sockfd, const struct rdma_wire_msg *msg) {
+    size_t len = rdma_wire_size(msg->nqps, msg->nmrs);
+    uint8_t *buf = malloc(len);
+    int ret = -1;
+
+    if(!buf) {
+        perror("malloc");
+        return -1;
+    }
+    if(rdma_wire_encode(msg, buf, len) == 0) {
+        fprintf(stderr, "Connection descriptor: %u QPs and %u MRs is too many\n",
+                msg->nqps, msg->nmrs);
+    } else {
+        ret = rdma_sock_send(sockfd, buf, len);
+    }
+    free(buf);
+    return ret;
+}
+
+int rdma_wire_recv(int sockfd, struct rdma_wire_msg *msg) {
+    uint8_t prefix[RDMA_WIRE_PREFIX_LEN];
+    uint32_t total;
+
+    memset(msg, 0, sizeof(*msg));
+    if(rdma_sock_recv(sockfd, prefix, sizeof(prefix)) || rdma_wire_msg_len(prefix, &total)) {
+        return -1;
+    }
+    if(total > WIRE_RECV_MAX) {
+        fprintf(stderr, "Connection descriptor: %u bytes is too long\n", total);
+        return -1;
+    }
+
+    uint8_t *buf = malloc(total);
+    if(!buf) {
+        perror("malloc");
+        return -1;
+    }
+    memcpy(buf, prefix, sizeof(prefix));
+    int ret = rdma_sock_recv(sockfd, buf + sizeof(prefix), total - sizeof(prefix));
+    if(ret == 0) {
+        ret = rdma_wire_decode(msg, buf, total);
+    }
+    free(buf);
+    return ret;
+}
+
+void rdma_wire_u32(struct rdma_wire_codec *c, uint32_t *v) {
+    if(c->buf && c->decode) {
+        *v = get_u32(c->buf + c->pos);
+    } else if(c->buf) {
+        put_u32(c->buf + c->pos, *v);
+    }
+    c->pos += sizeof(*v);
+}
+
+void rdma_wire_u64(struct rdma_wire_codec *c, uint64_t *v) {
+    if(c->buf && c->decode) {
+        *v = get_u64(c->buf + c->pos);
+    } else if(c->buf) {
+        put_u64(c->buf + c->pos, *v);
+    }
+    c->pos += sizeof(*v);
+}
+
+// Both directions: size the message with a counting pass, then run the
+// field list over a buffer of that size
+static int transfer_fields(int sockfd, rdma_wire_fields_fn fields, void *obj,
+                           int decode) {
+    struct rdma_wire_codec c = { 0 };
+    fields(&c, obj);
+
+    uint8_t *buf = malloc(c.pos);
+    if(!buf) {
+        perror("malloc");
+        return -1;
+    }
+    size_t len = c.pos;
+    int ret = 0;
+    c = (struct rdma_wire_codec) { .buf = buf, .decode = decode };
+    if(decode) {
+        ret = rdma_sock_recv(sockfd, buf, len);
+        if(ret == 0) {
+            fields(&c, obj);
+        }
+    } else {
+        fields(&c, obj);
+        ret = rdma_sock_send(sockfd, buf, len);
+    }
+    free(buf);
+    return ret;
+}
+
+int rdma_wire_send_fields(int sockfd, rdma_wire_fields_fn fields, void *obj) {
+    return transfer_fields(sockfd, fields, obj, 0);
+}
+
+int rdma_wire_recv_fields(int sockfd, rdma_wire_fields_fn fields, void *obj) {
+    return transfer_fields(sockfd, fields, obj, 1);
+}
+
+void rdma_wire_from_conn_info(const struct rdma_conn_info *info,
+                              struct rdma_qp_desc *qp, struct rdma_mr_desc *mr) {
+    *qp = (struct rdma_qp_desc) {
+        .qpn = info->qpn,
+        .psn = info->psn,
+        .gid = info->gid,
+        .lid = info->lid
+    };
+    *mr = (struct rdma_mr_desc) {
+        .addr = info->remote_addr,
+        .rkey = info->rkey
+    };
+}
+
+void rdma_wire_to_conn_info(const struct rdma_qp_desc *qp,
+                            const struct rdma_mr_desc *mr, struct rdma_conn_info *info) {
+    memset(info, 0, sizeof(*info));
+    if(qp) {
+        info->qpn = qp->qpn;
+        info->psn = qp->psn;
+        info->gid = qp->gid;
+        info->lid = qp->lid;
+    }
+    if(mr) {
+        info->rkey = mr->rkey;
+        info->remote_addr = mr->addr;
+    }
+}
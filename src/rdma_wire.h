@@ -0,0 +1,119 @@
+#ifndef RDMA_WIRE_H
+#define RDMA_WIRE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <infiniband/verbs.h>
+#include "rdma_common.h"
+
+// Connection descriptor wire format.
+// One length-prefixed message describes any number of QPs and memory
+// regions, so bringing up N QPs takes one round trip however large N is.
+// Every field is written at a fixed offset in network byte order; nothing
+// depends on the compiler's struct layout or the host's endianness.
+//
+//   header   magic u32, version u16, header_len u16, total_len u32,
+//            caps u32, nqps u16, nmrs u16, qp_len u8, mr_len u8, pad u16
+//   nqps x   qpn u32, psn u32, gid[16], lid u16, mtu u8, pad u8,
+//            rd_atom u8, init_rd_atom u8, timeout u8, retry_cnt u8,
+//            rnr_retry u8, pad[3]                        (version 2 on)
+//   nmrs x   addr u64, len u64, rkey u32
+//
+// header_len, qp_len and mr_len give the sizes the sender used. A later
+// version may only append fields, so a reader takes the ones it knows from
+// each record and skips the rest; the version both sides speak is the
+// lower of the two. A field the sender left out reads as 0; the decoded
+// version, not the value, tells whether it was given.
+#define RDMA_WIRE_MAGIC       0x52444d57u   // "RDMW"
+#define RDMA_WIRE_VERSION     2
+#define RDMA_WIRE_PREFIX_LEN  12            // Up to and including total_len
+#define RDMA_WIRE_HEADER_LEN  24
+#define RDMA_WIRE_QP_LEN      36
+#define RDMA_WIRE_QP_LEN_V1   28            // Shortest QP record accepted
+#define RDMA_WIRE_MR_LEN      20
+#define RDMA_WIRE_MAX_QPS     4096
+#define RDMA_WIRE_MAX_MRS     4096
+
+// Capabilities a side advertises; a connection gets the ones both have
+#define RDMA_CAP_REMOTE_WRITE (1u << 0)     // Its MRs accept RDMA writes
+#define RDMA_CAP_REMOTE_READ  (1u << 1)     // Its MRs can be read remotely
+#define RDMA_CAP_ATOMIC       (1u << 2)     // Its device executes atomics
+#define RDMA_CAP_ODP          (1u << 3)     // Its MRs may fault (ODP)
+
+struct rdma_qp_desc {
+    uint32_t qpn;
+    uint32_t psn;
+    union ibv_gid gid;
+    uint16_t lid;
+    uint8_t mtu;                // enum ibv_mtu of the port (0: not given)
+
+    // What the QP can do, for the two sides to settle on (version 2 on;
+    // the read/atomic depths may legitimately be 0)
+    uint8_t rd_atom;            // Incoming reads/atomics it can serve at once
+    uint8_t init_rd_atom;       // Reads/atomics it can have outstanding
+    uint8_t timeout;            // Local ACK timeout it wants (4.096 us << n)
+    uint8_t retry_cnt;          // Transport retries it wants
+    uint8_t rnr_retry;          // RNR retries it wants (7: forever)
+};
+
+struct rdma_mr_desc {
+    uint64_t addr;
+    uint64_t len;
+    uint32_t rkey;
+};
+
+struct rdma_wire_msg {
+    uint16_t version;
+    uint32_t caps;
+    uint32_t nqps;
+    uint32_t nmrs;
+    struct rdma_qp_desc *qps;
+    struct rdma_mr_desc *mrs;
+};
+
+// Encoded size of a message with `nqps` QPs and `nmrs` MRs
+size_t rdma_wire_size(uint32_t nqps, uint32_t nmrs);
+
+// Encode into `buf`; returns the bytes written, or 0 if it does not fit
+size_t rdma_wire_encode(const struct rdma_wire_msg *msg, uint8_t *buf, size_t len);
+
+// Check the first RDMA_WIRE_PREFIX_LEN bytes of a message and return its
+// total length in `total`
+int rdma_wire_msg_len(const uint8_t *prefix, uint32_t *total);
+
+// Decode a whole message; the QP and MR arrays are allocated
+int rdma_wire_decode(struct rdma_wire_msg *msg, const uint8_t *buf, size_t len);
+
+void rdma_wire_msg_free(struct rdma_wire_msg *msg);
+
+// Send or receive one message on a TCP socket
+int rdma_wire_send(int sockfd, const struct rdma_wire_msg *msg);
+int rdma_wire_recv(int sockfd, struct rdma_wire_msg *msg);
+
+// Between a one-QP description and the legacy struct
+void rdma_wire_from_conn_info(const struct rdma_conn_info *info,
+                              struct rdma_qp_desc *qp, struct rdma_mr_desc *mr);
+void rdma_wire_to_conn_info(const struct rdma_qp_desc *qp,
+                            const struct rdma_mr_desc *mr, struct rdma_conn_info *info);
+
+// Benchmark control messages: test configurations and per-point results.
+// A program lists a message's fields once, in order, in a function taking
+// an rdma_wire_codec. The same list then encodes the fields (fixed width,
+// network byte order, no padding) or decodes them, so the two sides cannot
+// disagree on a layout the way two compilers can on a struct's.
+struct rdma_wire_codec {
+    uint8_t *buf;               // NULL: only count the bytes
+    size_t pos;                 // Offset of the next field; the size after a pass
+    int decode;                 // Fill the fields from buf instead
+};
+
+void rdma_wire_u32(struct rdma_wire_codec *c, uint32_t *v);
+void rdma_wire_u64(struct rdma_wire_codec *c, uint64_t *v);
+
+typedef void (*rdma_wire_fields_fn)(struct rdma_wire_codec *c, void *obj);
+
+// Send `obj` as the fields `fields` lists, or receive it
+int rdma_wire_send_fields(int sockfd, rdma_wire_fields_fn fields, void *obj);
+int rdma_wire_recv_fields(int sockfd, rdma_wire_fields_fn fields, void *obj);
+
+#endif // RDMA_WIRE_H
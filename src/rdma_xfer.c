@@ -0,0 +1,126 @@
+#include "rdma_xfer.h"
+#include "rdma_common.h"
+#include <stdio.h>
+#include <string.h>
+
+const char *xfer_mode_str(enum xfer_mode mode) {
+    return mode == XFER_PULL ? "pull" : "push";
+}
+
+// Build the chunk at x->next into `lane`'s open batch
+static void build_one(struct xfer_engine *x, uint32_t lane_idx) {
+    struct xfer_lane *lane = &x->lanes[lane_idx];
+    struct ibv_qp_ex *qpx = lane->qpx;
+    uint64_t off = x->next;
+    uint32_t len = x->len - off < x->chunk ? (uint32_t)(x->len - off) : x->chunk;
+
+    if(!lane->open) {
+        ibv_wr_start(qpx);
+        lane->open = 1;
+    }
+    // RC completes a QP's WRs in order, so the lane is all the CQE needs
+    qpx->wr_id = lane_idx;
+    qpx->wr_flags = IBV_SEND_SIGNALED;
+    if(x->mode == XFER_PULL) {
+        ibv_wr_rdma_read(qpx, x->remote_rkey, x->remote_addr + off);
+    } else {
+        ibv_wr_rdma_write(qpx, x->remote_rkey, x->remote_addr + off);
+    }
+    ibv_wr_set_sge(qpx, x->lkey, (uintptr_t)(x->buf + off), len);
+
+    x->next += len;
+    x->pending++;
+    lane->inflight++;
+    lane->chunks++;
+}
+
+// Deal chunks one per lane per pass, so even an object of a few chunks is
+// spread over every QP, then ring each lane's doorbell once. Each pass
+// starts one lane further on, so single-chunk objects rotate too.
+static int fill_lanes(struct xfer_engine *x, struct xfer_stats *stats) {
+    int room = 1;
+
+    while(x->next < x->len && room) {
+        room = 0;
+        for(uint32_t k = 0; k < x->nlanes && x->next < x->len; k++) {
+            uint32_t i = (x->rr + k) % x->nlanes;
+            if(x->lanes[i].inflight < x->lanes[i].depth) {
+                build_one(x, i);
+                stats->wrs++;
+                room = 1;
+            }
+        }
+        x->rr = (x->rr + 1) % x->nlanes;
+    }
+    for(uint32_t i = 0; i < x->nlanes; i++) {
+        struct xfer_lane *lane = &x->lanes[i];
+        if(!lane->open) {
+            continue;
+        }
+        lane->open = 0;
+        if(ibv_wr_complete(lane->qpx)) {
+            perror("ibv_wr_complete");
+            return -1;
+        }
+        x->doorbells++;
+    }
+    return 0;
+}
+
+static int on_xfer_completion(void *arg, const struct ibv_wc *wc, uint64_t nic_ns) {
+    struct xfer_engine *x = arg;
+    (void)nic_ns;
+
+    x->lanes[wc->wr_id].inflight--;
+    x->pending--;
+    return 0;
+}
+
+int xfer_run(struct xfer_engine *x, uint64_t len, uint64_t iters,
+             struct xfer_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    hist_init(&stats->lat);
+    if(len == 0 || x->chunk == 0 || x->nlanes == 0) {
+        return -1;
+    }
+    for(uint32_t i = 0; i < x->nlanes; i++) {
+        x->lanes[i].inflight = 0;
+        x->lanes[i].open = 0;
+        x->lanes[i].chunks = 0;
+        if(x->lanes[i].depth == 0) {
+            x->lanes[i].depth = 1;
+        }
+    }
+    x->len = len;
+    x->rr = 0;
+    x->doorbells = 0;
+
+    uint64_t start = rdma_now_ns();
+    uint64_t cpu_start = rdma_cpu_time_ns();
+
+    for(uint64_t i = 0; i < iters && !rdma_stop_requested; i++) {
+        uint64_t t0 = rdma_now_ns();
+
+        x->next = 0;
+        x->pending = 0;
+        while(x->next < x->len || x->pending) {
+            if(x->next < x->len && fill_lanes(x, stats)) {
+                return -1;
+            }
+            int n = cq_poller_wait(x->poller, on_xfer_completion, x);
+            stats->polls++;
+            if(n < 0) {
+                return -1;
+            }
+        }
+
+        hist_record(&stats->lat, rdma_now_ns() - t0);
+        stats->objects++;
+        stats->bytes += len;
+    }
+
+    stats->elapsed_ns = rdma_now_ns() - start;
+    stats->cpu_ns = rdma_cpu_time_ns() - cpu_start;
+    stats->doorbells = x->doorbells;
+    return 0;
+}
@@ -0,0 +1,80 @@
+#ifndef RDMA_XFER_H
+#define RDMA_XFER_H
+
+#include <stdint.h>
+#include <infiniband/verbs.h>
+#include "rdma_cq.h"
+#include "rdma_hist.h"
+
+// Chunked one-sided transfer of a whole object, striped over several RC QPs.
+// In pull mode the reader has the owner's (addr, rkey, len) and fetches the
+// object with RDMA reads; in push mode the owner writes it into the
+// reader's buffer instead. The object is cut into `chunk`-byte WRs dealt
+// round-robin to the lanes, each of which keeps up to its `depth` WRs in
+// flight and is topped back up with one doorbell as completions arrive.
+// Every lane's send queue completes on the one CQ `poller` drains, so one
+// thread drives them all.
+//
+// A read occupies one of the initiator's outstanding read slots until its
+// response is back, so a pull lane's depth must not exceed the QP's
+// max_rd_atomic (rdma_qp_params): with a depth of 1 every chunk waits a
+// full round trip. Writes have no such limit.
+
+enum xfer_mode {
+    XFER_PULL,                  // RDMA read from the peer's object
+    XFER_PUSH,                  // RDMA write into the peer's object
+};
+
+const char *xfer_mode_str(enum xfer_mode mode);
+
+// One QP the object is striped over
+struct xfer_lane {
+    struct ibv_qp_ex *qpx;      // Extended QP, connected (RC)
+    uint32_t depth;             // Max WRs outstanding
+    uint32_t inflight;
+    int open;                   // Inside ibv_wr_start
+    uint64_t chunks;            // Chunks moved over this lane
+};
+
+struct xfer_engine {
+    enum xfer_mode mode;
+    struct xfer_lane *lanes;
+    uint32_t nlanes;
+    struct cq_poller *poller;   // The CQ every lane's sends complete on
+    char *buf;                  // Local side of the object
+    uint32_t lkey;              // Any MR on the lanes' PD covering buf
+    uint32_t remote_rkey;       // The peer's side, reachable over every lane
+    uint64_t remote_addr;
+    uint32_t chunk;             // Bytes per WR
+
+    // One object's progress
+    uint64_t len;
+    uint64_t next;              // Offset of the next chunk to post
+    uint64_t pending;           // Chunks posted and not yet completed
+    uint32_t rr;                // Lane the next pass starts at
+    uint64_t doorbells;
+};
+
+// Results of a run of back-to-back objects
+struct xfer_stats {
+    uint64_t objects;
+    uint64_t bytes;
+    uint64_t elapsed_ns;        // First post to last completion
+    uint64_t wrs;
+    uint64_t polls;             // ibv_poll_cq calls (including empty ones)
+    uint64_t doorbells;
+    uint64_t cpu_ns;            // Process CPU time spent in the run
+    struct rdma_hist lat;       // Per object, first post to last chunk (ns)
+};
+
+// Move `iters` objects of `len` bytes one after another, each complete
+// before the next starts. Returns 0, or -1 on a post failure or a
+// completion error.
+int xfer_run(struct xfer_engine *x, uint64_t len, uint64_t iters,
+             struct xfer_stats *stats);
+
+static inline double xfer_gbps(const struct xfer_stats *stats) {
+    return stats->elapsed_ns ? (double)stats->bytes / stats->elapsed_ns : 0;
+}
+
+#endif // RDMA_XFER_H
@@ -15,6 +15,8 @@
 #include <inttypes.h>
 #include "devinfo.h"
 #include "rdma_common.h"
+#include "rdma_opts.h"
+#include "rdma_recv.h"
 
 struct receiver_context {
 	struct ibv_context *ctx;
@@ -22,9 +24,11 @@ struct receiver_context {
 	struct ibv_pd *pd;
 	struct ibv_mr *mr;
 	struct ibv_cq *cq;
+	struct ibv_cq_ex *cqx;	// Extended view when timestamping
 	struct ibv_qp *qp;
-	char *buf;
-	int size;
+	char *buf;		// mem.addr
+	struct rdma_mem mem;	// Mapping behind buf
+	size_t size;
 	int num_packets;
 	struct ibv_port_attr portinfo;
 
@@ -83,15 +87,25 @@ static int modify_qp_to_rts(struct receiver_context *ctx)
 int main(int argc, char *argv[])
 {
 	int tcp_port = RDMA_TCP_PORT;
+	struct rdma_opts opts;
 
-	// Parse command-line arguments
-	if (argc > 1) {
-		tcp_port = atoi(argv[1]);
+	// Parse command-line arguments: ./receiver [options] [port]
+	rdma_opts_init(&opts);
+	int ret = rdma_parse_opts(argc, argv, "[port]", &opts);
+	if (ret) {
+		return ret < 0 ? 1 : 0;
+	}
+	if (argc > optind) {
+		tcp_port = atoi(argv[optind]);
 		if (tcp_port <= 0 || tcp_port > 65535) {
-			fprintf(stderr, "Invalid port number: %s\n", argv[1]);
+			fprintf(stderr, "Invalid port number: %s\n",
+				argv[optind]);
 			return 1;
 		}
 	}
+	if (rdma_install_stop_handler()) {
+		return 1;
+	}
 
 	printf("Receiver starting on port %d\n", tcp_port);
 
@@ -164,16 +178,24 @@ int main(int argc, char *argv[])
 
 	printf("GID type: %s\n", gid_type_str(entry->gid_type));
 
-	recv_ctx->num_packets = 3;
+	if (opts.depth > (uint32_t)dev_attr->max_qp_wr) {
+		fprintf(stderr, "Queue depth %u exceeds device max_qp_wr %d\n",
+			opts.depth, dev_attr->max_qp_wr);
+		return 1;
+	}
+
+	// One CQE per posted receive WR
+	recv_ctx->num_packets = opts.depth;
 	recv_ctx->size = 3 * 1024 * sizeof(char);
+	if (opts.msg_size > recv_ctx->size) {
+		recv_ctx->size = opts.msg_size;
+	}
 
-	// Use posix_memalign for page-aligned memory (required for RDMA)
-	if (posix_memalign((void **)&recv_ctx->buf, sysconf(_SC_PAGESIZE),
-			   recv_ctx->size)) {
-		perror("posix_memalign");
+	// Page-aligned, pre-faulted and locked, on huge pages with -H
+	if (rdma_mem_alloc(&recv_ctx->mem, recv_ctx->size, opts.page, NULL)) {
 		return 1;
 	}
-	memset(recv_ctx->buf, 0, recv_ctx->size);
+	recv_ctx->buf = recv_ctx->mem.addr;
 
 	recv_ctx->channel = ibv_create_comp_channel(recv_ctx->ctx);
 	if (!recv_ctx->channel) {
@@ -187,16 +209,23 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	recv_ctx->mr =
-		ibv_reg_mr(recv_ctx->pd, recv_ctx->buf, recv_ctx->size,
-			   IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+	recv_ctx->mr = rdma_mem_reg(&recv_ctx->mem, recv_ctx->pd,
+				    IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
 	if (!recv_ctx->mr) {
 		perror("ibv_reg_mr");
 		return 1;
 	}
-
-	recv_ctx->cq = ibv_create_cq(recv_ctx->ctx, recv_ctx->num_packets, NULL,
-				     recv_ctx->channel, 0);
+	rdma_mem_print(&recv_ctx->mem, "Buffer");
+
+	// NIC completion timestamps need a CQ created through ibv_create_cq_ex
+	if (opts.hw_timestamps) {
+		recv_ctx->cq = create_cq_timestamped(
+			recv_ctx->ctx, recv_ctx->num_packets, recv_ctx->channel,
+			&recv_ctx->cqx);
+	} else {
+		recv_ctx->cq = ibv_create_cq(recv_ctx->ctx, recv_ctx->num_packets,
+					     NULL, recv_ctx->channel, 0);
+	}
 	if (!recv_ctx->cq) {
 		perror("ibv_create_cq");
 		return 1;
@@ -208,7 +237,7 @@ int main(int argc, char *argv[])
         .recv_cq = recv_ctx->cq,
         .cap     = {
             .max_send_wr = 1,
-            .max_recv_wr = 3,
+            .max_recv_wr = opts.depth,
             .max_send_sge = 1,
             .max_recv_sge = 1,
         },
@@ -326,39 +355,60 @@ int main(int argc, char *argv[])
 	close(server_sock);
 	printf("Receiver ready! Waiting for data...\n");
 
-	// Post receive buffer
-	struct ibv_sge sge = { .addr = (uintptr_t)recv_ctx->buf,
-			       .length = recv_ctx->size,
-			       .lkey = recv_ctx->mr->lkey };
-
-	struct ibv_recv_wr wr = { .wr_id = 1, .sg_list = &sge, .num_sge = 1 };
-
-	struct ibv_recv_wr *bad_wr;
-	if (ibv_post_recv(recv_ctx->qp, &wr, &bad_wr)) {
-		perror("ibv_post_recv");
+	// Post the receive ring. Each write with immediate consumes one
+	// receive WR; the data lands at the advertised RDMA address, so the
+	// WRs carry no scatter list. RNR retries cover the sender racing us.
+	uint32_t recv_batch = opts.recv_batch ? opts.recv_batch :
+						opts.depth / 4;
+	struct recv_ring ring;
+	if (recv_ring_init(&ring, recv_ctx->qp, NULL, 0, 0, opts.depth,
+			   recv_batch) ||
+	    recv_ring_fill(&ring)) {
 		return 1;
 	}
-	printf("Posted receive work request\n");
+	printf("Posted %u receive work requests (repost batch %u)\n",
+	       ring.depth, ring.batch);
 
-	// Poll for completion
-	struct ibv_wc wc;
-	int num_completions = 0;
-	do {
-		num_completions = ibv_poll_cq(recv_ctx->cq, 1, &wc);
-	} while (num_completions == 0);
+	if (opts.iters == 0) {
+		printf("Receiving until interrupted (Ctrl-C to stop)\n");
+	}
 
-	if (wc.status != IBV_WC_SUCCESS) {
-		fprintf(stderr, "Work completion error: %s\n",
-			ibv_wc_status_str(wc.status));
+	// Drain completions in batches and keep the ring replenished until
+	// done or stopped
+	struct cq_poller poller;
+	if (cq_poller_init(&poller, recv_ctx->cq, opts.poll_batch)) {
+		return 1;
+	}
+	if (opts.use_events) {
+		cq_poller_enable_events(&poller, recv_ctx->channel,
+					opts.spin_usec * 1000ULL);
+	}
+	struct hw_clock clock;
+	if (opts.hw_timestamps &&
+	    (hw_clock_init(&clock, recv_ctx->ctx) ||
+	     cq_poller_enable_timestamps(&poller, recv_ctx->cqx, &clock))) {
 		return 1;
 	}
-	if (wc.wc_flags & IBV_WC_WITH_IMM) {
-		printf("Received immediate data: %x\n", ntohl(wc.imm_data));
+	struct recv_stats stats;
+	if (recv_ring_run(&ring, &poller, opts.iters, NULL,
+			  &stats)) {
+		return 1;
 	}
 
+	if (stats.msgs == 0) {
+		fprintf(stderr, "Stopped before any completion arrived\n");
+		return 1;
+	}
+
+	printf("Received immediate data: %x\n", stats.last_imm);
 	printf("Received data: %s\n", recv_ctx->buf);
-	printf("Receive completed successfully! (wr_id: %lu, byte_len: %u)\n",
-	       wc.wr_id, wc.byte_len);
+	recv_stats_print(&stats);
+	printf("Receive ring reposts: %lu ibv_post_recv calls\n",
+	       ring.post_calls);
+	cq_poller_print(&poller);
+
+	cq_poller_destroy(&poller);
+	recv_ring_destroy(&ring);
 
 	return 0;
 }
\ No newline at end of file
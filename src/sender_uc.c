@@ -15,6 +15,8 @@
 #include <inttypes.h>
 #include "devinfo.h"
 #include "rdma_common.h"
+#include "rdma_opts.h"
+#include "rdma_send.h"
 
 struct sender_context {
     struct ibv_context *ctx;
@@ -23,10 +25,13 @@ struct sender_context {
     struct ibv_mr *mr;
 //    struct ibv_dm       *dm;
     struct ibv_cq *cq;
+    struct ibv_cq_ex *cqx;      // Extended view when timestamping
     struct ibv_qp *qp;
     struct ibv_qp_ex *qpx;      // Extended QP for advanced operations
-    char *buf;
-    int size;
+    uint32_t max_inline;        // Inline data size granted at QP creation
+    char *buf;                  // mem.addr
+    struct rdma_mem mem;        // Mapping behind buf
+    size_t size;
     int num_packets;
     struct ibv_port_attr portinfo;
     
@@ -87,15 +92,25 @@ static int modify_qp_to_rts(struct sender_context *ctx) {
 int main(int argc, char *argv[]) {
     const char *receiver_ip = "127.0.0.1";  // Default to localhost
     int tcp_port = RDMA_TCP_PORT;
+    struct rdma_opts opts;
     
-    // Parse command-line arguments: ./sender [receiver_ip] [port]
-    if(argc > 1) {
-        receiver_ip = argv[1];
+    // Parse command-line arguments: ./sender [options] [receiver_ip] [port]
+    rdma_opts_init(&opts);
+    int ret = rdma_parse_opts(argc, argv, "[receiver_ip] [port]", &opts);
+    if(ret) {
+        return ret < 0 ? 1 : 0;
     }
-    if(argc > 2) {
-        tcp_port = atoi(argv[2]);
+    if(opts.iters == 0) {
+        fprintf(stderr, "Sender needs a finite message count (-n)\n");
+        return 1;
+    }
+    if(argc > optind) {
+        receiver_ip = argv[optind];
+    }
+    if(argc > optind + 1) {
+        tcp_port = atoi(argv[optind + 1]);
         if(tcp_port <= 0 || tcp_port > 65535) {
-            fprintf(stderr, "Invalid port number: %s\n", argv[2]);
+            fprintf(stderr, "Invalid port number: %s\n", argv[optind + 1]);
             return 1;
         }
     }
@@ -120,6 +135,7 @@ int main(int argc, char *argv[]) {
     const char* dev_name = ibv_get_device_name(dev_list[0]);
 
     struct sender_context *send_ctx = malloc(sizeof(*send_ctx));
+    memset(send_ctx, 0, sizeof(*send_ctx));
 
     send_ctx->ctx = ibv_open_device(dev_list[0]);
 
@@ -167,16 +183,26 @@ int main(int argc, char *argv[]) {
 
     printf("GID type: %s\n", gid_type_str(entry->gid_type)); 
 
-    send_ctx->num_packets = 3;
+    const char *greeting = "Hello, RDMA!";
+    uint32_t msg_size = opts.msg_size ? opts.msg_size : strlen(greeting) + 1;
+
+    if(opts.depth > (uint32_t)dev_attr->max_qp_wr) {
+        fprintf(stderr, "Queue depth %u exceeds device max_qp_wr %d\n",
+                opts.depth, dev_attr->max_qp_wr);
+        return 1;
+    }
+
+    // One CQE per outstanding signaled WR
+    send_ctx->num_packets = opts.depth;
 
-    send_ctx->size = 3 * 1024 * sizeof(char);
+    // One source slot per in-flight WR
+    send_ctx->size = (size_t)opts.depth * msg_size;
 
-    // Use posix_memalign for page-aligned memory (required for RDMA)
-    if(posix_memalign((void**)&send_ctx->buf, sysconf(_SC_PAGESIZE), send_ctx->size)) {
-        perror("posix_memalign");
+    // Page-aligned, pre-faulted and locked, on huge pages with -H
+    if(rdma_mem_alloc(&send_ctx->mem, send_ctx->size, opts.page, NULL)) {
         return 1;
     }
-    memset(send_ctx->buf, 0, send_ctx->size);
+    send_ctx->buf = send_ctx->mem.addr;
 
     send_ctx->channel = ibv_create_comp_channel(send_ctx->ctx);
     if(!send_ctx->channel) {
@@ -190,13 +216,20 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    send_ctx->mr = ibv_reg_mr(send_ctx->pd, send_ctx->buf, send_ctx->size, IBV_ACCESS_LOCAL_WRITE);
+    send_ctx->mr = rdma_mem_reg(&send_ctx->mem, send_ctx->pd, IBV_ACCESS_LOCAL_WRITE);
     if(!send_ctx->mr) {
         perror("ibv_reg_mr");
         return 1;
     }
+    rdma_mem_print(&send_ctx->mem, "Buffer");
 
-    send_ctx->cq = ibv_create_cq(send_ctx->ctx, send_ctx->num_packets, NULL, send_ctx->channel, 0);
+    // NIC completion timestamps need a CQ created through ibv_create_cq_ex
+    if(opts.hw_timestamps) {
+        send_ctx->cq = create_cq_timestamped(send_ctx->ctx, send_ctx->num_packets,
+                                             send_ctx->channel, &send_ctx->cqx);
+    } else {
+        send_ctx->cq = ibv_create_cq(send_ctx->ctx, send_ctx->num_packets, NULL, send_ctx->channel, 0);
+    }
     if(!send_ctx->cq) {
         perror("ibv_create_cq");
         return 1;
@@ -208,7 +241,7 @@ int main(int argc, char *argv[]) {
             .send_cq = send_ctx->cq,
             .recv_cq = send_ctx->cq,
             .cap     = {
-                .max_send_wr = 3,
+                .max_send_wr = opts.depth,
                 .max_recv_wr = 1, //extend to rx_depth here
                 .max_send_sge = 1,
                 .max_recv_sge = 1,
@@ -216,15 +249,25 @@ int main(int argc, char *argv[]) {
             .qp_type = IBV_QPT_UC,
             .comp_mask = IBV_QP_INIT_ATTR_PD | IBV_QP_INIT_ATTR_SEND_OPS_FLAGS,
             .pd = send_ctx->pd,
-            .send_ops_flags = IBV_QP_EX_WITH_SEND | IBV_QP_EX_WITH_RDMA_WRITE
+            .send_ops_flags = IBV_QP_EX_WITH_SEND | IBV_QP_EX_WITH_RDMA_WRITE |
+                              IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM
         };
 
-        send_ctx->qp = ibv_create_qp_ex(send_ctx->ctx, &init_attr_ex);
+        // Inline mode asks the device for the largest inline size it grants
+        if(opts.use_inline) {
+            send_ctx->qp = create_qp_ex_inline(send_ctx->ctx, &init_attr_ex);
+        } else {
+            send_ctx->qp = ibv_create_qp_ex(send_ctx->ctx, &init_attr_ex);
+        }
 
         if(!send_ctx->qp) {
             perror("ibv_create_qp_ex");
             return 1;
         }
+        if(opts.use_inline) {
+            send_ctx->max_inline = init_attr_ex.cap.max_inline_data;
+            printf("Max inline data: %u bytes\n", send_ctx->max_inline);
+        }
         
         // Get extended QP pointer - since we created with ibv_create_qp_ex,
         // the QP has extended features and can be cast to ibv_qp_ex
@@ -356,57 +399,62 @@ int main(int argc, char *argv[]) {
     
     // Extended QP is already available (created as extended from start)
     
-    // Step 6: Prepare data to send
-    strcpy(send_ctx->buf, "Hello, RDMA!");
-    size_t send_len = strlen(send_ctx->buf) + 1;
+    // Step 6: Prepare data to send - every slot carries the greeting
+    for(uint32_t i = 0; i < opts.depth; i++) {
+        char *slot = send_ctx->buf + (size_t)i * msg_size;
+        strncpy(slot, greeting, msg_size);
+        slot[msg_size - 1] = '\0';
+    }
     
-    // Example using RDMA write with immediate (requires qpx)
-    if(send_ctx->qpx) {
-        ibv_wr_start(send_ctx->qpx);
-        
-        send_ctx->qpx->wr_id = 1;
-        send_ctx->qpx->wr_flags = IBV_SEND_SIGNALED;
-        
-        // Set RDMA write with immediate operation
-        // Parameters: qp, rkey, remote_addr, imm_data (all in network byte order)
-        ibv_wr_rdma_write_imm(send_ctx->qpx, send_ctx->remote_rkey, 
-                              send_ctx->remote_addr,  // Remote address from connection exchange
-                              htonl(0x12345678));      // Immediate data (32-bit, network byte order)
-        
-        // Set scatter-gather entry (local buffer to write)
-        ibv_wr_set_sge(send_ctx->qpx, send_ctx->mr->lkey, 
-                      (uintptr_t)send_ctx->buf, send_len);
-        
-        if(ibv_wr_complete(send_ctx->qpx)) {
-            perror("ibv_wr_complete");
-            return 1;
-        }
-        printf("Posted RDMA write with immediate work request (remote_addr=0x%llx, rkey=0x%x, len=%zu)\n",
-               (unsigned long long)send_ctx->remote_addr, send_ctx->remote_rkey, send_len);
-    } else {
+    // Step 7: Stream RDMA writes with immediate, keeping opts.depth in flight
+    if(!send_ctx->qpx) {
         fprintf(stderr, "Extended QP not available\n");
         return 1;
     }
     
-    // Step 8: Poll for send completion
-    struct ibv_wc wc;
-    int num_completions = 0;
-    int poll_count = 0;
-    printf("Polling for send completion...\n");
-    do {
-        num_completions = ibv_poll_cq(send_ctx->cq, 1, &wc);
-        poll_count++;
-        if(poll_count % 1000000 == 0) {
-            printf("Still polling for send completion... (count: %d)\n", poll_count);
-        }
-    } while(num_completions == 0);
+    struct cq_poller poller;
+    if(cq_poller_init(&poller, send_ctx->cq, opts.poll_batch)) {
+        return 1;
+    }
+    if(opts.use_events) {
+        cq_poller_enable_events(&poller, send_ctx->channel, opts.spin_usec * 1000ULL);
+    }
+    struct hw_clock clock;
+    if(opts.hw_timestamps &&
+       (hw_clock_init(&clock, send_ctx->ctx) ||
+        cq_poller_enable_timestamps(&poller, send_ctx->cqx, &clock))) {
+        return 1;
+    }
+    
+    struct send_window win = {
+        .qpx = send_ctx->qpx,
+        .poller = &poller,
+        .buf = send_ctx->buf,
+        .lkey = send_ctx->mr->lkey,
+        .msg_size = msg_size,
+        .remote_rkey = send_ctx->remote_rkey,
+        .remote_addr = send_ctx->remote_addr,
+        .depth = opts.depth,
+        .signal_every = opts.signal_every,
+        .max_inline = send_ctx->max_inline,
+        .batch = opts.post_batch,
+        .batch_timeout_ns = opts.batch_usec * 1000ULL
+    };
+    struct send_stats stats;
+    
+    printf("Streaming %lu RDMA writes with immediate (msg_size=%u, depth=%u, remote_addr=0x%llx, rkey=0x%x)\n",
+           opts.iters, msg_size, opts.depth,
+           (unsigned long long)send_ctx->remote_addr, send_ctx->remote_rkey);
     
-    if(wc.status != IBV_WC_SUCCESS) {
-        fprintf(stderr, "Work completion error: %s\n", ibv_wc_status_str(wc.status));
+    // Step 8: Post and poll until every message has completed
+    if(send_window_run(&win, opts.iters, &stats)) {
         return 1;
     }
     
-    printf("Send completed successfully! (wr_id: %lu)\n", wc.wr_id);
+    printf("Send completed successfully! (%lu messages)\n", stats.msgs);
+    send_stats_print(&stats, msg_size);
+    cq_poller_print(&poller);
+    cq_poller_destroy(&poller);
 
     return 0;
 }        